@@ -8,28 +8,24 @@ MYSQL_DB="somedb"
 AUTODIRBASE=$(/bin/pwd)
 AUTODIR=$AUTODIRBASE/autodirjson
 
-## You shouldn't have to modify anything below this line.
-
-export MYOPTS="-h $MYSQL_HOST -p$MYSQL_PASS -u $MYSQL_USER $MYSQL_DB"
-export FUSEOPTS="-H $MYSQL_HOST -p $MYSQL_PASS -u $MYSQL_USER -D $MYSQL_DB -T 'UNIX_TIMESTAMP()'"
+#Comma-separated globs, e.g. EXCLUDE="cache*,sessions".  Empty INCLUDE means every table.
+INCLUDE=""
+EXCLUDE=""
 
-for table in $(mysql $MYOPTS -e 'show tables' | sed '1d')
-  do PRIKEY=$(mysql $MYOPTS -e 'show create table '$table'\G' | grep -F 'PRIMARY KEY')
-
-  # We don't currently handle multiple primary keys; synthesize those by hand.
-  echo $PRIKEY | sed 's/,$//' | grep -qF ',' && continue
+## You shouldn't have to modify anything below this line.
 
-  # No primary key?  Skip it.
-  [ -z "$PRIKEY" ] && continue
+export FUSEOPTS="-H $MYSQL_HOST -p $MYSQL_PASS -u $MYSQL_USER -D $MYSQL_DB -T UNIX_TIMESTAMP()"
 
-  PRIKEY=$(echo $PRIKEY | sed 's/`).*//;s/PRIMARY KEY...//')
-  echo $table: $PRIKEY
+# One dfuse serves every table as $AUTODIR/<table>/<key>, finding each table's primary key
+# itself.  A multi-column key's files are named <col1>,<col2>,... (each urlencoded); tables
+# without a primary key are skipped.
+[ -n "$INCLUDE" ] && FUSEOPTS="$FUSEOPTS --include=$INCLUDE"
+[ -n "$EXCLUDE" ] && FUSEOPTS="$FUSEOPTS --exclude=$EXCLUDE"
 
-  #Unmount anything that was there, just in case.
-  umount $AUTODIR/$table >>/dev/null 2>&1
+#Unmount anything that was there, just in case.
+umount $AUTODIR >>/dev/null 2>&1
 
-  mkdir -p $AUTODIR/$table
+mkdir -p $AUTODIR
 
-  ./dfuse $FUSEOPTS -t $table -P $PRIKEY -c '*' --json $AUTODIR/$table
-  sleep 0.25
-done 
+set -f # Keep the shell's hands off the globs.
+./dfuse $FUSEOPTS -c '*' --json $AUTODIR
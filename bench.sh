@@ -0,0 +1,288 @@
+#!/bin/bash
+
+# Runs a fixed set of filesystem workloads against dfuse mounts of synthetic tables in a
+# throwaway local mysqld (or mariadbd), and prints one JSON object per mode and workload on
+# stdout.  Same settings, same data, same numbers to compare: run it once per build and diff.
+#
+#   ./bench.sh > before.jsonl
+#   (rebuild)
+#   ./bench.sh > after.jsonl
+#
+# Every setting below can be overridden from the environment, e.g. ROWS=100000 ./bench.sh.
+
+DFUSE=${DFUSE:-./dfuse}
+
+#Rows per table.
+ROWS=${ROWS:-10000}
+
+#Key shape: "int" (1, 2, ...), "padded" (row-000000001, ...), "hash" (md5 of the row
+#number, so listing order has nothing to do with insert order) or "slashed" (17/4217,
+#which dfuse has to escape).
+KEYS=${KEYS:-int}
+
+#Value sizes in bytes: "fixed" (always VALUE_MIN), "uniform" (VALUE_MIN..VALUE_MAX) or
+#"skewed" (mostly near VALUE_MIN, with a long tail out to VALUE_MAX).  Sizes are seeded by
+#row number, so every run generates the same data.
+VALUES=${VALUES:-skewed}
+VALUE_MIN=${VALUE_MIN:-64}
+VALUE_MAX=${VALUE_MAX:-65536}
+
+#"raw" mounts one column of the table per file, "json" whole rows as --json, "columns" each
+#row as a directory of its columns (-c '*' --column-files).
+MODES=${MODES:-"raw json columns"}
+
+#Run in this order, each on a fresh mount so nothing is already in the kernel's caches.
+#git-status only makes sense after git-add.
+WORKLOADS=${WORKLOADS:-"walk cat tar write git-add git-status"}
+
+#How many files the write workload rewrites.
+WRITES=${WRITES:-1000}
+
+#Anything else to pass to dfuse, e.g. "--attr-ttl=60 --poll=1000".
+DFUSE_OPTS=${DFUSE_OPTS:-}
+
+#Set to keep the scratch directory (data directory, logs, stats snapshots) afterwards.
+KEEP=${KEEP:-}
+
+## You shouldn't have to modify anything below this line.
+
+MYSQLD=${MYSQLD:-$(command -v mariadbd || command -v mysqld)}
+MYSQL=${MYSQL:-$(command -v mariadb || command -v mysql)}
+INSTALL_DB=${INSTALL_DB:-$(command -v mariadb-install-db || command -v mysql_install_db)}
+
+die()
+{
+    echo "bench.sh: $*" >&2
+    exit 1
+}
+
+log()
+{
+    echo "bench.sh: $*" >&2
+}
+
+[ -x "$DFUSE" ] || die "no dfuse binary at $DFUSE (build it, or set DFUSE)"
+[ -n "$MYSQLD" ] || die "can't find mysqld or mariadbd (set MYSQLD)"
+[ -n "$MYSQL" ] || die "can't find the mysql client (set MYSQL)"
+
+case "$KEYS" in
+    int) KEY_TYPE="BIGINT"; KEY_EXPR="n" ;;
+    padded) KEY_TYPE="VARCHAR(32)"; KEY_EXPR="CONCAT('row-', LPAD(n, 9, '0'))" ;;
+    hash) KEY_TYPE="CHAR(32)"; KEY_EXPR="MD5(n)" ;;
+    slashed) KEY_TYPE="VARCHAR(32)"; KEY_EXPR="CONCAT(n % 100, '/', n)" ;;
+    *) die "KEYS must be int, padded, hash or slashed" ;;
+esac
+
+case "$VALUES" in
+    fixed) SIZE_EXPR="$VALUE_MIN" ;;
+    uniform) SIZE_EXPR="$VALUE_MIN + FLOOR(RAND(n) * ($VALUE_MAX - $VALUE_MIN + 1))" ;;
+    skewed) SIZE_EXPR="$VALUE_MIN + FLOOR(POW(RAND(n), 4) * ($VALUE_MAX - $VALUE_MIN + 1))" ;;
+    *) die "VALUES must be fixed, uniform or skewed" ;;
+esac
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/dfuse-bench.XXXXXX") || die "can't make a scratch directory"
+MNT=$WORK/mnt
+SOCK=$WORK/mysqld.sock
+mkdir -p "$MNT"
+
+# libmysqlclient connects to "localhost" through this socket, so dfuse can reach our server
+# without a port of its own.
+export MYSQL_UNIX_PORT=$SOCK
+
+unmount()
+{
+    fusermount3 -u "$MNT" >>/dev/null 2>&1 || fusermount -u "$MNT" >>/dev/null 2>&1 || umount "$MNT" >>/dev/null 2>&1
+}
+
+cleanup()
+{
+    unmount
+    [ -f "$WORK/mysqld.pid" ] && kill "$(cat "$WORK/mysqld.pid")" >>/dev/null 2>&1
+    while [ -f "$WORK/mysqld.pid" ] && kill -0 "$(cat "$WORK/mysqld.pid")" >>/dev/null 2>&1; do
+	sleep 0.2
+    done
+    if [ -n "$KEEP" ]; then
+	log "kept $WORK"
+    else
+	rm -rf "$WORK"
+    fi
+}
+trap cleanup EXIT
+
+sql()
+{
+    "$MYSQL" --no-defaults -S "$SOCK" -u root "$@"
+}
+
+now_ms()
+{
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+## Provision a server.
+
+log "initializing a data directory in $WORK"
+if "$MYSQLD" --version | grep -qi mariadb; then
+    [ -n "$INSTALL_DB" ] || die "can't find mariadb-install-db (set INSTALL_DB)"
+    "$INSTALL_DB" --no-defaults --datadir="$WORK/data" --auth-root-authentication-method=normal \
+	>"$WORK/install.log" 2>&1 || die "mariadb-install-db failed, see $WORK/install.log"
+else
+    "$MYSQLD" --no-defaults --initialize-insecure --datadir="$WORK/data" \
+	>"$WORK/install.log" 2>&1 || die "mysqld --initialize-insecure failed, see $WORK/install.log"
+fi
+
+# The binary log is on so that DFUSE_OPTS="--binlog" has something to follow.
+"$MYSQLD" --no-defaults --user="$(id -un)" --datadir="$WORK/data" --socket="$SOCK" --skip-networking \
+    --pid-file="$WORK/mysqld.pid" --log-error="$WORK/mysqld.err" --log-bin="$WORK/binlog" --server-id=1 \
+    --binlog-format=ROW --max-allowed-packet=64M >>/dev/null 2>&1 &
+
+for i in $(seq 100); do
+    sql -e 'SELECT 1' >>/dev/null 2>&1 && break
+    sleep 0.2
+done
+sql -e 'SELECT 1' >>/dev/null 2>&1 || die "mysqld didn't start, see $WORK/mysqld.err"
+
+## Generate the tables.
+
+log "generating $ROWS rows ($KEYS keys, $VALUES values of $VALUE_MIN..$VALUE_MAX bytes)"
+
+# Row numbers 1..ROWS, from a cross join of just enough digit tables.
+SEQ="SELECT d0.d"
+FROM="FROM digits d0"
+SCALE=1
+for (( i = 1; i < ${#ROWS}; i++ )); do
+    SCALE=$(( SCALE * 10 ))
+    SEQ="$SEQ + $SCALE * d$i.d"
+    FROM="$FROM, digits d$i"
+done
+
+sql <<EOF || die "couldn't generate the tables"
+CREATE DATABASE bench;
+CREATE USER 'bench'@'localhost' IDENTIFIED BY 'bench';
+GRANT ALL ON bench.* TO 'bench'@'localhost';
+GRANT REPLICATION SLAVE, REPLICATION CLIENT ON *.* TO 'bench'@'localhost';
+USE bench;
+CREATE TABLE digits ( d INT NOT NULL );
+INSERT INTO digits VALUES (0), (1), (2), (3), (4), (5), (6), (7), (8), (9);
+CREATE TABLE seq ( n INT NOT NULL PRIMARY KEY ) SELECT n FROM ( $SEQ + 1 AS n $FROM ) s WHERE n <= $ROWS;
+CREATE TABLE sizes ( n INT NOT NULL PRIMARY KEY, size INT NOT NULL ) SELECT n, $SIZE_EXPR AS size FROM seq;
+CREATE TABLE bench_raw ( k $KEY_TYPE NOT NULL PRIMARY KEY, v LONGBLOB NOT NULL );
+INSERT INTO bench_raw SELECT $KEY_EXPR, LEFT( REPEAT( MD5( n ), size DIV 32 + 1 ), size ) FROM sizes;
+CREATE TABLE bench_json ( k $KEY_TYPE NOT NULL PRIMARY KEY, title VARCHAR(64) NOT NULL, score INT NOT NULL,
+    body LONGTEXT NOT NULL );
+INSERT INTO bench_json SELECT $KEY_EXPR, CONCAT( 'Row ', n ), n * 7919 % 1000,
+    LEFT( REPEAT( MD5( n ), size DIV 32 + 1 ), size ) FROM sizes;
+DROP TABLE digits, seq, sizes;
+EOF
+
+## Run the workloads.
+
+mount_mode()
+{
+    local mode=$1
+
+    set -f # Keep the shell's hands off -c '*'.
+    case "$mode" in
+	raw) "$DFUSE" -H localhost -u bench -p bench -D bench -t bench_raw -P k -c v $DFUSE_OPTS "$MNT" ;;
+	json) "$DFUSE" -H localhost -u bench -p bench -D bench -t bench_json -P k -c '*' --json $DFUSE_OPTS "$MNT" ;;
+	columns) "$DFUSE" -H localhost -u bench -p bench -D bench -t bench_json -P k -c '*' --column-files $DFUSE_OPTS "$MNT" ;;
+	*) die "MODES must be some of raw, json and columns" ;;
+    esac || die "couldn't mount $mode"
+    set +f
+}
+
+run_workload()
+{
+    local workload=$1
+
+    case "$workload" in
+	walk) ls -lR "$MNT" >>/dev/null ;;
+	cat) find "$MNT" -type f -print0 | xargs -0 cat >>/dev/null ;;
+	# Through a pipe: GNU tar doesn't bother reading anything when it's writing to /dev/null.
+	tar) tar cf - -C "$MNT" . | cat >>/dev/null ;;
+	# Rewrites files with what they already hold, so the tables stay the same run to run.
+	write)
+	    find "$MNT" -type f | head -n "$WRITES" | while read -r f; do
+		cat "$f" >"$WORK/write.tmp" && cat "$WORK/write.tmp" >"$f"
+	    done
+	    ;;
+	git-add) git --git-dir="$WORK/git/.git" --work-tree="$MNT" add -A >>/dev/null ;;
+	git-status) git --git-dir="$WORK/git/.git" --work-tree="$MNT" status --porcelain >>/dev/null ;;
+	*) die "unknown workload $workload" ;;
+    esac
+}
+
+# Turns before and after snapshots of /.dfuse/stats into one line of results.  p50 and p99
+# are histogram bucket upper bounds, so they're only good to a factor of two; "inf" counts
+# as twice the last bound.
+report()
+{
+    awk -v mode="$1" -v workload="$2" -v wall_ms="$3" -v rows="$ROWS" -v keys="$KEYS" -v values="$VALUES" '
+	FNR == 1 { pass++ }
+	/"histogram"/ {
+	    gsub( /[{}":,]/, " " )
+	    name = $1
+	    if ( pass == 1 ) { names[++nops] = name }
+	    count[pass, name] = $3
+	    usec[pass, name] = $5
+	    nb = 0
+	    for ( i = 7; i < NF; i += 2 ) {
+		nb++
+		bound[nb] = ( $i == "inf" ) ? bound[nb - 1] * 2 : $i
+		bucket[pass, name, nb] = $( i + 1 )
+	    }
+	}
+	/"sql"/ {
+	    gsub( /[{}":,]/, " " )
+	    queries[pass] = $3
+	    fetched_rows[pass] = $5
+	    fetched_bytes[pass] = $7
+	}
+	function percentile( name, n, p,   i, seen ) {
+	    seen = 0
+	    for ( i = 1; i <= nb; i++ ) {
+		seen += bucket[2, name, i] - bucket[1, name, i]
+		if ( seen >= n * p ) { return bound[i] }
+	    }
+	    return bound[nb]
+	}
+	END {
+	    total = 0
+	    printf( "{\"mode\": \"%s\", \"workload\": \"%s\", \"rows\": %d, \"keys\": \"%s\", \"values\": \"%s\", \"wall_ms\": %d, \"ops\": {",
+		mode, workload, rows, keys, values, wall_ms )
+	    for ( o = 1; o <= nops; o++ ) {
+		name = names[o]
+		n = count[2, name] - count[1, name]
+		total += n
+		printf( "%s\"%s\": {\"count\": %d", o > 1 ? ", " : "", name, n )
+		if ( n > 0 ) {
+		    printf( ", \"mean_us\": %d, \"p50_us\": %d, \"p99_us\": %d",
+			( usec[2, name] - usec[1, name] ) / n, percentile( name, n, 0.5 ), percentile( name, n, 0.99 ) )
+		}
+		printf( "}" )
+	    }
+	    q = queries[2] - queries[1]
+	    printf( "}, \"sql\": {\"queries\": %d, \"rows_fetched\": %d, \"bytes_fetched\": %d, \"queries_per_op\": %.4f}}\n",
+		q, fetched_rows[2] - fetched_rows[1], fetched_bytes[2] - fetched_bytes[1], total ? q / total : 0 )
+	}' "$WORK/before.json" "$WORK/after.json"
+}
+
+for mode in $MODES; do
+    rm -rf "$WORK/git"
+    git init -q "$WORK/git" || die "couldn't make a scratch git repository"
+
+    for workload in $WORKLOADS; do
+	log "$mode: $workload"
+	mount_mode "$mode"
+
+	cat "$MNT/.dfuse/stats" >"$WORK/before.json" || die "no /.dfuse/stats on the $mode mount"
+	started=$(now_ms)
+	run_workload "$workload"
+	finished=$(now_ms)
+	cat "$MNT/.dfuse/stats" >"$WORK/after.json"
+
+	report "$mode" "$workload" $(( finished - started ))
+	cp "$WORK/after.json" "$WORK/stats.$mode.$workload.json"
+	unmount
+    done
+done
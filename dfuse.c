@@ -11,19 +11,33 @@
  * www.gnu.org at the time of its use or modification.
  */
 
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 31
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <my_global.h>
 #include <my_sys.h>
 #include <mysql.h>
 #include <errmsg.h>
 #include <fuse_opt.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fnmatch.h>
+
+// SSE2 is a given on x86-64; AVX2 gets picked at runtime.  -DDFUSE_NO_SIMD for plain C.
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(DFUSE_NO_SIMD)
+#define DFUSE_SIMD
+#include <immintrin.h>
+#endif
 
 /** options for fuse_opt.h */
 struct options {
@@ -35,6 +49,28 @@ struct options {
     char *prikey;
     char *columns;
     char *timestamp;
+    char *include;
+    char *exclude;
+    unsigned int pool_min;
+    unsigned int pool_max;
+    unsigned int attr_ttl;
+    unsigned int negative_ttl;
+    unsigned int attr_cache_max;
+    unsigned int readdir_batch;
+    unsigned int write_back;
+    unsigned int write_back_batch;
+    unsigned int write_back_delay;
+    unsigned int stream_threshold;
+    unsigned int binlog;
+    unsigned int binlog_server_id;
+    unsigned int poll;
+    unsigned int snapshot;
+    char *mirror;
+    unsigned int mirror_refresh;
+    char *shard;
+    unsigned int shard_levels;
+    unsigned int shard_width;
+    unsigned int column_files;
 }options;
 
 //Conservative, yes, but should be plenty.  Also protects us from signedness issues.
@@ -45,11 +81,114 @@ struct string_length {
     unsigned long length;
 };
 
-struct dfuse_nv_ll {
-    struct string_length * name;
-    struct string_length * value;
-    struct dfuse_nv_ll * nvll_value;
-    struct dfuse_nv_ll * next;
+struct dfuse_json_parser;
+
+/*
+ * One of these hangs off fi->fh for every open file.  dfuse_open renders the row (raw column
+ * or JSON) into it exactly once, and dfuse_read just slices it, so a file costs one round trip
+ * no matter how many chunks the kernel carves the read into.  Writes and ftruncate() edit it
+ * in place, like any other file, and flush/release write it back with a single UPDATE.
+ */
+struct dfuse_handle {
+    pthread_mutex_t lock;	// FUSE will happily read and write one handle from several threads.
+    char *data;			// Always followed by a '\0', which length doesn't count.
+    unsigned long length;
+    unsigned long capacity;	// How much data has room for, not counting the '\0'.
+    int dirty;			// Written to since we last wrote it back.
+    struct dfuse_table *table;
+    char *key;
+    unsigned long key_length;
+    unsigned int column;	// --column-files: which of table's columns, plus one; 0 for the -c value.
+
+    // Nonzero for a value too big to snapshot (see --stream-threshold): data is NULL, and every
+    // read fetches just its own range.  Only ever opened read-only.  If data is NULL and this is
+    // zero, the row hasn't been fetched yet; see dfuse_snapshot_row.
+    unsigned long long streamed_length;
+
+    // --json only: data[0..parser->fed), parsed as it was written, so flush needn't start over.
+    // Lazily created, and thrown away whenever a write or truncate lands inside what it's seen.
+    struct dfuse_json_parser *parser;
+};
+
+/*
+ * The query shapes a mount issues.  They never change for the life of the mount, so each
+ * connection prepares them (once, on first use) and after that we only ever send parameters.
+ */
+enum
+{
+    DFUSE_STMT_STAT,		// getattr: size (and -T timestamp) of one row
+    DFUSE_STMT_ROW,		// open: the row itself
+    DFUSE_STMT_EXISTS,		// truncate: is there a row to truncate?
+    DFUSE_STMT_LIST_FIRST,	// readdir: a batch, by offset
+    DFUSE_STMT_LIST_AFTER,	// readdir: a batch, after a key
+    DFUSE_STMT_UPDATE,		// flush: write a row back
+    DFUSE_STMT_RANGE,		// read: one chunk of a streamed value
+    DFUSE_STMT_MIRROR_ROW,	// --mirror: a changed row, and its validator
+    DFUSE_STMT_SHARD_NEXT,	// --shard=prefix: the next key column value in key order
+    DFUSE_STMT_SHARD_FIRST,	// --shard: a batch of one shard directory's rows, by offset
+    DFUSE_STMT_SHARD_AFTER,	// --shard: a batch of one shard directory's rows, after a key
+    DFUSE_STMT_COUNT
+};
+
+/*
+ * --column-files: the same shapes again for each of a table's columns c (counting from 1), about
+ * that column instead of -c.  Only STAT, ROW, UPDATE and RANGE are ever asked for this way.
+ */
+#define DFUSE_STMT_COLUMN(c, which) ( (c) * DFUSE_STMT_COUNT + (which) )
+
+/*
+ * One fetched row of a prepared statement, as strings.  Every column lives in block, each
+ * followed by a '\0' (values[i] is NULL for SQL NULL), so a single free() lets go of a row.
+ */
+struct dfuse_stmt_row {
+    unsigned int num_fields;
+    MYSQL_BIND *binds;
+    unsigned long *lengths;
+    my_bool *is_null;
+    char **values;
+    char *block;
+};
+
+/*
+ * A table we serve.  With -t there's exactly one, and it's the whole mount; without, every
+ * table in -D with a primary key gets a directory of its own.  Fixed at mount time, so nothing
+ * here needs a lock (except schema; see dfuse_json_schema).
+ */
+struct dfuse_table {
+    unsigned int index;		// Into tables[].
+    char *name;			// The directory name: urlencoded, like keys are.
+    char *sql_name;		// What goes after FROM: -t verbatim, or the quoted table name.
+    char *prikey;		// -P verbatim, or the quoted column name(s), comma-separated.
+    unsigned int key_columns;	// More than one for a composite key; see dfuse_key_join.
+    char **key_names;		// A composite key's columns, unquoted.
+    char *key_where;		// "prikey=?", or "`a`=? AND `b`=?".
+    char *key_after;		// "prikey > ?", or "((`a`>?) OR (`a`=? AND `b`>?))"; see dfuse_key_bind_after.
+    unsigned int shard;		// One of DFUSE_SHARD_*; see dfuse_shard_tables.
+    char *shard_column;		// DFUSE_SHARD_PREFIX: the key column the directories split up.
+    char *shard_where;		// Which rows a directory of the last level holds; see dfuse_shard_binds.
+    unsigned int num_columns;	// --column-files: the files in each row's directory; see dfuse_column_tables.
+    char **column_names;	// Their names, urlencoded.
+    char **column_sql;		// And the quoted columns they hold.
+    unsigned int stmt_base;	// Its first slot in each connection's stmts[].
+    struct dfuse_schema *schema;	// --json only.
+};
+
+// The most columns a composite key can have; MySQL's own limit for an index.
+#define DFUSE_MAX_KEY_COLUMNS 16
+
+// The most placeholders table->key_after has: the first key value, then the first two, and so on.
+#define DFUSE_MAX_KEY_AFTER_PARAMS ( DFUSE_MAX_KEY_COLUMNS * ( DFUSE_MAX_KEY_COLUMNS + 1 ) / 2 )
+
+/*
+ * A key, as the placeholders of table->key_where take it: one value per key column.  For a
+ * single-column key, that's the key itself, uncopied; a composite key's columns are decoded into
+ * buffer.  See dfuse_key_split.
+ */
+struct dfuse_key_values {
+    unsigned int count;
+    char *buffer;
+    char *values[DFUSE_MAX_KEY_COLUMNS];
+    unsigned long lengths[DFUSE_MAX_KEY_COLUMNS];
 };
 
 FILE *debug_fd( void );
@@ -60,15 +199,80 @@ FILE *debug_fd( void );
 #define D(x,y) (void)0
 #endif
 
-// Stands for "DFuse Return Value".  Implements --lazy-connect.  Use instead of "return (somevalue);".
-#define DFRV(v) { dfuse_maybe_close(); return (v); }
+// Stands for "DFuse Return Value".  Hands this thread's connection back to the pool (which is also
+// where --lazy-connect is implemented).  Use instead of "return (somevalue);".
+#define DFRV(v) { dfuse_checkin(); return (v); }
 
 #define MYSQLSERVER options.hostname
 #define MYSQLUSER options.username
 #define MYSQLPASS options.password
 #define MYSQLDB options.database
 
-#define MAX_SQL_LENGTH 1500
+//Connection pool defaults; see --pool-min and --pool-max.
+#define DFUSE_POOL_DEFAULT_MIN 1
+#define DFUSE_POOL_DEFAULT_MAX 8
+//How long a thread will wait for a connection before giving up with EIO.
+#define DFUSE_POOL_WAIT_SECONDS 30
+//Idle connections older than this get a mysql_ping() before they're handed out again.
+#define DFUSE_POOL_PING_AFTER 30
+
+//Attribute cache defaults; see --attr-ttl, --negative-ttl and --attr-cache-max.  The TTLs only
+//apply with a change feed (--binlog, --poll) following; without one, caching is opt-in.
+#define DFUSE_ATTR_TTL_DEFAULT 5
+#define DFUSE_NEGATIVE_TTL_DEFAULT 2
+#define DFUSE_TTL_UNSET ~0U
+#define DFUSE_ATTR_CACHE_MAX_DEFAULT 100000
+//What the kernel may cache entries and attributes for when no change feed is following; what
+//the high-level API always told it.  Directories are fixed at mount time, so they get longer.
+#define DFUSE_KERNEL_TTL_DEFAULT 1.0
+#define DFUSE_KERNEL_DIR_TTL 86400.0
+
+//Latency histogram buckets in /.dfuse/stats: powers of two from 1usec to 2^22usec (about 4s), then
+//everything slower.
+#define DFUSE_STATS_BUCKETS 24
+
+//Rows per directory listing query; see --readdir-batch.
+#define DFUSE_READDIR_BATCH_DEFAULT 1000
+
+//Write-back defaults; see --write-back-batch and --write-back-delay (in ms).
+#define DFUSE_WRITE_BACK_BATCH_DEFAULT 500
+#define DFUSE_WRITE_BACK_DELAY_DEFAULT 50
+//Writers block once this many batches' worth of rows are waiting for the committer.
+#define DFUSE_WRITE_BACK_QUEUE_BATCHES 8
+
+//Raw values bigger than this are read a chunk at a time, not snapshotted; see --stream-threshold.
+#define DFUSE_STREAM_THRESHOLD_DEFAULT (16*1024*1024)
+
+//--binlog: how often an idle server should say it's still there, and how long to wait before
+//reconnecting after losing it.
+#define DFUSE_BINLOG_HEARTBEAT_SECONDS 1
+#define DFUSE_BINLOG_RETRY_SECONDS 5
+
+//--poll: how far back (in seconds) each -T query reaches past the previous tick, for rows
+//written in the same second the last tick ran.
+#define DFUSE_POLL_OVERLAP_SECONDS 1
+
+//--snapshot: how often (in seconds) to look for a read view that's had its time but hasn't been
+//used since.
+#define DFUSE_SNAPSHOT_REAP_SECONDS 1
+
+//--mirror: how often (in seconds) to bring the local copies up to date; see --mirror-refresh.
+#define DFUSE_MIRROR_REFRESH_DEFAULT 60
+//How close (in seconds) to the newest -T in a mirror a row's -T has to be for it to be fetched
+//again anyway, for rows written twice in the same second.
+#define DFUSE_MIRROR_OVERLAP_SECONDS 1
+//How many changed rows --mirror keeps track of per table before it just reloads it; and the
+//buckets they're kept in.
+#define DFUSE_MIRROR_DIRTY_MAX 65536
+#define DFUSE_MIRROR_DIRTY_BUCKETS 1024
+
+//--shard: how many levels of directories, and how many characters (or hex digits) of the key each
+//level's names take; see --shard-levels and --shard-width.
+#define DFUSE_SHARD_LEVELS_DEFAULT 1
+#define DFUSE_SHARD_WIDTH_DEFAULT 2
+
+//How long a truncate() waits for the open() that's going to write the file; see dfuse_truncate.
+#define DFUSE_TRUNCATE_PENDING_SECONDS 10
 
 //Doesn't like 'A', prefers 'a'.  Makes the algorithm faster.
 #define FROM_HEX(nbl) (((nbl)-'0')%('a'-'0'-10))
@@ -96,6 +300,28 @@ static struct fuse_opt dfuse_opts[] =
     DFUSE_OPT_KEY("-P %s", prikey, 0),
     DFUSE_OPT_KEY("-c %s", columns, 0),
     DFUSE_OPT_KEY("-T %s", timestamp, 0),
+    DFUSE_OPT_KEY("--pool-min=%u", pool_min, 0),
+    DFUSE_OPT_KEY("--pool-max=%u", pool_max, 0),
+    DFUSE_OPT_KEY("--attr-ttl=%u", attr_ttl, 0),
+    DFUSE_OPT_KEY("--negative-ttl=%u", negative_ttl, 0),
+    DFUSE_OPT_KEY("--attr-cache-max=%u", attr_cache_max, 0),
+    DFUSE_OPT_KEY("--readdir-batch=%u", readdir_batch, 0),
+    DFUSE_OPT_KEY("--include=%s", include, 0),
+    DFUSE_OPT_KEY("--exclude=%s", exclude, 0),
+    DFUSE_OPT_KEY("--write-back", write_back, 1),
+    DFUSE_OPT_KEY("--write-back-batch=%u", write_back_batch, 0),
+    DFUSE_OPT_KEY("--write-back-delay=%u", write_back_delay, 0),
+    DFUSE_OPT_KEY("--stream-threshold=%u", stream_threshold, 0),
+    DFUSE_OPT_KEY("--binlog", binlog, 1),
+    DFUSE_OPT_KEY("--binlog-server-id=%u", binlog_server_id, 0),
+    DFUSE_OPT_KEY("--poll=%u", poll, 0),
+    DFUSE_OPT_KEY("--snapshot=%u", snapshot, 0),
+    DFUSE_OPT_KEY("--mirror=%s", mirror, 0),
+    DFUSE_OPT_KEY("--mirror-refresh=%u", mirror_refresh, 0),
+    DFUSE_OPT_KEY("--shard=%s", shard, 0),
+    DFUSE_OPT_KEY("--shard-levels=%u", shard_levels, 0),
+    DFUSE_OPT_KEY("--shard-width=%u", shard_width, 0),
+    DFUSE_OPT_KEY("--column-files", column_files, 1),
 
     // #define FUSE_OPT_KEY(templ, key) { templ, -1U, key }
     FUSE_OPT_KEY("-V",			KEY_VERSION),
@@ -109,13 +335,103 @@ static struct fuse_opt dfuse_opts[] =
     FUSE_OPT_END
 };
 
-MYSQL *cached_sql = NULL;
 MYSQL *dfuse_connect( char *host, char *user, char *pass, char *defaultdb );
+void dfuse_checkin( void );
+int dfuse_stmt_execute( struct dfuse_table *table, unsigned int which, const char *key,
+    unsigned long key_length, unsigned long long *ints, unsigned int num_ints, MYSQL_STMT **stmt );
+int dfuse_stmt_execute_binds( struct dfuse_table *table, unsigned int which, MYSQL_BIND *params, MYSQL_STMT **stmt );
+int dfuse_stmt_fetch_row( MYSQL_STMT *stmt, struct dfuse_stmt_row *row );
+void dfuse_stmt_row_free( struct dfuse_stmt_row *row );
+int dfuse_stmt_with_stat( MYSQL *sql, struct dfuse_table *table );
+struct dfuse_dir_handle;
+void dfuse_mirror_mark( const struct dfuse_table *table, const char *key, unsigned long key_length );
+int dfuse_mirror_stat( struct dfuse_table *table, const char *key, unsigned long key_length, struct stat *stbuf );
+int dfuse_mirror_has( struct dfuse_table *table, const char *key, unsigned long key_length );
+int dfuse_mirror_fetch( struct dfuse_handle *fh );
+int dfuse_mirror_list( struct dfuse_dir_handle *dh, const char *after_key, unsigned long after_key_length,
+    unsigned long long skip, off_t first_cookie );
+char *dfuse_mirror_validator_sql( MYSQL *sql, struct dfuse_table *table );
+char *dfuse_row_sum_columns( MYSQL *sql, struct dfuse_table *table );
+void dfuse_write_back_settle( const struct dfuse_table *table, const char *key, unsigned long key_length );
+void dfuse_free_handle( struct dfuse_handle *fh );
 FILE *cached_debug_fd = NULL;
 void usage( char **argv );
 unsigned short int lazy_conn = 0;
 unsigned short int json = 0;
 
+struct dfuse_table *tables = NULL;
+unsigned int num_tables = 0;
+unsigned int num_stmts = 0;	// Slots in each connection's stmts[]; see dfuse_stmt.
+unsigned short int multi_table = 0;	// No -t: serve /<table>/<key> for every table.
+volatile int binlog_following = 0;	// --binlog: we're caught up with the server's changes.
+volatile int poll_following = 0;	// --poll: likewise.
+
+/*
+ * Live metrics, for /.dfuse/stats (see dfuse_stats_render).  Whichever thread does the work bumps
+ * the counter with an atomic add, so nothing on the serving path takes a lock for them; a reader
+ * may catch one counter a moment ahead of another, which is fine for monitoring.
+ */
+enum
+{
+    DFUSE_OP_LOOKUP,
+    DFUSE_OP_GETATTR,
+    DFUSE_OP_OPEN,
+    DFUSE_OP_READ,
+    DFUSE_OP_WRITE,
+    DFUSE_OP_FLUSH,
+    DFUSE_OP_READDIR,		// readdir and readdirplus alike.
+    DFUSE_OP_COUNT
+};
+
+static const char *dfuse_op_names[DFUSE_OP_COUNT] = { "lookup", "getattr", "open", "read", "write", "flush", "readdir" };
+
+struct dfuse_op_stats {
+    unsigned long long count;
+    unsigned long long usec;
+    unsigned long long buckets[DFUSE_STATS_BUCKETS];	// [i]: took under 2^i usec (the last: the rest).
+};
+
+struct dfuse_stats {
+    time_t started;
+    struct dfuse_op_stats ops[DFUSE_OP_COUNT];
+
+    unsigned long long queries;		// Round trips: statements prepared and run, queries, commits.
+    unsigned long long rows_fetched;	// By prepared statements, where all row data comes from.
+    unsigned long long bytes_fetched;	// Likewise, plus streamed reads.
+} stats;
+
+unsigned long long dfuse_now_us( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// mysql_query(), counted.
+int dfuse_query( MYSQL *sql, const char *query )
+{
+    __sync_fetch_and_add( &stats.queries, 1 );
+
+    return mysql_query( sql, query );
+}
+
+// Counts one op, which began at started (from dfuse_now_us).
+void dfuse_stats_op( unsigned int op, unsigned long long started )
+{
+    unsigned long long took = dfuse_now_us() - started;
+    unsigned int i;
+
+    for ( i = 0; i < DFUSE_STATS_BUCKETS - 1 && took >= ( 1ULL << i ); i++ )
+    {
+    }
+
+    __sync_fetch_and_add( &stats.ops[op].count, 1 );
+    __sync_fetch_and_add( &stats.ops[op].usec, took );
+    __sync_fetch_and_add( &stats.ops[op].buckets[i], 1 );
+}
+
 #ifdef VMALLOC
 //No support for calloc, realloc... it's a hack, replace it with something better.
 
@@ -155,13 +471,181 @@ void dfuse_free( void * p, long line )
 
 #endif
 
+/*
+ * sprintf() into a buffer of exactly the right size.  Column lists and size expressions can be
+ * arbitrarily long, so SQL gets built with this rather than into a fixed buffer.
+ *
+ * @returns A DFUSE_MALLOC'd string, or NULL.
+ */
+char *dfuse_asprintf( const char *fmt, ... )
+{
+    va_list ap;
+    int n;
+    char *rv;
+
+    va_start( ap, fmt );
+    n = vsnprintf( NULL, 0, fmt, ap );
+    va_end( ap );
+
+    if ( n < 0 || !( rv = DFUSE_MALLOC( n+1 ) ) )
+    {
+	return NULL;
+    }
+
+    va_start( ap, fmt );
+    vsnprintf( rv, n+1, fmt, ap );
+    va_end( ap );
+
+    return rv;
+}
+
 static char hex[] = "0123456789abcdef";
 
+/*
+ * The bytes urlencode() leaves alone, [A-Za-z0-9-_.:], and the ones htmlencode() does, which
+ * are the same plus ' '.  Paranoid on purpose: no locales, no ctype.
+ */
+#define DFUSE_URL_SAFE(c) ( ( (c) >= 'A' && (c) <= 'Z' ) || ( (c) >= 'a' && (c) <= 'z' ) \
+    || ( (c) >= '0' && (c) <= '9' ) || (c) == '-' || (c) == '_' || (c) == '.' || (c) == ':' )
+#define DFUSE_HTML_SAFE(c) ( DFUSE_URL_SAFE(c) || (c) == ' ' )
+
+// How many bytes at the start of s are safe; see DFUSE_URL_SAFE, or DFUSE_HTML_SAFE if html.
+static unsigned long dfuse_safe_span_scalar( const char *s, unsigned long length, int html )
+{
+    unsigned long i;
+
+    for ( i = 0; i < length; i++ )
+    {
+	if ( !( html ? DFUSE_HTML_SAFE( s[i] ) : DFUSE_URL_SAFE( s[i] ) ) )
+	{
+	    break;
+	}
+    }
+
+    return i;
+}
+
+#ifdef DFUSE_SIMD
+/*
+ * The same test, sixteen bytes at a time: 0xff in every safe byte's lane.  A range check is an
+ * unsigned x - lo <= hi - lo, and SSE2's only unsigned comparison is min, so that's
+ * min(x - lo, hi - lo) == x - lo.  Letters fold to lowercase with | 0x20 first, which can't
+ * pull anything else into [a-z].  extra is ' ' for html, and otherwise just '-' again.
+ */
+static inline __m128i dfuse_safe_mask_sse2( __m128i v, __m128i extra )
+{
+    __m128i letters = _mm_sub_epi8( _mm_or_si128( v, _mm_set1_epi8( 0x20 ) ), _mm_set1_epi8( 'a' ) );
+    __m128i digits = _mm_sub_epi8( v, _mm_set1_epi8( '0' ) );
+    __m128i rv;
+
+    rv = _mm_cmpeq_epi8( _mm_min_epu8( letters, _mm_set1_epi8( 'z'-'a' ) ), letters );
+    rv = _mm_or_si128( rv, _mm_cmpeq_epi8( _mm_min_epu8( digits, _mm_set1_epi8( 9 ) ), digits ) );
+    rv = _mm_or_si128( rv, _mm_cmpeq_epi8( v, _mm_set1_epi8( '-' ) ) );
+    rv = _mm_or_si128( rv, _mm_cmpeq_epi8( v, _mm_set1_epi8( '_' ) ) );
+    rv = _mm_or_si128( rv, _mm_cmpeq_epi8( v, _mm_set1_epi8( '.' ) ) );
+    rv = _mm_or_si128( rv, _mm_cmpeq_epi8( v, _mm_set1_epi8( ':' ) ) );
+    rv = _mm_or_si128( rv, _mm_cmpeq_epi8( v, extra ) );
+
+    return rv;
+}
+
+static unsigned long dfuse_safe_span_sse2( const char *s, unsigned long length, int html )
+{
+    __m128i extra = _mm_set1_epi8( html ? ' ' : '-' );
+    unsigned long i;
+    unsigned int mask;
+
+    for ( i = 0; i + 16 <= length; i += 16 )
+    {
+	mask = _mm_movemask_epi8( dfuse_safe_mask_sse2( _mm_loadu_si128( (const __m128i *)( s + i ) ), extra ) );
+
+	if ( mask != 0xffff )
+	{
+	    return i + __builtin_ctz( ~mask );
+	}
+    }
+
+    return i + dfuse_safe_span_scalar( s + i, length - i, html );
+}
+
+// dfuse_safe_mask_sse2, thirty-two bytes at a time.
+__attribute__((target("avx2")))
+static inline __m256i dfuse_safe_mask_avx2( __m256i v, __m256i extra )
+{
+    __m256i letters = _mm256_sub_epi8( _mm256_or_si256( v, _mm256_set1_epi8( 0x20 ) ), _mm256_set1_epi8( 'a' ) );
+    __m256i digits = _mm256_sub_epi8( v, _mm256_set1_epi8( '0' ) );
+    __m256i rv;
+
+    rv = _mm256_cmpeq_epi8( _mm256_min_epu8( letters, _mm256_set1_epi8( 'z'-'a' ) ), letters );
+    rv = _mm256_or_si256( rv, _mm256_cmpeq_epi8( _mm256_min_epu8( digits, _mm256_set1_epi8( 9 ) ), digits ) );
+    rv = _mm256_or_si256( rv, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '-' ) ) );
+    rv = _mm256_or_si256( rv, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '_' ) ) );
+    rv = _mm256_or_si256( rv, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '.' ) ) );
+    rv = _mm256_or_si256( rv, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( ':' ) ) );
+    rv = _mm256_or_si256( rv, _mm256_cmpeq_epi8( v, extra ) );
+
+    return rv;
+}
+
+__attribute__((target("avx2")))
+static unsigned long dfuse_safe_span_avx2( const char *s, unsigned long length, int html )
+{
+    __m256i extra = _mm256_set1_epi8( html ? ' ' : '-' );
+    unsigned long i;
+    unsigned int mask;
+
+    for ( i = 0; i + 32 <= length; i += 32 )
+    {
+	mask = (unsigned int)_mm256_movemask_epi8( dfuse_safe_mask_avx2( _mm256_loadu_si256( (const __m256i *)( s + i ) ), extra ) );
+
+	if ( mask != 0xffffffffU )
+	{
+	    return i + __builtin_ctz( ~mask );
+	}
+    }
+
+    return i + dfuse_safe_span_sse2( s + i, length - i, html );
+}
+#endif
+
+// 0 is scalar, 1 SSE2, 2 AVX2.  Settled on first use, unless -DBENCH_JSON's benchmark forces it.
+int dfuse_simd_level = -1;
+
+static unsigned long dfuse_safe_span( const char *s, unsigned long length, int html )
+{
+#ifdef DFUSE_SIMD
+    unsigned long n;
+
+    if ( dfuse_simd_level < 0 )
+    {
+	dfuse_simd_level = __builtin_cpu_supports( "avx2" ) ? 2 : 1;
+    }
+
+    if ( dfuse_simd_level > 0 )
+    {
+	// In escape-heavy (binary) data most runs are a byte or two long, and not worth a vector.
+	if ( ( n = dfuse_safe_span_scalar( s, length < 4 ? length : 4, html ) ) < 4 )
+	{
+	    return n;
+	}
+
+	if ( dfuse_simd_level == 2 )
+	{
+	    return n + dfuse_safe_span_avx2( s+n, length-n, html );
+	}
+
+	return n + dfuse_safe_span_sse2( s+n, length-n, html );
+    }
+#endif
+
+    return dfuse_safe_span_scalar( s, length, html );
+}
+
 //I couldn't find a decent one, so I wrote my own.  It's frankly proud of the fact that it ignores locales.
 //I can't come up with a reason why that's not the right decision here, but if I'm wrong, feel free to correct it.
 char *urlencode( const char *encodethis, unsigned long length )
 {
-    unsigned long i, rvptr = 0;
+    unsigned long i, n, rvptr = 0;
     char *rv;
 
     if ( !length || !encodethis )
@@ -182,21 +666,23 @@ char *urlencode( const char *encodethis, unsigned long length )
 
     D("Encoding '%s': ",encodethis);
 
-    for ( i = 0; i < length; i++ )
+    for ( i = 0; i < length; )
     {
-	if ( ( encodethis[i] >= 'A' && encodethis[i] <= 'Z' ) //[A-Z], aka isupper() but paranoid
-	  || ( encodethis[i] >= 'a' && encodethis[i] <= 'z' ) //[a-z], aka islower() but paranoid
-	  || ( encodethis[i] >= '0' && encodethis[i] <= '9' ) //[0-9], ala isdigit() but paranoid
-	  || ( encodethis[i] == '-' || encodethis[i] == '_' || encodethis[i] == '.' || encodethis[i] == ':' ) ) //Exceptions
+	// Copy the safe run in one go...
+	n = dfuse_safe_span( encodethis+i, length-i, 0 );
+	memcpy( rv+rvptr, encodethis+i, n );
+	rvptr += n;
+	i += n;
+
+	// ...then escape what follows it.  Escapes tend to come in runs too, so stay here until
+	// there's something safe again.
+	for ( ; i < length && !DFUSE_URL_SAFE( encodethis[i] ); i++ )
 	{
-	    rv[rvptr++] = encodethis[i];
-	    continue;
+	    rv[rvptr++] = '%';
+	    rv[rvptr++] = hex[(encodethis[i] >> 4) & 0x0f];
+	    rv[rvptr++] = hex[(encodethis[i] ) & 0x0f];
 	}
 
-	rv[rvptr++] = '%';
-	rv[rvptr++] = hex[(encodethis[i] >> 4) & 0x0f];
-	rv[rvptr++] = hex[(encodethis[i] ) & 0x0f];
-
 	if ( rvptr >= MAX_STRING_LENGTH )
 	{
 	    DFUSE_FREE(rv);
@@ -213,7 +699,8 @@ char *urlencode( const char *encodethis, unsigned long length )
 
 struct string_length *htmldecode_n( const char *decodethis, struct string_length *rv_struct, unsigned long maxi )
 {
-    unsigned long i, rvptr = 0;
+    unsigned long i, n, rvptr = 0;
+    const char *amp;
     char *rv;
 
     D( "Decoding '%s'.\n", decodethis );
@@ -231,12 +718,24 @@ struct string_length *htmldecode_n( const char *decodethis, struct string_length
 
     rv = rv_struct->string;
 
-    for ( i = 0; i <= maxi; i++ )
+    for ( i = 0; i <= maxi; i += 5 )
     {
-        if ( decodethis[i] != '&' )
-        {
-	    rv[rvptr++] = decodethis[i];
-	    continue;
+	// Everything up to the next '&' is literal; memchr() finds it a vector at a time.
+	amp = memchr( decodethis+i, '&', maxi+1-i );
+	n = amp ? (unsigned long)( amp - ( decodethis+i ) ) : maxi+1-i;
+	memcpy( rv+rvptr, decodethis+i, n );
+	rvptr += n;
+	i += n;
+
+	if ( i > maxi )
+	{
+	    break;
+	}
+
+	if ( maxi - i < 4 )
+	{
+	    D( "Truncated entity at i=%ld.", i );
+	    return NULL;
 	}
 
 	if ( decodethis[i+1] != 'x' )
@@ -252,13 +751,6 @@ struct string_length *htmldecode_n( const char *decodethis, struct string_length
 	}
 
 	rv[rvptr++] = (FROM_HEX(decodethis[i+2])<<4) + FROM_HEX(decodethis[i+3]);
-
-	i += 4;
-
-	if ( rvptr >= MAX_STRING_LENGTH ) // This can never happen, since rvptr is always <= strlen(decodethis), but meh
-	{
-	    return NULL;
-	}
     }
 
     rv[rvptr] = '\0';
@@ -268,9 +760,39 @@ struct string_length *htmldecode_n( const char *decodethis, struct string_length
     return rv_struct;
 }
 
+/*
+ * htmlencode(), but into a buffer the caller has already sized with htmlencoded_length().
+ *
+ * @returns The number of bytes written (no '\0' is appended).
+ */
+unsigned long htmlencode_into( char *rv, const char *encodethis, unsigned long length )
+{
+    unsigned long i, n, rvptr = 0;
+
+    for ( i = 0; i < length; )
+    {
+	// Same shape as urlencode(): a safe run in one memcpy(), then a run of escapes.
+	n = dfuse_safe_span( encodethis+i, length-i, 1 );
+	memcpy( rv+rvptr, encodethis+i, n );
+	rvptr += n;
+	i += n;
+
+	for ( ; i < length && !DFUSE_HTML_SAFE( encodethis[i] ); i++ )
+	{
+	    rv[rvptr++] = '&';
+	    rv[rvptr++] = 'x';
+	    rv[rvptr++] = hex[(encodethis[i] >> 4) & 0x0f];
+	    rv[rvptr++] = hex[(encodethis[i] ) & 0x0f];
+	    rv[rvptr++] = ';';
+	}
+    }
+
+    return rvptr;
+}
+
 char *htmlencode( const char *encodethis, unsigned long length )
 {
-    unsigned long i, rvptr = 0;
+    unsigned long rvptr;
     char *rv;
 
     if ( length < 0 || !encodethis )
@@ -291,28 +813,12 @@ char *htmlencode( const char *encodethis, unsigned long length )
 
     D("Encoding '%s': ",encodethis);
 
-    for ( i = 0; i < length; i++ )
-    {
-	if ( ( encodethis[i] >= 'A' && encodethis[i] <= 'Z' ) //[A-Z], aka isupper() but paranoid
-	  || ( encodethis[i] >= 'a' && encodethis[i] <= 'z' ) //[a-z], aka islower() but paranoid
-	  || ( encodethis[i] >= '0' && encodethis[i] <= '9' ) //[0-9], ala isdigit() but paranoid
-	  || ( encodethis[i] == '-' || encodethis[i] == '_' || encodethis[i] == '.' || encodethis[i] == ':' ) || encodethis[i] == ' ' ) //Exceptions
-	{
-	    rv[rvptr++] = encodethis[i];
-	    continue;
-	}
-
-	rv[rvptr++] = '&';
-	rv[rvptr++] = 'x';
-	rv[rvptr++] = hex[(encodethis[i] >> 4) & 0x0f];
-	rv[rvptr++] = hex[(encodethis[i] ) & 0x0f];
-	rv[rvptr++] = ';';
+    rvptr = htmlencode_into( rv, encodethis, length );
 
-	if ( rvptr >= MAX_STRING_LENGTH )
-	{
-	    DFUSE_FREE(rv);
-	    return NULL;
-	}
+    if ( rvptr >= MAX_STRING_LENGTH )
+    {
+	DFUSE_FREE(rv);
+	return NULL;
     }
 
     rv[rvptr] = '\0';
@@ -337,7 +843,8 @@ char *htmlencode( const char *encodethis, unsigned long length )
  */
 struct string_length *urldecode( const char *decodethis )
 {
-    unsigned long i, rvptr = 0;
+    unsigned long i, n, length, rvptr = 0;
+    const char *percent;
     char *rv;
     struct string_length * rv_struct = NULL;
 
@@ -350,39 +857,44 @@ struct string_length *urldecode( const char *decodethis )
 	return NULL;
     }
 
-    if ( strlen(decodethis) >= MAX_STRING_LENGTH )
+    if ( ( length = strlen(decodethis) ) >= MAX_STRING_LENGTH )
     {
 	//Arguably should die here.
 	return NULL;
     }
 
-    if ( !( rv = DFUSE_MALLOC( strlen(decodethis)+1 ) ) )
+    if ( !( rv = DFUSE_MALLOC( length+1 ) ) )
     {
 	return NULL;
     }
 
-    for ( i = 0; i < strlen(decodethis); i++ )
+    for ( i = 0; i < length; i += 3 )
     {
-	if ( decodethis[i] != '%' )
+	// Everything up to the next '%' is literal.
+	percent = memchr( decodethis+i, '%', length-i );
+	n = percent ? (unsigned long)( percent - ( decodethis+i ) ) : length-i;
+	memcpy( rv+rvptr, decodethis+i, n );
+	rvptr += n;
+	i += n;
+
+	if ( i >= length )
 	{
-	    rv[rvptr++] = decodethis[i];
-	    continue;
+	    break;
 	}
 
-	rv[rvptr++] = (FROM_HEX(decodethis[i+1])<<4) + FROM_HEX(decodethis[i+2]);
-
-	i += 2;
-
-	if ( rvptr >= MAX_STRING_LENGTH ) // This can never happen, since rvptr is always <= strlen(decodethis), but meh
+	// A '%' with fewer than two characters after it would have us reading past the end.
+	if ( length - i < 3 )
 	{
 	    DFUSE_FREE( rv );
 	    return NULL;
 	}
+
+	rv[rvptr++] = (FROM_HEX(decodethis[i+1])<<4) + FROM_HEX(decodethis[i+2]);
     }
 
     rv[rvptr] = '\0';
 
-    if ( !( rv_struct = DFUSE_MALLOC( sizeof( rv_struct ) ) ) )
+    if ( !( rv_struct = DFUSE_MALLOC( sizeof( *rv_struct ) ) ) )
     {
 	DFUSE_FREE( rv );
 	return NULL;
@@ -394,541 +906,1159 @@ struct string_length *urldecode( const char *decodethis )
     return rv_struct;
 }
 
-void dfuse_maybe_close( void )
+/*
+ * What htmlencode() would hand back for this string, without building it.  Used to work out
+ * --json file sizes from lengths alone.
+ */
+unsigned long htmlencoded_length( const char *encodethis, unsigned long length )
 {
-    if ( !cached_sql || !lazy_conn )
+    unsigned long i, rv = length;
+
+    // Every unsafe byte grows by four; count them the same way htmlencode_into() finds them.
+    for ( i = 0; i < length; )
     {
-	return;
-    }
+	i += dfuse_safe_span( encodethis+i, length-i, 1 );
 
-    mysql_close( cached_sql );
-    cached_sql = NULL;
+	for ( ; i < length && !DFUSE_HTML_SAFE( encodethis[i] ); i++ )
+	{
+	    rv += 4;
+	}
+    }
 
-    return;
+    return rv;
 }
 
-char * dfuse_jsonify_row( MYSQL_ROW *sql_row, MYSQL_RES *sql_res, char *prikey, unsigned long prikey_len )
+/*
+ * What we know about the shape of a --json row: the names of the columns we render, and, where
+ * every column is a plain table column, a SQL expression that makes the server tell us how many
+ * bytes the rendered values will take, and the SET clause that writes a row back.  Loaded once
+ * per table.
+ */
+struct dfuse_schema {
+    unsigned int num_fields;
+    char **names;		// As the server sent them; what a written file's keys get matched against.
+    char **encoded_names;
+    unsigned long *encoded_name_lengths;
+
+    // Bytes of the rendered file that don't depend on the row: the framing, plus every field
+    // name.  Add htmlencoded_length(prikey) and the result of size_sql to get st_size.
+    unsigned long fixed_length;
+
+    // NULL if some column is an expression we can't measure server-side.
+    char *size_sql;
+
+    // "`a`=IF(?,`a`,?),...": each column gets a keep-it flag and a new value.  NULL if some
+    // column is an expression, since there'd be nothing to write it back to.
+    char *update_sql;
+
+    // "QUOTE(`a`),...": the row, for CONCAT_WS to checksum (see dfuse_row_sum_columns).  NULL
+    // under the same conditions as update_sql.
+    char *sum_sql;
+};
+
+// Guards every dfuse_table's schema.
+pthread_mutex_t json_schema_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// These are the pieces dfuse_render_json glues a row together with.
+static char jsonify_prepri[] = "{\n\t\"";
+static char jsonify_postpri[] = "\": {\n";
+static char jsonify_prerow[] = "\t\"";
+static char jsonify_midrow[] = "\": \"";
+static char jsonify_midrow_nq[] = "\": ";
+static char jsonify_postrow[] = "\",\n";
+static char jsonify_postrow_nq[] = ",\n";
+static char jsonify_end[] = "\t}\n}";
+
+#define JSONIFY_LEN(piece) (sizeof(piece)-1)
+
+/*
+ * Server-side, the rendered length of a non-NULL value v is 5*OCTET_LENGTH(v) - 4*(its safe
+ * bytes), since every unsafe byte becomes "&xNN;".  We count the safe bytes by stripping out
+ * everything else with REGEXP_REPLACE; the CAST/CONVERT dance relabels the value as latin1 without
+ * converting it, so that the regex sees exactly one character per byte.  v is the value as we'll
+ * be sent it: a text column converted to the connection's character set first (see
+ * json_size_value_fmt), since that's what we render, and that's not always what's stored.
+ */
+static const char json_size_column_fmt[] =
+    "IFNULL(%lu+5*OCTET_LENGTH(%s)-4*OCTET_LENGTH(REGEXP_REPLACE("
+    "CONVERT(%s USING latin1) COLLATE latin1_bin,'[^-A-Za-z0-9_.: ]','')),%lu)";
+static const char json_size_value_fmt[] = "CAST(CONVERT(`%s` USING %s) AS BINARY)";
+static const char json_size_binary_fmt[] = "CAST(`%s` AS BINARY)";
+
+// One column of schema->update_sql.  The first ? says "leave it alone", for columns a written
+// file didn't mention.
+static const char json_update_column_fmt[] = "`%s`=IF(?,`%s`,?)";
+
+// One column of schema->sum_sql.
+static const char json_sum_column_fmt[] = "QUOTE(`%s`)";
+
+void dfuse_free_schema( struct dfuse_schema *schema )
 {
-    char **encoded_pieces, **encoded_fieldname, *encoded_prikey, *rv;
-    MYSQL_FIELD *sql_field;
-    unsigned long *lengths;
-    unsigned int num_fields, i;
-    unsigned long encoded_length = 0;
-    unsigned long long jsonified_length = 0;
-    static char jsonify_prepri[] = "{\n\t\"";
-    static char jsonify_postpri[] = "\": {\n";
-    static char jsonify_prerow[] = "\t\"";
-    static char jsonify_midrow[] = "\": \"";
-    static char jsonify_midrow_nq[] = "\": ";
-    static char jsonify_postrow[] = "\",\n";
-    static char jsonify_postrow_nq[] = ",\n";
-    static char jsonify_end[] = "\t}\n}";
+    unsigned int i;
 
-    if ( !sql_row || !prikey )
+    if ( !schema )
     {
-	return NULL;
+	return;
     }
 
-    if ( prikey_len > MAX_STRING_LENGTH )
+    for ( i = 0; i < schema->num_fields; i++ )
     {
-	//Arguably should die here.
-	return NULL;
+	if ( schema->names[i] ) { DFUSE_FREE( schema->names[i] ); }
+	if ( schema->encoded_names[i] ) { DFUSE_FREE( schema->encoded_names[i] ); }
     }
 
-    if ( !( num_fields = mysql_num_fields( sql_res ) ) )
+    if ( schema->names ) { DFUSE_FREE( schema->names ); }
+    if ( schema->encoded_names ) { DFUSE_FREE( schema->encoded_names ); }
+    if ( schema->encoded_name_lengths ) { DFUSE_FREE( schema->encoded_name_lengths ); }
+    if ( schema->size_sql ) { DFUSE_FREE( schema->size_sql ); }
+    if ( schema->update_sql ) { DFUSE_FREE( schema->update_sql ); }
+    if ( schema->sum_sql ) { DFUSE_FREE( schema->sum_sql ); }
+
+    DFUSE_FREE( schema );
+}
+
+/*
+ * Builds a dfuse_schema from a result set's field list.  If the fields came from a real table,
+ * the size expression gets built, too, measuring text as it comes out in charset (the
+ * connection's).
+ */
+struct dfuse_schema *dfuse_build_schema( MYSQL_FIELD *fields, unsigned int num_fields, const char *charset )
+{
+    struct dfuse_schema *schema;
+    unsigned int i;
+    unsigned long size_sql_length = 0, update_sql_length = 0, sum_sql_length = 0;
+    char *p, value[512];
+    size_t n;
+
+    if ( !( schema = DFUSE_MALLOC( sizeof( struct dfuse_schema ) ) ) )
     {
 	return NULL;
     }
 
-    if ( !( lengths = mysql_fetch_lengths( sql_res ) ) )
+    memset( schema, 0, sizeof( struct dfuse_schema ) );
+
+    if ( !( schema->names = DFUSE_MALLOC( sizeof( char * ) * ( num_fields ? num_fields : 1 ) ) )
+      || !( schema->encoded_names = DFUSE_MALLOC( sizeof( char * ) * ( num_fields ? num_fields : 1 ) ) )
+      || !( schema->encoded_name_lengths = DFUSE_MALLOC( sizeof( unsigned long ) * ( num_fields ? num_fields : 1 ) ) ) )
     {
+	dfuse_free_schema( schema );
 	return NULL;
     }
 
-    if ( !( encoded_prikey = htmlencode(prikey, prikey_len) ) )
+    schema->fixed_length = JSONIFY_LEN(jsonify_prepri) + JSONIFY_LEN(jsonify_postpri) + JSONIFY_LEN(jsonify_end);
+
+    for ( i = 0; i < num_fields; i++ )
     {
-	return NULL;
+	schema->names[i] = NULL;
+
+	if ( !( schema->encoded_names[i] = htmlencode( fields[i].name ? fields[i].name : "", fields[i].name ? fields[i].name_length : 0 ) ) )
+	{
+	    dfuse_free_schema( schema );
+	    return NULL;
+	}
+	schema->num_fields++;
+
+	if ( !( schema->names[i] = DFUSE_MALLOC( ( fields[i].name ? fields[i].name_length : 0 ) + 1 ) ) )
+	{
+	    dfuse_free_schema( schema );
+	    return NULL;
+	}
+	memcpy( schema->names[i], fields[i].name ? fields[i].name : "", fields[i].name ? fields[i].name_length : 0 );
+	schema->names[i][fields[i].name ? fields[i].name_length : 0] = '\0';
+
+	schema->encoded_name_lengths[i] = strlen( schema->encoded_names[i] );
+	schema->fixed_length += JSONIFY_LEN(jsonify_prerow) + schema->encoded_name_lengths[i];
+
+	// An expression (COUNT(*), CONCAT(...)) has no org_name, and we can't measure those.
+	if ( size_sql_length != (unsigned long)-1 )
+	{
+	    if ( !fields[i].org_name || !fields[i].org_name_length || strchr( fields[i].org_name, '`' )
+	      || fields[i].org_name_length + strlen( charset ) + sizeof(json_size_value_fmt) > sizeof( value ) )
+	    {
+		size_sql_length = (unsigned long)-1;
+	    }
+	    else
+	    {
+		size_sql_length += sizeof(json_size_column_fmt) + 2*sizeof(value) + 2*20 + 1;
+		update_sql_length += sizeof(json_update_column_fmt) + 2*fields[i].org_name_length + 1;
+		sum_sql_length += sizeof(json_sum_column_fmt) + fields[i].org_name_length + 1;
+	    }
+	}
     }
 
-    if ( !( encoded_pieces = DFUSE_MALLOC(sizeof(encoded_pieces)*num_fields) ) )
+    if ( size_sql_length == (unsigned long)-1 || !num_fields )
     {
-	return NULL;
+	return schema;
     }
 
-    if ( !( encoded_fieldname = DFUSE_MALLOC(sizeof(encoded_fieldname)*num_fields) ) )
+    if ( !( schema->size_sql = DFUSE_MALLOC( size_sql_length + 3 ) ) )
     {
+	dfuse_free_schema( schema );
 	return NULL;
     }
 
+    p = schema->size_sql;
+    *p++ = '(';
+
     for ( i = 0; i < num_fields; i++ )
     {
-	sql_field = mysql_fetch_field( sql_res );
-
-	if ( sql_field && sql_field->name )
+	// Binary strings (and numbers, whose text is ASCII either way) reach us unconverted.
+	if ( fields[i].charsetnr == 63 )
 	{
-	    encoded_fieldname[i] = htmlencode(sql_field->name,sql_field->name_length);
+	    snprintf( value, sizeof( value ), json_size_binary_fmt, fields[i].org_name );
 	}
 	else
 	{
-	    encoded_fieldname[i] = "";
+	    snprintf( value, sizeof( value ), json_size_value_fmt, fields[i].org_name, charset );
 	}
-	encoded_length += strlen(encoded_fieldname[i]);
 
-	D("Got an encoded fieldname: '%s'.\n", encoded_fieldname[i]);
+	n = snprintf( p, size_sql_length + 3 - ( p - schema->size_sql ), json_size_column_fmt,
+	    (unsigned long)( JSONIFY_LEN(jsonify_midrow) + JSONIFY_LEN(jsonify_postrow) ), value, value,
+	    (unsigned long)( JSONIFY_LEN(jsonify_midrow_nq) + strlen("null") + JSONIFY_LEN(jsonify_postrow_nq) ) );
+	p += n;
+	*p++ = ( i+1 < num_fields ) ? '+' : ')';
+    }
 
-	if ( (*sql_row)[i] )
-	{
-	    encoded_pieces[i] = htmlencode((*sql_row)[i],lengths[i]);
-	    encoded_length += strlen(encoded_pieces[i]);
-	}
-	else
-	{
-	    D("\tDecided to null-code: '%p', ", sql_row[i]);
-	    D("'%p'\n", (*sql_row)[i]);
-	    encoded_pieces[i] = NULL;
-	    encoded_length += strlen("null")-
-		((strlen(jsonify_midrow)+strlen(jsonify_postrow))-
-		 (strlen(jsonify_midrow_nq)+strlen(jsonify_postrow_nq))); // -2 for the start and end quotes.
-	}
-
-	D("\tBuilt an encoded_piece: '%s'.\n", encoded_pieces[i]);
-    }
+    *p = '\0';
 
-    jsonified_length = (
-	strlen( jsonify_prepri ) +
-	strlen( encoded_prikey ) +
-	strlen( jsonify_postpri ) +
-	( ( strlen( jsonify_prerow ) + strlen( jsonify_midrow ) + strlen( jsonify_postrow ) ) * num_fields ) +
-	encoded_length +		// length of all the row data and field names, htmlencoded
-	strlen( jsonify_end ) +
-	1 );				// '\0'
+    D( "Built a size expression: '%s'.\n", schema->size_sql );
 
-    if ( jsonified_length > MAX_STRING_LENGTH )
+    if ( !( schema->update_sql = DFUSE_MALLOC( update_sql_length + 1 ) ) )
     {
-	//Arguably should die noisily, since this means skullduggery is almost certainly afoot.
-	for ( i = 0; i < num_fields; i++ )
-	{
-	    DFUSE_FREE( encoded_fieldname[i] );
-	    DFUSE_FREE( encoded_pieces[i] );
-	}
-	DFUSE_FREE( encoded_fieldname );
-	DFUSE_FREE( encoded_pieces );
-	DFUSE_FREE( encoded_prikey);
+	dfuse_free_schema( schema );
 	return NULL;
-
     }
 
-    //Opportunity to optimize: cache strlen()s via #define or summat
-    if ( !jsonified_length || !( rv = DFUSE_MALLOC( jsonified_length ) ) )
+    p = schema->update_sql;
+
+    for ( i = 0; i < num_fields; i++ )
     {
-	for ( i = 0; i < num_fields; i++ )
+	p += snprintf( p, update_sql_length + 1 - ( p - schema->update_sql ), json_update_column_fmt,
+	    fields[i].org_name, fields[i].org_name );
+	if ( i+1 < num_fields )
 	{
-	    DFUSE_FREE( encoded_fieldname[i] );
-	    DFUSE_FREE( encoded_pieces[i] );
+	    *p++ = ',';
 	}
-	DFUSE_FREE( encoded_fieldname );
-	DFUSE_FREE( encoded_pieces );
-	DFUSE_FREE( encoded_prikey);
-	return NULL;
     }
 
-    // This part is stupidly easy to optimize; parts of the rv string are copied over themselves (row+1) times.
-
-    D("Got a rv ready to bundle with e_l = %ld.\n",encoded_length);
+    *p = '\0';
 
-    sprintf( rv, "%s%s%s",
-	jsonify_prepri,
-	encoded_prikey,
-	jsonify_postpri );
+    if ( !( schema->sum_sql = DFUSE_MALLOC( sum_sql_length + 1 ) ) )
+    {
+	dfuse_free_schema( schema );
+	return NULL;
+    }
 
-    D("Starting off small: '%s'.\n", rv);
+    p = schema->sum_sql;
 
     for ( i = 0; i < num_fields; i++ )
     {
-	sprintf( rv, "%s%s%s%s%s%s",
-	    rv,
-	    jsonify_prerow,
-	    encoded_fieldname[i],
-	    encoded_pieces[i] ? jsonify_midrow : jsonify_midrow_nq,
-	    encoded_pieces[i] ? encoded_pieces[i] : "null",		//The irony that "null" goes in quotes here of
-	    encoded_pieces[i] ? jsonify_postrow : jsonify_postrow_nq ); //all places is not lost on me.
-
-	DFUSE_FREE( encoded_fieldname[i] );
-	DFUSE_FREE( encoded_pieces[i] );
-
-	D("Gettin' fancier: '%s'.\n", rv);
+	p += snprintf( p, sum_sql_length + 1 - ( p - schema->sum_sql ), json_sum_column_fmt, fields[i].org_name );
+	if ( i+1 < num_fields )
+	{
+	    *p++ = ',';
+	}
     }
 
-    sprintf( rv, "%s%s",
-	rv,
-	jsonify_end );
-
-    D("Slicker 'n a mayonaise sandwich: '%s'.\n", rv);
+    *p = '\0';
 
-    DFUSE_FREE( encoded_fieldname );
-    DFUSE_FREE( encoded_pieces );
-    DFUSE_FREE( encoded_prikey);
+    return schema;
+}
 
-    return rv;
+/*
+ * Returns the --json schema for table, fetching it (with a LIMIT 0 query) the first time
+ * anybody asks.
+ */
+struct dfuse_schema *dfuse_json_schema( MYSQL *sql, struct dfuse_table *table )
+{
+    MYSQL_RES *sql_res;
+    char *query;
+    struct dfuse_schema *schema;
+    int qr;
 
-/*  Pseudocode to help me get things right.
-    $rv = "{\n\t" . prikey . ": {\n";
+    pthread_mutex_lock( &json_schema_lock );
 
-    foreach( $row as $key => $val )
+    if ( table->schema )
     {
-	$rv .= "\t" . $key . ': "' . htmlencode($val) . '",' . "\n";
+	pthread_mutex_unlock( &json_schema_lock );
+	return table->schema;
     }
 
-    $rv .= "\t}\n}";
-*/
-}
-
+    if ( !( query = dfuse_asprintf( "SELECT %s FROM %s LIMIT 0", options.columns, table->sql_name ) ) )
+    {
+	pthread_mutex_unlock( &json_schema_lock );
+	return NULL;
+    }
 
-struct dfuse_nv_ll * new_nvll( void )
-{
-    struct dfuse_nv_ll *rv;
+    qr = dfuse_query( sql, query );
+    DFUSE_FREE( query );
 
-    if ( !( rv = DFUSE_MALLOC( sizeof( struct dfuse_nv_ll ) ) ) )
+    if ( qr || !( sql_res = mysql_store_result( sql ) ) )
     {
+	pthread_mutex_unlock( &json_schema_lock );
 	return NULL;
     }
 
-    rv->name = NULL;
-    rv->nvll_value = NULL;
-    rv->value = NULL;
-    rv->next = NULL;
+    schema = dfuse_build_schema( mysql_fetch_fields( sql_res ), mysql_num_fields( sql_res ), mysql_character_set_name( sql ) );
 
-    return rv;
-}
+    mysql_free_result( sql_res );
 
-void free_nvll( struct dfuse_nv_ll *root )
-{
-    if ( !root )
+    // The size expression goes into prepared statements, where a server without REGEXP_REPLACE
+    // (anything before MySQL 8.0) would fail every one of them.  Find out now, and do without.
+    if ( schema && schema->size_sql )
     {
-	return;
+	if ( !( query = dfuse_asprintf( "SELECT %s FROM %s LIMIT 0", schema->size_sql, table->sql_name ) )
+	  || dfuse_query( sql, query ) || !( sql_res = mysql_store_result( sql ) ) )
+	{
+	    D( "Server can't measure rows for us: '%s'.\n", mysql_error( sql ) );
+	    DFUSE_FREE( schema->size_sql );
+	    schema->size_sql = NULL;
+	}
+	else
+	{
+	    mysql_free_result( sql_res );
+	}
+
+	if ( query ) { DFUSE_FREE( query ); }
     }
 
-    if ( root->name ) { DFUSE_FREE(root->name); }
-    if ( root->value ) { DFUSE_FREE(root->value); }
-    if ( root->nvll_value ) { free_nvll( root->nvll_value ); }
-    if ( root->next ) { free_nvll( root->next ); }
+    table->schema = schema;
+
+    pthread_mutex_unlock( &json_schema_lock );
 
-    DFUSE_FREE( root );
+    return schema;
 }
 
-#define so_sl sizeof( struct string_length )
+#define JSONIFY_PUT(p, piece) { memcpy( (p), (piece), JSONIFY_LEN(piece) ); (p) += JSONIFY_LEN(piece); }
 
 /*
- * Parses some JSON into an array for you.
+ * Renders a row as JSON in a single allocation: one pass over the values to measure them, then
+ * one to encode them directly into place.  Field names come pre-encoded from the schema.
  *
- * @param json The string to parse.  Must be complete and valid JSON, and cannot omit the
- *   root {} (that said, it might actually work, but I can't promise anything).
- * @param recursed If it is non-null, we will return as soon as paren_deep <= 0 and set the
- *   unsigned long to which it points to the number of characters we disgested (intended
- *   for internal use; by default, we error out when the json is invalid, and this test is
- *   one of the ways we know that it is.
- *
- * @returns A linked list, next == null on the last element.
+ * @param values One per schema field; NULL means SQL NULL.
+ * @param rendered_length If non-NULL, gets the length of the result (also '\0'-terminated).
  */
-struct dfuse_nv_ll * dfuse_parse_json( const char *json, size_t size, unsigned long *recursed )
+char * dfuse_render_json( const struct dfuse_schema *schema, char **values, unsigned long *lengths,
+    const char *prikey, unsigned long prikey_len, unsigned long *rendered_length )
 {
-    struct dfuse_nv_ll *rootnvll = NULL;
-    struct dfuse_nv_ll *thisnvll = NULL;
+    unsigned long long jsonified_length;
+    unsigned int i;
+    char *rv, *p;
 
-    unsigned long i;
-    unsigned long chars;
-    unsigned long toallocate;
-    int paren_deep = 0;
+    if ( !schema || !values || !lengths || !prikey || prikey_len > MAX_STRING_LENGTH )
+    {
+	return NULL;
+    }
 
-    short int gotaname = 0;
+    jsonified_length = schema->fixed_length + htmlencoded_length( prikey, prikey_len );
 
-    char *decodedval;
-    struct string_length *decodedsl;
+    for ( i = 0; i < schema->num_fields; i++ )
+    {
+	if ( values[i] )
+	{
+	    jsonified_length += JSONIFY_LEN(jsonify_midrow) + htmlencoded_length( values[i], lengths[i] ) + JSONIFY_LEN(jsonify_postrow);
+	}
+	else
+	{
+	    jsonified_length += JSONIFY_LEN(jsonify_midrow_nq) + strlen("null") + JSONIFY_LEN(jsonify_postrow_nq);
+	}
+    }
 
-    if ( !json )
+    if ( jsonified_length > MAX_STRING_LENGTH )
     {
-	D( "Null json with recursed='%p'.\n", recursed );
+	//Arguably should die noisily, since this means skullduggery is almost certainly afoot.
 	return NULL;
     }
 
-    // We'll do this inside the loop, instead.  Might be faster to do it here, though.  Feel
-    // free to benchmark both approaches.
-/*    if ( strlen(json) > MAX_STRING_LENGTH )
+    if ( !( rv = DFUSE_MALLOC( jsonified_length+1 ) ) )
     {
 	return NULL;
-    }*/
+    }
+
+    p = rv;
+
+    JSONIFY_PUT( p, jsonify_prepri );
+    p += htmlencode_into( p, prikey, prikey_len );
+    JSONIFY_PUT( p, jsonify_postpri );
 
-    for ( i = 0; json[i] != '\0' && i < size; i++ )
+    for ( i = 0; i < schema->num_fields; i++ )
     {
-	D( "\nParsing '%c'.\n", json[i] );
+	JSONIFY_PUT( p, jsonify_prerow );
+	memcpy( p, schema->encoded_names[i], schema->encoded_name_lengths[i] );
+	p += schema->encoded_name_lengths[i];
 
-	switch( json[i] )
+	if ( values[i] )
 	{
-	    case ' ':
-	    case '\t':
-	    case '\n':
-	    case '\r':
-	    case ',': //We skip it; arguably, we should parse through it, but that really only adds an extra error check.
-	    case ':': //As above.
-		continue;
-	    case '"':
-		if ( !rootnvll || !thisnvll )
-		{
-		    D( "Reading a string without any rootnvll and/or thisnvll.  Dying at %d.\n", __LINE__ );
-		    return NULL;
-		}
+	    JSONIFY_PUT( p, jsonify_midrow );
+	    p += htmlencode_into( p, values[i], lengths[i] );
+	    JSONIFY_PUT( p, jsonify_postrow );
+	}
+	else
+	{
+	    //The irony that "null" goes in quotes here of all places is not lost on me.
+	    JSONIFY_PUT( p, jsonify_midrow_nq );
+	    memcpy( p, "null", strlen("null") );
+	    p += strlen("null");
+	    JSONIFY_PUT( p, jsonify_postrow_nq );
+	}
+    }
 
-		// Read until endquote, this is our name if name==null, our value otherwise.
-		// If it's a value, when done reading it, set name=null.
-		toallocate=1; //sizeof("") = 1 due to '\0'.
+    JSONIFY_PUT( p, jsonify_end );
+    *p = '\0';
 
-		for ( chars = 1; json[i+chars] != '"'; chars++ )
-		{
-		    toallocate++;
+    if ( p - rv != jsonified_length )
+    {
+	D( "Assert failed; my size estimation was off by %lld!\n", (long long)( p - rv ) - (long long)jsonified_length );
+	DFUSE_FREE( rv );
+	return NULL;
+    }
 
-		    if ( json[i+chars] == '\0' )
-		    {
-			D( "Unexpected null while reading nameval at pos %ld.\n", i+chars );
-			free_nvll( rootnvll );
-			return NULL;
-		    }
+    D("Slicker 'n a mayonaise sandwich: '%s'.\n", rv);
 
-		    if ( json[i+chars] == '&' )
-		    {
-			if ( json[i+chars+1] != 'x'
-			  || json[i+chars+4] != ';' )
-			{
-			    D( "Bad '&' at position %ld.\n", i+chars );
-			    free_nvll( rootnvll );
-			    return NULL;
-			}
-
-			D( "\tRead an entity at i=%ld, ", i );
-			D( "chars=%ld.\n", chars );
-
-			chars += 4; // skip this character and the next four.
-			continue;
-		    }
-		}
+    if ( rendered_length )
+    {
+	*rendered_length = jsonified_length;
+    }
 
-		if ( !( decodedsl = DFUSE_MALLOC(sizeof(decodedsl)) ) )
-		{
-		    D( "Failed to allocate %ld bytes for decodedsl.", sizeof(decodedsl) );
-		    free_nvll(rootnvll);
-		    return NULL;
-		}
+    return rv;
 
-		if ( !( decodedval = DFUSE_MALLOC(toallocate) ) )
-		{
-		    D( "Failed to allocate %ld bytes for toallocate.", toallocate );
-		    free_nvll(rootnvll);
-		    DFUSE_FREE(decodedsl);
-		    return NULL;
-		}
+/*  Pseudocode to help me get things right.
+    $rv = "{\n\t" . prikey . ": {\n";
 
-		decodedsl->string = decodedval;
-		decodedsl->length = 0;
+    foreach( $row as $key => $val )
+    {
+	$rv .= "\t" . $key . ': "' . htmlencode($val) . '",' . "\n";
+    }
 
-		if ( chars == 1 ) //In other words, if the first character we hit was a "...
-		{
-			decodedsl->string[0] = '\0';
-		}
-		else if ( !htmldecode_n( json+i+1, decodedsl, chars-2 ) )
-		{
-		    D( "Chars = %ld", chars );
-		    D( "Failed to htmldecode at line %d.", __LINE__ );
-		    free_nvll(rootnvll);
-		    DFUSE_FREE(decodedval);
-		    DFUSE_FREE(decodedsl);
-		    return NULL;
-		}
+    $rv .= "\t}\n}";
+*/
+}
 
-		// -1 for the '\0'
-		if ( (toallocate-1) != decodedsl->length )
-		{
-		    D( "Assert failed; my size estimation was wrong!  They differ by %ld.", toallocate-1-decodedsl->length );
-		    free_nvll(rootnvll);
-		    DFUSE_FREE(decodedval);
-		    DFUSE_FREE(decodedsl);
-		    return NULL;
-		}
+#ifdef BENCH_JSON
+/*
+ * Build with -DBENCH_JSON and run the result with no arguments to compare dfuse_render_json
+ * with the sprintf()-based serializer it replaced.  The old one is reproduced here, minus the
+ * MYSQL_RES plumbing, as faithfully as possible; that includes its sprintf( rv, "%s...", rv )
+ * self-append, which is what made it quadratic.
+ */
+char * dfuse_bench_legacy_jsonify( char **names, char **values, unsigned long *lengths, unsigned int num_fields,
+    char *prikey, unsigned long prikey_len )
+{
+    char **encoded_pieces, **encoded_fieldname, *encoded_prikey, *rv;
+    unsigned int i;
+    unsigned long encoded_length = 0;
+    unsigned long long jsonified_length = 0;
 
-		if ( gotaname )
-		{
-		    if ( !( thisnvll->value = DFUSE_MALLOC( sizeof( thisnvll->value ) ) ) )
-		    {
-			D( "Failed to malloc for the value stringlength at i=%ld.", i );
-			free_nvll(rootnvll);
-		        DFUSE_FREE(decodedval);
-		        DFUSE_FREE(decodedsl);
-			return NULL;
-		    }
+    encoded_prikey = htmlencode(prikey, prikey_len);
+    encoded_pieces = DFUSE_MALLOC(sizeof(encoded_pieces)*num_fields);
+    encoded_fieldname = DFUSE_MALLOC(sizeof(encoded_fieldname)*num_fields);
 
-		    thisnvll->value->length = toallocate-1;
-		    thisnvll->value->string = decodedsl->string;
+    for ( i = 0; i < num_fields; i++ )
+    {
+	encoded_fieldname[i] = htmlencode(names[i],strlen(names[i]));
+	encoded_length += strlen(encoded_fieldname[i]);
 
-		    DFUSE_FREE( decodedsl );
+	if ( values[i] )
+	{
+	    encoded_pieces[i] = htmlencode(values[i],lengths[i]);
+	    encoded_length += strlen(encoded_pieces[i]);
+	}
+	else
+	{
+	    encoded_pieces[i] = NULL;
+	    encoded_length += strlen("null")-
+		((strlen(jsonify_midrow)+strlen(jsonify_postrow))-
+		 (strlen(jsonify_midrow_nq)+strlen(jsonify_postrow_nq)));
+	}
+    }
 
-		    gotaname = 0;
-		}
-		else
-		{
-		    struct dfuse_nv_ll *lastnvll = thisnvll;
+    jsonified_length = (
+	strlen( jsonify_prepri ) +
+	strlen( encoded_prikey ) +
+	strlen( jsonify_postpri ) +
+	( ( strlen( jsonify_prerow ) + strlen( jsonify_midrow ) + strlen( jsonify_postrow ) ) * num_fields ) +
+	encoded_length +
+	strlen( jsonify_end ) +
+	1 );
 
-		    if ( !( thisnvll = new_nvll() ) )
-		    {
-			D( "Failed to malloc for new thisnvll at %d.", __LINE__ );
-			free_nvll(rootnvll);
-			DFUSE_FREE(decodedval);
-			DFUSE_FREE(decodedsl);
-			return NULL;
-		    }
+    rv = DFUSE_MALLOC( jsonified_length );
 
-		    lastnvll->next = thisnvll;
+    sprintf( rv, "%s%s%s", jsonify_prepri, encoded_prikey, jsonify_postpri );
 
-		    if ( !( thisnvll->name = DFUSE_MALLOC( sizeof( thisnvll->name ) ) ) )
-		    {
-			D( "Failed to malloc for the name stringlength at i=%ld.", i );
-			free_nvll(rootnvll);
-		        DFUSE_FREE(decodedval);
-		        DFUSE_FREE(decodedsl);
-			return NULL;
-		    }
+    for ( i = 0; i < num_fields; i++ )
+    {
+	sprintf( rv, "%s%s%s%s%s%s",
+	    rv,
+	    jsonify_prerow,
+	    encoded_fieldname[i],
+	    encoded_pieces[i] ? jsonify_midrow : jsonify_midrow_nq,
+	    encoded_pieces[i] ? encoded_pieces[i] : "null",
+	    encoded_pieces[i] ? jsonify_postrow : jsonify_postrow_nq );
 
-		    thisnvll->name->length = toallocate-1;
-		    thisnvll->name->string = decodedsl->string;
+	DFUSE_FREE( encoded_fieldname[i] );
+	DFUSE_FREE( encoded_pieces[i] );
+    }
 
-		    DFUSE_FREE( decodedsl );
+    sprintf( rv, "%s%s", rv, jsonify_end );
 
-		    gotaname = 1;
-		}
+    DFUSE_FREE( encoded_fieldname );
+    DFUSE_FREE( encoded_pieces );
+    DFUSE_FREE( encoded_prikey );
 
-		i += chars;
-		break;
-	    case '{':
-		paren_deep++;
+    return rv;
+}
 
-		if ( !rootnvll )
-		{
-		    if ( paren_deep > 1 )
-		    {
-			D( "Things that should never happen, part 6(b), subsection %d.", __LINE__ );
-			return NULL;
-		    }
-		    //Root brace.  Or misformatted JSON.  Either way, don't get too worked up over it.
-		    if ( !( rootnvll = thisnvll = new_nvll() ) )
-		    {
-			D( "Bailing due to inability to set rootnvll to newnvll at %d.", __LINE__ );
-			return NULL;
-		    }
-		    continue;
-		}
+static double dfuse_bench_seconds( void )
+{
+    struct timespec ts;
 
-		if ( !gotaname || !thisnvll->name )
-		{
-		    D( "Things that should never happen, part 6(b), subsection %d.", __LINE__ );
-		    free_nvll( rootnvll );
-		    return NULL;
-		}
+    clock_gettime( CLOCK_MONOTONIC, &ts );
 
-		if ( thisnvll->value )
-		{
-		    D( "Things that should never happen, part 6(b), subsection %d.", __LINE__ );
-		    free_nvll( rootnvll );
-		    return NULL;
-		}
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-		if ( !( thisnvll->nvll_value = dfuse_parse_json( json+i, size-i, &chars ) ) )
-		{
-		    D( "Things that should never happen, part 6(b), subsection %d.", __LINE__ );
-		    free_nvll( rootnvll );
-		    return NULL;
-		}
+/*
+ * One scenario: num_fields columns of value_length bytes apiece (every seventh value is NULL,
+ * and every byte that's a multiple of 5 needs escaping), rendered iterations times by each.
+ */
+static int dfuse_bench_json_case( const char *label, unsigned int num_fields, unsigned long value_length, unsigned int iterations )
+{
+    MYSQL_FIELD *fields;
+    char **names, **values, *old_rv, *new_rv;
+    unsigned long *lengths, new_length;
+    struct dfuse_schema *schema;
+    unsigned int i, it;
+    unsigned long j;
+    double started, old_secs, new_secs;
+    int rv = 0;
+
+    fields = calloc( num_fields, sizeof( MYSQL_FIELD ) );
+    names = calloc( num_fields, sizeof( char * ) );
+    values = calloc( num_fields, sizeof( char * ) );
+    lengths = calloc( num_fields, sizeof( unsigned long ) );
 
-		i += chars-1; //We want to be handed back the location of the next }, as we've incremented paren_deep.
+    for ( i = 0; i < num_fields; i++ )
+    {
+	names[i] = malloc( 32 );
+	snprintf( names[i], 32, "column_%u", i );
+	fields[i].name = fields[i].org_name = names[i];
+	fields[i].name_length = fields[i].org_name_length = strlen( names[i] );
 
-		break;
-	    case '}':
-		paren_deep--;
+	if ( i % 7 == 6 )
+	{
+	    continue;
+	}
 
-		if ( !recursed && paren_deep < 0 )
-		{
-		    D( "The JSON dwarves delved too deep: %d!", __LINE__ );
-		    free_nvll( rootnvll );
-		    return NULL;
-		}
+	values[i] = malloc( value_length+1 );
+	for ( j = 0; j < value_length; j++ )
+	{
+	    values[i][j] = ( j % 5 ) ? 'a' + ( j % 26 ) : '"';
+	}
+	values[i][value_length] = '\0';
+	lengths[i] = value_length;
+    }
 
-		if ( recursed && paren_deep == 0 )
-		{
-		    D( "Found the bottom of my stack.  Returning at i=%ld.", i );
-		    *recursed = i;
-		    return rootnvll;
-		}
+    schema = dfuse_build_schema( fields, num_fields, "utf8mb4" );
 
-		break;
-	    //TODO: Dies on nulls at the moment.  Fix that.
-	    default:
-		D( "Unhandled character '%c' in json input.  Bailing.\n", json[i] );
-		return NULL;
-	}
+    started = dfuse_bench_seconds();
+    for ( it = 0; it < iterations; it++ )
+    {
+	DFUSE_FREE( dfuse_bench_legacy_jsonify( names, values, lengths, num_fields, "bench_key", 9 ) );
     }
+    old_secs = dfuse_bench_seconds() - started;
 
-    if ( paren_deep != 0 )
+    started = dfuse_bench_seconds();
+    for ( it = 0; it < iterations; it++ )
     {
-	D( "Parse error: paren_deep is %d (and should be zero).  Bailing.\n", paren_deep );
-	free_nvll( rootnvll );
-	return NULL;
+	DFUSE_FREE( dfuse_render_json( schema, values, lengths, "bench_key", 9, &new_length ) );
+    }
+    new_secs = dfuse_bench_seconds() - started;
+
+    // The whole point is that nothing changes but the speed.
+    old_rv = dfuse_bench_legacy_jsonify( names, values, lengths, num_fields, "bench_key", 9 );
+    new_rv = dfuse_render_json( schema, values, lengths, "bench_key", 9, &new_length );
+
+    if ( !old_rv || !new_rv || strlen( old_rv ) != new_length || memcmp( old_rv, new_rv, new_length ) )
+    {
+	printf( "%-28s OUTPUT MISMATCH\n", label );
+	rv = 1;
+    }
+    else
+    {
+	printf( "%-28s %5u fields x %8lu bytes: old %9.3f ms/row, new %9.3f ms/row, %6.1fx\n",
+	    label, num_fields, value_length, old_secs * 1000 / iterations, new_secs * 1000 / iterations,
+	    new_secs > 0 ? old_secs / new_secs : 0 );
+    }
+
+    free( old_rv );
+    free( new_rv );
+    dfuse_free_schema( schema );
+
+    for ( i = 0; i < num_fields; i++ )
+    {
+	free( names[i] );
+	free( values[i] );
     }
 
-    D( "All's well: returning '%p'.\n", rootnvll );
-    D( "Total characters parsed: %ld.\n", i );
+    free( fields );
+    free( names );
+    free( values );
+    free( lengths );
 
-    return rootnvll;
+    return rv;
 }
 
-void print_nvll( struct dfuse_nv_ll *rootnvll, unsigned long deep )
+/*
+ * Times htmlencode() and urlencode() on count values of value_length bytes at every SIMD level
+ * this machine has, and checks every level's output against the scalar one.  safe_percent of
+ * the bytes are ones that pass through unescaped.
+ */
+static int dfuse_bench_encoder_case( const char *label, unsigned long value_length, unsigned int count, unsigned int safe_percent )
 {
-    struct dfuse_nv_ll *thisnvll;
-    int i;
+    static const char safe[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.:";
+    char *values, *expected[2], *got;
+    double started, secs[3];
+    unsigned int i, level, max_level, encoder;
+    unsigned long j;
+    int rv = 0;
 
-    if ( !rootnvll )
+    values = malloc( value_length * count );
+
+    srand( 42 );
+    for ( j = 0; j < value_length * count; j++ )
     {
-	D( "Bailing early; asked to print an empty nvll at deep=%ld.\n", deep );
-	return;
+	values[j] = (unsigned int)rand() % 100 < safe_percent ? safe[rand() % ( sizeof( safe ) - 1 )] : (char)( rand() % 45 );
     }
 
-    for ( i = 0; i < deep; i++ ) { printf( "\t" ); }
+#ifdef DFUSE_SIMD
+    max_level = __builtin_cpu_supports( "avx2" ) ? 2 : 1;
+#else
+    max_level = 0;
+#endif
 
-    printf( "{\n" );
+    // The scalar output is the reference.
+    dfuse_simd_level = 0;
+    expected[0] = htmlencode( values, value_length );
+    expected[1] = urlencode( values, value_length );
 
-    for ( thisnvll = rootnvll; thisnvll; thisnvll = thisnvll->next )
+    for ( level = 0; level <= max_level; level++ )
     {
-	if ( thisnvll->name )
-	{
-	    for ( i = 0; i < deep; i++ ) { printf( "\t" ); }
-
-	    //Blatantly not null-safe, but this is intended as a debugging function.
-	    printf( "%s: ", thisnvll->name->string );
+	dfuse_simd_level = level;
 
-	    if ( thisnvll->nvll_value )
-	    {
-		print_nvll( thisnvll->nvll_value, deep+1 );
-	    }
-	    else if ( thisnvll->value )
-	    {
-		//Blatantly not null-safe, but this is intended as a debugging function.
-		printf( "\"%s\",\n", thisnvll->value->string );
-	    }
-	    else
+	for ( encoder = 0; encoder < 2; encoder++ )
+	{
+	    got = encoder ? urlencode( values, value_length ) : htmlencode( values, value_length );
+	    if ( !got || strcmp( got, expected[encoder] ) )
 	    {
-		printf( "null,\n" );
+		printf( "%-28s OUTPUT MISMATCH at SIMD level %u\n", label, level );
+		rv = 1;
 	    }
+	    free( got );
+	}
+
+	started = dfuse_bench_seconds();
+	for ( i = 0; i < count; i++ )
+	{
+	    DFUSE_FREE( htmlencode( values + i * value_length, value_length ) );
+	    DFUSE_FREE( urlencode( values + i * value_length, value_length ) );
 	}
+	secs[level] = dfuse_bench_seconds() - started;
     }
 
-    for ( i = 0; i < deep; i++ ) { printf( "\t" ); }
+    printf( "%-28s %6u values x %8lu bytes: scalar %9.3f ms", label, count, value_length, secs[0] * 1000 );
+    for ( level = 1; level <= max_level; level++ )
+    {
+	printf( ", %s %9.3f ms (%4.1fx)", level == 2 ? "AVX2" : "SSE2", secs[level] * 1000,
+	    secs[level] > 0 ? secs[0] / secs[level] : 0 );
+    }
+    printf( "\n" );
 
-    printf( "}\n" );
+    dfuse_simd_level = -1;
+
+    free( expected[0] );
+    free( expected[1] );
+    free( values );
+
+    return rv;
+}
+
+int dfuse_bench_json( void )
+{
+    int rv = 0;
+
+    rv |= dfuse_bench_json_case( "narrow row", 8, 64, 20000 );
+    rv |= dfuse_bench_json_case( "wide row", 500, 32, 200 );
+    rv |= dfuse_bench_json_case( "very wide row", 2000, 16, 20 );
+    rv |= dfuse_bench_json_case( "large values", 4, 1 << 20, 20 );
+    rv |= dfuse_bench_json_case( "wide row, large values", 64, 64 << 10, 5 );
+
+    rv |= dfuse_bench_encoder_case( "filenames", 12, 100000, 100 );
+    rv |= dfuse_bench_encoder_case( "text", 1 << 20, 8, 98 );
+    rv |= dfuse_bench_encoder_case( "binary", 1 << 20, 8, 20 );
+
+    return rv;
+}
+#endif
+
+/*
+ * A bump allocator.  Everything one parse produces comes out of a handful of big blocks, and
+ * dfuse_arena_free() lets go of all of it at once, however many strings there were.
+ */
+#define DFUSE_ARENA_BLOCK 16384
+
+// Every allocation is aligned for anything we'd put there.
+#define DFUSE_ARENA_ALIGN(n) ( ( (n) + 15 ) & ~(unsigned long)15 )
+
+struct dfuse_arena_block {
+    struct dfuse_arena_block *next;
+    unsigned long size;
+    unsigned long used;
+};
+
+struct dfuse_arena {
+    struct dfuse_arena_block *head;	// The one we're carving from.
+};
+
+void *dfuse_arena_alloc( struct dfuse_arena *arena, unsigned long size )
+{
+    struct dfuse_arena_block *block;
+    unsigned long header = DFUSE_ARENA_ALIGN( sizeof( struct dfuse_arena_block ) );
+    unsigned long block_size;
+    void *rv;
+
+    size = DFUSE_ARENA_ALIGN( size );
+
+    if ( arena->head && arena->head->size - arena->head->used >= size )
+    {
+	block = arena->head;
+    }
+    else
+    {
+	block_size = size > DFUSE_ARENA_BLOCK / 4 ? size : DFUSE_ARENA_BLOCK;
+
+	if ( !( block = DFUSE_MALLOC( header + block_size ) ) )
+	{
+	    return NULL;
+	}
+
+	block->size = block_size;
+	block->used = 0;
+
+	// A big one gets a block of its own, behind the current one, so the room left in that
+	// still gets used.
+	if ( arena->head && block_size != DFUSE_ARENA_BLOCK )
+	{
+	    block->next = arena->head->next;
+	    arena->head->next = block;
+	}
+	else
+	{
+	    block->next = arena->head;
+	    arena->head = block;
+	}
+    }
+
+    rv = (char *)block + header + block->used;
+    block->used += size;
+
+    return rv;
+}
+
+void dfuse_arena_free( struct dfuse_arena *arena )
+{
+    struct dfuse_arena_block *block, *next;
+
+    for ( block = arena->head; block; block = next )
+    {
+	next = block->next;
+	DFUSE_FREE( block );
+    }
+
+    arena->head = NULL;
+}
+
+/*
+ * A parsed --json file is one flat array of these, in document order.  An object's members are
+ * the tokens after it, one level deeper, so walking the whole document is a single loop.
+ */
+enum
+{
+    DFUSE_JSON_STRING,
+    DFUSE_JSON_NULL,		// A bare null; SQL NULL.  value is NULL.
+    DFUSE_JSON_OBJECT		// value is NULL; its members follow.
+};
+
+struct dfuse_json_token {
+    int type;
+    unsigned int depth;		// 1 for the root object's own members.
+    const char *name;		// Decoded, and '\0'-terminated like value, in the parser's arena.
+    unsigned long name_length;
+    const char *value;
+    unsigned long value_length;
+};
+
+enum
+{
+    DFUSE_JSON_STATE_START,	// Before the root '{'.
+    DFUSE_JSON_STATE_OBJECT,	// Between tokens.
+    DFUSE_JSON_STATE_IN_STRING,	// Partway through a string that began in an earlier chunk.
+    DFUSE_JSON_STATE_IN_NULL,	// Partway through a null.
+    DFUSE_JSON_STATE_DONE,	// Past the root '}'; only whitespace may follow.
+    DFUSE_JSON_STATE_END,	// Hit a '\0' after the root '}'; whatever follows is ignored.
+    DFUSE_JSON_STATE_ERROR
+};
+
+/*
+ * Parses a document handed to it in as many chunks as it likes, picking up each one exactly
+ * where the last left off, so nothing is ever buffered or scanned twice.  The only thing carried
+ * over between chunks is a string that straddles them, which waits in partial (reused from one
+ * string to the next) until its closing quote shows up.
+ */
+struct dfuse_json_parser {
+    struct dfuse_arena arena;
+    struct dfuse_json_token *tokens;
+    unsigned long num_tokens;
+    unsigned long max_tokens;
+    unsigned long fed;		// How many bytes of the document we've been handed so far.
+
+    int state;
+    int error;			// Set with DFUSE_JSON_STATE_ERROR: a negative errno.
+    unsigned int depth;
+    const char *name;		// A name still waiting for its value.
+    unsigned long name_length;
+    unsigned int null_seen;	// How much of "null" we've matched.
+    char *partial;
+    unsigned long partial_length;
+    unsigned long partial_capacity;
+};
+
+struct dfuse_json_parser *dfuse_json_parser_new( void )
+{
+    struct dfuse_json_parser *p;
+
+    if ( !( p = DFUSE_MALLOC( sizeof( struct dfuse_json_parser ) ) ) )
+    {
+	return NULL;
+    }
+
+    memset( p, 0, sizeof( *p ) );
+    p->state = DFUSE_JSON_STATE_START;
+
+    return p;
+}
+
+void dfuse_json_parser_free( struct dfuse_json_parser *p )
+{
+    if ( !p )
+    {
+	return;
+    }
+
+    dfuse_arena_free( &p->arena );
+
+    if ( p->partial ) { DFUSE_FREE( p->partial ); }
+
+    DFUSE_FREE( p );
+}
+
+static int dfuse_json_fail( struct dfuse_json_parser *p, int error )
+{
+    p->state = DFUSE_JSON_STATE_ERROR;
+    p->error = error;
+
+    return error;
+}
+
+static int dfuse_json_token( struct dfuse_json_parser *p, int type, const char *value, unsigned long value_length )
+{
+    struct dfuse_json_token *tokens, *t;
+
+    if ( !p->name )
+    {
+	D( "A value with no name, at depth %u.\n", p->depth );
+	return dfuse_json_fail( p, -EINVAL );
+    }
+
+    if ( p->num_tokens == p->max_tokens )
+    {
+	// The old array stays behind in the arena; doubling keeps that to less than we keep.
+	if ( !( tokens = dfuse_arena_alloc( &p->arena, sizeof( struct dfuse_json_token ) * ( p->max_tokens ? 2 * p->max_tokens : 32 ) ) ) )
+	{
+	    return dfuse_json_fail( p, -ENOMEM );
+	}
+
+	if ( p->num_tokens )
+	{
+	    memcpy( tokens, p->tokens, sizeof( struct dfuse_json_token ) * p->num_tokens );
+	}
+
+	p->tokens = tokens;
+	p->max_tokens = p->max_tokens ? 2 * p->max_tokens : 32;
+    }
+
+    t = &p->tokens[p->num_tokens++];
+    t->type = type;
+    t->depth = p->depth;
+    t->name = p->name;
+    t->name_length = p->name_length;
+    t->value = value;
+    t->value_length = value_length;
+
+    p->name = NULL;
+
+    return 0;
+}
+
+/*
+ * A complete string, still entity-encoded: it's a name if we're waiting for one, and that name's
+ * value otherwise.
+ */
+static int dfuse_json_string( struct dfuse_json_parser *p, const char *raw, unsigned long raw_length )
+{
+    struct string_length decoded;
+
+    // Decoding only ever shrinks it.
+    if ( !( decoded.string = dfuse_arena_alloc( &p->arena, raw_length+1 ) ) )
+    {
+	return dfuse_json_fail( p, -ENOMEM );
+    }
+
+    decoded.string[0] = '\0';
+    decoded.length = 0;
+
+    if ( raw_length && !htmldecode_n( raw, &decoded, raw_length-1 ) )
+    {
+	D( "Failed to htmldecode a %lu-byte string.\n", raw_length );
+	return dfuse_json_fail( p, -EINVAL );
+    }
+
+    if ( !p->name )
+    {
+	p->name = decoded.string;
+	p->name_length = decoded.length;
+	return 0;
+    }
+
+    return dfuse_json_token( p, DFUSE_JSON_STRING, decoded.string, decoded.length );
+}
+
+static int dfuse_json_partial( struct dfuse_json_parser *p, const char *raw, unsigned long length )
+{
+    unsigned long capacity;
+    char *partial;
+
+    if ( p->partial_length + length > p->partial_capacity )
+    {
+	for ( capacity = p->partial_capacity ? p->partial_capacity : 4096; capacity < p->partial_length + length; capacity *= 2 );
+
+	if ( !( partial = realloc( p->partial, capacity ) ) )
+	{
+	    return dfuse_json_fail( p, -ENOMEM );
+	}
+
+	p->partial = partial;
+	p->partial_capacity = capacity;
+    }
+
+    memcpy( p->partial + p->partial_length, raw, length );
+    p->partial_length += length;
+
+    return 0;
+}
+
+/*
+ * Parses the next length bytes of the document.  The grammar is DFuse's own: objects, strings
+ * with their bytes encoded as &xHH; entities, and bare nulls; commas and colons are optional.
+ * An error sticks: every later call, and dfuse_json_finish(), returns it too.
+ *
+ * @returns 0 so far so good, or a negative errno: -EINVAL for a malformed document.
+ */
+int dfuse_json_feed( struct dfuse_json_parser *p, const char *chunk, unsigned long length )
+{
+    const char *quote;
+    unsigned long i;
+
+    p->fed += length;
+
+    for ( i = 0; i < length; i++ )
+    {
+	switch ( p->state )
+	{
+	    case DFUSE_JSON_STATE_ERROR:
+		return p->error;
+	    case DFUSE_JSON_STATE_END:
+		return 0;
+	    case DFUSE_JSON_STATE_IN_STRING:
+		if ( !( quote = memchr( chunk+i, '"', length-i ) ) )
+		{
+		    return dfuse_json_partial( p, chunk+i, length-i );
+		}
+
+		if ( dfuse_json_partial( p, chunk+i, quote-(chunk+i) )
+		  || dfuse_json_string( p, p->partial, p->partial_length ) )
+		{
+		    return p->error;
+		}
+
+		p->partial_length = 0;
+		p->state = DFUSE_JSON_STATE_OBJECT;
+		i = quote-chunk;
+		continue;
+	    case DFUSE_JSON_STATE_IN_NULL:
+		if ( chunk[i] != "null"[p->null_seen] )
+		{
+		    D( "Bad null at byte %lu.\n", p->fed-length+i );
+		    return dfuse_json_fail( p, -EINVAL );
+		}
+
+		if ( ++p->null_seen == 4 )
+		{
+		    if ( dfuse_json_token( p, DFUSE_JSON_NULL, NULL, 0 ) )
+		    {
+			return p->error;
+		    }
+
+		    p->state = DFUSE_JSON_STATE_OBJECT;
+		}
+		continue;
+	}
+
+	switch ( chunk[i] )
+	{
+	    case ' ':
+	    case '\t':
+	    case '\n':
+	    case '\r':
+	    case ',':
+	    case ':':
+		continue;
+	    case '\0':
+		// Something wrote the file out with its C string's terminator; be forgiving.
+		if ( p->state != DFUSE_JSON_STATE_DONE )
+		{
+		    break;
+		}
+
+		p->state = DFUSE_JSON_STATE_END;
+		return 0;
+	    case '{':
+		if ( p->state == DFUSE_JSON_STATE_START )
+		{
+		    p->state = DFUSE_JSON_STATE_OBJECT;
+		    p->depth = 1;
+		    continue;
+		}
+
+		if ( p->state != DFUSE_JSON_STATE_OBJECT || dfuse_json_token( p, DFUSE_JSON_OBJECT, NULL, 0 ) )
+		{
+		    break;
+		}
+
+		p->depth++;
+		continue;
+	    case '}':
+		if ( p->state != DFUSE_JSON_STATE_OBJECT )
+		{
+		    break;
+		}
+
+		// A name with no value says nothing about its column.
+		p->name = NULL;
+
+		if ( !--p->depth )
+		{
+		    p->state = DFUSE_JSON_STATE_DONE;
+		}
+		continue;
+	    case '"':
+		if ( p->state != DFUSE_JSON_STATE_OBJECT )
+		{
+		    break;
+		}
+
+		// Usually the whole string is right here, and decodes straight out of the chunk.
+		if ( !( quote = memchr( chunk+i+1, '"', length-i-1 ) ) )
+		{
+		    p->state = DFUSE_JSON_STATE_IN_STRING;
+		    return dfuse_json_partial( p, chunk+i+1, length-i-1 );
+		}
+
+		if ( dfuse_json_string( p, chunk+i+1, quote-(chunk+i+1) ) )
+		{
+		    return p->error;
+		}
+
+		i = quote-chunk;
+		continue;
+	    case 'n':
+		if ( p->state != DFUSE_JSON_STATE_OBJECT || !p->name )
+		{
+		    break;
+		}
+
+		p->state = DFUSE_JSON_STATE_IN_NULL;
+		p->null_seen = 1;
+		continue;
+	}
+
+	if ( p->state != DFUSE_JSON_STATE_ERROR )
+	{
+	    D( "Unhandled character '%c' in json input.  Bailing.\n", chunk[i] );
+	    dfuse_json_fail( p, -EINVAL );
+	}
+
+	return p->error;
+    }
+
+    return p->state == DFUSE_JSON_STATE_ERROR ? p->error : 0;
+}
+
+/*
+ * Call once the whole document has been fed.
+ *
+ * @returns 0 if it was complete and well-formed, or a negative errno.
+ */
+int dfuse_json_finish( struct dfuse_json_parser *p )
+{
+    if ( p->state == DFUSE_JSON_STATE_ERROR )
+    {
+	return p->error;
+    }
+
+    if ( p->state != DFUSE_JSON_STATE_DONE && p->state != DFUSE_JSON_STATE_END )
+    {
+	D( "Parse error: the document ends in state %d.\n", p->state );
+	return -EINVAL;
+    }
+
+    return 0;
+}
+
+void print_json_tokens( const struct dfuse_json_parser *p )
+{
+    unsigned long i;
+    unsigned int j;
+
+    for ( i = 0; i < p->num_tokens; i++ )
+    {
+	for ( j = 0; j < p->tokens[i].depth; j++ ) { printf( "\t" ); }
+
+	//Blatantly not binary-safe, but this is intended as a debugging function.
+	printf( "%s: ", p->tokens[i].name );
+
+	switch ( p->tokens[i].type )
+	{
+	    case DFUSE_JSON_OBJECT:
+		printf( "{\n" );
+		break;
+	    case DFUSE_JSON_NULL:
+		printf( "null,\n" );
+		break;
+	    default:
+		printf( "\"%s\",\n", p->tokens[i].value );
+		break;
+	}
+    }
 }
 
 static int dfuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
@@ -944,12 +2074,8 @@ static int dfuse_opt_proc(void *data, const char *arg, int key, struct fuse_args
 	    return 0;
 	    break; //Paranoia, it's all the rage this year.
 	case KEY_FOREGROUND:
-	    if ( fuse_daemonize(1) )
-	    {
-		printf( "Failed to forestall daemonization.\n" );
-		return -1;
-	    }
-	    return 0;
+	    // fuse_parse_cmdline only knows it as -f.
+	    return fuse_opt_add_arg( outargs, "-f" ) ? -1 : 0;
 	    break;
 	case KEY_JSON:
 	    json = 1;
@@ -970,907 +2096,10558 @@ FILE *debug_fd( void )
 
     if ( cached_debug_fd ) { return cached_debug_fd; }
 
-    if ( !( cached_debug_fd = fopen( "/tmp/fusedebug", "a" ) ) )
+    if ( !( cached_debug_fd = fopen( "/tmp/fusedebug", "a" ) ) )
+    {
+	exit(-1);
+    }
+
+    return cached_debug_fd;
+}
+
+static void dfuse_readlink( fuse_req_t req, fuse_ino_t ino )
+{
+    //In the interest of saving ourselves a lot of time, if this is being called,
+    //it's a symlink, and if it is, it's always the same one.
+
+    //TAG: NULL_HANDLING
+
+    fuse_reply_readlink( req, "/dev/null" );
+}
+
+/*
+ * Tables.  With -t, tables[] holds just that one, served at the root.  Without it, we ask
+ * information_schema (once, at mount time) for every table in -D with a primary key, filter them
+ * through --include and --exclude, and serve each as /<table>/<key>.  Either way, every table
+ * shares the one connection pool and the one attribute cache.
+ */
+enum {
+    DFUSE_PATH_ROOT,
+    DFUSE_PATH_TABLE,
+    DFUSE_PATH_SHARD,
+    DFUSE_PATH_ROW,
+    DFUSE_PATH_COLUMN,
+};
+
+// Inode numbers: the root is FUSE_ROOT_ID, then come /.dfuse, /.dfuse/stats (see
+// dfuse_stats_render) and /.dfuse/snapshot (see struct dfuse_read_view), and without -t,
+// tables[i]'s directory is DFUSE_TABLE_INO(i).  Rows get theirs from dfuse_inode_ref, numbered
+// from DFUSE_TABLE_INO(num_tables) up.
+#define DFUSE_STATS_DIR_INO ( FUSE_ROOT_ID + 1 )
+#define DFUSE_STATS_INO ( FUSE_ROOT_ID + 2 )
+#define DFUSE_SNAPSHOT_INO ( FUSE_ROOT_ID + 3 )
+#define DFUSE_TABLE_INO(i) ( FUSE_ROOT_ID + 4 + (fuse_ino_t)(i) )
+
+/*
+ * Each table's primary key columns, in the key's order, separated by NULs (which no name has in
+ * it), how many there are, and how long the list should be if group_concat_max_len didn't cut it.
+ */
+static const char dfuse_tables_sql[] =
+    "SELECT TABLE_NAME, GROUP_CONCAT(COLUMN_NAME ORDER BY ORDINAL_POSITION SEPARATOR '\\0'), COUNT(*), "
+    "SUM(LENGTH(COLUMN_NAME))+COUNT(*)-1 "
+    "FROM information_schema.KEY_COLUMN_USAGE WHERE TABLE_SCHEMA=DATABASE() AND CONSTRAINT_NAME='PRIMARY' "
+    "GROUP BY TABLE_NAME HAVING COUNT(*)<=16";
+
+// `name`, with any backticks in it doubled.
+static char *dfuse_quote_identifier( const char *name, unsigned long length )
+{
+    char *rv, *p;
+    unsigned long i;
+
+    if ( !( rv = DFUSE_MALLOC( length*2+3 ) ) )
+    {
+	return NULL;
+    }
+
+    p = rv;
+    *p++ = '`';
+
+    for ( i = 0; i < length; i++ )
+    {
+	if ( name[i] == '`' )
+	{
+	    *p++ = '`';
+	}
+	*p++ = name[i];
+    }
+
+    *p++ = '`';
+    *p = '\0';
+
+    return rv;
+}
+
+/*
+ * A composite key, both as we carry it around and as its filename: each column's value
+ * urlencoded, joined with commas.  urlencode() never leaves a comma alone, so that splits back
+ * apart unambiguously, and an empty column is just an empty part.
+ *
+ * @returns The joined key (for the caller to free), or NULL if a value is NULL or memory ran out.
+ */
+static char *dfuse_key_join( char **values, unsigned long *lengths, unsigned int count, unsigned long *length )
+{
+    unsigned long total = 0, n = 0;
+    unsigned int i;
+    char *rv, *encoded;
+
+    for ( i = 0; i < count; i++ )
+    {
+	if ( !values[i] )
+	{
+	    return NULL;
+	}
+	total += lengths[i]*3 + 1;
+    }
+
+    if ( !( rv = DFUSE_MALLOC( total+1 ) ) )
+    {
+	return NULL;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+	if ( i )
+	{
+	    rv[n++] = ',';
+	}
+
+	if ( !lengths[i] )
+	{
+	    continue;
+	}
+
+	if ( !( encoded = urlencode( values[i], lengths[i] ) ) )
+	{
+	    DFUSE_FREE( rv );
+	    return NULL;
+	}
+
+	strcpy( rv+n, encoded );
+	n += strlen( encoded );
+	DFUSE_FREE( encoded );
+    }
+
+    rv[n] = '\0';
+    *length = n;
+
+    return rv;
+}
+
+/*
+ * Splits key into the values table->key_where's placeholders take.  A single-column key is
+ * passed through as it is; a composite one is decoded into kv->buffer, and has to have exactly
+ * as many parts as the table has key columns.  dfuse_key_values_free() afterwards either way.
+ *
+ * @returns 0, -ENOENT if key isn't one of table's, or -ENOMEM.
+ */
+static int dfuse_key_split( const struct dfuse_table *table, const char *key, unsigned long key_length, struct dfuse_key_values *kv )
+{
+    const char *p = key, *end = key + key_length, *comma;
+    unsigned long n, j;
+    unsigned int i;
+    char *out;
+
+    kv->buffer = NULL;
+    kv->count = table->key_columns;
+
+    if ( kv->count == 1 )
+    {
+	kv->values[0] = (char *)key;
+	kv->lengths[0] = key_length;
+	return 0;
+    }
+
+    // Decoding only ever shrinks it, and each comma makes room for its part's '\0'.
+    if ( !( out = kv->buffer = DFUSE_MALLOC( key_length+1 ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    for ( i = 0; i < kv->count; i++ )
+    {
+	comma = memchr( p, ',', end-p );
+
+	if ( ( i+1 < kv->count ) != ( comma != NULL ) )
+	{
+	    DFUSE_FREE( kv->buffer );
+	    kv->buffer = NULL;
+	    return -ENOENT;
+	}
+
+	n = comma ? (unsigned long)( comma - p ) : (unsigned long)( end - p );
+	kv->values[i] = out;
+
+	for ( j = 0; j < n; j++ )
+	{
+	    if ( p[j] != '%' )
+	    {
+		*out++ = p[j];
+		continue;
+	    }
+
+	    if ( j+2 >= n || !isxdigit( (unsigned char)p[j+1] ) || !isxdigit( (unsigned char)p[j+2] ) )
+	    {
+		DFUSE_FREE( kv->buffer );
+		kv->buffer = NULL;
+		return -ENOENT;
+	    }
+
+	    *out++ = (FROM_HEX(tolower( (unsigned char)p[j+1] ))<<4) + FROM_HEX(tolower( (unsigned char)p[j+2] ));
+	    j += 2;
+	}
+
+	kv->lengths[i] = out - kv->values[i];
+	*out++ = '\0';
+	p += n + 1;
+    }
+
+    return 0;
+}
+
+static void dfuse_key_values_free( struct dfuse_key_values *kv )
+{
+    if ( kv->buffer )
+    {
+	DFUSE_FREE( kv->buffer );
+	kv->buffer = NULL;
+    }
+}
+
+// Binds kv's first count values to params, in order.
+static unsigned int dfuse_key_bind_first( struct dfuse_key_values *kv, unsigned int count, MYSQL_BIND *params )
+{
+    unsigned int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+	params[i].buffer_type = MYSQL_TYPE_STRING;
+	params[i].buffer = kv->values[i];
+	params[i].buffer_length = kv->lengths[i];
+	params[i].length = &kv->lengths[i];
+    }
+
+    return count;
+}
+
+// Binds kv's values to the params that table->key_where's placeholders take, in order.
+static unsigned int dfuse_key_bind( struct dfuse_key_values *kv, MYSQL_BIND *params )
+{
+    return dfuse_key_bind_first( kv, kv->count, params );
+}
+
+// Binds kv's values to the params that table->key_after's placeholders take: the first value, then
+// the first two, and so on.
+static unsigned int dfuse_key_bind_after( struct dfuse_key_values *kv, MYSQL_BIND *params )
+{
+    unsigned int i, n;
+
+    for ( i = 0, n = 0; i < kv->count; i++ )
+    {
+	n += dfuse_key_bind_first( kv, i + 1, params + n );
+    }
+
+    return n;
+}
+
+// The filename for key, for the caller to free.  NULL for an empty key: that can't be a filename.
+static char *dfuse_key_name( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    char *rv;
+
+    if ( table->key_columns == 1 || !key_length )
+    {
+	return urlencode( key, key_length );
+    }
+
+    // A composite key is already encoded.
+    if ( ( rv = DFUSE_MALLOC( key_length+1 ) ) )
+    {
+	memcpy( rv, key, key_length );
+	rv[key_length] = '\0';
+    }
+
+    return rv;
+}
+
+/*
+ * The key of a row whose first table->key_columns columns are values: the one column, copied,
+ * or the composite key dfuse_key_join makes of them.  For the caller to free.
+ *
+ * @returns The key, or NULL if it's NULL or we're out of memory.
+ */
+static char *dfuse_row_key( const struct dfuse_table *table, char **values, unsigned long *lengths, unsigned long *length )
+{
+    char *rv;
+
+    if ( table->key_columns > 1 )
+    {
+	return dfuse_key_join( values, lengths, table->key_columns, length );
+    }
+
+    if ( !values[0] || !( rv = DFUSE_MALLOC( lengths[0]+1 ) ) )
+    {
+	return NULL;
+    }
+
+    memcpy( rv, values[0], lengths[0] );
+    rv[lengths[0]] = '\0';
+    *length = lengths[0];
+
+    return rv;
+}
+
+/*
+ * dfuse_row_key(), for loops over a whole table that only need to look at each key: a
+ * single-column one isn't copied.  *joined is what to free afterwards, if it's not NULL.
+ */
+static const char *dfuse_row_key_ref( const struct dfuse_table *table, char **values, unsigned long *lengths,
+    unsigned long *length, char **joined )
+{
+    *joined = NULL;
+
+    if ( table->key_columns == 1 )
+    {
+	*length = lengths[0];
+	return values[0];
+    }
+
+    return *joined = dfuse_key_join( values, lengths, table->key_columns, length );
+}
+
+/*
+ * The key a filename in one of table's directories names.  A composite key's parts are decoded
+ * and encoded again, so "a%2Cb,1" and "a%2cb,1" are the same row, as they'd be for a single
+ * column (see urldecode).
+ *
+ * @returns 0, -ENOENT if name can't be a key, or -ENOMEM.
+ */
+static int dfuse_name_key( const struct dfuse_table *table, const char *name, struct string_length **key )
+{
+    struct dfuse_key_values kv;
+    int rv;
+
+    if ( table->key_columns > 1 )
+    {
+	if ( ( rv = dfuse_key_split( table, name, strlen(name), &kv ) ) )
+	{
+	    return rv;
+	}
+
+	if ( !( *key = DFUSE_MALLOC( sizeof( struct string_length ) ) ) )
+	{
+	    dfuse_key_values_free( &kv );
+	    return -ENOMEM;
+	}
+
+	if ( !( (*key)->string = dfuse_key_join( kv.values, kv.lengths, kv.count, &(*key)->length ) ) )
+	{
+	    DFUSE_FREE( *key );
+	    dfuse_key_values_free( &kv );
+	    return -ENOMEM;
+	}
+
+	dfuse_key_values_free( &kv );
+	return 0;
+    }
+
+    if ( !( *key = urldecode( name ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    if ( !(*key)->length )
+    {
+	DFUSE_FREE( (*key)->string );
+	DFUSE_FREE( *key );
+	return -ENOENT;
+    }
+
+    return 0;
+}
+
+/*
+ * Splits -P into its columns if it's a plain list of two or more of them, quoted or not, and
+ * fills in table's key_* to match.  Anything else -- one column, or an expression like the
+ * CONCAT() the README used to suggest -- is used verbatim, as a single key.
+ *
+ * @returns 0, or -ENOMEM.
+ */
+static int dfuse_table_key( struct dfuse_table *t, const char *prikey )
+{
+    char *names[DFUSE_MAX_KEY_COLUMNS], *out, *quoted, *where, *after;
+    const char *p = prikey;
+    unsigned long length;
+    unsigned int n = 0, i;
+    int ok = 1;
+
+    while ( ok && n < DFUSE_MAX_KEY_COLUMNS )
+    {
+	while ( *p == ' ' )
+	{
+	    p++;
+	}
+
+	if ( !( out = names[n++] = DFUSE_MALLOC( strlen(prikey)+1 ) ) )
+	{
+	    n--;
+	    ok = 0;
+	    break;
+	}
+
+	if ( *p == '`' )
+	{
+	    for ( p++; *p && ( *p != '`' || p[1] == '`' ); p++ )
+	    {
+		*out++ = *p;
+		p += *p == '`';
+	    }
+
+	    ok = *p++ == '`';
+	}
+	else
+	{
+	    for ( ; ( *p >= 'a' && *p <= 'z' ) || ( *p >= 'A' && *p <= 'Z' ) || ( *p >= '0' && *p <= '9' ) || *p == '_' || *p == '$'; p++ )
+	    {
+		*out++ = *p;
+	    }
+	}
+
+	*out = '\0';
+	ok = ok && *names[n-1];
+
+	while ( *p == ' ' )
+	{
+	    p++;
+	}
+
+	if ( !ok || *p != ',' )
+	{
+	    break;
+	}
+
+	p++;
+    }
+
+    t->key_columns = 1;
+
+    if ( ok && *p == '\0' && n > 1 )
+    {
+	if ( !( t->key_names = DFUSE_MALLOC( sizeof( char * ) * n ) ) )
+	{
+	    for ( i = 0; i < n; i++ )
+	    {
+		DFUSE_FREE( names[i] );
+	    }
+	    return -ENOMEM;
+	}
+
+	memcpy( t->key_names, names, sizeof( char * ) * n );
+	t->key_columns = n;
+	n = 0;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+	DFUSE_FREE( names[i] );
+    }
+
+    if ( t->key_columns == 1 )
+    {
+	t->prikey = (char *)prikey;
+	t->key_where = dfuse_asprintf( "%s=?", prikey );
+	t->key_after = dfuse_asprintf( "%s > ?", prikey );
+	return t->key_where && t->key_after ? 0 : -ENOMEM;
+    }
+
+    // prikey becomes the quoted column list, which is what SELECT and ORDER BY want.
+    for ( i = 0, length = 0; i < t->key_columns; i++ )
+    {
+	length += strlen( t->key_names[i] )*2 + 3;
+    }
+
+    // Mount time: a failure here means no mount, so there's no point tidying up after it.
+    if ( !( t->prikey = DFUSE_MALLOC( length ) ) || !( where = DFUSE_MALLOC( length + 6*t->key_columns ) )
+      || !( after = DFUSE_MALLOC( ( length + 6*t->key_columns + 16 ) * t->key_columns + 3 ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    t->prikey[0] = where[0] = '\0';
+    strcpy( after, "(" );
+
+    for ( i = 0; i < t->key_columns; i++ )
+    {
+	if ( !( quoted = dfuse_quote_identifier( t->key_names[i], strlen( t->key_names[i] ) ) ) )
+	{
+	    return -ENOMEM;
+	}
+
+	sprintf( t->prikey + strlen( t->prikey ), "%s%s", i ? "," : "", quoted );
+
+	// Spelled out, since the optimizer won't range-scan a row constructor's (`a`,`b`) > (?,?).
+	sprintf( after + strlen( after ), "%s(%s%s%s>?)", i ? " OR " : "", where, i ? " AND " : "", quoted );
+
+	sprintf( where + strlen( where ), "%s%s=?", i ? " AND " : "", quoted );
+	DFUSE_FREE( quoted );
+    }
+
+    strcat( after, ")" );
+
+    t->key_where = where;
+    t->key_after = after;
+
+    return 0;
+}
+
+// Does name match any of the comma-separated fnmatch() patterns in patterns?
+static int dfuse_table_matches( const char *name, const char *patterns )
+{
+    char *copy, *pattern, *saveptr = NULL;
+    int rv = 0;
+
+    if ( !( copy = DFUSE_MALLOC( strlen(patterns)+1 ) ) )
+    {
+	return 0;
+    }
+
+    strcpy( copy, patterns );
+
+    for ( pattern = strtok_r( copy, ",", &saveptr ); pattern && !rv; pattern = strtok_r( NULL, ",", &saveptr ) )
+    {
+	rv = !fnmatch( pattern, name, 0 );
+    }
+
+    DFUSE_FREE( copy );
+
+    return rv;
+}
+
+static int dfuse_table_cmp( const void *a, const void *b )
+{
+    return strcmp( ((const struct dfuse_table *)a)->name, ((const struct dfuse_table *)b)->name );
+}
+
+/*
+ * Fills in tables[].  Called once, from main(), before FUSE starts up.
+ *
+ * @returns 0, or -1 (having said why) if there's nothing to serve.
+ */
+int dfuse_load_tables( MYSQL *sql )
+{
+    MYSQL_RES *sql_res;
+    MYSQL_ROW sql_row;
+    unsigned long *lengths;
+    struct dfuse_table *t;
+    unsigned int i, j, count;
+    char *quoted, *column, *key;
+
+    if ( !multi_table )
+    {
+	if ( !( tables = DFUSE_MALLOC( sizeof( struct dfuse_table ) ) ) )
+	{
+	    printf( "Unable to allocate memory for the table list.\n" );
+	    return -1;
+	}
+
+	memset( tables, 0, sizeof( struct dfuse_table ) );
+	tables[0].name = options.table;
+	tables[0].sql_name = options.table;
+	num_tables = 1;
+	num_stmts = DFUSE_STMT_COUNT;
+
+	if ( dfuse_table_key( &tables[0], options.prikey ) )
+	{
+	    printf( "Unable to allocate memory for the primary key.\n" );
+	    return -1;
+	}
+
+	if ( tables[0].key_columns > 1 )
+	{
+	    D( "Serving a %u-column key.\n", tables[0].key_columns );
+	}
+
+	return 0;
+    }
+
+    if ( dfuse_query( sql, dfuse_tables_sql ) || !( sql_res = mysql_store_result( sql ) ) )
+    {
+	printf( "Unable to list the tables in '%s': '%s'.\n", options.database, mysql_error( sql ) );
+	return -1;
+    }
+
+    if ( !( tables = DFUSE_MALLOC( sizeof( struct dfuse_table ) * ( mysql_num_rows( sql_res ) + 1 ) ) ) )
+    {
+	printf( "Unable to allocate memory for the table list.\n" );
+	mysql_free_result( sql_res );
+	return -1;
+    }
+
+    while ( ( sql_row = mysql_fetch_row( sql_res ) ) )
+    {
+	lengths = mysql_fetch_lengths( sql_res );
+
+	if ( !sql_row[0] || !sql_row[1] || !sql_row[2]
+	  || ( options.include && !dfuse_table_matches( sql_row[0], options.include ) )
+	  || ( options.exclude && dfuse_table_matches( sql_row[0], options.exclude ) ) )
+	{
+	    continue;
+	}
+
+	t = &tables[num_tables];
+	memset( t, 0, sizeof( struct dfuse_table ) );
+
+	if ( !( t->name = urlencode( sql_row[0], lengths[0] ) )
+	  || !( t->sql_name = dfuse_quote_identifier( sql_row[0], lengths[0] ) ) )
+	{
+	    printf( "Unable to allocate memory for table '%s'.\n", sql_row[0] );
+	    mysql_free_result( sql_res );
+	    return -1;
+	}
+
+	// The key's columns, quoted and comma-separated, for dfuse_table_key() to split back up.
+	count = sql_row[2] ? strtoul( sql_row[2], NULL, 10 ) : 0;
+
+	if ( !( key = DFUSE_MALLOC( lengths[1]*2 + 3*count + 1 ) ) )
+	{
+	    printf( "Unable to allocate memory for table '%s'.\n", sql_row[0] );
+	    mysql_free_result( sql_res );
+	    return -1;
+	}
+
+	key[0] = '\0';
+
+	for ( j = 0, column = sql_row[1]; j < count && column <= sql_row[1] + lengths[1]; j++, column += strlen(column) + 1 )
+	{
+	    if ( !( quoted = dfuse_quote_identifier( column, strlen(column) ) ) )
+	    {
+		break;
+	    }
+
+	    sprintf( key + strlen(key), "%s%s", j ? "," : "", quoted );
+	    DFUSE_FREE( quoted );
+	}
+
+	// group_concat_max_len can cut a long list short; better to leave the table out than guess.
+	if ( j < count || !sql_row[3] || strtoul( sql_row[3], NULL, 10 ) != lengths[1] )
+	{
+	    printf( "Skipping table '%s': its primary key's column list was cut short.\n", sql_row[0] );
+	    DFUSE_FREE( key );
+	    DFUSE_FREE( t->name );
+	    DFUSE_FREE( t->sql_name );
+	    continue;
+	}
+
+	if ( dfuse_table_key( t, key ) )
+	{
+	    printf( "Unable to allocate memory for table '%s'.\n", sql_row[0] );
+	    mysql_free_result( sql_res );
+	    return -1;
+	}
+
+	// A single column's key is the string itself; a composite one's was copied apart.
+	if ( t->key_columns > 1 )
+	{
+	    DFUSE_FREE( key );
+	}
+
+	num_tables++;
+    }
+
+    mysql_free_result( sql_res );
+
+    if ( !num_tables )
+    {
+	printf( "No table in '%s' with a primary key matched --include/--exclude.\n", options.database );
+	return -1;
+    }
+
+    // Sorted by name, so that listings come out in order and dfuse_find_table can bisect.
+    qsort( tables, num_tables, sizeof( struct dfuse_table ), dfuse_table_cmp );
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	tables[i].index = i;
+	tables[i].stmt_base = num_stmts;
+	num_stmts += DFUSE_STMT_COUNT;
+	D( "Serving table %s.\n", tables[i].sql_name );
+    }
+
+    return 0;
+}
+
+// Finds the table whose directory is the first length bytes of name.
+static struct dfuse_table *dfuse_find_table( const char *name, unsigned long length )
+{
+    unsigned int lo = 0, hi = num_tables, mid;
+    int c;
+
+    while ( lo < hi )
+    {
+	mid = lo + ( hi - lo ) / 2;
+
+	// A name that matches for length bytes but keeps going sorts after ours.
+	if ( !( c = strncmp( tables[mid].name, name, length ) ) && !( c = tables[mid].name[length] != '\0' ) )
+	{
+	    return &tables[mid];
+	}
+
+	if ( c < 0 )
+	{
+	    lo = mid + 1;
+	}
+	else
+	{
+	    hi = mid;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * --shard.  A table with millions of rows makes one directory nobody can ls, so its rows can go
+ * --shard-levels directories deep instead, named for either the start of the key or a hash of
+ * it.  With --shard=prefix, each level takes the next --shard-width characters of the key's
+ * (first) column, so "abcdef" lives at /ab/cd/abcdef; a key that runs out early stops at
+ * a directory named "@" instead ("a" is at /a/@/a).  A directory's subdirectories are found by
+ * skipping through the key's index one prefix at a time, and its rows are an index range scan.
+ * That only holds together if the server sorts the column bytewise (a _ci collation would skip
+ * "AB" on its way past "ab", and an integer's digits aren't a range), so a table whose key
+ * doesn't can't be sharded that way.  With --shard=hash, each level takes the next --shard-width
+ * hex digits of the key's CRC32, as MySQL's CRC32() computes it, so the last level's rows are a
+ * scan the server filters for us.
+ *
+ * A shard directory is an inode like a row's (see dfuse_inode_ref), keyed by its "shard key":
+ * the column's prefix so far, or the hex digits so far, and told apart from rows (and from
+ * each other) by its depth.  The table's own directory is depth 0, with an empty shard key.
+ */
+enum {
+    DFUSE_SHARD_NONE,
+    DFUSE_SHARD_PREFIX,
+    DFUSE_SHARD_HASH,
+};
+
+// The CRC32 MySQL's CRC32() computes (zlib's); crc is 0, or what the data so far came to.
+static uint32_t dfuse_crc32( uint32_t crc, const char *data, unsigned long length )
+{
+    unsigned long i;
+    unsigned int bit;
+
+    crc = ~crc;
+
+    for ( i = 0; i < length; i++ )
+    {
+	crc ^= (unsigned char)data[i];
+
+	for ( bit = 0; bit < 8; bit++ )
+	{
+	    crc = ( crc >> 1 ) ^ ( 0xedb88320 & -( crc & 1 ) );
+	}
+    }
+
+    return ~crc;
+}
+
+// How many bytes the first chars UTF-8 characters of s take; all of it, if it's shorter.
+static unsigned long dfuse_utf8_span( const char *s, unsigned long length, unsigned long chars )
+{
+    unsigned long i = 0;
+
+    while ( i < length && chars-- )
+    {
+	// A lead byte, and whatever continuation bytes (10xxxxxx) follow it.
+	for ( i++; i < length && ( (unsigned char)s[i] & 0xc0 ) == 0x80; i++ )
+	{
+	}
+    }
+
+    return i;
+}
+
+/*
+ * How long the shard key at depth is of something whose column value (DFUSE_SHARD_PREFIX) or
+ * hex digits (DFUSE_SHARD_HASH) are s.  A shard key shorter than its depth's worth of characters
+ * is a key that ran out.
+ */
+static unsigned long dfuse_shard_span( const struct dfuse_table *table, const char *s, unsigned long length, unsigned int depth )
+{
+    if ( table->shard == DFUSE_SHARD_HASH )
+    {
+	return depth * options.shard_width < length ? depth * options.shard_width : length;
+    }
+
+    return dfuse_utf8_span( s, length, (unsigned long)depth * options.shard_width );
+}
+
+/*
+ * The shard key at depth of either a row's key (shard 0) or of the shard directory at depth shard
+ * (which has to be deeper), for the caller to free.
+ *
+ * @returns 0, -ENOENT if key isn't one of table's, or -ENOMEM.
+ */
+static int dfuse_shard_path( const struct dfuse_table *table, const char *key, unsigned long key_length,
+    unsigned int shard, unsigned int depth, char **path, unsigned long *path_length )
+{
+    struct dfuse_key_values kv;
+    char digits[9];
+    const char *s = key;
+    unsigned long length = key_length;
+    uint32_t crc = 0;
+    unsigned int i;
+    int rv;
+
+    kv.buffer = NULL;
+
+    if ( !shard )
+    {
+	if ( ( rv = dfuse_key_split( table, key, key_length, &kv ) ) )
+	{
+	    return rv;
+	}
+
+	s = kv.values[0];
+	length = kv.lengths[0];
+
+	// Every column, separated as CONCAT_WS(0x1f, ...) would; see dfuse_shard_tables.
+	if ( table->shard == DFUSE_SHARD_HASH )
+	{
+	    for ( i = 0; i < kv.count; i++ )
+	    {
+		crc = i ? dfuse_crc32( crc, "\x1f", 1 ) : crc;
+		crc = dfuse_crc32( crc, kv.values[i], kv.lengths[i] );
+	    }
+
+	    sprintf( digits, "%08x", crc );
+	    s = digits;
+	    length = 8;
+	}
+    }
+
+    length = dfuse_shard_span( table, s, length, depth );
+
+    if ( ( *path = DFUSE_MALLOC( length+1 ) ) )
+    {
+	memcpy( *path, s, length );
+	(*path)[length] = '\0';
+	*path_length = length;
+    }
+
+    dfuse_key_values_free( &kv );
+
+    return *path ? 0 : -ENOMEM;
+}
+
+// Whether the row key is in the shard directory (at depth) whose shard key is shard_key.
+static int dfuse_shard_holds( const struct dfuse_table *table, const char *shard_key, unsigned long shard_key_length,
+    unsigned int depth, const char *key, unsigned long key_length )
+{
+    char *path;
+    unsigned long path_length;
+    int rv;
+
+    if ( dfuse_shard_path( table, key, key_length, 0, depth, &path, &path_length ) )
+    {
+	return 0;
+    }
+
+    rv = path_length == shard_key_length && !memcmp( path, shard_key, path_length );
+    DFUSE_FREE( path );
+
+    return rv;
+}
+
+/*
+ * The filename of a row (shard 0; see dfuse_key_name) or of the shard directory at depth shard,
+ * for the caller to free.  A directory is named for its own level's part of its shard key:
+ * hex digits, or characters, urlencoded, "@" if there are none, and never "." or "..".
+ */
+static char *dfuse_shard_name( const struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int shard )
+{
+    unsigned long start;
+    char *rv;
+
+    if ( !shard )
+    {
+	return dfuse_key_name( table, key, key_length );
+    }
+
+    start = dfuse_shard_span( table, key, key_length, shard-1 );
+
+    if ( start == key_length )
+    {
+	return ( rv = DFUSE_MALLOC( 2 ) ) ? strcpy( rv, "@" ) : NULL;
+    }
+
+    if ( !( rv = urlencode( key + start, key_length - start ) ) )
+    {
+	return NULL;
+    }
+
+    if ( !strcmp( rv, "." ) || !strcmp( rv, ".." ) )
+    {
+	DFUSE_FREE( rv );
+	return dfuse_asprintf( "%s", key_length - start == 1 ? "%2e" : "%2e%2e" );
+    }
+
+    return rv;
+}
+
+// Whether the shard directory at depth is one for keys that ran out before they got that deep.
+static int dfuse_shard_ended( const struct dfuse_table *table, const char *shard_key, unsigned long shard_key_length, unsigned int depth )
+{
+    return table->shard == DFUSE_SHARD_PREFIX && depth
+	&& dfuse_utf8_span( shard_key, shard_key_length, (unsigned long)depth * options.shard_width - 1 ) == shard_key_length;
+}
+
+/*
+ * The shard key of the subdirectory name would be of the shard directory (at depth, with
+ * shard_key) it's looked up in, which has to be above the last level.  Whether there's anything
+ * in it is dfuse_shard_exists's business.
+ *
+ * @returns 0, -ENOENT if name can't be one, or -ENOMEM.
+ */
+static int dfuse_shard_child( const struct dfuse_table *table, const char *shard_key, unsigned long shard_key_length,
+    unsigned int depth, const char *name, struct string_length **child )
+{
+    struct string_length *part = NULL;
+    const char *s = name;
+    unsigned long i, length;
+
+    if ( table->shard == DFUSE_SHARD_HASH )
+    {
+	for ( i = 0; ( name[i] >= '0' && name[i] <= '9' ) || ( name[i] >= 'a' && name[i] <= 'f' ); i++ )
+	{
+	}
+
+	if ( name[i] || i != options.shard_width )
+	{
+	    return -ENOENT;
+	}
+
+	length = i;
+    }
+    else if ( !strcmp( name, "@" ) )
+    {
+	length = 0;
+    }
+    else if ( !strcmp( name, "." ) || !strcmp( name, ".." ) || dfuse_shard_ended( table, shard_key, shard_key_length, depth ) )
+    {
+	// Those are spelled %2e, and below a key that's run out, there's only ever "@".
+	return -ENOENT;
+    }
+    else if ( !( part = urldecode( name ) ) )
+    {
+	return -ENOMEM;
+    }
+    else
+    {
+	s = part->string;
+	length = part->length;
+
+	if ( !length || dfuse_utf8_span( s, length, options.shard_width ) != length )
+	{
+	    DFUSE_FREE( part->string );
+	    DFUSE_FREE( part );
+	    return -ENOENT;
+	}
+    }
+
+    if ( ( *child = DFUSE_MALLOC( sizeof( struct string_length ) ) )
+      && !( (*child)->string = DFUSE_MALLOC( shard_key_length + length + 1 ) ) )
+    {
+	DFUSE_FREE( *child );
+	*child = NULL;
+    }
+
+    if ( *child )
+    {
+	memcpy( (*child)->string, shard_key, shard_key_length );
+	memcpy( (*child)->string + shard_key_length, s, length );
+	(*child)->string[shard_key_length + length] = '\0';
+	(*child)->length = shard_key_length + length;
+    }
+
+    if ( part )
+    {
+	DFUSE_FREE( part->string );
+	DFUSE_FREE( part );
+    }
+
+    return *child ? 0 : -ENOMEM;
+}
+
+/*
+ * The smallest string that sorts after every string starting with s: s with its last byte that
+ * isn't 0xff incremented, and everything after that dropped.  For the caller to free.
+ *
+ * @returns 0, -ENOENT if there's no such string (s is empty, or all 0xff), or -ENOMEM.
+ */
+static int dfuse_shard_successor( const char *s, unsigned long length, char **successor, unsigned long *successor_length )
+{
+    while ( length && (unsigned char)s[length-1] == 0xff )
+    {
+	length--;
+    }
+
+    if ( !length )
+    {
+	return -ENOENT;
+    }
+
+    if ( !( *successor = DFUSE_MALLOC( length ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    memcpy( *successor, s, length );
+    (*successor)[length-1]++;
+    *successor_length = length;
+
+    return 0;
+}
+
+/*
+ * What table->shard_where's placeholders take, for the last level's directory with shard_key,
+ * and what they point at.  For DFUSE_SHARD_PREFIX, "col>=? AND (col<? OR ?) AND (col<=? OR ?)":
+ * the range of column values that start with it (or, if its keys ran out, just the one).  For
+ * DFUSE_SHARD_HASH, "CRC32(...)>>?=?": how far to shift, and what has to be left.
+ */
+struct dfuse_shard_binds {
+    char *successor;
+    unsigned long lengths[3];
+    unsigned long long ints[2];
+};
+
+// Binds shard_key's shard_where to params, in order; dfuse_shard_binds_free() afterwards.
+static int dfuse_shard_bind( const struct dfuse_table *table, const char *shard_key, unsigned long shard_key_length,
+    unsigned int depth, struct dfuse_shard_binds *sb, MYSQL_BIND *params )
+{
+    int rv;
+
+    memset( sb, 0, sizeof( struct dfuse_shard_binds ) );
+
+    if ( table->shard == DFUSE_SHARD_HASH )
+    {
+	sb->ints[0] = 32 - 4*shard_key_length;
+	sb->ints[1] = strtoull( shard_key, NULL, 16 );
+	params[0].buffer_type = params[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	params[0].is_unsigned = params[1].is_unsigned = 1;
+	params[0].buffer = &sb->ints[0];
+	params[1].buffer = &sb->ints[1];
+	return 2;
+    }
+
+    if ( ( rv = dfuse_shard_successor( shard_key, shard_key_length, &sb->successor, &sb->lengths[1] ) ) == -ENOMEM )
+    {
+	return rv;
+    }
+
+    // No successor: nothing's too big.  Keys that ran out: nothing bigger than the one.
+    sb->ints[0] = rv == -ENOENT;
+    sb->ints[1] = !dfuse_shard_ended( table, shard_key, shard_key_length, depth );
+    sb->lengths[0] = sb->lengths[2] = shard_key_length;
+
+    params[0].buffer_type = params[1].buffer_type = params[3].buffer_type = MYSQL_TYPE_STRING;
+    params[0].buffer = params[3].buffer = (char *)shard_key;
+    params[0].buffer_length = params[3].buffer_length = shard_key_length;
+    params[0].length = &sb->lengths[0];
+    params[1].buffer = sb->successor ? sb->successor : (char *)shard_key;
+    params[1].buffer_length = sb->lengths[1];
+    params[1].length = &sb->lengths[1];
+    params[3].length = &sb->lengths[2];
+    params[2].buffer_type = params[4].buffer_type = MYSQL_TYPE_LONGLONG;
+    params[2].buffer = &sb->ints[0];
+    params[4].buffer = &sb->ints[1];
+
+    return 5;
+}
+
+static void dfuse_shard_binds_free( struct dfuse_shard_binds *sb )
+{
+    if ( sb->successor )
+    {
+	DFUSE_FREE( sb->successor );
+	sb->successor = NULL;
+    }
+}
+
+/*
+ * Runs DFUSE_STMT_SHARD_FIRST or DFUSE_STMT_SHARD_AFTER for the last level's directory with
+ * shard_key: dfuse_stmt_execute(), with the directory's shard_where bound after the key.
+ */
+static int dfuse_shard_execute( struct dfuse_table *table, unsigned int which, const char *shard_key,
+    unsigned long shard_key_length, unsigned int depth, const char *key, unsigned long key_length,
+    unsigned long long *ints, unsigned int num_ints, MYSQL_STMT **stmt )
+{
+    MYSQL_BIND params[DFUSE_MAX_KEY_AFTER_PARAMS+7];
+    struct dfuse_key_values kv;
+    struct dfuse_shard_binds sb;
+    unsigned int i, n = 0;
+    int rv;
+
+    memset( params, 0, sizeof( params ) );
+    kv.buffer = NULL;
+
+    if ( key )
+    {
+	if ( ( rv = dfuse_key_split( table, key, key_length, &kv ) ) )
+	{
+	    return rv;
+	}
+
+	n = dfuse_key_bind_after( &kv, params );
+    }
+
+    if ( ( rv = dfuse_shard_bind( table, shard_key, shard_key_length, depth, &sb, params + n ) ) < 0 )
+    {
+	dfuse_key_values_free( &kv );
+	return rv;
+    }
+
+    for ( i = 0, n += rv; i < num_ints && i < 2; i++, n++ )
+    {
+	params[n].buffer_type = MYSQL_TYPE_LONGLONG;
+	params[n].buffer = &ints[i];
+	params[n].is_unsigned = 1;
+    }
+
+    rv = dfuse_stmt_execute_binds( table, which, params, stmt );
+    dfuse_shard_binds_free( &sb );
+    dfuse_key_values_free( &kv );
+
+    return rv;
+}
+
+/*
+ * The smallest value of table->shard_column at or after (or, if !inclusive, just after) from,
+ * for the caller to free, or NULL in *found if there isn't one.  One dive into the key's index:
+ * this is what skips from one of a directory's subdirectories to the next.  The caller must
+ * already hold a connection.
+ *
+ * @returns 0 or a negative errno.
+ */
+static int dfuse_shard_next( struct dfuse_table *table, const char *from, unsigned long from_length, int inclusive,
+    char **found, unsigned long *found_length )
+{
+    MYSQL_BIND params[3];
+    MYSQL_STMT *stmt;
+    struct dfuse_stmt_row row;
+    unsigned long long include = inclusive;
+    int rv;
+
+    *found = NULL;
+    memset( params, 0, sizeof( params ) );
+
+    params[0].buffer_type = params[1].buffer_type = MYSQL_TYPE_STRING;
+    params[0].buffer = params[1].buffer = (char *)from;
+    params[0].buffer_length = params[1].buffer_length = from_length;
+    params[0].length = params[1].length = &from_length;
+    params[2].buffer_type = MYSQL_TYPE_LONGLONG;
+    params[2].buffer = &include;
+
+    if ( ( rv = dfuse_stmt_execute_binds( table, DFUSE_STMT_SHARD_NEXT, params, &stmt ) ) )
+    {
+	return rv;
+    }
+
+    memset( &row, 0, sizeof( row ) );
+
+    if ( ( rv = dfuse_stmt_fetch_row( stmt, &row ) ) > 0 && row.values[0] )
+    {
+	if ( ( *found = DFUSE_MALLOC( row.lengths[0]+1 ) ) )
+	{
+	    memcpy( *found, row.values[0], row.lengths[0]+1 );
+	    *found_length = row.lengths[0];
+	}
+	else
+	{
+	    rv = -ENOMEM;
+	}
+    }
+
+    mysql_stmt_free_result( stmt );
+    dfuse_stmt_row_free( &row );
+
+    return rv < 0 ? rv : 0;
+}
+
+/*
+ * Whether the shard directory at depth with shard_key has anything in it: always, with
+ * DFUSE_SHARD_HASH; otherwise, whether the first key at or after it starts with it.
+ *
+ * @returns 0, -ENOENT, or another negative errno.
+ */
+static int dfuse_shard_exists( struct dfuse_table *table, const char *shard_key, unsigned long shard_key_length, unsigned int depth )
+{
+    char *found;
+    unsigned long found_length;
+    int rv;
+
+    if ( table->shard == DFUSE_SHARD_HASH )
+    {
+	return 0;
+    }
+
+    if ( !dfuse_connect( NULL, NULL, NULL, NULL ) )
+    {
+	DFRV(-EIO);
+    }
+
+    if ( !( rv = dfuse_shard_next( table, shard_key, shard_key_length, 1, &found, &found_length ) ) )
+    {
+	rv = found && dfuse_shard_span( table, found, found_length, depth ) == shard_key_length
+	    && !memcmp( found, shard_key, shard_key_length ) ? 0 : -ENOENT;
+    }
+
+    if ( found ) { DFUSE_FREE( found ); }
+
+    DFRV(rv);
+}
+
+/*
+ * --shard=hash's WHERE: "CRC32(CONCAT_WS(0x1f,CONVERT(a USING cs),...))>>?=?".  Each column is
+ * converted by itself, since CONCAT_WS with 0x1f makes a binary string, which CONVERT leaves be.
+ */
+static char *dfuse_shard_hash_where( MYSQL *sql, const struct dfuse_table *t )
+{
+    const char *charset = mysql_character_set_name( sql );
+    char *columns = NULL, *quoted, *next, *rv;
+    unsigned int i;
+
+    for ( i = 0; i < t->key_columns; i++ )
+    {
+	quoted = t->key_columns > 1 ? dfuse_quote_identifier( t->key_names[i], strlen( t->key_names[i] ) ) : t->prikey;
+	next = quoted ? dfuse_asprintf( "%s%sCONVERT(%s USING %s)", columns ? columns : "", columns ? "," : "", quoted,
+	    charset ) : NULL;
+
+	if ( t->key_columns > 1 && quoted )
+	{
+	    DFUSE_FREE( quoted );
+	}
+
+	if ( columns )
+	{
+	    DFUSE_FREE( columns );
+	}
+
+	if ( !( columns = next ) )
+	{
+	    return NULL;
+	}
+    }
+
+    rv = dfuse_asprintf( "CRC32(CONCAT_WS(0x1f,%s))>>?=?", columns );
+    DFUSE_FREE( columns );
+
+    return rv;
+}
+
+/*
+ * Sets up --shard for every table.  Called once, from main(), after dfuse_load_tables.  Prefix
+ * directories need the key's (first) column to sort bytewise, which means a binary string or a
+ * _bin collation; any other table is refused, rather than quietly sharded some slower way.  The
+ * hash is over the key's columns as we get them, so the server converts them to our character
+ * set before it hashes.
+ *
+ * @returns 0, or -1 (having said why).
+ */
+int dfuse_shard_tables( MYSQL *sql )
+{
+    MYSQL_RES *sql_res;
+    MYSQL_FIELD *field;
+    struct dfuse_table *t;
+    unsigned int i;
+    char *query, *c;
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	t = &tables[i];
+	t->shard = DFUSE_SHARD_HASH;
+
+	if ( !strcmp( options.shard, "prefix" ) )
+	{
+	    t->shard_column = t->key_columns > 1 ? dfuse_quote_identifier( t->key_names[0], strlen( t->key_names[0] ) ) : t->prikey;
+
+	    if ( !t->shard_column || !( query = dfuse_asprintf( "SELECT %s FROM %s LIMIT 0", t->shard_column, t->sql_name ) ) )
+	    {
+		printf( "Unable to allocate memory for table '%s'.\n", t->name );
+		return -1;
+	    }
+
+	    if ( dfuse_query( sql, query ) || !( sql_res = mysql_store_result( sql ) ) )
+	    {
+		printf( "Unable to look at the key of table '%s': '%s'.\n", t->name, mysql_error( sql ) );
+		DFUSE_FREE( query );
+		return -1;
+	    }
+
+	    DFUSE_FREE( query );
+	    field = mysql_fetch_fields( sql_res );
+
+	    switch ( field[0].type )
+	    {
+		case MYSQL_TYPE_STRING:
+		case MYSQL_TYPE_VAR_STRING:
+		case MYSQL_TYPE_VARCHAR:
+		case MYSQL_TYPE_TINY_BLOB:
+		case MYSQL_TYPE_BLOB:
+		case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB:
+		    if ( field[0].flags & BINARY_FLAG )
+		    {
+			t->shard = DFUSE_SHARD_PREFIX;
+		    }
+		    break;
+		default:
+		    break;
+	    }
+
+	    mysql_free_result( sql_res );
+
+	    if ( t->shard == DFUSE_SHARD_HASH )
+	    {
+		printf( "Can't shard table '%s' by prefix: its key doesn't sort bytewise (it isn't a binary string or in a _bin "
+		    "collation).  Try --shard=hash.\n", t->name );
+		return -1;
+	    }
+	}
+
+	c = t->shard_column;
+
+	if ( t->shard == DFUSE_SHARD_PREFIX )
+	{
+	    t->shard_where = dfuse_asprintf( "%s>=? AND (%s<? OR ?) AND (%s<=? OR ?)", c, c, c );
+	}
+	else
+	{
+	    t->shard_where = dfuse_shard_hash_where( sql, t );
+	}
+
+	if ( !t->shard_where )
+	{
+	    printf( "Unable to allocate memory for table '%s'.\n", t->name );
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+// Whether c[i] is a * standing for a whole item of a SELECT list, between commas (or ends).
+static int dfuse_bare_star( const char *c, size_t length, size_t i )
+{
+    size_t j;
+
+    if ( c[i] != '*' )
+    {
+	return 0;
+    }
+
+    for ( j = i; j > 0 && isspace( (unsigned char)c[j-1] ); j-- );
+
+    if ( j > 0 && c[j-1] != ',' )
+    {
+	return 0;
+    }
+
+    for ( j = i + 1; j < length && isspace( (unsigned char)c[j] ); j++ );
+
+    return j == length || c[j] == ',';
+}
+
+/*
+ * -c, for a SELECT list where it follows other columns: "SELECT k,* FROM t" is a syntax error, so
+ * any bare * in it becomes <table>.*.  For the caller to free; NULL if out of memory.
+ */
+static char *dfuse_select_columns( const struct dfuse_table *table )
+{
+    const char *c = options.columns;
+    size_t length = strlen( c ), name_length = strlen( table->sql_name ), stars = 0, i, j;
+    char *rv;
+
+    for ( i = 0; i < length; i++ )
+    {
+	stars += dfuse_bare_star( c, length, i );
+    }
+
+    if ( !( rv = DFUSE_MALLOC( length + stars * ( name_length + 1 ) + 1 ) ) )
+    {
+	return NULL;
+    }
+
+    for ( i = j = 0; i < length; i++ )
+    {
+	if ( dfuse_bare_star( c, length, i ) )
+	{
+	    memcpy( rv + j, table->sql_name, name_length );
+	    j += name_length;
+	    rv[j++] = '.';
+	}
+
+	rv[j++] = c[i];
+    }
+
+    rv[j] = 0;
+    return rv;
+}
+
+/*
+ * --column-files: each row is a directory, holding a file per column -c names (every column, with
+ * -c '*'), so that reading or writing one field of a row only ever touches that one column.  The
+ * columns are found once, at mount time, with a LIMIT 0 query per table; the key's own are left
+ * out, since they're the directory's name already.  Each column gets its own set of statements
+ * (see DFUSE_STMT_COLUMN), numbered from 1 in the order the server listed them.
+ *
+ * @returns 0, or -1 (having said why) if some table can't be served this way.
+ */
+int dfuse_column_tables( MYSQL *sql )
+{
+    MYSQL_RES *sql_res;
+    MYSQL_FIELD *fields;
+    struct dfuse_table *t;
+    unsigned int i, j, k, num_fields;
+    char *columns, *query;
+
+    for ( num_stmts = 0, i = 0; i < num_tables; i++ )
+    {
+	t = &tables[i];
+	query = ( columns = dfuse_select_columns( t ) )
+	    ? dfuse_asprintf( "SELECT %s,%s FROM %s LIMIT 0", t->prikey, columns, t->sql_name ) : NULL;
+	DFUSE_FREE( columns );
+
+	if ( !query )
+	{
+	    printf( "Unable to allocate memory for table '%s'.\n", t->name );
+	    return -1;
+	}
+
+	if ( dfuse_query( sql, query ) || !( sql_res = mysql_store_result( sql ) ) )
+	{
+	    printf( "Unable to look at the columns of table '%s': '%s'.\n", t->name, mysql_error( sql ) );
+	    DFUSE_FREE( query );
+	    return -1;
+	}
+
+	DFUSE_FREE( query );
+	fields = mysql_fetch_fields( sql_res );
+	num_fields = mysql_num_fields( sql_res );
+
+	// Mount time: a failure here means no mount, so there's no point tidying up after it.
+	if ( !( t->column_names = DFUSE_MALLOC( sizeof( char * ) * ( num_fields ? num_fields : 1 ) ) )
+	  || !( t->column_sql = DFUSE_MALLOC( sizeof( char * ) * ( num_fields ? num_fields : 1 ) ) ) )
+	{
+	    printf( "Unable to allocate memory for table '%s'.\n", t->name );
+	    mysql_free_result( sql_res );
+	    return -1;
+	}
+
+	// The key's columns come first; everything after them is -c.
+	for ( j = t->key_columns; j < num_fields; j++ )
+	{
+	    // An expression has nothing we could SELECT or UPDATE by itself.
+	    if ( !fields[j].org_name || !fields[j].org_name_length )
+	    {
+		printf( "Unable to serve '%s' in table '%s' as a file: --column-files needs -c to name columns.\n",
+		    fields[j].name, t->name );
+		mysql_free_result( sql_res );
+		return -1;
+	    }
+
+	    // A key column, or one we already have (-c '*,a', or two columns with the same name).
+	    for ( k = 0; k < j; k++ )
+	    {
+		if ( ( fields[k].org_name && !strcmp( fields[k].org_name, fields[j].org_name ) )
+		  || ( k >= t->key_columns && !strcmp( fields[k].name, fields[j].name ) ) )
+		{
+		    break;
+		}
+	    }
+
+	    if ( k < j )
+	    {
+		continue;
+	    }
+
+	    if ( !( t->column_names[t->num_columns] = urlencode( fields[j].name, fields[j].name_length ) )
+	      || !( t->column_sql[t->num_columns] = dfuse_quote_identifier( fields[j].org_name, fields[j].org_name_length ) ) )
+	    {
+		printf( "Unable to allocate memory for table '%s'.\n", t->name );
+		mysql_free_result( sql_res );
+		return -1;
+	    }
+
+	    t->num_columns++;
+	}
+
+	mysql_free_result( sql_res );
+
+	t->stmt_base = num_stmts;
+	num_stmts += DFUSE_STMT_COLUMN( t->num_columns + 1, 0 );
+
+	D( "Serving %u columns as files.\n", t->num_columns );
+    }
+
+    return 0;
+}
+
+// The column of table's whose file is called name, plus one, or 0 if there's no such file.
+static unsigned int dfuse_column_find( const struct dfuse_table *table, const char *name )
+{
+    unsigned int i;
+
+    for ( i = 0; i < table->num_columns; i++ )
+    {
+	if ( !strcmp( table->column_names[i], name ) )
+	{
+	    return i+1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Attribute cache.  git, rsync and editors lstat() the same handful of paths over and over, and
+ * probe for ones that don't exist (.git, *.swp, 4913) just as often.  We remember the struct stat
+ * for rows we've seen, and a short-lived ENOENT for ones we haven't, keyed by table and decoded
+ * primary key (and, with --column-files, column: a row's columns share its hash, so evicting the
+ * row finds them all).  Entries expire after --attr-ttl / --negative-ttl seconds, and our own
+ * writes evict them.
+ *
+ * An eviction can land between a reader's query and its put, which would leave what the reader
+ * saw before the change cached for as long as --attr-ttl.  So every invalidation also counts
+ * itself, per table or for everything, and a reader takes dfuse_invalidation_seq before its
+ * query; if that's moved on by the time it puts (or replies to the kernel), it doesn't.
+ */
+enum {
+    DFUSE_CACHE_MISS,
+    DFUSE_CACHE_HIT,
+    DFUSE_CACHE_NEGATIVE,
+};
+
+struct dfuse_attr_entry {
+    const struct dfuse_table *table;
+    char *key;
+    unsigned long key_length;
+    unsigned int column;	// --column-files: one of the row's columns, plus one; 0 for the row.
+    unsigned long long hash;
+    struct stat st;
+    int negative;
+    unsigned long long expires;	// dfuse_now_ms() at which this entry stops counting
+    struct dfuse_attr_entry *next;
+};
+
+struct dfuse_attr_cache {
+    pthread_mutex_t lock;
+    struct dfuse_attr_entry **buckets;
+    unsigned long bucket_count;	// Always a power of two.
+    unsigned long count;
+
+    unsigned long long invalidated;	// Invalidations of everything.
+    unsigned long long *table_invalidated;	// Per table: invalidations of it, or of any of its rows.
+
+    unsigned long long hits;
+    unsigned long long negative_hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} attr_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+#define DFUSE_ATTR_CACHE_MIN_BUCKETS 1024
+
+unsigned long long dfuse_now_ms( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a.  Keys are short and this is nowhere near the bottleneck.
+unsigned long long dfuse_hash( const char *key, unsigned long length )
+{
+    unsigned long long h = 14695981039346656037ULL;
+    unsigned long i;
+
+    for ( i = 0; i < length; i++ )
+    {
+	h ^= (unsigned char)key[i];
+	h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// Keys are only unique within a table, so the table goes into the hash (and the comparison).
+static unsigned long long dfuse_attr_hash( const struct dfuse_table *table, const char *key, unsigned long length )
+{
+    return dfuse_hash( key, length ) ^ ( table->index * 0x9e3779b97f4a7c15ULL );
+}
+
+static void dfuse_attr_free_entry( struct dfuse_attr_entry *e )
+{
+    DFUSE_FREE( e->key );
+    DFUSE_FREE( e );
+}
+
+// Caller holds attr_cache.lock.  Drops every expired entry; only called when we're full.
+static void dfuse_attr_cache_sweep( unsigned long long now )
+{
+    struct dfuse_attr_entry **ep, *e;
+    unsigned long i;
+
+    for ( i = 0; i < attr_cache.bucket_count; i++ )
+    {
+	for ( ep = &attr_cache.buckets[i]; ( e = *ep ); )
+	{
+	    if ( e->expires <= now )
+	    {
+		*ep = e->next;
+		dfuse_attr_free_entry( e );
+		attr_cache.count--;
+		attr_cache.evictions++;
+		continue;
+	    }
+	    ep = &e->next;
+	}
+    }
+}
+
+// Caller holds attr_cache.lock.  Doubles the bucket array; failure to do so is harmless.
+static void dfuse_attr_cache_grow( void )
+{
+    struct dfuse_attr_entry **buckets, *e, *next;
+    unsigned long i, bucket_count;
+
+    bucket_count = attr_cache.bucket_count ? attr_cache.bucket_count * 2 : DFUSE_ATTR_CACHE_MIN_BUCKETS;
+
+    if ( !( buckets = calloc( bucket_count, sizeof( struct dfuse_attr_entry * ) ) ) )
+    {
+	return;
+    }
+
+    for ( i = 0; i < attr_cache.bucket_count; i++ )
+    {
+	for ( e = attr_cache.buckets[i]; e; e = next )
+	{
+	    next = e->next;
+	    e->next = buckets[e->hash & (bucket_count-1)];
+	    buckets[e->hash & (bucket_count-1)] = e;
+	}
+    }
+
+    free( attr_cache.buckets );
+    attr_cache.buckets = buckets;
+    attr_cache.bucket_count = bucket_count;
+}
+
+/*
+ * Whether something is telling us about other writers' changes (--binlog, --poll) and every one
+ * of them is caught up, which is what makes it safe to cache for longer than a TTL's worth.
+ */
+int dfuse_changes_following( void )
+{
+    return ( options.binlog || options.poll )
+	&& ( !options.binlog || binlog_following ) && ( !options.poll || poll_following );
+}
+
+// Caller holds attr_cache.lock.
+static unsigned long long dfuse_invalidation_seq_locked( const struct dfuse_table *table )
+{
+    return attr_cache.invalidated + ( attr_cache.table_invalidated ? attr_cache.table_invalidated[table->index] : 0 );
+}
+
+/*
+ * How many times table (or everything) has been invalidated so far; both only ever go up, so
+ * their sum changes whenever either does.  Take it before the query whose answer you'll cache.
+ */
+unsigned long long dfuse_invalidation_seq( const struct dfuse_table *table )
+{
+    unsigned long long seq;
+
+    pthread_mutex_lock( &attr_cache.lock );
+    seq = dfuse_invalidation_seq_locked( table );
+    pthread_mutex_unlock( &attr_cache.lock );
+
+    return seq;
+}
+
+// Caller holds attr_cache.lock.  Counts an invalidation of table, or if it's NULL, of everything.
+static void dfuse_invalidation_count( const struct dfuse_table *table )
+{
+    if ( table && !attr_cache.table_invalidated )
+    {
+	attr_cache.table_invalidated = calloc( num_tables, sizeof( unsigned long long ) );
+    }
+
+    // Without the per-table counts, everything it is.
+    if ( table && attr_cache.table_invalidated )
+    {
+	attr_cache.table_invalidated[table->index]++;
+    }
+    else
+    {
+	attr_cache.invalidated++;
+    }
+}
+
+/*
+ * Looks table's key (or one of its columns) up.  On DFUSE_CACHE_HIT, *stbuf is filled in; on
+ * DFUSE_CACHE_NEGATIVE, the row recently didn't exist; on DFUSE_CACHE_MISS, go ask the database.
+ */
+int dfuse_attr_cache_get( const struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column,
+    struct stat *stbuf )
+{
+    struct dfuse_attr_entry **ep, *e;
+    unsigned long long h, now;
+    int rv = DFUSE_CACHE_MISS;
+
+    if ( !options.attr_ttl && !options.negative_ttl )
+    {
+	return DFUSE_CACHE_MISS;
+    }
+
+    // With --binlog or --poll, TTLs can be long, which is only safe while we're actually hearing
+    // about changes.
+    if ( ( options.binlog || options.poll ) && !dfuse_changes_following() )
+    {
+	return DFUSE_CACHE_MISS;
+    }
+
+    h = dfuse_attr_hash( table, key, key_length );
+    now = dfuse_now_ms();
+
+    pthread_mutex_lock( &attr_cache.lock );
+
+    if ( attr_cache.bucket_count )
+    {
+	for ( ep = &attr_cache.buckets[h & (attr_cache.bucket_count-1)]; ( e = *ep ); ep = &e->next )
+	{
+	    if ( e->hash != h || e->table != table || e->column != column || e->key_length != key_length
+	      || memcmp( e->key, key, key_length ) )
+	    {
+		continue;
+	    }
+
+	    if ( e->expires <= now )
+	    {
+		*ep = e->next;
+		dfuse_attr_free_entry( e );
+		attr_cache.count--;
+		attr_cache.evictions++;
+		break;
+	    }
+
+	    if ( e->negative )
+	    {
+		rv = DFUSE_CACHE_NEGATIVE;
+		attr_cache.negative_hits++;
+	    }
+	    else
+	    {
+		memcpy( stbuf, &e->st, sizeof( struct stat ) );
+		rv = DFUSE_CACHE_HIT;
+		attr_cache.hits++;
+	    }
+	    break;
+	}
+    }
+
+    if ( rv == DFUSE_CACHE_MISS )
+    {
+	attr_cache.misses++;
+    }
+
+    pthread_mutex_unlock( &attr_cache.lock );
+
+    return rv;
+}
+
+/*
+ * Remembers stbuf for key, or, if stbuf is NULL, remembers that key doesn't exist.  Replaces
+ * whatever was there before.  since is dfuse_invalidation_seq from before stbuf was fetched; if
+ * table has been invalidated since, stbuf may be from before that, and isn't remembered.
+ */
+void dfuse_attr_cache_put( const struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column,
+    const struct stat *stbuf, unsigned long long since )
+{
+    struct dfuse_attr_entry **ep, *e;
+    unsigned long long h, now;
+    unsigned int ttl = stbuf ? options.attr_ttl : options.negative_ttl;
+
+    if ( !ttl )
+    {
+	return;
+    }
+
+    h = dfuse_attr_hash( table, key, key_length );
+    now = dfuse_now_ms();
+
+    pthread_mutex_lock( &attr_cache.lock );
+
+    if ( dfuse_invalidation_seq_locked( table ) != since )
+    {
+	pthread_mutex_unlock( &attr_cache.lock );
+	return;
+    }
+
+    if ( attr_cache.count >= options.attr_cache_max )
+    {
+	dfuse_attr_cache_sweep( now );
+    }
+
+    if ( attr_cache.count >= attr_cache.bucket_count )
+    {
+	dfuse_attr_cache_grow();
+    }
+
+    if ( !attr_cache.bucket_count )
+    {
+	pthread_mutex_unlock( &attr_cache.lock );
+	return;
+    }
+
+    for ( ep = &attr_cache.buckets[h & (attr_cache.bucket_count-1)]; ( e = *ep ); ep = &e->next )
+    {
+	if ( e->hash == h && e->table == table && e->column == column && e->key_length == key_length
+	  && !memcmp( e->key, key, key_length ) )
+	{
+	    break;
+	}
+    }
+
+    if ( !e )
+    {
+	// Still full of live entries?  Then this one just doesn't get cached.
+	if ( attr_cache.count >= options.attr_cache_max
+	  || !( e = DFUSE_MALLOC( sizeof( struct dfuse_attr_entry ) ) ) )
+	{
+	    pthread_mutex_unlock( &attr_cache.lock );
+	    return;
+	}
+
+	if ( !( e->key = DFUSE_MALLOC( key_length+1 ) ) )
+	{
+	    DFUSE_FREE( e );
+	    pthread_mutex_unlock( &attr_cache.lock );
+	    return;
+	}
+
+	memcpy( e->key, key, key_length );
+	e->key[key_length] = '\0';
+	e->key_length = key_length;
+	e->table = table;
+	e->column = column;
+	e->hash = h;
+	e->next = *ep;
+	*ep = e;
+	attr_cache.count++;
+    }
+
+    if ( stbuf )
+    {
+	memcpy( &e->st, stbuf, sizeof( struct stat ) );
+	e->negative = 0;
+    }
+    else
+    {
+	memset( &e->st, 0, sizeof( struct stat ) );
+	e->negative = 1;
+    }
+
+    e->expires = now + ttl * 1000ULL;
+
+    pthread_mutex_unlock( &attr_cache.lock );
+}
+
+// Forgets table's key, and all of its columns.
+void dfuse_attr_cache_invalidate( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    struct dfuse_attr_entry **ep, *e;
+    unsigned long long h;
+
+    h = dfuse_attr_hash( table, key, key_length );
+
+    pthread_mutex_lock( &attr_cache.lock );
+
+    dfuse_invalidation_count( table );
+
+    if ( attr_cache.bucket_count )
+    {
+	for ( ep = &attr_cache.buckets[h & (attr_cache.bucket_count-1)]; ( e = *ep ); )
+	{
+	    if ( e->hash == h && e->table == table && e->key_length == key_length && !memcmp( e->key, key, key_length ) )
+	    {
+		*ep = e->next;
+		dfuse_attr_free_entry( e );
+		attr_cache.count--;
+		continue;
+	    }
+	    ep = &e->next;
+	}
+    }
+
+    pthread_mutex_unlock( &attr_cache.lock );
+}
+
+// Forgets everything about table or, if table is NULL, about every table.
+void dfuse_attr_cache_invalidate_table( const struct dfuse_table *table )
+{
+    struct dfuse_attr_entry **ep, *e;
+    unsigned long i;
+
+    pthread_mutex_lock( &attr_cache.lock );
+
+    dfuse_invalidation_count( table );
+
+    for ( i = 0; i < attr_cache.bucket_count; i++ )
+    {
+	for ( ep = &attr_cache.buckets[i]; ( e = *ep ); )
+	{
+	    if ( !table || e->table == table )
+	    {
+		*ep = e->next;
+		dfuse_attr_free_entry( e );
+		attr_cache.count--;
+		continue;
+	    }
+	    ep = &e->next;
+	}
+    }
+
+    pthread_mutex_unlock( &attr_cache.lock );
+}
+
+void dfuse_attr_cache_report( void )
+{
+    pthread_mutex_lock( &attr_cache.lock );
+
+    syslog( LOG_INFO, "dfuse attr cache: %lu entries, %llu hits, %llu negative hits, %llu misses, %llu evictions",
+	attr_cache.count, attr_cache.hits, attr_cache.negative_hits, attr_cache.misses, attr_cache.evictions );
+
+    pthread_mutex_unlock( &attr_cache.lock );
+}
+
+/*
+ * Inodes.  Every row the kernel looks up (or sees in a readdirplus) gets a number, remembered
+ * until the kernel forgets it as often as it's looked it up, so that every later operation finds
+ * its table and decoded key straight from the number.  Numbers are never reused.  The root and
+ * the table directories have fixed numbers (see DFUSE_TABLE_INO), and aren't in here; --shard's
+ * directories are, by their shard key and depth, and so are --column-files' files, by their row's
+ * key and their column.
+ */
+struct dfuse_inode {
+    fuse_ino_t ino;
+    struct dfuse_table *table;
+    char *key;			// Decoded, or a shard key.
+    unsigned long key_length;
+    unsigned int shard;		// 0 for a row; a shard directory's depth.
+    unsigned int column;	// --column-files: a column's file, plus one; 0 for its row's directory.
+    unsigned long long hash;	// dfuse_inode_hash( table, key, shard, column ).
+    uint64_t nlookup;		// Lookups the kernel hasn't forgotten yet.
+    struct dfuse_inode *next_by_key;
+    struct dfuse_inode *next_by_ino;
+};
+
+struct dfuse_inodes {
+    pthread_mutex_t lock;
+    struct dfuse_inode **by_key;
+    struct dfuse_inode **by_ino;
+    unsigned long bucket_count;	// Of each of them; always a power of two.
+    unsigned long count;
+    fuse_ino_t next_ino;
+
+    unsigned long long forgotten;
+} inodes = { PTHREAD_MUTEX_INITIALIZER };
+
+// Caller holds inodes.lock.  Doubles both bucket arrays; failure to do so is harmless.
+static void dfuse_inodes_grow( void )
+{
+    struct dfuse_inode **by_key, **by_ino, *e, *next;
+    unsigned long i, bucket_count;
+
+    bucket_count = inodes.bucket_count ? inodes.bucket_count * 2 : DFUSE_ATTR_CACHE_MIN_BUCKETS;
+
+    if ( !( by_key = calloc( bucket_count, sizeof( struct dfuse_inode * ) ) ) )
+    {
+	return;
+    }
+
+    if ( !( by_ino = calloc( bucket_count, sizeof( struct dfuse_inode * ) ) ) )
+    {
+	free( by_key );
+	return;
+    }
+
+    for ( i = 0; i < inodes.bucket_count; i++ )
+    {
+	for ( e = inodes.by_key[i]; e; e = next )
+	{
+	    next = e->next_by_key;
+	    e->next_by_key = by_key[e->hash & (bucket_count-1)];
+	    by_key[e->hash & (bucket_count-1)] = e;
+	}
+
+	for ( e = inodes.by_ino[i]; e; e = next )
+	{
+	    next = e->next_by_ino;
+	    e->next_by_ino = by_ino[e->ino & (bucket_count-1)];
+	    by_ino[e->ino & (bucket_count-1)] = e;
+	}
+    }
+
+    free( inodes.by_key );
+    free( inodes.by_ino );
+    inodes.by_key = by_key;
+    inodes.by_ino = by_ino;
+    inodes.bucket_count = bucket_count;
+}
+
+static unsigned long long dfuse_inode_hash( const struct dfuse_table *table, const char *key, unsigned long key_length,
+    unsigned int shard, unsigned int column )
+{
+    return dfuse_attr_hash( table, key, key_length ) + shard + ( (unsigned long long)column << 8 );
+}
+
+// Caller holds inodes.lock.
+static struct dfuse_inode *dfuse_inode_by_key( const struct dfuse_table *table, const char *key, unsigned long key_length,
+    unsigned int shard, unsigned int column, unsigned long long h )
+{
+    struct dfuse_inode *e;
+
+    if ( !inodes.bucket_count )
+    {
+	return NULL;
+    }
+
+    for ( e = inodes.by_key[h & (inodes.bucket_count-1)]; e; e = e->next_by_key )
+    {
+	if ( e->hash == h && e->table == table && e->shard == shard && e->column == column && e->key_length == key_length
+	  && !memcmp( e->key, key, key_length ) )
+	{
+	    return e;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * Counts a lookup of table's key (or, if shard isn't 0, of the shard directory at that depth, or
+ * if column isn't, of that column's file), which the kernel is about to be told about, giving it
+ * a number if it hasn't got one.
+ *
+ * @returns The inode number, or 0 if we're out of memory.
+ */
+fuse_ino_t dfuse_inode_ref( struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int shard,
+    unsigned int column )
+{
+    struct dfuse_inode *e;
+    unsigned long long h = dfuse_inode_hash( table, key, key_length, shard, column );
+    fuse_ino_t ino = 0;
+
+    pthread_mutex_lock( &inodes.lock );
+
+    if ( !( e = dfuse_inode_by_key( table, key, key_length, shard, column, h ) ) )
+    {
+	if ( inodes.count >= inodes.bucket_count )
+	{
+	    dfuse_inodes_grow();
+	}
+
+	if ( !inodes.bucket_count || !( e = DFUSE_MALLOC( sizeof( struct dfuse_inode ) ) ) )
+	{
+	    pthread_mutex_unlock( &inodes.lock );
+	    return 0;
+	}
+
+	if ( !( e->key = DFUSE_MALLOC( key_length+1 ) ) )
+	{
+	    DFUSE_FREE( e );
+	    pthread_mutex_unlock( &inodes.lock );
+	    return 0;
+	}
+
+	if ( !inodes.next_ino )
+	{
+	    inodes.next_ino = DFUSE_TABLE_INO(num_tables);
+	}
+
+	memcpy( e->key, key, key_length );
+	e->key[key_length] = '\0';
+	e->key_length = key_length;
+	e->table = table;
+	e->shard = shard;
+	e->column = column;
+	e->hash = h;
+	e->ino = inodes.next_ino++;
+	e->nlookup = 0;
+	e->next_by_key = inodes.by_key[h & (inodes.bucket_count-1)];
+	inodes.by_key[h & (inodes.bucket_count-1)] = e;
+	e->next_by_ino = inodes.by_ino[e->ino & (inodes.bucket_count-1)];
+	inodes.by_ino[e->ino & (inodes.bucket_count-1)] = e;
+	inodes.count++;
+    }
+
+    e->nlookup++;
+    ino = e->ino;
+
+    pthread_mutex_unlock( &inodes.lock );
+
+    return ino;
+}
+
+// The number table's key (or shard directory, or column) already has, or 0 if the kernel doesn't
+// know it.
+fuse_ino_t dfuse_inode_find( const struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int shard,
+    unsigned int column )
+{
+    struct dfuse_inode *e;
+    fuse_ino_t ino;
+
+    pthread_mutex_lock( &inodes.lock );
+    e = dfuse_inode_by_key( table, key, key_length, shard, column, dfuse_inode_hash( table, key, key_length, shard, column ) );
+    ino = e ? e->ino : 0;
+    pthread_mutex_unlock( &inodes.lock );
+
+    return ino;
+}
+
+// The kernel's dropped nlookup of its lookups of ino; once it's dropped them all, so do we.
+void dfuse_inode_forget( fuse_ino_t ino, uint64_t nlookup )
+{
+    struct dfuse_inode **ep, *e;
+
+    pthread_mutex_lock( &inodes.lock );
+
+    for ( ep = inodes.bucket_count ? &inodes.by_ino[ino & (inodes.bucket_count-1)] : NULL; ep && ( e = *ep ); ep = &e->next_by_ino )
+    {
+	if ( e->ino != ino )
+	{
+	    continue;
+	}
+
+	if ( e->nlookup > nlookup )
+	{
+	    e->nlookup -= nlookup;
+	    break;
+	}
+
+	*ep = e->next_by_ino;
+
+	for ( ep = &inodes.by_key[e->hash & (inodes.bucket_count-1)]; *ep != e; ep = &(*ep)->next_by_key )
+	{
+	}
+	*ep = e->next_by_key;
+
+	DFUSE_FREE( e->key );
+	DFUSE_FREE( e );
+	inodes.count--;
+	inodes.forgotten++;
+	break;
+    }
+
+    pthread_mutex_unlock( &inodes.lock );
+}
+
+/*
+ * Works out what ino is: the root, a table's directory (*table set), or a shard directory, a row or
+ * a column (*table and *inode set).  A row's dfuse_inode stays put for as long as the kernel's
+ * asking about it, since it can't forget an inode it's got a request outstanding for.  With
+ * --column-files, a row is a directory; that's for the caller to know.
+ *
+ * @returns One of DFUSE_PATH_*, or -ENOENT for a number we don't know.
+ */
+int dfuse_resolve_ino( fuse_ino_t ino, struct dfuse_table **table, struct dfuse_inode **inode )
+{
+    struct dfuse_inode *e = NULL;
+
+    *table = NULL;
+    *inode = NULL;
+
+    if ( ino == FUSE_ROOT_ID )
+    {
+	return DFUSE_PATH_ROOT;
+    }
+
+    // What dfuse_stats_* don't answer for /.dfuse, they don't allow.
+    if ( ino == DFUSE_STATS_DIR_INO || ino == DFUSE_STATS_INO || ino == DFUSE_SNAPSHOT_INO )
+    {
+	return -EACCES;
+    }
+
+    if ( multi_table && ino >= DFUSE_TABLE_INO(0) && ino < DFUSE_TABLE_INO(num_tables) )
+    {
+	*table = &tables[ino - DFUSE_TABLE_INO(0)];
+	return DFUSE_PATH_TABLE;
+    }
+
+    pthread_mutex_lock( &inodes.lock );
+
+    for ( e = inodes.bucket_count ? inodes.by_ino[ino & (inodes.bucket_count-1)] : NULL; e && e->ino != ino; e = e->next_by_ino )
+    {
+    }
+
+    pthread_mutex_unlock( &inodes.lock );
+
+    if ( !e )
+    {
+	return -ENOENT;
+    }
+
+    *table = e->table;
+    *inode = e;
+
+    return e->shard ? DFUSE_PATH_SHARD : e->column ? DFUSE_PATH_COLUMN : DFUSE_PATH_ROW;
+}
+
+// Where table's rows live: the root with -t, or the table's own directory.
+static fuse_ino_t dfuse_table_dir( const struct dfuse_table *table )
+{
+    return multi_table ? DFUSE_TABLE_INO(table->index) : FUSE_ROOT_ID;
+}
+
+/*
+ * Works out what name, in the directory parent, is: a table's directory (only in the root, and
+ * only without -t), a shard directory (--shard), a row, or one of a row's columns
+ * (--column-files).  For any but the first, *table is set, and so are *key (the decoded key or
+ * the shard key, for the caller to free; see dfuse_name_key and dfuse_shard_child), *shard (the
+ * directory's depth, or 0) and *column (the column, plus one, or 0).  This is the only place a
+ * filename gets decoded: after lookup, the kernel hands us the inode number, and we already know
+ * what's behind that (see dfuse_inode_ref).
+ *
+ * @returns One of DFUSE_PATH_*, or a negative errno.
+ */
+int dfuse_resolve_name( fuse_ino_t parent, const char *name, struct dfuse_table **table, struct string_length **key,
+    unsigned int *shard, unsigned int *column )
+{
+    struct dfuse_inode *inode = NULL;
+    const char *shard_key = "";
+    unsigned long shard_key_length = 0;
+    unsigned int depth = 0;
+    int rv;
+
+    *table = NULL;
+    *shard = 0;
+    *column = 0;
+
+    if ( parent == DFUSE_STATS_DIR_INO )
+    {
+	return -EACCES;
+    }
+
+    if ( parent == FUSE_ROOT_ID && multi_table )
+    {
+	return ( *table = dfuse_find_table( name, strlen(name) ) ) ? DFUSE_PATH_TABLE : -ENOENT;
+    }
+
+    if ( parent == FUSE_ROOT_ID )
+    {
+	*table = &tables[0];
+    }
+    else if ( multi_table && parent >= DFUSE_TABLE_INO(0) && parent < DFUSE_TABLE_INO(num_tables) )
+    {
+	*table = &tables[parent - DFUSE_TABLE_INO(0)];
+    }
+    else if ( ( rv = dfuse_resolve_ino( parent, table, &inode ) ) == DFUSE_PATH_SHARD )
+    {
+	shard_key = inode->key;
+	shard_key_length = inode->key_length;
+	depth = inode->shard;
+    }
+    else if ( rv == DFUSE_PATH_ROW && options.column_files )
+    {
+	// A column's file is named for the column, and belongs to its directory's row.
+	if ( !( *column = dfuse_column_find( *table, name ) ) )
+	{
+	    return -ENOENT;
+	}
+
+	if ( !( *key = DFUSE_MALLOC( sizeof( struct string_length ) ) ) || !( (*key)->string = DFUSE_MALLOC( inode->key_length+1 ) ) )
+	{
+	    if ( *key ) { DFUSE_FREE( *key ); }
+	    return -ENOMEM;
+	}
+
+	memcpy( (*key)->string, inode->key, inode->key_length+1 );
+	(*key)->length = inode->key_length;
+
+	return DFUSE_PATH_COLUMN;
+    }
+    else
+    {
+	// Rows are never directories (but see --column-files), and neither are columns.
+	*table = NULL;
+	return -ENOTDIR;
+    }
+
+    if ( name[0] == '\0' )
+    {
+	return -ENOENT;
+    }
+
+    // Above the last level of shard directories, there are only more of them.
+    if ( (*table)->shard && depth < options.shard_levels )
+    {
+	if ( ( rv = dfuse_shard_child( *table, shard_key, shard_key_length, depth, name, key ) ) )
+	{
+	    return rv;
+	}
+
+	*shard = depth+1;
+	return DFUSE_PATH_SHARD;
+    }
+
+    if ( ( rv = dfuse_name_key( *table, name, key ) ) )
+    {
+	return rv;
+    }
+
+    // A row only shows up in its own shard directory.
+    if ( (*table)->shard && !dfuse_shard_holds( *table, shard_key, shard_key_length, depth, (*key)->string, (*key)->length ) )
+    {
+	DFUSE_FREE( (*key)->string );
+	DFUSE_FREE( *key );
+	return -ENOENT;
+    }
+
+    return DFUSE_PATH_ROW;
+}
+
+void dfuse_inodes_report( void )
+{
+    pthread_mutex_lock( &inodes.lock );
+
+    syslog( LOG_INFO, "dfuse inodes: %lu known, %llu forgotten", inodes.count, inodes.forgotten );
+
+    pthread_mutex_unlock( &inodes.lock );
+}
+
+/*
+ * Telling the kernel.  With a change feed (--binlog, --poll) following, the kernel gets to cache
+ * names and attributes for as long as we do (see dfuse_kernel_ttl), so every change
+ * dfuse_invalidate hears of has to reach it, too.  Doing that from inside a request can deadlock
+ * against whatever the kernel is holding while it waits for our reply, so notices are queued,
+ * and a thread of their own delivers them.  A whole table's worth (or everything's) is only
+ * marked, not queued: the thread sweeps the inode table for it once, however many times it was
+ * asked while it was busy, and not at all if the kernel's been given nothing with a long TTL
+ * since the last sweep, so a stream of statements in the binlog costs a flag each.
+ */
+struct dfuse_notice {
+    fuse_ino_t parent;
+    char *name;			// urlencoded, as the kernel knows it.
+    fuse_ino_t ino;		// 0 if the kernel has no inode for it, just (maybe) a negative entry.
+    struct dfuse_notice *next;
+};
+
+struct dfuse_notifier {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;	// There's a notice, or it's time to stop.
+    pthread_t thread;
+    int running;
+    int stopping;
+
+    struct dfuse_notice *head;
+    struct dfuse_notice **tail;
+
+    // Tables to sweep, by index (see dfuse_notifier_sweep), and whether there are any.
+    unsigned char *sweep;
+    unsigned char *sweeping;	// The sweep's own copy, so the flags can be set again meanwhile.
+    int sweep_pending;
+    unsigned char *granted;	// Tables dfuse_kernel_ttl has given a long TTL for since their last sweep.
+
+    unsigned long long entries;
+    unsigned long long inodes;
+    unsigned long long lost;
+} notifier = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+struct fuse_session *session = NULL;
+
+/*
+ * How long the kernel may trust what we tell it about a row of table or, if negative, about a
+ * row not existing.  While there's nothing to tell it otherwise, as long as the high-level API
+ * let it.  since is dfuse_invalidation_seq from before we looked (table NULL: nothing to check);
+ * if table's been invalidated since, the notice may beat our reply to the kernel, so that reply
+ * only gets the short TTL.
+ */
+static double dfuse_kernel_ttl( const struct dfuse_table *table, unsigned long long since, int negative )
+{
+    if ( notifier.running && dfuse_changes_following() )
+    {
+	// Before the check, so that an invalidation the check misses can't miss this.
+	if ( table && !negative )
+	{
+	    __sync_lock_test_and_set( &notifier.granted[table->index], 1 );
+	}
+
+	if ( !table || dfuse_invalidation_seq( table ) == since )
+	{
+	    return negative ? options.negative_ttl : options.attr_ttl;
+	}
+    }
+
+    return negative ? 0 : DFUSE_KERNEL_TTL_DEFAULT;
+}
+
+/*
+ * Queues a notice for table's key (or, if shard isn't 0, its shard directory at that depth, or
+ * if column isn't, that column's file) at *tail.  Caller holds inodes.lock, and notifier.lock if
+ * that's the notifier's queue.
+ *
+ * @returns 1 if the notice was lost, for the caller to count, or 0.
+ */
+static int dfuse_notice_add( const struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int shard,
+    unsigned int column, fuse_ino_t ino, struct dfuse_notice ***tail )
+{
+    struct dfuse_notice *n;
+    struct dfuse_inode *p = NULL;
+    fuse_ino_t parent = dfuse_table_dir( table );
+    unsigned int depth = shard ? shard-1 : options.shard_levels;
+    char *path;
+    unsigned long path_length;
+
+    // A column's file is in its row's directory, which the kernel has to have, too.
+    if ( column )
+    {
+	if ( !( p = dfuse_inode_by_key( table, key, key_length, 0, 0, dfuse_inode_hash( table, key, key_length, 0, 0 ) ) ) )
+	{
+	    return 0;
+	}
+
+	parent = p->ino;
+    }
+    // Under --shard, it's in a shard directory; if the kernel hasn't got that, it can't have this.
+    else if ( table->shard && depth )
+    {
+	if ( dfuse_shard_path( table, key, key_length, shard, depth, &path, &path_length ) )
+	{
+	    return 1;
+	}
+
+	p = dfuse_inode_by_key( table, path, path_length, depth, 0, dfuse_inode_hash( table, path, path_length, depth, 0 ) );
+	DFUSE_FREE( path );
+
+	if ( !p )
+	{
+	    return 0;
+	}
+
+	parent = p->ino;
+    }
+
+    if ( !( n = DFUSE_MALLOC( sizeof( struct dfuse_notice ) ) )
+      || !( n->name = column ? dfuse_asprintf( "%s", table->column_names[column-1] ) : dfuse_shard_name( table, key, key_length, shard ) ) )
+    {
+	// The kernel finds out when its TTL runs out instead.
+	if ( n ) { DFUSE_FREE( n ); }
+	return 1;
+    }
+
+    n->parent = parent;
+    n->ino = ino;
+    n->next = NULL;
+    **tail = n;
+    *tail = &n->next;
+
+    return 0;
+}
+
+/*
+ * Queues the kernel's copy of one row (table and key), or every row it knows of in table (no
+ * key), or in every table (no table either), for invalidation.  A negative entry for a row we
+ * never gave a number to only gets invalidated by key; otherwise it lasts its --negative-ttl.
+ */
+static void dfuse_notify( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    struct dfuse_inode *e, *file;
+    unsigned long path_length;
+    unsigned int depth, column;
+    char *path;
+
+    if ( !notifier.running )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &notifier.lock );
+
+    if ( !key )
+    {
+	if ( table )
+	{
+	    notifier.sweep[table->index] = 1;
+	}
+	else
+	{
+	    memset( notifier.sweep, 1, num_tables );
+	}
+
+	notifier.sweep_pending = 1;
+	pthread_cond_signal( &notifier.wake );
+	pthread_mutex_unlock( &notifier.lock );
+	return;
+    }
+
+    pthread_mutex_lock( &inodes.lock );
+
+    e = dfuse_inode_by_key( table, key, key_length, 0, 0, dfuse_inode_hash( table, key, key_length, 0, 0 ) );
+    notifier.lost += dfuse_notice_add( table, key, key_length, 0, 0, e ? e->ino : 0, &notifier.tail );
+
+    // With --column-files, what changed is in the files (which the kernel can only have under a
+    // directory it's got).
+    for ( column = 1; e && column <= table->num_columns; column++ )
+    {
+	file = dfuse_inode_by_key( table, key, key_length, 0, column, dfuse_inode_hash( table, key, key_length, 0, column ) );
+
+	if ( file )
+	{
+	    notifier.lost += dfuse_notice_add( table, key, key_length, 0, column, file->ino, &notifier.tail );
+	}
+    }
+
+    // A new row can make new --shard=prefix directories, which the kernel may have as missing.
+    for ( depth = 1; table->shard == DFUSE_SHARD_PREFIX && depth <= options.shard_levels; depth++ )
+    {
+	if ( !dfuse_shard_path( table, key, key_length, 0, depth, &path, &path_length ) )
+	{
+	    if ( !dfuse_inode_by_key( table, path, path_length, depth, 0, dfuse_inode_hash( table, path, path_length, depth, 0 ) ) )
+	    {
+		notifier.lost += dfuse_notice_add( table, path, path_length, depth, 0, 0, &notifier.tail );
+	    }
+	    DFUSE_FREE( path );
+	}
+    }
+
+    pthread_mutex_unlock( &inodes.lock );
+
+    pthread_cond_signal( &notifier.wake );
+
+    pthread_mutex_unlock( &notifier.lock );
+}
+
+/*
+ * Queues a notice for everything the kernel has of the tables marked for a sweep.  That's one
+ * walk of the inode table, under its lock but not the notifier's, so dfuse_notify can go on
+ * marking (and queueing single rows) meanwhile.  Caller holds notifier.lock.
+ */
+static void dfuse_notifier_sweep( void )
+{
+    struct dfuse_notice *head = NULL, **tail = &head;
+    struct dfuse_inode *e;
+    unsigned long long lost = 0;
+    unsigned long i;
+    int any = 0;
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	// What the kernel got before the last sweep, that sweep took care of.
+	notifier.sweeping[i] = notifier.sweep[i] && __sync_lock_test_and_set( &notifier.granted[i], 0 );
+	notifier.sweep[i] = 0;
+	any |= notifier.sweeping[i];
+    }
+
+    notifier.sweep_pending = 0;
+
+    if ( !any )
+    {
+	return;
+    }
+
+    pthread_mutex_unlock( &notifier.lock );
+
+    pthread_mutex_lock( &inodes.lock );
+
+    for ( i = 0; i < inodes.bucket_count; i++ )
+    {
+	for ( e = inodes.by_ino[i]; e; e = e->next_by_ino )
+	{
+	    if ( notifier.sweeping[e->table->index] )
+	    {
+		lost += dfuse_notice_add( e->table, e->key, e->key_length, e->shard, e->column, e->ino, &tail );
+	    }
+	}
+    }
+
+    pthread_mutex_unlock( &inodes.lock );
+
+    pthread_mutex_lock( &notifier.lock );
+
+    notifier.lost += lost;
+
+    if ( head )
+    {
+	*notifier.tail = head;
+	notifier.tail = tail;
+    }
+}
+
+static void *dfuse_notifier_run( void *unused )
+{
+    struct dfuse_notice *n;
+
+    pthread_mutex_lock( &notifier.lock );
+
+    for ( ;; )
+    {
+	while ( !notifier.head && !notifier.sweep_pending && !notifier.stopping )
+	{
+	    pthread_cond_wait( &notifier.wake, &notifier.lock );
+	}
+
+	if ( notifier.stopping )
+	{
+	    break;
+	}
+
+	if ( notifier.sweep_pending )
+	{
+	    dfuse_notifier_sweep();
+	    continue;
+	}
+
+	n = notifier.head;
+
+	if ( !( notifier.head = n->next ) )
+	{
+	    notifier.tail = &notifier.head;
+	}
+
+	pthread_mutex_unlock( &notifier.lock );
+
+	// Either may say -ENOENT, if the kernel's already let go of it, and that's fine.
+	if ( n->ino )
+	{
+	    fuse_lowlevel_notify_inval_inode( session, n->ino, 0, 0 );
+	}
+
+	fuse_lowlevel_notify_inval_entry( session, n->parent, n->name, strlen( n->name ) );
+
+	pthread_mutex_lock( &notifier.lock );
+
+	notifier.entries++;
+	if ( n->ino )
+	{
+	    notifier.inodes++;
+	}
+
+	DFUSE_FREE( n->name );
+	DFUSE_FREE( n );
+    }
+
+    pthread_mutex_unlock( &notifier.lock );
+
+    return NULL;
+}
+
+int dfuse_notifier_start( void )
+{
+    notifier.tail = &notifier.head;
+
+    if ( !( notifier.sweep = calloc( num_tables ? num_tables : 1, 1 ) )
+      || !( notifier.sweeping = calloc( num_tables ? num_tables : 1, 1 ) )
+      || !( notifier.granted = calloc( num_tables ? num_tables : 1, 1 ) )
+      || pthread_create( &notifier.thread, NULL, dfuse_notifier_run, NULL ) )
+    {
+	free( notifier.sweep );
+	free( notifier.sweeping );
+	free( notifier.granted );
+	notifier.sweep = notifier.sweeping = notifier.granted = NULL;
+	return -1;
+    }
+
+    notifier.running = 1;
+
+    return 0;
+}
+
+// Whatever's still queued isn't worth holding up an unmount for.
+void dfuse_notifier_stop( void )
+{
+    struct dfuse_notice *n;
+
+    if ( !notifier.running )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &notifier.lock );
+
+    while ( ( n = notifier.head ) )
+    {
+	notifier.head = n->next;
+	DFUSE_FREE( n->name );
+	DFUSE_FREE( n );
+    }
+    notifier.tail = &notifier.head;
+
+    notifier.stopping = 1;
+    pthread_cond_signal( &notifier.wake );
+    pthread_mutex_unlock( &notifier.lock );
+
+    pthread_join( notifier.thread, NULL );
+
+    free( notifier.sweep );
+    free( notifier.sweeping );
+    free( notifier.granted );
+    notifier.sweep = notifier.sweeping = notifier.granted = NULL;
+    notifier.sweep_pending = 0;
+
+    notifier.running = 0;
+}
+
+void dfuse_notifier_report( void )
+{
+    if ( !notifier.entries && !notifier.lost )
+    {
+	return;
+    }
+
+    syslog( LOG_INFO, "dfuse kernel notices: %llu entries and %llu inodes invalidated, %llu lost",
+	notifier.entries, notifier.inodes, notifier.lost );
+}
+
+/*
+ * What lets open() hand the kernel's page cache back to it (keep_cache) instead of making it throw
+ * every file away on every open.  Telling the kernel about a change (see dfuse_notify) only reaches
+ * what it's still got an inode for, and only while it's listening, so every file we open also gets
+ * a generation: a sequence number for its last open, and another for the last change to it we heard
+ * of (from --binlog, --poll or our own writes).  If nothing has changed since the last open, what
+ * the kernel cached then is still the row, and it can keep it.  Anything we can't vouch for (a file
+ * we've forgotten, a whole table changing, a change feed that's fallen behind) just means the
+ * kernel rereads.
+ */
+struct dfuse_gen_entry {
+    const struct dfuse_table *table;
+    char *key;
+    unsigned long key_length;
+    unsigned int column;	// --column-files: each column is a file of its own; see dfuse_attr_entry.
+    unsigned long long hash;
+    unsigned long long opened;	// generations.seq as of its last open().
+    unsigned long long changed;	// ... and as of the last change to it since we started tracking it.
+    struct dfuse_gen_entry *next;
+};
+
+struct dfuse_generations {
+    pthread_mutex_t lock;
+    struct dfuse_gen_entry **buckets;	// NULL unless there's a change feed to keep them honest.
+    unsigned long bucket_count;	// Always a power of two.
+    unsigned long count;
+    unsigned long long seq;
+    unsigned long long *table_changed;	// Per table: seq as of its last wholesale change.
+
+    unsigned long long kept;
+    unsigned long long dropped;
+    unsigned long long forgotten;
+} generations = { PTHREAD_MUTEX_INITIALIZER };
+
+// Most buckets we'll allocate; past this, chains just get longer.
+#define DFUSE_GENERATIONS_MAX_BUCKETS (1024*1024)
+
+int dfuse_generations_init( void )
+{
+    unsigned long bucket_count;
+
+    for ( bucket_count = DFUSE_ATTR_CACHE_MIN_BUCKETS;
+	bucket_count < options.attr_cache_max && bucket_count < DFUSE_GENERATIONS_MAX_BUCKETS; bucket_count *= 2 )
+    {
+    }
+
+    if ( !( generations.table_changed = calloc( num_tables, sizeof( unsigned long long ) ) )
+      || !( generations.buckets = calloc( bucket_count, sizeof( struct dfuse_gen_entry * ) ) ) )
+    {
+	free( generations.table_changed );
+	generations.table_changed = NULL;
+	return -1;
+    }
+
+    generations.bucket_count = bucket_count;
+
+    return 0;
+}
+
+// Caller holds generations.lock.  Forgetting every file only costs their next open a reread.
+static void dfuse_generations_clear( void )
+{
+    struct dfuse_gen_entry *e;
+    unsigned long i;
+
+    for ( i = 0; i < generations.bucket_count; i++ )
+    {
+	while ( ( e = generations.buckets[i] ) )
+	{
+	    generations.buckets[i] = e->next;
+	    DFUSE_FREE( e->key );
+	    DFUSE_FREE( e );
+	}
+    }
+
+    generations.forgotten += generations.count;
+    generations.count = 0;
+}
+
+/*
+ * Records an open() of table's key (or one of its columns), before the row is fetched, so that
+ * any change from here on counts against what it's about to read.
+ *
+ * @returns 1 if the kernel can keep what it cached for the file last time it was open.
+ */
+int dfuse_generation_open( const struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column )
+{
+    struct dfuse_gen_entry **ep, *e;
+    unsigned long long h;
+    int keep = 0;
+
+    if ( !generations.buckets )
+    {
+	return 0;
+    }
+
+    h = dfuse_attr_hash( table, key, key_length );
+
+    pthread_mutex_lock( &generations.lock );
+
+    for ( ep = &generations.buckets[h & (generations.bucket_count-1)]; ( e = *ep ); ep = &e->next )
+    {
+	if ( e->hash == h && e->table == table && e->column == column && e->key_length == key_length
+	  && !memcmp( e->key, key, key_length ) )
+	{
+	    break;
+	}
+    }
+
+    if ( e )
+    {
+	keep = dfuse_changes_following() && e->changed < e->opened && generations.table_changed[table->index] < e->opened;
+    }
+    else
+    {
+	if ( generations.count >= options.attr_cache_max )
+	{
+	    dfuse_generations_clear();
+	    ep = &generations.buckets[h & (generations.bucket_count-1)];
+	}
+
+	if ( ( e = DFUSE_MALLOC( sizeof( struct dfuse_gen_entry ) ) ) && !( e->key = DFUSE_MALLOC( key_length+1 ) ) )
+	{
+	    DFUSE_FREE( e );
+	    e = NULL;
+	}
+
+	if ( e )
+	{
+	    memcpy( e->key, key, key_length );
+	    e->key[key_length] = '\0';
+	    e->key_length = key_length;
+	    e->table = table;
+	    e->column = column;
+	    e->hash = h;
+	    e->changed = 0;
+	    e->next = *ep;
+	    *ep = e;
+	    generations.count++;
+	}
+    }
+
+    if ( e )
+    {
+	e->opened = ++generations.seq;
+    }
+
+    if ( keep )
+    {
+	generations.kept++;
+    }
+    else
+    {
+	generations.dropped++;
+    }
+
+    pthread_mutex_unlock( &generations.lock );
+
+    return keep;
+}
+
+static void dfuse_generation_change( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    struct dfuse_gen_entry *e;
+    unsigned long long h;
+    unsigned int i;
+
+    if ( !generations.buckets )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &generations.lock );
+
+    if ( key )
+    {
+	h = dfuse_attr_hash( table, key, key_length );
+
+	// A row's columns change with it.
+	for ( e = generations.buckets[h & (generations.bucket_count-1)]; e; e = e->next )
+	{
+	    if ( e->hash == h && e->table == table && e->key_length == key_length && !memcmp( e->key, key, key_length ) )
+	    {
+		e->changed = ++generations.seq;
+	    }
+	}
+    }
+    else if ( table )
+    {
+	generations.table_changed[table->index] = ++generations.seq;
+    }
+    else
+    {
+	++generations.seq;
+
+	for ( i = 0; i < num_tables; i++ )
+	{
+	    generations.table_changed[i] = generations.seq;
+	}
+    }
+
+    pthread_mutex_unlock( &generations.lock );
+}
+
+/*
+ * Somebody changed one row (table and key), all of table (no key), or everything (no table
+ * either): forget its attributes, and make sure the kernel rereads it on its next open.
+ */
+void dfuse_invalidate( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    if ( key )
+    {
+	dfuse_attr_cache_invalidate( table, key, key_length );
+    }
+    else
+    {
+	dfuse_attr_cache_invalidate_table( table );
+    }
+
+    dfuse_generation_change( table, key, key_length );
+    dfuse_notify( table, key, key_length );
+    dfuse_mirror_mark( table, key, key_length );
+}
+
+void dfuse_generations_report( void )
+{
+    if ( !generations.buckets )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &generations.lock );
+
+    syslog( LOG_INFO, "dfuse page cache: %llu opens kept it, %llu dropped it; %lu files tracked, %llu forgotten",
+	generations.kept, generations.dropped, generations.count, generations.forgotten );
+
+    pthread_mutex_unlock( &generations.lock );
+}
+
+/*
+ * truncate() by name, rather than on a handle.  That's how O_TRUNC reaches us (the kernel
+ * truncates, then opens), and an empty --json file isn't a row we could write back, so instead
+ * we remember the new size, getattr reports it, and the next open() for writing starts from
+ * it.  Left unclaimed, it's forgotten after DFUSE_TRUNCATE_PENDING_SECONDS.
+ */
+struct dfuse_pending_truncate {
+    struct dfuse_table *table;
+    char *key;
+    unsigned long key_length;
+    unsigned int column;	// --column-files: which of the row's files, plus one.
+    off_t size;
+    time_t expires;
+    struct dfuse_pending_truncate *next;
+};
+
+struct dfuse_pending_truncate *pending_truncates = NULL;
+pthread_mutex_t pending_truncates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller holds pending_truncates_lock.  Finds table's key (and column), dropping expired entries.
+static struct dfuse_pending_truncate **dfuse_pending_truncate_find( struct dfuse_table *table, const char *key, unsigned long key_length,
+    unsigned int column )
+{
+    struct dfuse_pending_truncate **pp, *p;
+    time_t now = time(NULL);
+
+    for ( pp = &pending_truncates; ( p = *pp ); )
+    {
+	if ( p->expires <= now )
+	{
+	    *pp = p->next;
+	    DFUSE_FREE( p->key );
+	    DFUSE_FREE( p );
+	    continue;
+	}
+
+	if ( p->table == table && p->column == column && p->key_length == key_length && !memcmp( p->key, key, key_length ) )
+	{
+	    return pp;
+	}
+
+	pp = &p->next;
+    }
+
+    return NULL;
+}
+
+int dfuse_pending_truncate_add( struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column, off_t size )
+{
+    struct dfuse_pending_truncate **pp, *p;
+
+    pthread_mutex_lock( &pending_truncates_lock );
+
+    if ( ( pp = dfuse_pending_truncate_find( table, key, key_length, column ) ) )
+    {
+	p = *pp;
+    }
+    else
+    {
+	if ( !( p = DFUSE_MALLOC( sizeof( struct dfuse_pending_truncate ) ) ) || !( p->key = DFUSE_MALLOC( key_length+1 ) ) )
+	{
+	    if ( p ) { DFUSE_FREE( p ); }
+	    pthread_mutex_unlock( &pending_truncates_lock );
+	    return -ENOMEM;
+	}
+
+	memcpy( p->key, key, key_length );
+	p->key[key_length] = '\0';
+	p->key_length = key_length;
+	p->table = table;
+	p->column = column;
+	p->next = pending_truncates;
+	pending_truncates = p;
+    }
+
+    p->size = size;
+    p->expires = time(NULL) + DFUSE_TRUNCATE_PENDING_SECONDS;
+
+    pthread_mutex_unlock( &pending_truncates_lock );
+
+    return 0;
+}
+
+/*
+ * Looks for a pending truncate of table's key (or column); if there is one, *size gets its size,
+ * and if take is set, it's consumed.
+ *
+ * @returns 1 if there was one, 0 if not.
+ */
+int dfuse_pending_truncate_get( struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column,
+    off_t *size, int take )
+{
+    struct dfuse_pending_truncate **pp, *p;
+
+    pthread_mutex_lock( &pending_truncates_lock );
+
+    if ( !( pp = dfuse_pending_truncate_find( table, key, key_length, column ) ) )
+    {
+	pthread_mutex_unlock( &pending_truncates_lock );
+	return 0;
+    }
+
+    p = *pp;
+    *size = p->size;
+
+    if ( take )
+    {
+	*pp = p->next;
+	DFUSE_FREE( p->key );
+	DFUSE_FREE( p );
+    }
+
+    pthread_mutex_unlock( &pending_truncates_lock );
+
+    return 1;
+}
+
+/*
+ * Builds the struct stat for a row, given what getattr or readdir fetched for it: whether the
+ * column was NULL (raw mode only), the file's size, and the -T timestamp, if any.  Both callers
+ * go through here so that a listing and a later stat() can never disagree.
+ */
+void dfuse_fill_stat( struct stat *stbuf, int is_null, unsigned long long size, const char *timestamp )
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_nlink = 1;
+
+    if ( is_null ) //This will happen if table[prikey].column is NULL
+    {
+	// TAG: NULL_HANDLING
+	stbuf->st_size = strlen("/dev/null")-1;
+
+	if ( stbuf->st_mode & S_IFREG )
+	{
+	    // I recognize that there are cheaper ways to do this, but I didn't want
+	    // to have to have a 0xfffffffff or whatever, just in case someone has a
+	    // freaky set of st_mode flags.
+	    stbuf->st_mode -= S_IFREG;
+	}
+	stbuf->st_mode |= S_IFLNK;
+//	DFRV(-ENOENT); //This creates an unambiguous representation of NULL (vs "")
+//	stbuf->st_size = 0;
+    }
+    else
+    {
+	stbuf->st_size = size;
+    }
+
+    if ( !json && timestamp )
+    {
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = strtoll(timestamp, NULL, 10);
+    }
+
+    // TODO: properly support timestamp in json mode
+    if ( json && options.timestamp )
+    {
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    }
+}
+
+static void dfuse_stat_dir( fuse_ino_t ino, struct stat *stbuf )
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+}
+
+// --column-files: a row is a directory, so all there is to know about one is whether it's there.
+static int dfuse_stat_row_dir( struct dfuse_table *table, const char *key, unsigned long key_length, struct stat *stbuf )
+{
+    MYSQL_STMT *stmt;
+    unsigned long long since;
+    int rv;
+
+    switch ( dfuse_attr_cache_get( table, key, key_length, 0, stbuf ) )
+    {
+	case DFUSE_CACHE_HIT:
+	    DFRV(0);
+	case DFUSE_CACHE_NEGATIVE:
+	    DFRV(-ENOENT);
+	default:
+	    break;
+    }
+
+    if ( !dfuse_connect( NULL, NULL, NULL, NULL ) )
+    {
+	DFRV(-EIO);
+    }
+
+    // Connecting may have begun a --snapshot view, which invalidates everything from before it.
+    since = dfuse_invalidation_seq( table );
+
+    if ( ( rv = dfuse_stmt_execute( table, DFUSE_STMT_EXISTS, key, key_length, NULL, 0, &stmt ) ) )
+    {
+	DFRV(rv);
+    }
+
+    rv = mysql_stmt_num_rows( stmt ) ? 0 : -ENOENT;
+
+    mysql_stmt_free_result( stmt );
+
+    if ( rv )
+    {
+	dfuse_attr_cache_put( table, key, key_length, 0, NULL, since );
+	DFRV(rv);
+    }
+
+    dfuse_stat_dir( 0, stbuf );
+    dfuse_attr_cache_put( table, key, key_length, 0, stbuf, since );
+
+    DFRV(0);
+}
+
+// Stats table's (decoded) key, or with --column-files one of its columns; st_ino is the caller's.
+static int dfuse_stat_row( struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column,
+    struct stat *stbuf )
+{
+    MYSQL *sql;
+    MYSQL_STMT *stmt;
+    struct dfuse_stmt_row row;
+    int rv;
+    struct dfuse_schema *schema = NULL;
+    off_t truncated_size;
+    unsigned long jsonified_length;
+    unsigned long long since;
+    char *jsonified;
+
+    if ( options.column_files && !column )
+    {
+	return dfuse_stat_row_dir( table, key, key_length, stbuf );
+    }
+
+    // A write that's still queued would leave us describing the row as it was.
+    dfuse_write_back_settle( table, key, key_length );
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_nlink = 1;
+
+    // Answer from the attribute cache if we can; that's zero round trips.
+    switch ( dfuse_attr_cache_get( table, key, key_length, column, stbuf ) )
+    {
+	case DFUSE_CACHE_HIT:
+	    if ( dfuse_pending_truncate_get( table, key, key_length, column, &truncated_size, 0 ) )
+	    {
+		stbuf->st_size = truncated_size;
+	    }
+	    DFRV(0);
+	case DFUSE_CACHE_NEGATIVE:
+	    DFRV(-ENOENT);
+	default:
+	    break;
+    }
+
+    // Or from --mirror; that's zero round trips too, and it doesn't expire.
+    switch ( dfuse_mirror_stat( table, key, key_length, stbuf ) )
+    {
+	case DFUSE_CACHE_HIT:
+	    if ( dfuse_pending_truncate_get( table, key, key_length, column, &truncated_size, 0 ) )
+	    {
+		stbuf->st_size = truncated_size;
+	    }
+	    DFRV(0);
+	case DFUSE_CACHE_NEGATIVE:
+	    DFRV(-ENOENT);
+	default:
+	    break;
+    }
+
+    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	DFRV(-EIO);
+    }
+
+    // Connecting may have begun a --snapshot view, which invalidates everything from before it.
+    since = dfuse_invalidation_seq( table );
+
+    /*
+     * Have the server measure the row instead of shipping it to us: in --json mode the answer
+     * is a few bytes even when the row holds a 10MB blob.  If it can't (some column is an
+     * expression), we fall back to fetching and rendering the row, and measuring that.  A
+     * --column-files column is always measured for us, and only that column gets read.
+     */
+    if ( column )
+    {
+	rv = dfuse_stmt_execute( table, DFUSE_STMT_COLUMN( column, DFUSE_STMT_STAT ), key, key_length, NULL, 0, &stmt );
+    }
+    else if ( dfuse_stmt_with_stat( sql, table ) )
+    {
+	schema = json ? dfuse_json_schema( sql, table ) : NULL;
+	rv = dfuse_stmt_execute( table, DFUSE_STMT_STAT, key, key_length, NULL, 0, &stmt );
+    }
+    else
+    {
+	rv = dfuse_stmt_execute( table, DFUSE_STMT_ROW, key, key_length, NULL, 0, &stmt );
+    }
+
+    if ( rv )
+    {
+	DFRV(rv);
+    }
+
+    if ( mysql_stmt_num_rows( stmt ) > 1 )
+    {
+	mysql_stmt_free_result( stmt );
+	DFRV(-EIO);
+    }
+
+    memset( &row, 0, sizeof( row ) );
+
+    if ( ( rv = dfuse_stmt_fetch_row( stmt, &row ) ) <= 0 )
+    {
+	mysql_stmt_free_result( stmt );
+	dfuse_stmt_row_free( &row );
+
+	if ( rv == 0 )
+	{
+	    dfuse_attr_cache_put( table, key, key_length, column, NULL, since );
+	}
+
+	DFRV(rv ? rv : -ENOENT);
+    }
+
+    mysql_stmt_free_result( stmt );
+
+//    fprintf( debug_fd(), "st_size: %d\n", atoi(row.values[0]) );
+
+    if ( schema )
+    {
+	// Same arithmetic as readdir: the framing and names are ours, the values the server's.
+	dfuse_fill_stat( stbuf, 0, schema->fixed_length + htmlencoded_length( key, key_length )
+	    + ( row.values[0] ? strtoull( row.values[0], NULL, 10 ) : 0 ), NULL );
+    }
+    else if ( json )
+    {
+	if ( !( schema = dfuse_json_schema( sql, table ) ) || schema->num_fields != row.num_fields )
+	{
+	    dfuse_stmt_row_free( &row );
+	    DFRV(-EIO);
+	}
+
+	//Blatant opportunity for caching/optimization.
+	if ( !( jsonified = dfuse_render_json( schema, row.values, row.lengths, key, key_length, &jsonified_length ) ) )
+	{
+	    dfuse_stmt_row_free( &row );
+	    DFRV(-ENOMEM); //Hard to know for sure, but a likely cause, at least.
+	}
+
+	D("Got a jsonified string: '%s'.\n", jsonified);
+
+	dfuse_fill_stat( stbuf, 0, jsonified_length, NULL );
+
+	D("It's %ld long.\n", stbuf->st_size);
+
+	DFUSE_FREE( jsonified );
+    }
+    else
+    {
+	dfuse_fill_stat( stbuf, row.values[0] == NULL, row.values[0] ? strtoull(row.values[0], NULL, 10) : 0,
+	    options.timestamp ? row.values[1] : NULL );
+    }
+
+    dfuse_attr_cache_put( table, key, key_length, column, stbuf, since );
+
+    // A truncate() that's waiting for its open() (see dfuse_truncate) has, as far as anybody
+    // else is concerned, already happened.
+    if ( dfuse_pending_truncate_get( table, key, key_length, column, &truncated_size, 0 ) )
+    {
+	stbuf->st_size = truncated_size;
+    }
+
+    dfuse_stmt_row_free( &row );
+
+    DFRV(0);
+}
+
+static __thread unsigned short int thread_reader = 0;
+
+/*
+ * Brackets an operation that only reads, which --snapshot serves from its read view (see
+ * dfuse_connect).  Ending one checks in whatever it still holds, so a reader that returned
+ * without a DFRV() can't leave the view locked.
+ */
+static void dfuse_reader_begin( void )
+{
+    thread_reader = 1;
+}
+
+static void dfuse_reader_end( void )
+{
+    dfuse_checkin();
+    thread_reader = 0;
+}
+
+/*
+ * Looks name up in parent and fills in e for the kernel, taking a lookup on the row's (or shard
+ * directory's, or column's) inode.  With a negative TTL to give, a missing row is an entry too
+ * (e->ino is 0), and we return 0.
+ */
+static int dfuse_lookup_entry( fuse_ino_t parent, const char *name, struct fuse_entry_param *e )
+{
+    struct dfuse_table *table;
+    struct string_length *key;
+    unsigned int shard, column;
+    unsigned long long since;
+    int rv;
+
+    memset( e, 0, sizeof( struct fuse_entry_param ) );
+
+    rv = dfuse_resolve_name( parent, name, &table, &key, &shard, &column );
+
+    if ( rv == DFUSE_PATH_TABLE )
+    {
+	e->ino = DFUSE_TABLE_INO(table->index);
+	e->attr_timeout = e->entry_timeout = DFUSE_KERNEL_DIR_TTL;
+	dfuse_stat_dir( e->ino, &e->attr );
+	return 0;
+    }
+
+    if ( rv < 0 )
+    {
+	return rv;
+    }
+
+    since = dfuse_invalidation_seq( table );
+
+    if ( rv == DFUSE_PATH_SHARD )
+    {
+	if ( !( rv = dfuse_shard_exists( table, key->string, key->length, shard ) ) )
+	{
+	    dfuse_stat_dir( 0, &e->attr );
+	}
+    }
+    else
+    {
+	rv = dfuse_stat_row( table, key->string, key->length, column, &e->attr );
+    }
+
+    if ( !rv && !( e->ino = dfuse_inode_ref( table, key->string, key->length, shard, column ) ) )
+    {
+	rv = -ENOMEM;
+    }
+
+    DFUSE_FREE( key->string );
+    DFUSE_FREE( key );
+
+    if ( rv == -ENOENT && ( e->entry_timeout = dfuse_kernel_ttl( table, since, 1 ) ) > 0 )
+    {
+	memset( &e->attr, 0, sizeof( struct stat ) );
+	return 0;
+    }
+
+    if ( rv )
+    {
+	return rv;
+    }
+
+    e->attr.st_ino = e->ino;
+    e->attr_timeout = e->entry_timeout = dfuse_kernel_ttl( table, since, 0 );
+
+    return 0;
+}
+
+static void dfuse_lookup( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+    struct fuse_entry_param e;
+    int rv;
+
+    dfuse_reader_begin();
+    rv = dfuse_lookup_entry( parent, name, &e );
+    dfuse_reader_end();
+
+    if ( rv )
+    {
+	fuse_reply_err( req, -rv );
+	return;
+    }
+
+    fuse_reply_entry( req, &e );
+}
+
+static void dfuse_forget( fuse_req_t req, fuse_ino_t ino, uint64_t nlookup )
+{
+    dfuse_inode_forget( ino, nlookup );
+    fuse_reply_none( req );
+}
+
+static void dfuse_forget_multi( fuse_req_t req, size_t count, struct fuse_forget_data *forgets )
+{
+    size_t i;
+
+    for ( i = 0; i < count; i++ )
+    {
+	dfuse_inode_forget( forgets[i].ino, forgets[i].nlookup );
+    }
+
+    fuse_reply_none( req );
+}
+
+// Stats ino, and sets *ttl to how long the kernel may keep the answer.
+static int dfuse_getattr_ino( fuse_ino_t ino, struct stat *stbuf, struct fuse_file_info *fi, double *ttl )
+{
+    struct dfuse_handle *fh = fi ? (struct dfuse_handle *)(uintptr_t)fi->fh : NULL;
+    struct dfuse_table *table;
+    struct dfuse_inode *inode;
+    unsigned long long since;
+    int rv;
+
+    rv = dfuse_resolve_ino( ino, &table, &inode );
+
+    if ( rv == DFUSE_PATH_ROOT || rv == DFUSE_PATH_TABLE || rv == DFUSE_PATH_SHARD )
+    {
+	dfuse_stat_dir( ino, stbuf );
+	*ttl = DFUSE_KERNEL_DIR_TTL;
+	return 0;
+    }
+
+    if ( rv < 0 )
+    {
+	return rv;
+    }
+
+    since = dfuse_invalidation_seq( table );
+
+    if ( ( rv = dfuse_stat_row( table, inode->key, inode->key_length, inode->column, stbuf ) ) )
+    {
+	return rv;
+    }
+
+    stbuf->st_ino = ino;
+    *ttl = S_ISDIR(stbuf->st_mode) ? DFUSE_KERNEL_DIR_TTL : dfuse_kernel_ttl( table, since, 0 );
+
+    if ( !fh )
+    {
+	return 0;
+    }
+
+    // Written but not yet written back: the handle knows better than the database.
+    pthread_mutex_lock( &fh->lock );
+    if ( fh->dirty )
+    {
+	stbuf->st_size = fh->length;
+    }
+    pthread_mutex_unlock( &fh->lock );
+
+    return 0;
+}
+
+static void dfuse_getattr( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    struct stat stbuf;
+    double ttl;
+    int rv;
+
+    dfuse_reader_begin();
+    rv = dfuse_getattr_ino( ino, &stbuf, fi, &ttl );
+    dfuse_reader_end();
+
+    if ( rv )
+    {
+	fuse_reply_err( req, -rv );
+	return;
+    }
+
+    fuse_reply_attr( req, &stbuf, ttl );
+}
+
+/*
+ * The connection pool.  A FUSE worker thread checks a connection out the first time it calls
+ * dfuse_connect() during an operation and keeps it for the rest of that operation; DFRV()
+ * checks it back in on the way out.  No two threads ever share a MYSQL*, so we're safe under
+ * libfuse's (default) multithreaded loop, and concurrent stat()s and read()s each get their own
+ * round trip instead of queueing up behind one connection.
+ */
+struct dfuse_conn {
+    MYSQL *sql;
+    MYSQL_STMT **stmts;		// num_stmts of them, prepared on first use; see dfuse_stmt().
+    int broken;			// The server went away mid-operation; don't put us back in the pool.
+    time_t last_used;
+    struct dfuse_conn *next;	// Only meaningful while the connection is sitting idle in the pool.
+};
+
+struct dfuse_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    struct dfuse_conn *idle;
+    unsigned int idle_count;
+    unsigned int open;		// idle + checked out (+ being connected)
+    unsigned int waiting;
+
+    // Everything below is bookkeeping, for dfuse_pool_report().
+    unsigned long long checkouts;
+    unsigned long long connects;
+    unsigned long long connect_failures;
+    unsigned long long pings;
+    unsigned long long waits;
+    unsigned long long wait_usec;
+    unsigned long long timeouts;
+    unsigned int peak_open;
+    unsigned int peak_waiting;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static __thread struct dfuse_conn *thread_conn = NULL;
+static __thread unsigned short int thread_in_view = 0;	// thread_conn is the read view's.
+static pthread_key_t thread_end_key;
+static pthread_once_t thread_end_once = PTHREAD_ONCE_INIT;
+
+static void dfuse_thread_end( void *unused )
+{
+    mysql_thread_end();
+}
+
+static void dfuse_thread_end_init( void )
+{
+    pthread_key_create( &thread_end_key, dfuse_thread_end );
+}
+
+/*
+ * libmysqlclient wants mysql_thread_init()/mysql_thread_end() bracketing every thread that
+ * touches it.  FUSE owns our threads, so we hang the _end() off a thread-specific key.
+ */
+static void dfuse_thread_init( void )
+{
+    pthread_once( &thread_end_once, dfuse_thread_end_init );
+
+    if ( !pthread_getspecific( thread_end_key ) )
+    {
+	mysql_thread_init();
+	pthread_setspecific( thread_end_key, (void *)1 );
+    }
+}
+
+// Opens a brand-new connection for the pool.  Called without the pool lock held.
+static MYSQL *dfuse_pool_real_connect( void )
+{
+    MYSQL *sql;
+
+    if ( !( sql = mysql_init( NULL ) ) )
+    {
+	return NULL;
+    }
+
+    if ( !mysql_real_connect( sql, MYSQLSERVER, MYSQLUSER, MYSQLPASS, MYSQLDB, 0, NULL, 0 ) )
+    {
+	D( "Pool failed to connect: '%s'.\n", mysql_error( sql ) );
+	mysql_close( sql );
+	return NULL;
+    }
+
+    return sql;
+}
+
+static struct dfuse_conn *dfuse_pool_new_conn( void )
+{
+    struct dfuse_conn *conn;
+
+    if ( !( conn = DFUSE_MALLOC( sizeof( struct dfuse_conn ) ) ) )
+    {
+	return NULL;
+    }
+
+    if ( !( conn->sql = dfuse_pool_real_connect() ) )
+    {
+	DFUSE_FREE( conn );
+	return NULL;
+    }
+
+    conn->stmts = NULL;
+    conn->broken = 0;
+    conn->last_used = time(NULL);
+    conn->next = NULL;
+
+    return conn;
+}
+
+// Statements belong to the MYSQL* they were prepared on, so they go when it does.
+static void dfuse_conn_close_stmts( struct dfuse_conn *conn )
+{
+    unsigned int i;
+
+    if ( !conn->stmts )
+    {
+	return;
+    }
+
+    for ( i = 0; i < num_stmts; i++ )
+    {
+	if ( conn->stmts[i] )
+	{
+	    mysql_stmt_close( conn->stmts[i] );
+	    conn->stmts[i] = NULL;
+	}
+    }
+}
+
+static void dfuse_pool_free_conn( struct dfuse_conn *conn )
+{
+    if ( !conn )
+    {
+	return;
+    }
+
+    dfuse_conn_close_stmts( conn );
+
+    if ( conn->stmts ) { DFUSE_FREE( conn->stmts ); }
+    if ( conn->sql ) { mysql_close( conn->sql ); }
+
+    DFUSE_FREE( conn );
+}
+
+/*
+ * Hands out an idle connection if there is one, opens a new one if we're under --pool-max, and
+ * otherwise waits (up to DFUSE_POOL_WAIT_SECONDS) for somebody to check one back in.
+ */
+struct dfuse_conn *dfuse_pool_checkout( void )
+{
+    struct dfuse_conn *conn = NULL;
+    struct timeval now, started;
+    struct timespec deadline;
+    int waited = 0;
+
+    dfuse_thread_init();
+
+    pthread_mutex_lock( &pool.lock );
+
+    pool.checkouts++;
+
+    while ( !pool.idle && pool.open >= options.pool_max )
+    {
+	if ( !waited )
+	{
+	    gettimeofday( &started, NULL );
+	    deadline.tv_sec = started.tv_sec + DFUSE_POOL_WAIT_SECONDS;
+	    deadline.tv_nsec = started.tv_usec * 1000;
+	    pool.waits++;
+	    waited = 1;
+	}
+
+	pool.waiting++;
+	if ( pool.waiting > pool.peak_waiting )
+	{
+	    pool.peak_waiting = pool.waiting;
+	}
+
+	if ( pthread_cond_timedwait( &pool.available, &pool.lock, &deadline ) == ETIMEDOUT
+	  && !pool.idle && pool.open >= options.pool_max )
+	{
+	    pool.waiting--;
+	    pool.timeouts++;
+	    pthread_mutex_unlock( &pool.lock );
+	    D( "Gave up waiting for a connection after %d seconds.\n", DFUSE_POOL_WAIT_SECONDS );
+	    return NULL;
+	}
+
+	pool.waiting--;
+    }
+
+    if ( waited )
+    {
+	gettimeofday( &now, NULL );
+	pool.wait_usec += ( now.tv_sec - started.tv_sec ) * 1000000ULL + now.tv_usec - started.tv_usec;
+    }
+
+    if ( pool.idle )
+    {
+	conn = pool.idle;
+	pool.idle = conn->next;
+	pool.idle_count--;
+	conn->next = NULL;
+    }
+    else
+    {
+	// Reserve the slot now, so nobody else overshoots --pool-max while we're connecting.
+	pool.open++;
+	if ( pool.open > pool.peak_open )
+	{
+	    pool.peak_open = pool.open;
+	}
+    }
+
+    pthread_mutex_unlock( &pool.lock );
+
+    if ( !conn )
+    {
+	if ( !( conn = dfuse_pool_new_conn() ) )
+	{
+	    pthread_mutex_lock( &pool.lock );
+	    pool.open--;
+	    pool.connect_failures++;
+	    pthread_cond_signal( &pool.available );
+	    pthread_mutex_unlock( &pool.lock );
+	    return NULL;
+	}
+
+	__sync_fetch_and_add( &pool.connects, 1 );
+
+	return conn;
+    }
+
+    // A connection that's been sitting around may have been reaped by wait_timeout.
+    if ( time(NULL) - conn->last_used >= DFUSE_POOL_PING_AFTER )
+    {
+	__sync_fetch_and_add( &pool.pings, 1 );
+
+	if ( mysql_ping( conn->sql ) ) //0 = connection is up, so nonzero means it's gone
+	{
+	    dfuse_conn_close_stmts( conn );
+	    mysql_close( conn->sql );
+
+	    if ( !( conn->sql = dfuse_pool_real_connect() ) )
+	    {
+		if ( conn->stmts ) { DFUSE_FREE( conn->stmts ); }
+		DFUSE_FREE( conn );
+		pthread_mutex_lock( &pool.lock );
+		pool.open--;
+		pool.connect_failures++;
+		pthread_cond_signal( &pool.available );
+		pthread_mutex_unlock( &pool.lock );
+		return NULL;
+	    }
+
+	    __sync_fetch_and_add( &pool.connects, 1 );
+	}
+    }
+
+    return conn;
+}
+
+void dfuse_pool_checkin_conn( struct dfuse_conn *conn )
+{
+    if ( !conn )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &pool.lock );
+
+    // --lazy-connect means exactly what it always has: we disconnect as soon as we're done.
+    if ( lazy_conn || conn->broken )
+    {
+	pool.open--;
+	pthread_cond_signal( &pool.available );
+	pthread_mutex_unlock( &pool.lock );
+	dfuse_pool_free_conn( conn );
+	return;
+    }
+
+    conn->last_used = time(NULL);
+    conn->next = pool.idle;
+    pool.idle = conn;
+    pool.idle_count++;
+
+    pthread_cond_signal( &pool.available );
+    pthread_mutex_unlock( &pool.lock );
+}
+
+/*
+ * --snapshot=S: reads (lookups, getattrs, listings, and opening and reading files read-only)
+ * all go through one connection that's run START TRANSACTION WITH CONSISTENT SNAPSHOT, for up
+ * to S seconds after the first of them, or until /.dfuse/snapshot is touched; the next read
+ * after that starts a new view.  A tar or a git add -A of the mount then sees the database as
+ * of one moment, rather than one autocommit SELECT at a time, and skips the checkout per
+ * operation.  The price: those reads take turns on the one connection, the server keeps undo
+ * around for as long as the view lasts, and a file written during a view reads as it was when
+ * the view began.  Writes and the change feeds go through the pool as always.
+ */
+struct dfuse_read_view {
+    pthread_mutex_t lock;	// Held to start or end a view, and by whichever thread is using it.
+    pthread_mutex_t reaper_lock;
+    pthread_cond_t wake;	// It's time to stop.
+    pthread_t thread;
+    int running;
+    int stopping;
+
+    struct dfuse_conn *conn;	// The view, if there is one.  Not in the pool, nor counted in it.
+    time_t started;
+
+    unsigned long long views;
+    unsigned long long operations;
+    unsigned long long expired;
+    unsigned long long released;
+    unsigned long long failures;
+} read_view = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// Caller holds read_view.lock.
+static void dfuse_read_view_end( void )
+{
+    if ( !read_view.conn )
+    {
+	return;
+    }
+
+    // There's nothing to commit; it just lets go of the view sooner than closing would.
+    if ( !read_view.conn->broken && dfuse_query( read_view.conn->sql, "COMMIT" ) )
+    {
+	D( "Couldn't end the read view: '%s'.\n", mysql_error( read_view.conn->sql ) );
+    }
+
+    dfuse_pool_free_conn( read_view.conn );
+    read_view.conn = NULL;
+
+    // Anything cached during the view is as old as the view.
+    dfuse_invalidate( NULL, NULL, 0 );
+}
+
+// Caller holds read_view.lock.
+static int dfuse_read_view_begin( void )
+{
+    struct dfuse_conn *conn;
+
+    if ( !( conn = dfuse_pool_new_conn() ) )
+    {
+	read_view.failures++;
+	return -1;
+    }
+
+    // WITH CONSISTENT SNAPSHOT means nothing below REPEATABLE READ, whatever the server's default.
+    if ( dfuse_query( conn->sql, "SET SESSION TRANSACTION ISOLATION LEVEL REPEATABLE READ" )
+      || dfuse_query( conn->sql, "START TRANSACTION WITH CONSISTENT SNAPSHOT, READ ONLY" ) )
+    {
+	D( "Couldn't start a read view: '%s'.\n", mysql_error( conn->sql ) );
+	dfuse_pool_free_conn( conn );
+	read_view.failures++;
+	return -1;
+    }
+
+    read_view.conn = conn;
+    read_view.started = time(NULL);
+    read_view.views++;
+
+    // Nor may anything cached before it began agree with it.
+    dfuse_invalidate( NULL, NULL, 0 );
+
+    return 0;
+}
+
+// Caller holds read_view.lock.
+static void dfuse_read_view_expire( void )
+{
+    if ( read_view.conn && time(NULL) - read_view.started >= options.snapshot )
+    {
+	read_view.expired++;
+	dfuse_read_view_end();
+    }
+}
+
+/*
+ * Hands the calling thread the read view's connection, starting a view if there isn't one (or
+ * the one there is has had its time), and keeps every other reader off it until
+ * dfuse_read_view_leave().
+ *
+ * @returns NULL if we couldn't start one, in which case the caller goes to the pool instead.
+ */
+static struct dfuse_conn *dfuse_read_view_enter( void )
+{
+    dfuse_thread_init();
+
+    pthread_mutex_lock( &read_view.lock );
+
+    dfuse_read_view_expire();
+
+    if ( !read_view.conn && dfuse_read_view_begin() )
+    {
+	pthread_mutex_unlock( &read_view.lock );
+	return NULL;
+    }
+
+    read_view.operations++;
+
+    return read_view.conn;
+}
+
+static void dfuse_read_view_leave( void )
+{
+    // The server went away mid-operation; the next reader gets a new view on a new connection.
+    if ( read_view.conn->broken )
+    {
+	dfuse_read_view_end();
+    }
+
+    pthread_mutex_unlock( &read_view.lock );
+}
+
+// Touching /.dfuse/snapshot: end the view now, so the next read starts one as of then.
+void dfuse_read_view_release( void )
+{
+    pthread_mutex_lock( &read_view.lock );
+
+    if ( read_view.conn )
+    {
+	read_view.released++;
+	dfuse_read_view_end();
+    }
+
+    pthread_mutex_unlock( &read_view.lock );
+}
+
+// Ends a view whose time is up even if nobody reads again, so the server isn't left holding it.
+static void *dfuse_read_view_run( void *unused )
+{
+    struct timeval now;
+    struct timespec deadline;
+
+    dfuse_thread_init();
+
+    pthread_mutex_lock( &read_view.reaper_lock );
+
+    while ( !read_view.stopping )
+    {
+	pthread_mutex_unlock( &read_view.reaper_lock );
+
+	pthread_mutex_lock( &read_view.lock );
+	dfuse_read_view_expire();
+	pthread_mutex_unlock( &read_view.lock );
+
+	gettimeofday( &now, NULL );
+	deadline.tv_sec = now.tv_sec + DFUSE_SNAPSHOT_REAP_SECONDS;
+	deadline.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock( &read_view.reaper_lock );
+
+	while ( !read_view.stopping )
+	{
+	    if ( pthread_cond_timedwait( &read_view.wake, &read_view.reaper_lock, &deadline ) == ETIMEDOUT )
+	    {
+		break;
+	    }
+	}
+    }
+
+    pthread_mutex_unlock( &read_view.reaper_lock );
+
+    return NULL;
+}
+
+int dfuse_read_view_start( void )
+{
+    if ( pthread_create( &read_view.thread, NULL, dfuse_read_view_run, NULL ) )
+    {
+	return -1;
+    }
+
+    read_view.running = 1;
+
+    return 0;
+}
+
+void dfuse_read_view_stop( void )
+{
+    if ( read_view.running )
+    {
+	pthread_mutex_lock( &read_view.reaper_lock );
+	read_view.stopping = 1;
+	pthread_cond_signal( &read_view.wake );
+	pthread_mutex_unlock( &read_view.reaper_lock );
+
+	pthread_join( read_view.thread, NULL );
+
+	read_view.running = 0;
+    }
+
+    pthread_mutex_lock( &read_view.lock );
+    dfuse_read_view_end();
+    pthread_mutex_unlock( &read_view.lock );
+}
+
+void dfuse_read_view_report( void )
+{
+    if ( !options.snapshot )
+    {
+	return;
+    }
+
+    syslog( LOG_INFO, "dfuse snapshot: %llu read views (%llu failed to start), %llu operations served; "
+	"%llu ran out of time, %llu released", read_view.views, read_view.failures, read_view.operations,
+	read_view.expired, read_view.released );
+}
+
+// The other half of DFRV(): give back whatever this thread checked out during this operation.
+void dfuse_checkin( void )
+{
+    if ( !thread_conn )
+    {
+	return;
+    }
+
+    if ( thread_in_view )
+    {
+	thread_conn = NULL;
+	thread_in_view = 0;
+	dfuse_read_view_leave();
+	return;
+    }
+
+    dfuse_pool_checkin_conn( thread_conn );
+    thread_conn = NULL;
+}
+
+/*
+ * Opens --pool-min connections up front, mostly so that main() finds out about bad credentials
+ * before we daemonize ourselves away.  In lazy mode we still make (and then drop) one.
+ *
+ * @returns 0 on success, -1 if we couldn't get even one connection.
+ */
+int dfuse_pool_init( void )
+{
+    struct dfuse_conn *conn;
+    unsigned int i, wanted;
+
+    wanted = lazy_conn || !options.pool_min ? 1 : options.pool_min;
+
+    for ( i = 0; i < wanted; i++ )
+    {
+	if ( !( conn = dfuse_pool_new_conn() ) )
+	{
+	    return i ? 0 : -1;
+	}
+
+	pthread_mutex_lock( &pool.lock );
+	pool.open++;
+	pool.connects++;
+	if ( pool.open > pool.peak_open )
+	{
+	    pool.peak_open = pool.open;
+	}
+	pthread_mutex_unlock( &pool.lock );
+
+	dfuse_pool_checkin_conn( conn );
+    }
+
+    return 0;
+}
+
+void dfuse_pool_report( void )
+{
+    pthread_mutex_lock( &pool.lock );
+
+    syslog( LOG_INFO, "dfuse pool: %u open (%u idle, peak %u), %llu checkouts, %llu connects (%llu failed), "
+	"%llu pings, %llu waits (%llu usec total, peak %u waiting), %llu timeouts",
+	pool.open, pool.idle_count, pool.peak_open, pool.checkouts, pool.connects, pool.connect_failures,
+	pool.pings, pool.waits, pool.wait_usec, pool.peak_waiting, pool.timeouts );
+
+    pthread_mutex_unlock( &pool.lock );
+}
+
+void dfuse_pool_destroy( void )
+{
+    struct dfuse_conn *conn;
+
+    pthread_mutex_lock( &pool.lock );
+
+    while ( ( conn = pool.idle ) )
+    {
+	pool.idle = conn->next;
+	pool.idle_count--;
+	pool.open--;
+	dfuse_pool_free_conn( conn );
+    }
+
+    pthread_mutex_unlock( &pool.lock );
+}
+
+MYSQL *dfuse_connect( char *host, char *user, char *pass, char *defaultdb )
+{
+    int use_defaults = 0;
+    MYSQL *sql = NULL;
+
+    if ( !host || !user || !pass || !defaultdb )
+    {
+	use_defaults = 1;
+    }
+
+    if ( !use_defaults )
+    {
+	if ( !( sql = mysql_init( NULL ) ) )
+	{
+	    return NULL;
+	}
+	return mysql_real_connect( sql, host, user, pass, defaultdb, 0, NULL, 0 );
+    }
+
+    // Already holding one for this operation?  Keep using it.
+    if ( thread_conn )
+    {
+	return thread_conn->sql;
+    }
+
+    // --snapshot: readers share the read view's, as long as there's one to be had.
+    if ( options.snapshot && thread_reader && ( thread_conn = dfuse_read_view_enter() ) )
+    {
+	thread_in_view = 1;
+	return thread_conn->sql;
+    }
+
+    if ( !( thread_conn = dfuse_pool_checkout() ) )
+    {
+	return NULL;
+    }
+
+    return thread_conn->sql;
+}
+
+/*
+ * Whether a stat can be answered without fetching the row: always in raw mode, but in --json
+ * mode only when the server can measure the rendered row for us (see dfuse_build_schema).  With
+ * --column-files, a row is a directory, with nothing to measure; its columns always can be.
+ */
+int dfuse_stmt_with_stat( MYSQL *sql, struct dfuse_table *table )
+{
+    struct dfuse_schema *schema;
+
+    return !options.column_files && ( !json || ( ( schema = dfuse_json_schema( sql, table ) ) && schema->size_sql ) );
+}
+
+// The SQL behind each DFUSE_STMT_* (and DFUSE_STMT_COLUMN).  Called once per connection per table
+// per shape.
+static char *dfuse_stmt_sql( MYSQL *sql, struct dfuse_table *table, unsigned int which )
+{
+    char *stat_columns, *validator, *rv = NULL;
+    unsigned int column = which / DFUSE_STMT_COUNT;
+    const char *value = column ? table->column_sql[column-1] : options.columns;
+    int with_stat = column || dfuse_stmt_with_stat( sql, table );
+
+    which %= DFUSE_STMT_COUNT;
+
+    if ( !with_stat )
+    {
+	stat_columns = NULL;
+    }
+    else if ( json )
+    {
+	stat_columns = dfuse_asprintf( "%s", dfuse_json_schema( sql, table )->size_sql );
+    }
+    else if ( options.timestamp )
+    {
+	stat_columns = dfuse_asprintf( "OCTET_LENGTH(%s),%s", value, options.timestamp );
+    }
+    else
+    {
+	stat_columns = dfuse_asprintf( "OCTET_LENGTH(%s)", value );
+    }
+
+    if ( with_stat && !stat_columns )
+    {
+	return NULL;
+    }
+
+    switch ( which )
+    {
+	case DFUSE_STMT_STAT:
+	    if ( with_stat )
+	    {
+		rv = dfuse_asprintf( "SELECT %s FROM %s WHERE %s", stat_columns, table->sql_name, table->key_where );
+	    }
+	    break;
+	case DFUSE_STMT_ROW:
+	    rv = dfuse_asprintf( "SELECT %s FROM %s WHERE %s", value, table->sql_name, table->key_where );
+	    break;
+	case DFUSE_STMT_EXISTS:
+	    rv = dfuse_asprintf( "SELECT 1 FROM %s WHERE %s", table->sql_name, table->key_where );
+	    break;
+	case DFUSE_STMT_LIST_FIRST:
+	    rv = dfuse_asprintf( "SELECT %s%s%s FROM %s ORDER BY %s LIMIT ?,?", table->prikey,
+		with_stat ? "," : "", with_stat ? stat_columns : "", table->sql_name, table->prikey );
+	    break;
+	case DFUSE_STMT_LIST_AFTER:
+	    rv = dfuse_asprintf( "SELECT %s%s%s FROM %s WHERE %s ORDER BY %s LIMIT ?", table->prikey,
+		with_stat ? "," : "", with_stat ? stat_columns : "", table->sql_name, table->key_after, table->prikey );
+	    break;
+	case DFUSE_STMT_UPDATE:
+	    if ( !json )
+	    {
+		rv = dfuse_asprintf( "UPDATE %s SET %s=? WHERE %s", table->sql_name, value, table->key_where );
+	    }
+	    else if ( dfuse_json_schema( sql, table ) && table->schema->update_sql )
+	    {
+		rv = dfuse_asprintf( "UPDATE %s SET %s WHERE %s", table->sql_name, table->schema->update_sql, table->key_where );
+	    }
+	    break;
+	case DFUSE_STMT_RANGE:
+	    if ( !json )
+	    {
+		rv = dfuse_asprintf( "SELECT SUBSTRING(CAST(%s AS BINARY),?,?) FROM %s WHERE %s", value, table->sql_name, table->key_where );
+	    }
+	    break;
+	case DFUSE_STMT_MIRROR_ROW:
+	    if ( ( validator = dfuse_mirror_validator_sql( sql, table ) ) )
+	    {
+		rv = dfuse_asprintf( "SELECT %s,%s FROM %s WHERE %s", options.columns, validator, table->sql_name, table->key_where );
+		DFUSE_FREE( validator );
+	    }
+	    break;
+	case DFUSE_STMT_SHARD_NEXT:
+	    if ( table->shard == DFUSE_SHARD_PREFIX )
+	    {
+		rv = dfuse_asprintf( "SELECT %s FROM %s WHERE %s>=? AND (%s>? OR ?) ORDER BY %s LIMIT 1", table->shard_column,
+		    table->sql_name, table->shard_column, table->shard_column, table->shard_column );
+	    }
+	    break;
+	case DFUSE_STMT_SHARD_FIRST:
+	    if ( table->shard )
+	    {
+		rv = dfuse_asprintf( "SELECT %s%s%s FROM %s WHERE %s ORDER BY %s LIMIT ?,?", table->prikey,
+		    with_stat ? "," : "", with_stat ? stat_columns : "", table->sql_name, table->shard_where, table->prikey );
+	    }
+	    break;
+	case DFUSE_STMT_SHARD_AFTER:
+	    if ( table->shard )
+	    {
+		rv = dfuse_asprintf( "SELECT %s%s%s FROM %s WHERE %s AND %s ORDER BY %s LIMIT ?", table->prikey,
+		    with_stat ? "," : "", with_stat ? stat_columns : "", table->sql_name, table->key_after,
+		    table->shard_where, table->prikey );
+	    }
+	    break;
+    }
+
+    if ( stat_columns ) { DFUSE_FREE( stat_columns ); }
+
+    return rv;
+}
+
+// A statement that failed because the server went away takes its connection down with it.
+static void dfuse_stmt_failed( unsigned int slot )
+{
+    MYSQL_STMT *stmt = thread_conn->stmts[slot];
+    unsigned int err = stmt ? mysql_stmt_errno( stmt ) : mysql_errno( thread_conn->sql );
+
+    D( "Statement failed: '%s'.\n", stmt ? mysql_stmt_error( stmt ) : mysql_error( thread_conn->sql ) );
+
+    if ( err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST )
+    {
+	thread_conn->broken = 1;
+    }
+
+    // Whatever went wrong, start over with a fresh prepare next time.
+    if ( stmt )
+    {
+	mysql_stmt_close( stmt );
+	thread_conn->stmts[slot] = NULL;
+    }
+}
+
+// Returns this thread's prepared statement for which on table, preparing it if need be.
+static MYSQL_STMT *dfuse_stmt( struct dfuse_table *table, unsigned int which, unsigned int *slot )
+{
+    MYSQL_STMT *stmt;
+    char *query;
+
+    if ( !thread_conn || which >= DFUSE_STMT_COLUMN( table->num_columns + 1, 0 ) )
+    {
+	return NULL;
+    }
+
+    // tables[] is fixed by the time anybody gets here, so this never needs to grow.
+    if ( !thread_conn->stmts )
+    {
+	if ( !( thread_conn->stmts = DFUSE_MALLOC( sizeof( MYSQL_STMT * ) * num_stmts ) ) )
+	{
+	    return NULL;
+	}
+	memset( thread_conn->stmts, 0, sizeof( MYSQL_STMT * ) * num_stmts );
+    }
+
+    // Each table's slots are its DFUSE_STMT_COUNT, then as many again per --column-files column.
+    *slot = table->stmt_base + which;
+
+    if ( thread_conn->stmts[*slot] )
+    {
+	return thread_conn->stmts[*slot];
+    }
+
+    if ( !( query = dfuse_stmt_sql( thread_conn->sql, table, which ) ) )
+    {
+	return NULL;
+    }
+
+    D( "Preparing: '%s'.\n", query );
+
+    if ( !( stmt = mysql_stmt_init( thread_conn->sql ) ) )
+    {
+	DFUSE_FREE( query );
+	return NULL;
+    }
+
+    thread_conn->stmts[*slot] = stmt;
+
+    __sync_fetch_and_add( &stats.queries, 1 );
+
+    if ( mysql_stmt_prepare( stmt, query, strlen( query ) ) )
+    {
+	dfuse_stmt_failed( *slot );
+	DFUSE_FREE( query );
+	return NULL;
+    }
+
+    DFUSE_FREE( query );
+
+    return stmt;
+}
+
+/*
+ * Runs one of table's statements, binding key (if there is one) to the first placeholder (one
+ * per column, for a composite key, or as many as key_after takes) and ints to the rest, and
+ * buffers the whole result client-side.  Keys go over the wire as they are, so nothing needs
+ * escaping and nothing gets truncated.
+ *
+ * The caller must already hold a connection (dfuse_connect), and must mysql_stmt_free_result()
+ * *stmt when it's done with the rows.
+ *
+ * @returns 0 or a negative errno.
+ */
+int dfuse_stmt_execute( struct dfuse_table *table, unsigned int which, const char *key,
+    unsigned long key_length, unsigned long long *ints, unsigned int num_ints, MYSQL_STMT **stmt )
+{
+    MYSQL_BIND params[DFUSE_MAX_KEY_AFTER_PARAMS+2];
+    struct dfuse_key_values kv;
+    unsigned int i, n = 0;
+    int rv;
+
+    if ( num_ints > 2 )
+    {
+	return -EINVAL;
+    }
+
+    memset( params, 0, sizeof( params ) );
+    kv.buffer = NULL;
+
+    if ( key )
+    {
+	if ( ( rv = dfuse_key_split( table, key, key_length, &kv ) ) )
+	{
+	    return rv;
+	}
+
+	n = which % DFUSE_STMT_COUNT == DFUSE_STMT_LIST_AFTER
+	    ? dfuse_key_bind_after( &kv, params ) : dfuse_key_bind( &kv, params );
+    }
+
+    for ( i = 0; i < num_ints; i++, n++ )
+    {
+	params[n].buffer_type = MYSQL_TYPE_LONGLONG;
+	params[n].buffer = &ints[i];
+	params[n].is_unsigned = 1;
+    }
+
+    rv = dfuse_stmt_execute_binds( table, which, params, stmt );
+    dfuse_key_values_free( &kv );
+
+    return rv;
+}
+
+// dfuse_stmt_execute(), for statements whose parameters don't fit its mold (DFUSE_STMT_UPDATE).
+int dfuse_stmt_execute_binds( struct dfuse_table *table, unsigned int which, MYSQL_BIND *params, MYSQL_STMT **stmt )
+{
+    unsigned int slot;
+
+    if ( !( *stmt = dfuse_stmt( table, which, &slot ) ) )
+    {
+	return -EIO;
+    }
+
+    __sync_fetch_and_add( &stats.queries, 1 );
+
+    if ( mysql_stmt_bind_param( *stmt, params )
+      || mysql_stmt_execute( *stmt )
+      || mysql_stmt_store_result( *stmt ) )
+    {
+	dfuse_stmt_failed( slot );
+	*stmt = NULL;
+	return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Fetches the next row of stmt into row (which should start out zeroed, and can be reused for
+ * every row of a result).  We don't know how long a column is until the row is fetched, so the
+ * fetch is done with empty buffers, and the columns are then pulled into one block sized to fit.
+ *
+ * @returns 1 if there was a row, 0 if there wasn't, or a negative errno.
+ */
+int dfuse_stmt_fetch_row( MYSQL_STMT *stmt, struct dfuse_stmt_row *row )
+{
+    unsigned int i, num_fields = mysql_stmt_field_count( stmt );
+    unsigned long total = 0;
+    char *p;
+    int rv;
+
+    if ( !row->binds )
+    {
+	row->num_fields = num_fields;
+
+	if ( !( row->binds = DFUSE_MALLOC( sizeof( MYSQL_BIND ) * ( num_fields ? num_fields : 1 ) ) )
+	  || !( row->lengths = DFUSE_MALLOC( sizeof( unsigned long ) * ( num_fields ? num_fields : 1 ) ) )
+	  || !( row->is_null = DFUSE_MALLOC( sizeof( my_bool ) * ( num_fields ? num_fields : 1 ) ) )
+	  || !( row->values = DFUSE_MALLOC( sizeof( char * ) * ( num_fields ? num_fields : 1 ) ) ) )
+	{
+	    dfuse_stmt_row_free( row );
+	    return -ENOMEM;
+	}
+    }
+
+    if ( row->num_fields != num_fields )
+    {
+	return -EIO;
+    }
+
+    memset( row->binds, 0, sizeof( MYSQL_BIND ) * num_fields );
+
+    for ( i = 0; i < num_fields; i++ )
+    {
+	row->binds[i].buffer_type = MYSQL_TYPE_STRING;
+	row->binds[i].length = &row->lengths[i];
+	row->binds[i].is_null = &row->is_null[i];
+    }
+
+    if ( mysql_stmt_bind_result( stmt, row->binds ) )
+    {
+	return -EIO;
+    }
+
+    switch ( ( rv = mysql_stmt_fetch( stmt ) ) )
+    {
+	case MYSQL_NO_DATA:
+	    return 0;
+	case 0:
+	case MYSQL_DATA_TRUNCATED: // Expected: every buffer was zero bytes long.
+	    break;
+	default:
+	    D( "Fetch failed: '%s'.\n", mysql_stmt_error( stmt ) );
+	    return -EIO;
+    }
+
+    for ( i = 0; i < num_fields; i++ )
+    {
+	total += row->lengths[i] + 1;
+    }
+
+    if ( row->block ) { DFUSE_FREE( row->block ); }
+
+    if ( !( row->block = DFUSE_MALLOC( total ? total : 1 ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    for ( i = 0, p = row->block; i < num_fields; i++ )
+    {
+	if ( row->is_null[i] )
+	{
+	    row->values[i] = NULL;
+	    continue;
+	}
+
+	row->binds[i].buffer = p;
+	row->binds[i].buffer_length = row->lengths[i];
+
+	if ( row->lengths[i] && mysql_stmt_fetch_column( stmt, &row->binds[i], i, 0 ) )
+	{
+	    return -EIO;
+	}
+
+	p[row->lengths[i]] = '\0';
+	row->values[i] = p;
+	p += row->lengths[i] + 1;
+    }
+
+    __sync_fetch_and_add( &stats.rows_fetched, 1 );
+    __sync_fetch_and_add( &stats.bytes_fetched, total - num_fields );
+
+    return 1;
+}
+
+void dfuse_stmt_row_free( struct dfuse_stmt_row *row )
+{
+    if ( row->binds ) { DFUSE_FREE( row->binds ); }
+    if ( row->lengths ) { DFUSE_FREE( row->lengths ); }
+    if ( row->is_null ) { DFUSE_FREE( row->is_null ); }
+    if ( row->values ) { DFUSE_FREE( row->values ); }
+    if ( row->block ) { DFUSE_FREE( row->block ); }
+
+    memset( row, 0, sizeof( struct dfuse_stmt_row ) );
+}
+
+/*
+ * Directory listings are served in batches of --readdir-batch rows, fetched with keyset
+ * pagination ("WHERE prikey > last ORDER BY prikey LIMIT n"), so neither our memory nor the
+ * time we hold a connection grows with the size of the table.  The batch we're in the middle
+ * of hangs off fi->fh between readdir() calls.
+ *
+ * Cookies (the offsets we hand the kernel) are just ordinals: 1 and 2 are "." and "..", and the
+ * n'th row in key order is n+2.  Batches always start a multiple of --readdir-batch rows in, and
+ * the key each one starts after is remembered (see dfuse_dir_anchor_put), so a cookie we don't
+ * have cached, even on a fresh handle (a seekdir(), or an NFS export's next READDIR), is found
+ * again with the same "WHERE prikey > ?" as the next batch.  Only a cookie whose anchor has been
+ * forgotten has to be counted to with LIMIT offset,n.
+ */
+struct dfuse_dir_entry {
+    char *name;			// urlencoded, as the kernel is told it
+    char *key;			// decoded, as stored in the table, or a shard key
+    unsigned long key_length;
+    unsigned int shard;		// A shard directory's depth; 0 for a row.
+    struct stat st;
+};
+
+struct dfuse_dir_handle {
+    struct dfuse_table *table;	// NULL for the list of tables at the root of a mount without -t.
+    unsigned int shard;		// --shard: this directory's depth, and its shard key.
+    char *shard_key;
+    unsigned long shard_key_length;
+    char *row_key;		// --column-files: this is a row's directory, and lists its columns.
+    unsigned long row_key_length;
+    struct dfuse_dir_entry *entries;
+    unsigned int count;
+    off_t first_cookie;		// Cookie of entries[0].
+    int with_stat;		// Whether entries[].st means anything.
+    int eof;			// This batch is the last one.
+    unsigned long long since;	// dfuse_invalidation_seq from before this batch was fetched.
+};
+
+#define DFUSE_DIR_FIRST_COOKIE 3
+
+// Slots in dir_anchors.  A collision just costs a recount.
+#define DFUSE_DIR_ANCHORS 4096
+
+// d_ino for a row the kernel hasn't got an inode for; what the high-level API said.
+#define DFUSE_UNKNOWN_INO 0xffffffff
+
+static void dfuse_dir_free_batch( struct dfuse_dir_handle *dh )
+{
+    unsigned int i;
+
+    for ( i = 0; i < dh->count; i++ )
+    {
+	DFUSE_FREE( dh->entries[i].name );
+	DFUSE_FREE( dh->entries[i].key );
+    }
+
+    if ( dh->entries ) { DFUSE_FREE( dh->entries ); }
+
+    dh->entries = NULL;
+    dh->count = 0;
+}
+
+/*
+ * The key each batch of a listing starts after, by directory and batch number, shared by every
+ * handle.  Direct-mapped, so it stays the same size however many directories get listed.  An
+ * anchor doesn't go stale as such: rows after a key are rows after a key, whatever's changed.
+ */
+struct dfuse_dir_anchor {
+    const struct dfuse_table *table;
+    unsigned int shard;
+    char *shard_key;
+    unsigned long shard_key_length;
+    unsigned long long batch;
+    char *key;
+    unsigned long key_length;
+};
+
+struct {
+    pthread_mutex_t lock;
+    struct dfuse_dir_anchor slots[DFUSE_DIR_ANCHORS];
+} dir_anchors = { PTHREAD_MUTEX_INITIALIZER };
+
+static struct dfuse_dir_anchor *dfuse_dir_anchor_slot( const struct dfuse_dir_handle *dh, unsigned long long batch )
+{
+    unsigned long long h = dfuse_hash( dh->shard_key, dh->shard_key_length ) ^ ( dh->table->index * 0x9e3779b97f4a7c15ULL )
+	^ ( ( batch + dh->shard ) * 0xc2b2ae3d27d4eb4fULL );
+
+    return &dir_anchors.slots[( h ^ ( h >> 32 ) ) & ( DFUSE_DIR_ANCHORS-1 )];
+}
+
+// Remembers that dh's batch number batch starts after key.
+static void dfuse_dir_anchor_put( const struct dfuse_dir_handle *dh, unsigned long long batch, const char *key,
+    unsigned long key_length )
+{
+    struct dfuse_dir_anchor *a;
+    char *shard_key, *copy;
+
+    if ( !( copy = DFUSE_MALLOC( key_length+1 ) ) || !( shard_key = DFUSE_MALLOC( dh->shard_key_length+1 ) ) )
+    {
+	if ( copy ) { DFUSE_FREE( copy ); }
+	return;
+    }
+
+    memcpy( copy, key, key_length );
+    copy[key_length] = '\0';
+    memcpy( shard_key, dh->shard_key ? dh->shard_key : "", dh->shard_key_length+1 );
+
+    pthread_mutex_lock( &dir_anchors.lock );
+
+    a = dfuse_dir_anchor_slot( dh, batch );
+
+    if ( a->key ) { DFUSE_FREE( a->key ); }
+    if ( a->shard_key ) { DFUSE_FREE( a->shard_key ); }
+
+    a->table = dh->table;
+    a->shard = dh->shard;
+    a->shard_key = shard_key;
+    a->shard_key_length = dh->shard_key_length;
+    a->batch = batch;
+    a->key = copy;
+    a->key_length = key_length;
+
+    pthread_mutex_unlock( &dir_anchors.lock );
+}
+
+// The key dh's batch number batch starts after, for the caller to free, or NULL if it's forgotten.
+static char *dfuse_dir_anchor_get( const struct dfuse_dir_handle *dh, unsigned long long batch, unsigned long *key_length )
+{
+    struct dfuse_dir_anchor *a;
+    char *rv = NULL;
+
+    pthread_mutex_lock( &dir_anchors.lock );
+
+    a = dfuse_dir_anchor_slot( dh, batch );
+
+    if ( a->key && a->table == dh->table && a->shard == dh->shard && a->batch == batch
+      && a->shard_key_length == dh->shard_key_length && !memcmp( a->shard_key, dh->shard_key ? dh->shard_key : "", a->shard_key_length )
+      && ( rv = DFUSE_MALLOC( a->key_length+1 ) ) )
+    {
+	memcpy( rv, a->key, a->key_length+1 );
+	*key_length = a->key_length;
+    }
+
+    pthread_mutex_unlock( &dir_anchors.lock );
+
+    return rv;
+}
+
+/*
+ * dfuse_dir_fetch_batch, for a --shard=prefix directory above the last level: its (up to)
+ * --readdir-batch subdirectories after the one whose shard key is after_key (or the ones that
+ * start skip subdirectories in).  Each is one dfuse_shard_next from the end of the one before,
+ * so it takes as many index dives as there are subdirectories, however many rows they hold.
+ *
+ * @returns 0 or a negative errno.
+ */
+static int dfuse_shard_fetch_batch( struct dfuse_dir_handle *dh, const char *after_key,
+    unsigned long after_key_length, unsigned long long skip, off_t first_cookie )
+{
+    struct dfuse_table *table = dh->table;
+    struct dfuse_dir_entry *e;
+    char *cursor = NULL, *found = NULL;
+    unsigned long cursor_length, found_length, length;
+    int inclusive = 1, rv = 0;
+
+    dfuse_dir_free_batch( dh );
+
+    if ( !( dh->entries = DFUSE_MALLOC( sizeof( struct dfuse_dir_entry ) * ( options.readdir_batch + 1 ) ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    dh->first_cookie = first_cookie;
+    dh->with_stat = 0;
+    dh->eof = 0;
+    skip = after_key ? 0 : skip;
+
+    // Whatever comes next sorts after everything under after_key: just after it, if its keys ran
+    // out, or else from the first value that doesn't start with it.
+    if ( after_key && dfuse_shard_ended( table, after_key, after_key_length, dh->shard+1 ) )
+    {
+	inclusive = 0;
+    }
+    else if ( after_key && ( rv = dfuse_shard_successor( after_key, after_key_length, &cursor, &cursor_length ) ) )
+    {
+	dh->eof = rv == -ENOENT;
+	return rv == -ENOENT ? 0 : rv;
+    }
+
+    if ( !cursor && !( cursor = DFUSE_MALLOC( ( after_key ? after_key_length : dh->shard_key_length ) + 1 ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    if ( !after_key )
+    {
+	memcpy( cursor, dh->shard_key, cursor_length = dh->shard_key_length );
+    }
+    else if ( !inclusive )
+    {
+	memcpy( cursor, after_key, cursor_length = after_key_length );
+    }
+
+    while ( dh->count < options.readdir_batch )
+    {
+	if ( ( rv = dfuse_shard_next( table, cursor, cursor_length, inclusive, &found, &found_length ) ) )
+	{
+	    break;
+	}
+
+	// Past the end of this directory?
+	if ( !found || dfuse_shard_span( table, found, found_length, dh->shard ) != dh->shard_key_length
+	  || memcmp( found, dh->shard_key, dh->shard_key_length ) )
+	{
+	    dh->eof = 1;
+	    break;
+	}
+
+	// found's subdirectory here: the first value in it, cut down to its shard key.
+	length = dfuse_shard_span( table, found, found_length, dh->shard+1 );
+	found[length] = '\0';
+	DFUSE_FREE( cursor );
+	cursor = found;
+	cursor_length = length;
+	found = NULL;
+
+	if ( skip )
+	{
+	    skip--;
+	}
+	else
+	{
+	    e = &dh->entries[dh->count];
+
+	    if ( !( e->key = DFUSE_MALLOC( length+1 ) ) )
+	    {
+		rv = -ENOMEM;
+		break;
+	    }
+
+	    memcpy( e->key, cursor, length+1 );
+	    e->key_length = length;
+	    e->shard = dh->shard+1;
+
+	    if ( !( e->name = dfuse_shard_name( table, e->key, e->key_length, e->shard ) ) )
+	    {
+		DFUSE_FREE( e->key );
+		rv = -ENOMEM;
+		break;
+	    }
+
+	    dh->count++;
+	}
+
+	// On to the next one, as above.
+	if ( ( inclusive = !dfuse_shard_ended( table, cursor, cursor_length, dh->shard+1 ) ) )
+	{
+	    if ( ( rv = dfuse_shard_successor( cursor, cursor_length, &found, &found_length ) ) )
+	    {
+		dh->eof = rv == -ENOENT;
+		rv = rv == -ENOENT ? 0 : rv;
+		break;
+	    }
+
+	    DFUSE_FREE( cursor );
+	    cursor = found;
+	    cursor_length = found_length;
+	    found = NULL;
+	}
+    }
+
+    if ( cursor ) { DFUSE_FREE( cursor ); }
+    if ( found ) { DFUSE_FREE( found ); }
+
+    return rv;
+}
+
+/*
+ * Replaces dh's batch with the (up to) --readdir-batch rows that come after after_key (or, if
+ * after_key is NULL, the ones that start skip rows into the table), and sets their first cookie
+ * to first_cookie.
+ *
+ * @returns 0 or a negative errno.
+ */
+static int dfuse_dir_fetch_batch( MYSQL *sql, struct dfuse_dir_handle *dh, const char *after_key,
+    unsigned long after_key_length, unsigned long long skip, off_t first_cookie )
+{
+    MYSQL_STMT *stmt;
+    struct dfuse_stmt_row row;
+    unsigned long long limits[2];
+    int rv;
+    struct dfuse_schema *schema = NULL;
+    struct dfuse_dir_entry *e;
+    char **values;
+
+    if ( dh->table->shard == DFUSE_SHARD_PREFIX && dh->shard < options.shard_levels )
+    {
+	return dfuse_shard_fetch_batch( dh, after_key, after_key_length, skip, first_cookie );
+    }
+
+    /*
+     * Fetch everything getattr would have, in the same pass: that fills in readdirplus's stat and
+     * seeds the attribute cache, so the stat() that follows each entry (ls -l, git status)
+     * doesn't cost a query of its own.  In --json mode, we need the server to do the size math.
+     */
+    dh->with_stat = dfuse_stmt_with_stat( sql, dh->table );
+
+    if ( json && dh->with_stat )
+    {
+	schema = dfuse_json_schema( sql, dh->table );
+    }
+
+    if ( after_key )
+    {
+	limits[0] = options.readdir_batch;
+	rv = dh->table->shard
+	    ? dfuse_shard_execute( dh->table, DFUSE_STMT_SHARD_AFTER, dh->shard_key, dh->shard_key_length, dh->shard,
+		after_key, after_key_length, limits, 1, &stmt )
+	    : dfuse_stmt_execute( dh->table, DFUSE_STMT_LIST_AFTER, after_key, after_key_length, limits, 1, &stmt );
+    }
+    else
+    {
+	limits[0] = skip;
+	limits[1] = options.readdir_batch;
+	rv = dh->table->shard
+	    ? dfuse_shard_execute( dh->table, DFUSE_STMT_SHARD_FIRST, dh->shard_key, dh->shard_key_length, dh->shard,
+		NULL, 0, limits, 2, &stmt )
+	    : dfuse_stmt_execute( dh->table, DFUSE_STMT_LIST_FIRST, NULL, 0, limits, 2, &stmt );
+    }
+
+    if ( rv )
+    {
+	return rv;
+    }
+
+    dfuse_dir_free_batch( dh );
+
+    // The batch is bounded, so dfuse_stmt_execute storing it lets go of the server right away.
+    if ( !( dh->entries = DFUSE_MALLOC( sizeof( struct dfuse_dir_entry ) * ( mysql_stmt_num_rows( stmt ) + 1 ) ) ) )
+    {
+	mysql_stmt_free_result( stmt );
+	return -ENOMEM;
+    }
+
+    dh->first_cookie = first_cookie;
+    dh->eof = mysql_stmt_num_rows( stmt ) < options.readdir_batch;
+
+    memset( &row, 0, sizeof( row ) );
+
+    while ( ( rv = dfuse_stmt_fetch_row( stmt, &row ) ) > 0 )
+    {
+	e = &dh->entries[dh->count];
+
+	// A NULL or empty key can't be a filename, but it still takes up a cookie.
+	if ( !( e->key = dfuse_row_key( dh->table, row.values, row.lengths, &e->key_length ) ) )
+	{
+	    if ( !( e->key = DFUSE_MALLOC( 1 ) ) )
+	    {
+		rv = -ENOMEM;
+		break;
+	    }
+	    e->key[0] = '\0';
+	    e->key_length = 0;
+	}
+
+	if ( !( e->name = dfuse_key_name( dh->table, e->key, e->key_length ) ) )
+	{
+	    if ( !( e->name = DFUSE_MALLOC( 1 ) ) )
+	    {
+		DFUSE_FREE( e->key );
+		rv = -ENOMEM;
+		break;
+	    }
+	    e->name[0] = '\0';
+	}
+
+	// The server's shard test is only as good as its idea of our character set; ours decides.
+	if ( dh->table->shard && e->name[0]
+	  && !dfuse_shard_holds( dh->table, dh->shard_key, dh->shard_key_length, dh->shard, e->key, e->key_length ) )
+	{
+	    e->name[0] = '\0';
+	}
+
+	e->shard = 0;
+	dh->count++;
+
+	// Being listed is all a lookup of a --column-files row wants to know.
+	if ( options.column_files )
+	{
+	    dfuse_stat_dir( 0, &e->st );
+	    dfuse_attr_cache_put( dh->table, e->key, e->key_length, 0, &e->st, dh->since );
+	}
+
+	if ( !dh->with_stat )
+	{
+	    continue;
+	}
+
+	// The stat columns come after the key's.
+	values = row.values + dh->table->key_columns;
+
+	if ( json )
+	{
+	    dfuse_fill_stat( &e->st, 0, schema->fixed_length + htmlencoded_length( e->key, e->key_length )
+		+ ( values[0] ? strtoull( values[0], NULL, 10 ) : 0 ), NULL );
+	}
+	else
+	{
+	    dfuse_fill_stat( &e->st, values[0] == NULL, values[0] ? strtoull( values[0], NULL, 10 ) : 0,
+		options.timestamp ? values[1] : NULL );
+	}
+
+	dfuse_attr_cache_put( dh->table, e->key, e->key_length, 0, &e->st, dh->since );
+    }
+
+    mysql_stmt_free_result( stmt );
+    dfuse_stmt_row_free( &row );
+
+    return rv < 0 ? rv : 0;
+}
+
+static void dfuse_opendir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    struct dfuse_dir_handle *dh;
+    struct dfuse_table *table;
+    struct dfuse_inode *inode;
+    int rv;
+
+    // The directories are the root, without -t one per table, and --shard's; rows are never
+    // directories, except with --column-files.
+    if ( ( rv = dfuse_resolve_ino( ino, &table, &inode ) ) < 0 )
+    {
+	fuse_reply_err( req, -rv );
+	return;
+    }
+
+    if ( rv == DFUSE_PATH_COLUMN || ( rv == DFUSE_PATH_ROW && !options.column_files ) )
+    {
+	fuse_reply_err( req, ENOTDIR );
+	return;
+    }
+
+    if ( !( dh = DFUSE_MALLOC( sizeof( struct dfuse_dir_handle ) ) ) )
+    {
+	fuse_reply_err( req, ENOMEM );
+	return;
+    }
+
+    memset( dh, 0, sizeof( struct dfuse_dir_handle ) );
+
+    dh->table = ( rv == DFUSE_PATH_ROOT && !multi_table ) ? &tables[0] : table;
+
+    if ( rv == DFUSE_PATH_ROW )
+    {
+	dh->row_key_length = inode->key_length;
+
+	if ( !( dh->row_key = DFUSE_MALLOC( dh->row_key_length+1 ) ) )
+	{
+	    DFUSE_FREE( dh );
+	    fuse_reply_err( req, ENOMEM );
+	    return;
+	}
+
+	memcpy( dh->row_key, inode->key, dh->row_key_length+1 );
+    }
+    // A sharded table's own directory is its depth 0, whose shard key is empty.
+    else if ( dh->table && dh->table->shard )
+    {
+	dh->shard = inode ? inode->shard : 0;
+	dh->shard_key_length = inode ? inode->key_length : 0;
+
+	if ( !( dh->shard_key = DFUSE_MALLOC( dh->shard_key_length+1 ) ) )
+	{
+	    DFUSE_FREE( dh );
+	    fuse_reply_err( req, ENOMEM );
+	    return;
+	}
+
+	memcpy( dh->shard_key, inode ? inode->key : "", dh->shard_key_length+1 );
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)dh;
+
+    fuse_reply_open( req, fi );
+}
+
+static void dfuse_releasedir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    struct dfuse_dir_handle *dh = (struct dfuse_dir_handle *)(uintptr_t)fi->fh;
+
+    if ( dh )
+    {
+	dfuse_dir_free_batch( dh );
+	if ( dh->shard_key ) { DFUSE_FREE( dh->shard_key ); }
+	if ( dh->row_key ) { DFUSE_FREE( dh->row_key ); }
+	DFUSE_FREE( dh );
+    }
+
+    fi->fh = 0;
+
+    fuse_reply_err( req, 0 );
+}
+
+/*
+ * Appends name to a readdir (or, if plus, readdirplus) reply being built in buf.  For a row
+ * with attributes (key set), or a shard directory (shard set, too), a readdirplus entry is a
+ * lookup like any other, so it only takes one on the inode once it's sure the entry fits; the
+ * caller has set e's timeouts.
+ *
+ * @returns 1 if the reply's full, else 0.
+ */
+static int dfuse_dir_add( fuse_req_t req, char *buf, size_t size, size_t *used, int plus, const char *name,
+    struct fuse_entry_param *e, off_t cookie, struct dfuse_table *table, const char *key, unsigned long key_length,
+    unsigned int shard )
+{
+    size_t length;
+
+    length = plus ? fuse_add_direntry_plus( req, NULL, 0, name, NULL, 0 ) : fuse_add_direntry( req, NULL, 0, name, NULL, 0 );
+
+    if ( *used + length > size )
+    {
+	return 1;
+    }
+
+    if ( plus && key && ( e->ino = dfuse_inode_ref( table, key, key_length, shard, 0 ) ) )
+    {
+	e->attr.st_ino = e->ino;
+    }
+
+    if ( plus )
+    {
+	fuse_add_direntry_plus( req, buf + *used, size - *used, name, e, cookie );
+    }
+    else
+    {
+	fuse_add_direntry( req, buf + *used, size - *used, name, &e->attr, cookie );
+    }
+
+    *used += length;
+
+    return 0;
+}
+
+/*
+ * Fills buf (size bytes) with the entries of dh's directory (ino) from after offset on.
+ *
+ * @returns 0 or a negative errno; either way, *used says how much of buf is entries.
+ */
+static int dfuse_dir_fill( fuse_req_t req, fuse_ino_t ino, struct dfuse_dir_handle *dh, char *buf, size_t size,
+    size_t *used, off_t offset, int plus )
+{
+    MYSQL *sql = NULL;
+    struct dfuse_dir_entry *e;
+    struct fuse_entry_param de;
+    off_t cookie, first;
+    char *last_key;
+    unsigned long last_key_length;
+    unsigned long long batch;
+    char shard_key[9];
+    int rv;
+
+    // Neither "." nor ".." is a lookup, even in a readdirplus.
+    memset( &de, 0, sizeof( de ) );
+    dfuse_stat_dir( ino, &de.attr );
+
+    if ( offset < 1 && dfuse_dir_add( req, buf, size, used, plus, ".", &de, 1, NULL, NULL, 0, 0 ) )
+    {
+	DFRV(0);
+    }
+
+    de.attr.st_ino = FUSE_ROOT_ID;
+
+    if ( offset < 2 && dfuse_dir_add( req, buf, size, used, plus, "..", &de, 2, NULL, NULL, 0, 0 ) )
+    {
+	DFRV(0);
+    }
+
+    // The cookie of the next entry the kernel wants.
+    cookie = offset < DFUSE_DIR_FIRST_COOKIE ? DFUSE_DIR_FIRST_COOKIE : offset+1;
+
+    // The list of tables is already in memory; no need to go paging through anything.
+    if ( !dh->table )
+    {
+	for ( ; cookie - DFUSE_DIR_FIRST_COOKIE < num_tables; cookie++ )
+	{
+	    memset( &de, 0, sizeof( de ) );
+	    de.ino = DFUSE_TABLE_INO(cookie - DFUSE_DIR_FIRST_COOKIE);
+	    de.attr_timeout = de.entry_timeout = DFUSE_KERNEL_DIR_TTL;
+	    dfuse_stat_dir( de.ino, &de.attr );
+
+	    if ( dfuse_dir_add( req, buf, size, used, plus, tables[cookie - DFUSE_DIR_FIRST_COOKIE].name, &de, cookie, NULL, NULL, 0, 0 ) )
+	    {
+		break;
+	    }
+	}
+
+	DFRV(0);
+    }
+
+    // Above the last level of --shard=hash directories, every one has all the same subdirectories.
+    if ( dh->table->shard == DFUSE_SHARD_HASH && dh->shard < options.shard_levels )
+    {
+	for ( ; cookie - DFUSE_DIR_FIRST_COOKIE < 1 << 4*options.shard_width; cookie++ )
+	{
+	    sprintf( shard_key, "%s%0*x", dh->shard_key, (int)options.shard_width, (unsigned int)( cookie - DFUSE_DIR_FIRST_COOKIE ) );
+
+	    memset( &de, 0, sizeof( de ) );
+	    de.attr_timeout = de.entry_timeout = dfuse_kernel_ttl( NULL, 0, 0 );
+	    dfuse_stat_dir( dfuse_inode_find( dh->table, shard_key, strlen( shard_key ), dh->shard+1, 0 ), &de.attr );
+
+	    if ( !de.attr.st_ino )
+	    {
+		de.attr.st_ino = DFUSE_UNKNOWN_INO;
+	    }
+
+	    if ( dfuse_dir_add( req, buf, size, used, plus, shard_key + dh->shard_key_length, &de, cookie,
+		dh->table, shard_key, strlen( shard_key ), dh->shard+1 ) )
+	    {
+		break;
+	    }
+	}
+
+	DFRV(0);
+    }
+
+    // A --column-files row's directory holds a file per column, which we knew at mount time.
+    if ( dh->row_key )
+    {
+	for ( ; cookie - DFUSE_DIR_FIRST_COOKIE < dh->table->num_columns; cookie++ )
+	{
+	    memset( &de, 0, sizeof( de ) );
+	    de.attr.st_mode = S_IFREG;
+
+	    if ( !( de.attr.st_ino = dfuse_inode_find( dh->table, dh->row_key, dh->row_key_length, 0,
+		cookie - DFUSE_DIR_FIRST_COOKIE + 1 ) ) )
+	    {
+		de.attr.st_ino = DFUSE_UNKNOWN_INO;
+	    }
+
+	    if ( dfuse_dir_add( req, buf, size, used, plus, dh->table->column_names[cookie - DFUSE_DIR_FIRST_COOKIE], &de,
+		cookie, NULL, NULL, 0, 0 ) )
+	    {
+		break;
+	    }
+	}
+
+	DFRV(0);
+    }
+
+    for ( ;; )
+    {
+	// Is it in the batch we've already got?
+	if ( dh->entries && cookie >= dh->first_cookie && cookie < dh->first_cookie + dh->count )
+	{
+	    e = &dh->entries[cookie - dh->first_cookie];
+
+	    memset( &de, 0, sizeof( de ) );
+	    de.attr_timeout = de.entry_timeout = dfuse_kernel_ttl( dh->table, dh->since, 0 );
+
+	    if ( e->shard )
+	    {
+		dfuse_stat_dir( 0, &de.attr );
+	    }
+	    else if ( dh->with_stat || options.column_files )
+	    {
+		de.attr = e->st;
+	    }
+	    else
+	    {
+		de.attr.st_mode = S_IFREG;
+	    }
+
+	    // What a plain readdir (or an entry without attributes) reports; dfuse_dir_add
+	    // renumbers the entries it hands the kernel an inode for.
+	    if ( !( de.attr.st_ino = dfuse_inode_find( dh->table, e->key, e->key_length, e->shard, 0 ) ) )
+	    {
+		de.attr.st_ino = DFUSE_UNKNOWN_INO;
+	    }
+
+	    if ( e->name[0] && dfuse_dir_add( req, buf, size, used, plus, e->name, &de, cookie,
+		dh->table, dh->with_stat || e->shard || options.column_files ? e->key : NULL, e->key_length, e->shard ) )
+	    {
+		// The kernel's buffer is full; it'll be back for the rest, starting after the
+		// last cookie it actually got.
+		DFRV(0);
+	    }
+
+	    cookie++;
+	    continue;
+	}
+
+	// Ran off the end of the last batch?  Then we're done.
+	if ( dh->entries && dh->eof && cookie >= dh->first_cookie + dh->count )
+	{
+	    DFRV(0);
+	}
+
+	// The batch cookie is in, and where that starts.
+	batch = ( cookie - DFUSE_DIR_FIRST_COOKIE ) / options.readdir_batch;
+	first = DFUSE_DIR_FIRST_COOKIE + batch * options.readdir_batch;
+	last_key = NULL;
+	last_key_length = 0;
+
+	if ( dh->entries && dh->count && cookie == dh->first_cookie + dh->count )
+	{
+	    // The common case: pick up right where the last batch left off.
+	    last_key_length = dh->entries[dh->count-1].key_length;
+	    if ( !( last_key = DFUSE_MALLOC( last_key_length+1 ) ) )
+	    {
+		DFRV(-ENOMEM);
+	    }
+	    memcpy( last_key, dh->entries[dh->count-1].key, last_key_length+1 );
+	    first = cookie;
+	}
+	else if ( batch )
+	{
+	    // Fresh handle, or a seekdir() somewhere we don't have: start from its batch's anchor,
+	    // or if that's forgotten, count our way there.
+	    last_key = dfuse_dir_anchor_get( dh, batch, &last_key_length );
+	}
+
+	dh->since = dfuse_invalidation_seq( dh->table );
+
+	// --mirror has the same rows in the same order, when it's up to date.
+	if ( ( rv = dfuse_mirror_list( dh, last_key, last_key_length, first - DFUSE_DIR_FIRST_COOKIE, first ) ) > 0 )
+	{
+	    if ( !sql && !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+	    {
+		rv = -EIO;
+	    }
+	    else
+	    {
+		// Connecting may have begun a --snapshot view, which invalidates everything.
+		dh->since = dfuse_invalidation_seq( dh->table );
+		rv = dfuse_dir_fetch_batch( sql, dh, last_key, last_key_length, first - DFUSE_DIR_FIRST_COOKIE, first );
+	    }
+	}
+
+	if ( last_key ) { DFUSE_FREE( last_key ); }
+
+	if ( rv )
+	{
+	    DFRV(rv);
+	}
+
+	// A full batch has another after it, which starts after its last key.
+	if ( dh->count == options.readdir_batch )
+	{
+	    dfuse_dir_anchor_put( dh, ( dh->first_cookie - DFUSE_DIR_FIRST_COOKIE ) / options.readdir_batch + 1,
+		dh->entries[dh->count-1].key, dh->entries[dh->count-1].key_length );
+	}
+
+	if ( !dh->count )
+	{
+	    DFRV(0);
+	}
+    }
+}
+
+static void dfuse_readdir_any( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi, int plus )
+{
+    struct dfuse_dir_handle *dh = (struct dfuse_dir_handle *)(uintptr_t)fi->fh;
+    char *buf;
+    size_t used = 0;
+    int rv;
+
+    // opendir() already worked out which directory this is.
+    if ( !dh )
+    {
+	fuse_reply_err( req, EBADF );
+	return;
+    }
+
+    if ( !( buf = DFUSE_MALLOC( size ) ) )
+    {
+	fuse_reply_err( req, ENOMEM );
+	return;
+    }
+
+    dfuse_reader_begin();
+    rv = dfuse_dir_fill( req, ino, dh, buf, size, &used, offset, plus );
+    dfuse_reader_end();
+
+    // Whatever made it into buf has to reach the kernel, error or not: readdirplus entries
+    // have already been counted as lookups.  The error will come up again next time.
+    if ( rv && !used )
+    {
+	fuse_reply_err( req, -rv );
+    }
+    else
+    {
+	fuse_reply_buf( req, buf, used );
+    }
+
+    DFUSE_FREE( buf );
+}
+
+static void dfuse_readdir( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    dfuse_readdir_any( req, ino, size, offset, fi, 0 );
+}
+
+// Hands the kernel each row's attributes along with its name, from the batch that readdir
+// already fetched them in, so an ls -l or a find doesn't follow up with a lookup per row.
+static void dfuse_readdirplus( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    dfuse_readdir_any( req, ino, size, offset, fi, 1 );
+}
+
+/*
+ * Whether a raw value is big enough to stream rather than snapshot; see --stream-threshold.
+ *
+ * @returns 1 if it is (with *size set), 0 if not, or a negative errno suitable for handing to
+ * FUSE.
+ */
+static int dfuse_stream_size( struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column,
+    unsigned long long *size )
+{
+    MYSQL_STMT *stmt;
+    struct dfuse_stmt_row row;
+    struct stat st;
+    int rv;
+
+    if ( json || !options.stream_threshold )
+    {
+	return 0;
+    }
+
+    /*
+     * getattr() has almost always just asked, and a small file is fetched whole whatever size it's
+     * grown to since, so that answer is good enough.  A streamed one's length is what every read
+     * is clipped to, though, so that has to come from the server, not from a cache entry that may
+     * be older than the row.
+     */
+    if ( dfuse_attr_cache_get( table, key, key_length, column, &st ) == DFUSE_CACHE_HIT
+      && (unsigned long long)st.st_size <= options.stream_threshold )
+    {
+	return 0;
+    }
+
+    if ( ( rv = dfuse_stmt_execute( table, DFUSE_STMT_COLUMN( column, DFUSE_STMT_STAT ), key, key_length, NULL, 0, &stmt ) ) )
+    {
+	return rv;
+    }
+
+    memset( &row, 0, sizeof( row ) );
+
+    rv = dfuse_stmt_fetch_row( stmt, &row );
+
+    mysql_stmt_free_result( stmt );
+
+    if ( rv <= 0 )
+    {
+	dfuse_stmt_row_free( &row );
+	return rv ? rv : -ENOENT;
+    }
+
+    *size = row.values[0] ? strtoull( row.values[0], NULL, 10 ) : 0;
+
+    dfuse_stmt_row_free( &row );
+
+    return *size > options.stream_threshold;
+}
+
+/*
+ * Fetches fh's row and renders it into fh->data: the raw column in the default mode (or just fh's
+ * column, with --column-files), or the whole row through dfuse_render_json under --json.  If
+ * may_stream is set (the handle is only for reading), the row comes out of --mirror if it can, and
+ * failing that, a big enough raw value isn't fetched at all; see dfuse_read_range.  sql may be
+ * NULL, in which case we connect only if the mirror can't help.  Caller holds fh->lock, or is the
+ * only one with fh.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+static int dfuse_handle_fetch( MYSQL *sql, struct dfuse_handle *fh, int may_stream )
+{
+    unsigned long long size = 0;
+    MYSQL_STMT *stmt;
+    struct dfuse_stmt_row row;
+    int rv;
+    struct dfuse_schema *schema;
+    char *data;
+    unsigned long length;
+
+    if ( may_stream && ( rv = dfuse_mirror_fetch( fh ) ) <= 0 )
+    {
+	return rv;
+    }
+
+    if ( !sql && !( sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	return -EIO;
+    }
+
+    if ( may_stream && ( rv = dfuse_stream_size( fh->table, fh->key, fh->key_length, fh->column, &size ) ) )
+    {
+	if ( rv > 0 )
+	{
+	    fh->streamed_length = size;
+	}
+
+	return rv < 0 ? rv : 0;
+    }
+
+    if ( ( rv = dfuse_stmt_execute( fh->table, DFUSE_STMT_COLUMN( fh->column, DFUSE_STMT_ROW ), fh->key, fh->key_length,
+	NULL, 0, &stmt ) ) )
+    {
+	return rv;
+    }
+
+    if ( mysql_stmt_num_rows( stmt ) > 1 )
+    {
+	mysql_stmt_free_result( stmt );
+	return -EIO;
+    }
+
+    memset( &row, 0, sizeof( row ) );
+
+    rv = dfuse_stmt_fetch_row( stmt, &row );
+
+    mysql_stmt_free_result( stmt );
+
+    if ( rv <= 0 )
+    {
+	dfuse_stmt_row_free( &row );
+	return rv ? rv : -ENOENT;
+    }
+
+    if ( json )
+    {
+	D("key: '%s'\n",fh->key);
+	if ( !( schema = dfuse_json_schema( sql, fh->table ) ) || schema->num_fields != row.num_fields )
+	{
+	    D( "Row has %u fields, but our schema doesn't agree.\n", row.num_fields );
+	    dfuse_stmt_row_free( &row );
+	    return -EIO;
+	}
+
+	if ( !( data = dfuse_render_json( schema, row.values, row.lengths, fh->key, fh->key_length, &length ) ) )
+	{
+	    dfuse_stmt_row_free( &row );
+	    return -ENOMEM; //Hard to know for sure, but a likely cause, at least.
+	}
+    }
+    else
+    {
+	if ( row.values[0] == NULL )
+	{
+	    dfuse_stmt_row_free( &row );
+	    return -EINVAL;		// TAG: NULL_HANDLING
+	}
+
+	// The one column is the whole (NUL-terminated) block, so just take it over.
+	length = row.lengths[0];
+	data = row.block;
+	row.block = NULL;
+    }
+
+    dfuse_stmt_row_free( &row );
+
+    fh->data = data;
+    fh->length = length;
+    fh->capacity = length;
+
+    return 0;
+}
+
+/*
+ * Opens table's key (or, with --column-files, one of its columns) into a freshly-allocated
+ * dfuse_handle, which remembers where it came from, for writing it back.  The open counts towards
+ * the file's generation, and *keep_cache says whether the kernel may keep what it cached for it
+ * (see dfuse_generation_open).  If it may, and may_stream says the handle is only for reading, the
+ * row isn't fetched until a read actually reaches us; with the whole file in the page cache, that
+ * may be never.
+ *
+ * @returns 0 on success (with *handle set), or a negative errno suitable for handing to FUSE.
+ */
+int dfuse_snapshot_row( MYSQL *sql, struct dfuse_table *table, const char *key, unsigned long key_length,
+    unsigned int column, int may_stream, int *keep_cache, struct dfuse_handle **handle )
+{
+    int rv;
+    struct dfuse_handle *fh;
+
+    if ( !handle )
+    {
+	return -ENOENT;
+    }
+
+    if ( !( fh = DFUSE_MALLOC( sizeof( struct dfuse_handle ) ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    pthread_mutex_init( &fh->lock, NULL );
+    fh->data = NULL;
+    fh->length = 0;
+    fh->capacity = 0;
+    fh->dirty = 0;
+    fh->table = table;
+    fh->key = NULL;
+    fh->key_length = key_length;
+    fh->column = column;
+    fh->streamed_length = 0;
+    fh->parser = NULL;
+
+    if ( !( fh->key = DFUSE_MALLOC( key_length+1 ) ) )
+    {
+	dfuse_free_handle( fh );
+	return -ENOMEM;
+    }
+
+    memcpy( fh->key, key, key_length );
+    fh->key[key_length] = '\0';
+
+    *keep_cache = dfuse_generation_open( fh->table, fh->key, fh->key_length, fh->column );
+
+    if ( !( *keep_cache && may_stream ) && ( rv = dfuse_handle_fetch( sql, fh, may_stream ) ) )
+    {
+	dfuse_free_handle( fh );
+	return rv;
+    }
+
+    *handle = fh;
+
+    return 0;
+}
+
+void dfuse_free_handle( struct dfuse_handle *fh )
+{
+    if ( !fh )
+    {
+	return;
+    }
+
+    if ( fh->data ) { DFUSE_FREE( fh->data ); }
+    if ( fh->key ) { DFUSE_FREE( fh->key ); }
+
+    dfuse_json_parser_free( fh->parser );
+
+    pthread_mutex_destroy( &fh->lock );
+
+    DFUSE_FREE( fh );
+}
+
+/*
+ * Sets fh->length to length, growing fh->data if need be.  Anything between the old end and the
+ * new one reads as zeroes, as it would in a sparse file.  Caller holds fh->lock.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+static int dfuse_handle_resize( struct dfuse_handle *fh, unsigned long length )
+{
+    char *data;
+    unsigned long capacity;
+
+    if ( length > MAX_STRING_LENGTH )
+    {
+	return -EFBIG;
+    }
+
+    if ( length > fh->capacity )
+    {
+	// Doubling keeps a file written 4K at a time down to a handful of reallocs.
+	for ( capacity = fh->capacity ? fh->capacity : 4096; capacity < length; capacity *= 2 )
+	{
+	    if ( capacity > MAX_STRING_LENGTH / 2 )
+	    {
+		capacity = length;
+		break;
+	    }
+	}
+
+	if ( !( data = realloc( fh->data, capacity+1 ) ) )
+	{
+	    return -ENOMEM;
+	}
+
+	fh->data = data;
+	fh->capacity = capacity;
+    }
+
+    if ( length > fh->length )
+    {
+	memset( fh->data + fh->length, 0, length - fh->length );
+    }
+
+    fh->length = length;
+    fh->data[length] = '\0';
+
+    return 0;
+}
+
+/*
+ * Keeps fh->parser in step with a write of size bytes at offset (or, with size 0, a truncate to
+ * offset).  Bytes right where the parser left off get parsed now, while they're hot; anything
+ * landing on what it's already seen means starting over, and a write further on gets caught up
+ * at flush.  Caller holds fh->lock.
+ */
+static void dfuse_handle_parse( struct dfuse_handle *fh, off_t offset, size_t size )
+{
+    if ( !json )
+    {
+	return;
+    }
+
+    if ( fh->parser && (unsigned long long)offset < fh->parser->fed )
+    {
+	dfuse_json_parser_free( fh->parser );
+	fh->parser = NULL;
+    }
+
+    // Failing to get one only means flush parses the lot.
+    if ( size && !fh->parser )
+    {
+	fh->parser = dfuse_json_parser_new();
+    }
+
+    if ( size && fh->parser && (unsigned long long)offset == fh->parser->fed )
+    {
+	dfuse_json_feed( fh->parser, fh->data + offset, size );
+    }
+}
+
+static int dfuse_open_ino( fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    MYSQL *sql;
+    struct dfuse_handle *fh = NULL;
+    struct dfuse_table *table;
+    struct dfuse_inode *inode;
+    off_t size;
+    int rv, truncated, keep_cache;
+
+    D( "Asked to open inode %lu.", (unsigned long)ino );
+
+    // With --column-files, the files are the columns, and the rows are their directories.
+    if ( ( rv = dfuse_resolve_ino( ino, &table, &inode ) ) != ( options.column_files ? DFUSE_PATH_COLUMN : DFUSE_PATH_ROW ) )
+    {
+	return rv < 0 ? rv : -EISDIR;
+    }
+
+    // Nor should the handle start from the row as it was before a write that's still queued.
+    dfuse_write_back_settle( table, inode->key, inode->key_length );
+
+    // A read-only open the mirror can answer needn't wait for a connection at all.
+    if ( ( fi->flags & O_ACCMODE ) == O_RDONLY && dfuse_mirror_has( table, inode->key, inode->key_length ) )
+    {
+	sql = NULL;
+    }
+    else if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	DFRV(-EIO);
+    }
+
+    // This doubles as our existence check: no row, no snapshot, -ENOENT.  (Unless the kernel
+    // gets to keep its cache, in which case nothing's changed since an open that found one.)
+    // Only a read-only handle may stream or wait to fetch, since writes need the whole value in
+    // hand.
+    if ( ( rv = dfuse_snapshot_row( sql, table, inode->key, inode->key_length, inode->column, ( fi->flags & O_ACCMODE ) == O_RDONLY,
+	&keep_cache, &fh ) ) )
+    {
+	DFRV(rv);
+    }
+
+    fi->keep_cache = keep_cache;
+
+    // The O_ACCMODE dance is needed because O_RDONLY is 0x0.  @#&$*
+    // Opening for writing picks up a truncate() that was waiting for us, or does its own
+    // O_TRUNC; either way, the handle starts out dirty, so it gets written back on close even
+    // if nothing's written to it.
+    if ( ( fi->flags & O_ACCMODE ) != O_RDONLY )
+    {
+	truncated = dfuse_pending_truncate_get( fh->table, fh->key, fh->key_length, fh->column, &size, 1 );
+
+	if ( fi->flags & O_TRUNC )
+	{
+	    size = 0;
+	    truncated = 1;
+	}
+
+	if ( truncated )
+	{
+	    if ( ( rv = dfuse_handle_resize( fh, size ) ) )
+	    {
+		dfuse_free_handle( fh );
+		DFRV(rv);
+	    }
+
+	    fh->dirty = 1;
+	}
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)fh;
+
+    DFRV(0);
+}
+
+static void dfuse_open( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    int rv;
+
+    // A handle that's going to be written starts from the live row, not the read view's.
+    if ( ( fi->flags & O_ACCMODE ) == O_RDONLY )
+    {
+	dfuse_reader_begin();
+	rv = dfuse_open_ino( ino, fi );
+	dfuse_reader_end();
+    }
+    else
+    {
+	rv = dfuse_open_ino( ino, fi );
+    }
+
+    if ( rv )
+    {
+	fuse_reply_err( req, -rv );
+	return;
+    }
+
+    fuse_reply_open( req, fi );
+}
+
+/*
+ * A --json file, flattened into one value per schema column: the values UPDATE's SET binds.  A
+ * column the file doesn't mention keeps what the row already has.
+ */
+struct dfuse_update {
+    unsigned int num_fields;
+    signed char *keep;
+    char **values;		// Point into the parser's arena, so they live as long as it does.
+    unsigned long *lengths;
+    my_bool *is_null;
+};
+
+void dfuse_update_free( struct dfuse_update *update )
+{
+    if ( update->keep ) { DFUSE_FREE( update->keep ); }
+    if ( update->values ) { DFUSE_FREE( update->values ); }
+    if ( update->lengths ) { DFUSE_FREE( update->lengths ); }
+    if ( update->is_null ) { DFUSE_FREE( update->is_null ); }
+
+    memset( update, 0, sizeof( *update ) );
+}
+
+/*
+ * Matches every name-value pair in tokens (however deeply nested; DFuse-generated JSON nests the
+ * columns one level down, under the primary key) against schema's columns, filling in update.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE: -EINVAL if the file
+ * names a column the table doesn't have.
+ */
+int forge_update( const struct dfuse_json_token *tokens, unsigned long num_tokens, const struct dfuse_schema *schema, struct dfuse_update *update )
+{
+    unsigned long t;
+    unsigned int i;
+
+    update->num_fields = schema->num_fields;
+
+    if ( !( update->keep = DFUSE_MALLOC( sizeof( signed char ) * ( schema->num_fields ? schema->num_fields : 1 ) ) )
+      || !( update->values = DFUSE_MALLOC( sizeof( char * ) * ( schema->num_fields ? schema->num_fields : 1 ) ) )
+      || !( update->lengths = DFUSE_MALLOC( sizeof( unsigned long ) * ( schema->num_fields ? schema->num_fields : 1 ) ) )
+      || !( update->is_null = DFUSE_MALLOC( sizeof( my_bool ) * ( schema->num_fields ? schema->num_fields : 1 ) ) ) )
+    {
+	dfuse_update_free( update );
+	return -ENOMEM;
+    }
+
+    for ( i = 0; i < schema->num_fields; i++ )
+    {
+	update->keep[i] = 1;
+	update->values[i] = NULL;
+	update->lengths[i] = 0;
+	update->is_null[i] = 0;
+    }
+
+    for ( t = 0; t < num_tokens; t++ )
+    {
+	// An object's members are already on their way; it has nothing of its own to say.
+	if ( tokens[t].type == DFUSE_JSON_OBJECT )
+	{
+	    continue;
+	}
+
+	for ( i = 0; i < schema->num_fields; i++ )
+	{
+	    if ( strlen( schema->names[i] ) == tokens[t].name_length
+	      && !memcmp( schema->names[i], tokens[t].name, tokens[t].name_length ) )
+	    {
+		break;
+	    }
+	}
+
+	if ( i == schema->num_fields )
+	{
+	    D( "Written file names a column we don't have: '%s'.\n", tokens[t].name );
+	    return -EINVAL;
+	}
+
+	update->keep[i] = 0;
+	update->values[i] = (char *)tokens[t].value;
+	update->lengths[i] = tokens[t].value_length;
+	update->is_null[i] = tokens[t].type == DFUSE_JSON_NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * One row's worth of UPDATE, ready to run: the file, parsed if it's --json, and the binds that
+ * point into it.  table, key and data are the caller's, and have to outlive it; parser, if the
+ * caller hands one over (already fed some prefix of data), becomes ours.
+ */
+struct dfuse_row_update {
+    struct dfuse_table *table;
+    char *key;
+    unsigned long key_length;
+    unsigned int column;	// --column-files: the one column it sets, plus one; see DFUSE_STMT_COLUMN.
+    char *data;
+    unsigned long length;
+    struct dfuse_json_parser *parser;
+    struct dfuse_update update;
+    struct dfuse_key_values key_values;	// What the WHERE's params point at.
+    MYSQL_BIND *params;
+};
+
+void dfuse_row_update_free( struct dfuse_row_update *u )
+{
+    if ( u->params ) { DFUSE_FREE( u->params ); }
+
+    dfuse_update_free( &u->update );
+    dfuse_json_parser_free( u->parser );
+    dfuse_key_values_free( &u->key_values );
+
+    u->params = NULL;
+    u->parser = NULL;
+}
+
+/*
+ * Turns u's data into binds for its table's UPDATE.  Everything that can be wrong with what was
+ * written shows up here, rather than at execute time.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+int dfuse_row_update_prepare( MYSQL *sql, struct dfuse_row_update *u )
+{
+    struct dfuse_schema *schema;
+    unsigned int i, num_params;
+    int rv;
+
+    u->params = NULL;
+    u->key_values.buffer = NULL;
+    memset( &u->update, 0, sizeof( u->update ) );
+
+    if ( json )
+    {
+	if ( !( schema = dfuse_json_schema( sql, u->table ) ) )
+	{
+	    dfuse_row_update_free( u );
+	    return -EIO;
+	}
+
+	if ( !schema->update_sql )
+	{
+	    dfuse_row_update_free( u );
+	    return -EROFS;
+	}
+
+	// Only whatever dfuse_write didn't already get to needs parsing (all of it, if it
+	// didn't get to any).
+	if ( u->parser && u->parser->fed > u->length )
+	{
+	    dfuse_json_parser_free( u->parser );
+	    u->parser = NULL;
+	}
+
+	if ( !u->parser && !( u->parser = dfuse_json_parser_new() ) )
+	{
+	    return -ENOMEM;
+	}
+
+	if ( u->parser->fed < u->length )
+	{
+	    dfuse_json_feed( u->parser, u->data + u->parser->fed, u->length - u->parser->fed );
+	}
+
+	if ( ( rv = dfuse_json_finish( u->parser ) )
+	  || ( rv = forge_update( u->parser->tokens, u->parser->num_tokens, schema, &u->update ) ) )
+	{
+	    dfuse_row_update_free( u );
+	    return rv;
+	}
+
+	num_params = 2 * u->update.num_fields;
+    }
+    else
+    {
+	num_params = 1;
+    }
+
+    if ( ( rv = dfuse_key_split( u->table, u->key, u->key_length, &u->key_values ) ) )
+    {
+	dfuse_row_update_free( u );
+	return rv;
+    }
+
+    num_params += u->key_values.count;
+
+    if ( !( u->params = DFUSE_MALLOC( sizeof( MYSQL_BIND ) * num_params ) ) )
+    {
+	dfuse_row_update_free( u );
+	return -ENOMEM;
+    }
+
+    memset( u->params, 0, sizeof( MYSQL_BIND ) * num_params );
+
+    if ( json )
+    {
+	for ( i = 0; i < u->update.num_fields; i++ )
+	{
+	    u->params[2*i].buffer_type = MYSQL_TYPE_TINY;
+	    u->params[2*i].buffer = &u->update.keep[i];
+
+	    u->params[2*i+1].buffer_type = MYSQL_TYPE_STRING;
+	    u->params[2*i+1].buffer = u->update.values[i];
+	    u->params[2*i+1].buffer_length = u->update.lengths[i];
+	    u->params[2*i+1].length = &u->update.lengths[i];
+	    u->params[2*i+1].is_null = &u->update.is_null[i];
+	}
+    }
+    else
+    {
+	u->params[0].buffer_type = MYSQL_TYPE_STRING;
+	u->params[0].buffer = u->data;
+	u->params[0].buffer_length = u->length;
+	u->params[0].length = &u->length;
+    }
+
+    dfuse_key_bind( &u->key_values, u->params + num_params - u->key_values.count );
+
+    return 0;
+}
+
+// Runs a prepared update on this thread's connection, inside whatever transaction it's in.
+int dfuse_row_update_execute( struct dfuse_row_update *u )
+{
+    MYSQL_STMT *stmt;
+    int rv;
+
+    if ( !( rv = dfuse_stmt_execute_binds( u->table, DFUSE_STMT_COLUMN( u->column, DFUSE_STMT_UPDATE ), u->params, &stmt ) ) )
+    {
+	mysql_stmt_free_result( stmt );
+    }
+
+    return rv;
+}
+
+/*
+ * Runs a prepared update in a transaction of its own.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+int dfuse_row_update_commit( MYSQL *sql, struct dfuse_row_update *u )
+{
+    int rv;
+
+    if ( dfuse_query( sql, "START TRANSACTION" ) )
+    {
+	D( "Failed to start a transaction: %s\n", mysql_error( sql ) );
+	rv = -EIO;
+    }
+    else if ( ( rv = dfuse_row_update_execute( u ) ) )
+    {
+	dfuse_query( sql, "ROLLBACK" );
+    }
+    else if ( dfuse_query( sql, "COMMIT" ) )
+    {
+	D( "Failed to commit: %s\n", mysql_error( sql ) );
+	dfuse_query( sql, "ROLLBACK" );
+	rv = -EIO;
+    }
+
+    dfuse_invalidate( u->table, u->key, u->key_length );
+
+    return rv;
+}
+
+/*
+ * --write-back: instead of running its UPDATE, flush hands it to a committer thread, which
+ * applies them in batches of up to --write-back-batch, each batch one transaction, so the server
+ * pays for one commit per batch rather than one per file.  A batch goes when it's full, when the
+ * oldest write in it is --write-back-delay ms old, or as soon as somebody fsync()s, or stats or
+ * opens a file that's still queued.
+ */
+struct dfuse_wb_waiter {
+    int done;
+    int rv;
+};
+
+struct dfuse_wb_entry {
+    struct dfuse_row_update u;	// Its key and data are copies, owned by the entry.
+    unsigned long long seq;
+    int rv;
+    struct dfuse_wb_waiter *waiter;	// fsync() is waiting on this one.
+    struct dfuse_wb_entry *next;
+};
+
+struct dfuse_write_back {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;	// For the committer: there's work, or it's time to stop.
+    pthread_cond_t done;	// For everybody else: a batch is finished.
+    pthread_t thread;
+    int running;
+    int stopping;
+
+    struct dfuse_wb_entry *head;
+    struct dfuse_wb_entry **tail;
+    struct dfuse_wb_entry *committing;	// The batch the committer has in hand, if any.
+    unsigned int pending;
+    unsigned int urgent;	// fsync()s waiting, so there's no point letting the batch fill.
+    unsigned long long enqueued;	// Sequence numbers: everything up to completed has been applied.
+    unsigned long long completed;
+
+    // Stats, for dfuse_write_back_report.
+    unsigned long long batches;
+    unsigned long long batch_failures;
+    unsigned long long rows;
+    unsigned long long row_failures;
+    unsigned long long queue_waits;
+} write_back = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void dfuse_wb_entry_free( struct dfuse_wb_entry *e )
+{
+    dfuse_row_update_free( &e->u );
+
+    if ( e->u.key ) { DFUSE_FREE( e->u.key ); }
+    if ( e->u.data ) { DFUSE_FREE( e->u.data ); }
+
+    DFUSE_FREE( e );
+}
+
+/*
+ * Applies a batch in one transaction.  If that fails, it's retried a row at a time, so one bad
+ * row only costs itself.  Sets every entry's rv.
+ *
+ * @returns 0 if the batch went in as one transaction.
+ */
+static int dfuse_write_back_commit( struct dfuse_wb_entry *batch )
+{
+    MYSQL *sql;
+    struct dfuse_wb_entry *e;
+    int rv = 0;
+
+    if ( !( sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	for ( e = batch; e; e = e->next )
+	{
+	    e->rv = -EIO;
+	}
+
+	return -EIO;
+    }
+
+    if ( dfuse_query( sql, "START TRANSACTION" ) )
+    {
+	D( "Failed to start a transaction: %s\n", mysql_error( sql ) );
+	rv = -EIO;
+    }
+
+    for ( e = batch; !rv && e; e = e->next )
+    {
+	rv = dfuse_row_update_execute( &e->u );
+    }
+
+    if ( !rv && dfuse_query( sql, "COMMIT" ) )
+    {
+	D( "Failed to commit: %s\n", mysql_error( sql ) );
+	rv = -EIO;
+    }
+
+    if ( rv )
+    {
+	dfuse_query( sql, "ROLLBACK" );
+
+	for ( e = batch; e; e = e->next )
+	{
+	    e->rv = dfuse_row_update_commit( sql, &e->u );
+	}
+    }
+    else
+    {
+	for ( e = batch; e; e = e->next )
+	{
+	    e->rv = 0;
+	    dfuse_invalidate( e->u.table, e->u.key, e->u.key_length );
+	}
+    }
+
+    dfuse_checkin();
+
+    return rv;
+}
+
+static void *dfuse_write_back_run( void *unused )
+{
+    struct dfuse_wb_entry *batch, *e, **pp;
+    struct timeval now;
+    struct timespec deadline;
+    unsigned int n;
+    int rv;
+
+    pthread_mutex_lock( &write_back.lock );
+
+    for ( ;; )
+    {
+	while ( !write_back.head && !write_back.stopping )
+	{
+	    pthread_cond_wait( &write_back.wake, &write_back.lock );
+	}
+
+	// Stopping, and nothing left to drain.
+	if ( !write_back.head )
+	{
+	    break;
+	}
+
+	// Let the batch fill up, within reason.
+	gettimeofday( &now, NULL );
+	deadline.tv_sec = now.tv_sec + options.write_back_delay / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + ( options.write_back_delay % 1000 ) * 1000000;
+	if ( deadline.tv_nsec >= 1000000000 )
+	{
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000;
+	}
+
+	while ( write_back.pending < options.write_back_batch && !write_back.urgent && !write_back.stopping )
+	{
+	    if ( pthread_cond_timedwait( &write_back.wake, &write_back.lock, &deadline ) == ETIMEDOUT )
+	    {
+		break;
+	    }
+	}
+
+	batch = write_back.head;
+	for ( n = 0, pp = &batch; *pp && n < options.write_back_batch; pp = &(*pp)->next )
+	{
+	    n++;
+	}
+
+	write_back.head = *pp;
+	*pp = NULL;
+	if ( !write_back.head )
+	{
+	    write_back.tail = &write_back.head;
+	}
+	write_back.pending -= n;
+	write_back.committing = batch;
+
+	pthread_mutex_unlock( &write_back.lock );
+
+	rv = dfuse_write_back_commit( batch );
+
+	pthread_mutex_lock( &write_back.lock );
+
+	write_back.committing = NULL;
+
+	write_back.batches++;
+	write_back.rows += n;
+	if ( rv )
+	{
+	    write_back.batch_failures++;
+	}
+
+	while ( ( e = batch ) )
+	{
+	    batch = e->next;
+
+	    write_back.completed = e->seq;
+
+	    if ( e->rv )
+	    {
+		write_back.row_failures++;
+		D( "Lost a write-back: %d.\n", e->rv );
+	    }
+
+	    if ( e->waiter )
+	    {
+		e->waiter->rv = e->rv;
+		e->waiter->done = 1;
+		write_back.urgent--;
+	    }
+
+	    dfuse_wb_entry_free( e );
+	}
+
+	pthread_cond_broadcast( &write_back.done );
+    }
+
+    pthread_mutex_unlock( &write_back.lock );
+
+    return NULL;
+}
+
+int dfuse_write_back_start( void )
+{
+    write_back.tail = &write_back.head;
+
+    if ( pthread_create( &write_back.thread, NULL, dfuse_write_back_run, NULL ) )
+    {
+	return -1;
+    }
+
+    write_back.running = 1;
+
+    return 0;
+}
+
+// Drains the queue, then stops the committer.
+void dfuse_write_back_stop( void )
+{
+    if ( !write_back.running )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &write_back.lock );
+    write_back.stopping = 1;
+    pthread_cond_signal( &write_back.wake );
+    pthread_mutex_unlock( &write_back.lock );
+
+    pthread_join( write_back.thread, NULL );
+
+    write_back.running = 0;
+}
+
+/*
+ * Queues fh's contents for the committer.  Caller holds fh->lock.  If waiter is set, it hears
+ * how the write went; see dfuse_write_back_wait.  Checks the caller's connection back in, since
+ * a full queue means waiting on the committer, and the committer may need it.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+int dfuse_write_back_enqueue( MYSQL *sql, struct dfuse_handle *fh, struct dfuse_wb_waiter *waiter )
+{
+    struct dfuse_wb_entry *e;
+    int rv;
+
+    if ( !( e = DFUSE_MALLOC( sizeof( struct dfuse_wb_entry ) ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    memset( e, 0, sizeof( *e ) );
+    e->waiter = waiter;
+    e->u.table = fh->table;
+    e->u.key_length = fh->key_length;
+    e->u.column = fh->column;
+    e->u.length = fh->length;
+
+    if ( !( e->u.key = DFUSE_MALLOC( fh->key_length+1 ) ) || !( e->u.data = DFUSE_MALLOC( fh->length+1 ) ) )
+    {
+	dfuse_wb_entry_free( e );
+	return -ENOMEM;
+    }
+
+    memcpy( e->u.key, fh->key, fh->key_length+1 );
+    memcpy( e->u.data, fh->data, fh->length+1 );
+
+    // What's been parsed of the handle has been parsed of the copy, too.
+    e->u.parser = fh->parser;
+    fh->parser = NULL;
+
+    if ( ( rv = dfuse_row_update_prepare( sql, &e->u ) ) )
+    {
+	dfuse_wb_entry_free( e );
+	return rv;
+    }
+
+    dfuse_checkin();
+
+    pthread_mutex_lock( &write_back.lock );
+
+    // Don't let writers get arbitrarily far ahead of the database.
+    while ( write_back.pending >= DFUSE_WRITE_BACK_QUEUE_BATCHES * options.write_back_batch )
+    {
+	write_back.queue_waits++;
+	pthread_cond_wait( &write_back.done, &write_back.lock );
+    }
+
+    e->seq = ++write_back.enqueued;
+    *write_back.tail = e;
+    write_back.tail = &e->next;
+    write_back.pending++;
+
+    if ( waiter )
+    {
+	write_back.urgent++;
+    }
+
+    pthread_cond_signal( &write_back.wake );
+
+    pthread_mutex_unlock( &write_back.lock );
+
+    // stat() and open() wait for the committer (see dfuse_write_back_settle), which invalidates
+    // again once it's in.
+    dfuse_invalidate( fh->table, fh->key, fh->key_length );
+
+    return 0;
+}
+
+/*
+ * Waits until nothing's queued for the row at key, so that stat() and open() after a close()
+ * see what was written rather than the row as it was.  A row that's queued goes to the front of
+ * the line, the same as for fsync().  Whether the write went in is close()'s business (and the
+ * log's); if it didn't, the caller sees the row as the server has it.
+ */
+void dfuse_write_back_settle( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    struct dfuse_wb_entry *lists[2], *e;
+    unsigned long long target = 0;
+    unsigned int i;
+
+    if ( !options.write_back )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &write_back.lock );
+
+    lists[0] = write_back.committing;
+    lists[1] = write_back.head;
+
+    for ( i = 0; i < 2; i++ )
+    {
+	for ( e = lists[i]; e; e = e->next )
+	{
+	    if ( e->u.table == table && e->u.key_length == key_length && !memcmp( e->u.key, key, key_length ) )
+	    {
+		target = e->seq;
+	    }
+	}
+    }
+
+    if ( target > write_back.completed )
+    {
+	write_back.urgent++;
+	pthread_cond_signal( &write_back.wake );
+
+	while ( write_back.completed < target )
+	{
+	    pthread_cond_wait( &write_back.done, &write_back.lock );
+	}
+
+	write_back.urgent--;
+    }
+
+    pthread_mutex_unlock( &write_back.lock );
+}
+
+/*
+ * Waits for waiter's write, or, with no waiter, for everything queued so far.
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+int dfuse_write_back_wait( struct dfuse_wb_waiter *waiter )
+{
+    unsigned long long target;
+    int rv = 0;
+
+    pthread_mutex_lock( &write_back.lock );
+
+    if ( waiter )
+    {
+	while ( !waiter->done )
+	{
+	    pthread_cond_wait( &write_back.done, &write_back.lock );
+	}
+
+	rv = waiter->rv;
+    }
+    else
+    {
+	target = write_back.enqueued;
+
+	write_back.urgent++;
+	pthread_cond_signal( &write_back.wake );
+
+	while ( write_back.completed < target )
+	{
+	    pthread_cond_wait( &write_back.done, &write_back.lock );
+	}
+
+	write_back.urgent--;
+    }
+
+    pthread_mutex_unlock( &write_back.lock );
+
+    return rv;
+}
+
+void dfuse_write_back_report( void )
+{
+    if ( !options.write_back )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &write_back.lock );
+
+    syslog( LOG_INFO, "dfuse write-back: %u rows pending (%u batches), %llu batches committed (%llu retried row by row), "
+	"%llu rows (%llu lost), %llu waits for a full queue",
+	write_back.pending, ( write_back.pending + options.write_back_batch - 1 ) / options.write_back_batch,
+	write_back.batches, write_back.batch_failures, write_back.rows, write_back.row_failures, write_back.queue_waits );
+
+    pthread_mutex_unlock( &write_back.lock );
+}
+
+/*
+ * --binlog: a thread that follows the server's binary log the way a replica would, and evicts
+ * exactly the rows other writers change from the attribute cache, so --attr-ttl can be hours
+ * rather than seconds.  Row events are decoded just far enough to find the primary key; whatever
+ * we can't decode (a statement, a key type we don't render, DDL) costs a whole table's worth of
+ * cache, or all of it, never correctness.  While we're not following (not yet connected, or
+ * reconnecting) the cache is bypassed, and every reconnect starts from an empty one.
+ *
+ * Needs binlog_format=ROW to be useful, and a user with REPLICATION SLAVE and REPLICATION CLIENT.
+ * The kernel's own caches hear about the same changes; see dfuse_notify.
+ */
+enum
+{
+    DFUSE_BINLOG_QUERY = 2,
+    DFUSE_BINLOG_STOP = 3,
+    DFUSE_BINLOG_ROTATE = 4,
+    DFUSE_BINLOG_INTVAR = 5,
+    DFUSE_BINLOG_RAND = 13,
+    DFUSE_BINLOG_USER_VAR = 14,
+    DFUSE_BINLOG_FORMAT_DESCRIPTION = 15,
+    DFUSE_BINLOG_XID = 16,
+    DFUSE_BINLOG_TABLE_MAP = 19,
+    DFUSE_BINLOG_WRITE_ROWS_V1 = 23,
+    DFUSE_BINLOG_UPDATE_ROWS_V1 = 24,
+    DFUSE_BINLOG_DELETE_ROWS_V1 = 25,
+    DFUSE_BINLOG_HEARTBEAT = 27,
+    DFUSE_BINLOG_IGNORABLE = 28,
+    DFUSE_BINLOG_ROWS_QUERY = 29,
+    DFUSE_BINLOG_WRITE_ROWS = 30,
+    DFUSE_BINLOG_UPDATE_ROWS = 31,
+    DFUSE_BINLOG_DELETE_ROWS = 32,
+    DFUSE_BINLOG_GTID = 33,
+    DFUSE_BINLOG_ANONYMOUS_GTID = 34,
+    DFUSE_BINLOG_PREVIOUS_GTIDS = 35,
+    DFUSE_BINLOG_TRANSACTION_CONTEXT = 36,
+    DFUSE_BINLOG_VIEW_CHANGE = 37,
+    DFUSE_BINLOG_XA_PREPARE = 38,
+    DFUSE_BINLOG_PARTIAL_UPDATE_ROWS = 39,
+    DFUSE_BINLOG_HEARTBEAT_V2 = 41,
+    DFUSE_BINLOG_GTID_TAGGED = 42,
+    DFUSE_BINLOG_MARIADB_ANNOTATE_ROWS = 160,
+    DFUSE_BINLOG_MARIADB_CHECKPOINT = 161,
+    DFUSE_BINLOG_MARIADB_GTID = 162,
+    DFUSE_BINLOG_MARIADB_GTID_LIST = 163,
+    DFUSE_BINLOG_MARIADB_START_ENCRYPTION = 164,
+};
+
+// Timestamp, type, server id, size, next position and flags.
+#define DFUSE_BINLOG_HEADER 19
+
+// What a TABLE_MAP event said about one table id: enough to step through its rows.
+struct dfuse_binlog_map {
+    unsigned long long table_id;
+    struct dfuse_table *table;		// NULL if it isn't one of ours.
+    unsigned long num_columns;
+    unsigned char *types;
+    unsigned int *meta;
+    struct dfuse_binlog_map *next;
+};
+
+// Where a table's primary key columns sit in its rows, in the key's order, and which are UNSIGNED.
+struct dfuse_binlog_key {
+    int columns[DFUSE_MAX_KEY_COLUMNS];	// columns[0] is -1 until we've asked, -2 if we couldn't find out
+					// (or can't use the answer; see dfuse_binlog_key_column).
+    char is_unsigned[DFUSE_MAX_KEY_COLUMNS];
+};
+
+// Only the binlog thread touches this, until dfuse_binlog_stop() has joined it.
+struct dfuse_binlog {
+    pthread_t thread;
+    int running;
+    volatile int stopping;
+    int checksum;			// Events end in a CRC32, which we leave to TCP.
+    struct dfuse_binlog_map *maps;
+
+    // Per table: where its primary key is in a row.
+    struct dfuse_binlog_key *keys;
+
+    // -t as a schema and table name, or NULL if it's more than a name.
+    char *single[2];
+
+    unsigned long long events;
+    unsigned long long rows;
+    unsigned long long keys_invalidated;
+    unsigned long long tables_invalidated;
+    unsigned long long connects;
+} binlog;
+
+static unsigned long long dfuse_binlog_uint( const unsigned char *p, unsigned int n )
+{
+    unsigned long long rv = 0;
+
+    while ( n-- )
+    {
+	rv = ( rv << 8 ) | p[n];
+    }
+
+    return rv;
+}
+
+// A length-encoded integer.  @returns 0, or -1 if it runs off the end.
+static int dfuse_binlog_lenenc( const unsigned char **p, const unsigned char *end, unsigned long long *value )
+{
+    unsigned int n;
+
+    if ( *p >= end )
+    {
+	return -1;
+    }
+
+    switch ( **p )
+    {
+	case 0xfc: n = 2; break;
+	case 0xfd: n = 3; break;
+	case 0xfe: n = 8; break;
+	case 0xfb:
+	case 0xff: return -1;
+	default:
+	    *value = *(*p)++;
+	    return 0;
+    }
+
+    if ( end - *p <= n )
+    {
+	return -1;
+    }
+
+    *value = dfuse_binlog_uint( *p + 1, n );
+    *p += n + 1;
+
+    return 0;
+}
+
+/*
+ * Splits -t or -P into at most two parts (schema and name), undoing backtick quoting.  Anything
+ * fancier isn't something a binlog event could name.
+ *
+ * @returns How many parts there were, or 0.
+ */
+static int dfuse_unquote_identifier( const char *s, char **parts )
+{
+    const char *p = s;
+    char *out;
+    int n = 0, ok = 1;
+
+    parts[0] = parts[1] = NULL;
+
+    while ( ok && n < 2 )
+    {
+	if ( !( out = parts[n++] = DFUSE_MALLOC( strlen(s)+1 ) ) )
+	{
+	    ok = 0;
+	    break;
+	}
+
+	if ( *p == '`' )
+	{
+	    for ( p++; *p && ( *p != '`' || p[1] == '`' ); p++ )
+	    {
+		*out++ = *p;
+		p += *p == '`';
+	    }
+
+	    ok = *p++ == '`';
+	}
+	else
+	{
+	    for ( ; ( *p >= 'a' && *p <= 'z' ) || ( *p >= 'A' && *p <= 'Z' ) || ( *p >= '0' && *p <= '9' ) || *p == '_' || *p == '$'; p++ )
+	    {
+		*out++ = *p;
+	    }
+	}
+
+	*out = '\0';
+	ok = ok && *parts[n-1];
+
+	if ( ok && *p == '\0' )
+	{
+	    return n;
+	}
+
+	ok = ok && *p++ == '.';
+    }
+
+    if ( parts[0] ) { DFUSE_FREE( parts[0] ); }
+    if ( parts[1] ) { DFUSE_FREE( parts[1] ); }
+    parts[0] = parts[1] = NULL;
+
+    return 0;
+}
+
+// Which of our tables db.name is, if any.
+static struct dfuse_table *dfuse_binlog_table( const char *db, unsigned long db_length, const char *name, unsigned long name_length )
+{
+    const char *single_db = binlog.single[1] ? binlog.single[0] : options.database;
+    const char *single_name = binlog.single[1] ? binlog.single[1] : binlog.single[0];
+    struct dfuse_table *rv;
+    char *encoded;
+
+    if ( !multi_table )
+    {
+	// -t that isn't a plain name: any table might be behind it.
+	if ( !single_name )
+	{
+	    return &tables[0];
+	}
+
+	return strlen( single_db ) == db_length && !memcmp( single_db, db, db_length )
+	  && strlen( single_name ) == name_length && !memcmp( single_name, name, name_length ) ? &tables[0] : NULL;
+    }
+
+    if ( strlen( options.database ) != db_length || memcmp( options.database, db, db_length ) )
+    {
+	return NULL;
+    }
+
+    if ( !( encoded = urlencode( name, name_length ) ) )
+    {
+	return NULL;
+    }
+
+    rv = dfuse_find_table( encoded, strlen( encoded ) );
+
+    DFUSE_FREE( encoded );
+
+    return rv;
+}
+
+/*
+ * Where table's primary key columns sit in its rows, asked of information_schema the first time
+ * (and again after any DDL).  A row image holds a string key in its column's character set, and
+ * our cache holds it in the connection's, as spelled by whoever looked it up; unless the column
+ * compares bytewise (a binary collation) in the connection's character set, the two needn't
+ * match, so such a table's row events evict the whole table instead.
+ *
+ * @returns The first key column's 0-based position, or a negative number if we can't tell.
+ */
+static int dfuse_binlog_key_column( struct dfuse_table *table, const char *db, unsigned long db_length, const char *name, unsigned long name_length )
+{
+    struct dfuse_binlog_key *k = &binlog.keys[table->index];
+    MYSQL *sql;
+    MYSQL_RES *sql_res;
+    MYSQL_ROW sql_row;
+    char *key[2] = { NULL, NULL }, **names, *query, *p;
+    unsigned long length = 0;
+    unsigned int i, found = 0;
+
+    if ( k->columns[0] != -1 )
+    {
+	return k->columns[0];
+    }
+
+    // A -t we can't name means the event could be for any table at all.
+    if ( !multi_table && !binlog.single[0] )
+    {
+	return k->columns[0] = -2;
+    }
+
+    if ( table->key_columns > 1 )
+    {
+	names = table->key_names;
+    }
+    else if ( dfuse_unquote_identifier( table->prikey, key ) == 1 )
+    {
+	names = key;
+    }
+    else
+    {
+	// A schema-qualified -P has nothing to do with the key's place in a row.
+	if ( key[0] ) { DFUSE_FREE( key[0] ); }
+	if ( key[1] ) { DFUSE_FREE( key[1] ); }
+	return k->columns[0] = -2;
+    }
+
+    for ( i = 0; i < table->key_columns; i++ )
+    {
+	length += 2 * strlen( names[i] ) + 3;
+    }
+
+    // Failing to ask isn't an answer: we'll try again at its next TABLE_MAP.
+    if ( !( sql = dfuse_connect( NULL, NULL, NULL, NULL ) )
+      || !( query = DFUSE_MALLOC( 512 + 2 * ( db_length + name_length ) + length ) ) )
+    {
+	dfuse_checkin();
+	if ( key[0] ) { DFUSE_FREE( key[0] ); }
+	return -2;
+    }
+
+    p = query + sprintf( query, "SELECT COLUMN_NAME, ORDINAL_POSITION-1, COLUMN_TYPE LIKE '%%unsigned%%', "
+	"CHARACTER_SET_NAME IS NULL OR ( CHARACTER_SET_NAME='" );
+    p += mysql_real_escape_string( sql, p, mysql_character_set_name( sql ), strlen( mysql_character_set_name( sql ) ) );
+    p += sprintf( p, "' AND COLLATION_NAME LIKE '%%!_bin' ESCAPE '!' ) FROM information_schema.COLUMNS WHERE TABLE_SCHEMA='" );
+    p += mysql_real_escape_string( sql, p, db, db_length );
+    p += sprintf( p, "' AND TABLE_NAME='" );
+    p += mysql_real_escape_string( sql, p, name, name_length );
+    p += sprintf( p, "' AND COLUMN_NAME IN (" );
+
+    for ( i = 0; i < table->key_columns; i++ )
+    {
+	p += sprintf( p, "%s'", i ? "," : "" );
+	p += mysql_real_escape_string( sql, p, names[i], strlen( names[i] ) );
+	p += sprintf( p, "'" );
+    }
+
+    sprintf( p, ")" );
+
+    if ( !dfuse_query( sql, query ) && ( sql_res = mysql_store_result( sql ) ) )
+    {
+	while ( ( sql_row = mysql_fetch_row( sql_res ) ) )
+	{
+	    // Column names don't care about case, so the server's spelling needn't be ours.
+	    for ( i = 0; sql_row[0] && sql_row[1] && sql_row[2] && sql_row[3] && i < table->key_columns; i++ )
+	    {
+		if ( !strcasecmp( sql_row[0], names[i] ) && atoi( sql_row[3] ) )
+		{
+		    k->columns[i] = atoi( sql_row[1] );
+		    k->is_unsigned[i] = atoi( sql_row[2] );
+		    found |= 1U << i;
+		}
+	    }
+	}
+
+	mysql_free_result( sql_res );
+
+	if ( found != ( 1U << table->key_columns ) - 1 )
+	{
+	    k->columns[0] = -2;
+	}
+    }
+
+    dfuse_checkin();
+    DFUSE_FREE( query );
+    if ( key[0] ) { DFUSE_FREE( key[0] ); }
+
+    return k->columns[0] == -1 ? -2 : k->columns[0];
+}
+
+// Evicts one row (table and key), all of table (no key), or everything (no table either).
+static void dfuse_binlog_invalidate( struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    if ( key )
+    {
+	dfuse_invalidate( table, key, key_length );
+	binlog.keys_invalidated++;
+	return;
+    }
+
+    D( "Binlog: invalidating %s.\n", table ? table->name : "every table" );
+
+    dfuse_invalidate( table, NULL, 0 );
+    binlog.tables_invalidated++;
+}
+
+static void dfuse_binlog_free_maps( void )
+{
+    struct dfuse_binlog_map *m;
+
+    while ( ( m = binlog.maps ) )
+    {
+	binlog.maps = m->next;
+	if ( m->types ) { DFUSE_FREE( m->types ); }
+	if ( m->meta ) { DFUSE_FREE( m->meta ); }
+	DFUSE_FREE( m );
+    }
+}
+
+static void dfuse_binlog_table_map( const unsigned char *p, const unsigned char *end )
+{
+    struct dfuse_binlog_map *m, **mp;
+    const unsigned char *db, *name;
+    unsigned long long table_id, num_columns, meta_length;
+    unsigned long db_length, name_length, i;
+    const unsigned char *meta;
+
+    if ( end - p < 10 )
+    {
+	return;
+    }
+
+    table_id = dfuse_binlog_uint( p, 6 );
+    p += 8;
+
+    db_length = *p++;
+    db = p;
+    p += db_length + 1;
+
+    if ( p >= end )
+    {
+	return;
+    }
+
+    name_length = *p++;
+    name = p;
+    p += name_length + 1;
+
+    if ( dfuse_binlog_lenenc( &p, end, &num_columns ) || end - p < num_columns )
+    {
+	return;
+    }
+
+    for ( mp = &binlog.maps; ( m = *mp ) && m->table_id != table_id; mp = &m->next );
+
+    if ( m )
+    {
+	*mp = m->next;
+	if ( m->types ) { DFUSE_FREE( m->types ); }
+	if ( m->meta ) { DFUSE_FREE( m->meta ); }
+    }
+    else if ( !( m = DFUSE_MALLOC( sizeof( struct dfuse_binlog_map ) ) ) )
+    {
+	return;
+    }
+
+    memset( m, 0, sizeof( *m ) );
+    m->table_id = table_id;
+    m->next = binlog.maps;
+    binlog.maps = m;
+
+    if ( !( m->table = dfuse_binlog_table( (const char *)db, db_length, (const char *)name, name_length ) ) )
+    {
+	return;
+    }
+
+    if ( dfuse_binlog_key_column( m->table, (const char *)db, db_length, (const char *)name, name_length ) < 0 )
+    {
+	return;
+    }
+
+    if ( !( m->types = DFUSE_MALLOC( num_columns+1 ) ) || !( m->meta = DFUSE_MALLOC( sizeof( unsigned int ) * ( num_columns+1 ) ) ) )
+    {
+	return;
+    }
+
+    memcpy( m->types, p, num_columns );
+    p += num_columns;
+
+    if ( dfuse_binlog_lenenc( &p, end, &meta_length ) || end - p < meta_length )
+    {
+	return;
+    }
+
+    meta = p;
+
+    // Each type has its own idea of how many bytes of metadata it gets, and in what order.
+    for ( i = 0; i < num_columns; i++ )
+    {
+	switch ( m->types[i] )
+	{
+	    case MYSQL_TYPE_FLOAT:
+	    case MYSQL_TYPE_DOUBLE:
+	    case MYSQL_TYPE_BLOB:
+	    case MYSQL_TYPE_GEOMETRY:
+	    case 17:	// MYSQL_TYPE_TIMESTAMP2
+	    case 18:	// MYSQL_TYPE_DATETIME2
+	    case 19:	// MYSQL_TYPE_TIME2
+	    case 242:	// MYSQL_TYPE_VECTOR
+	    case 245:	// MYSQL_TYPE_JSON
+		if ( meta + 1 > p + meta_length ) { return; }
+		m->meta[i] = meta[0];
+		meta += 1;
+		break;
+	    case MYSQL_TYPE_VARCHAR:
+	    case MYSQL_TYPE_VAR_STRING:
+	    case MYSQL_TYPE_BIT:
+		if ( meta + 2 > p + meta_length ) { return; }
+		m->meta[i] = meta[0] | ( meta[1] << 8 );
+		meta += 2;
+		break;
+	    case MYSQL_TYPE_NEWDECIMAL:
+	    case MYSQL_TYPE_STRING:
+	    case MYSQL_TYPE_ENUM:
+	    case MYSQL_TYPE_SET:
+		if ( meta + 2 > p + meta_length ) { return; }
+		m->meta[i] = ( meta[0] << 8 ) | meta[1];
+		meta += 2;
+		break;
+	    default:
+		m->meta[i] = 0;
+		break;
+	}
+    }
+
+    // Only now is the map any use for decoding rows.
+    m->num_columns = num_columns;
+}
+
+/*
+ * How many bytes a value of the given type takes up in a row image, *prefix of them being its
+ * length.
+ *
+ * @returns The size, or -1 for a type we don't know or a value that runs off the end.
+ */
+static long long dfuse_binlog_value_size( unsigned char type, unsigned int meta, const unsigned char *p, const unsigned char *end, unsigned int *prefix )
+{
+    static const unsigned char dig2bytes[10] = { 0, 1, 1, 2, 2, 3, 3, 4, 4, 4 };
+    unsigned int real_type, length, intg, frac;
+
+    *prefix = 0;
+
+    switch ( type )
+    {
+	case MYSQL_TYPE_NULL: return 0;
+	case MYSQL_TYPE_TINY: case MYSQL_TYPE_YEAR: return 1;
+	case MYSQL_TYPE_SHORT: return 2;
+	case MYSQL_TYPE_INT24: case MYSQL_TYPE_DATE: case MYSQL_TYPE_TIME: case MYSQL_TYPE_NEWDATE: return 3;
+	case MYSQL_TYPE_LONG: case MYSQL_TYPE_TIMESTAMP: return 4;
+	case MYSQL_TYPE_LONGLONG: case MYSQL_TYPE_DATETIME: return 8;
+	case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE: return meta;
+	case 17: return 4 + ( meta + 1 ) / 2;
+	case 18: return 5 + ( meta + 1 ) / 2;
+	case 19: return 3 + ( meta + 1 ) / 2;
+	case MYSQL_TYPE_BIT: return ( meta >> 8 ) + ( ( meta & 0xff ) != 0 );
+	case MYSQL_TYPE_NEWDECIMAL:
+	    intg = ( meta >> 8 ) - ( meta & 0xff );
+	    frac = meta & 0xff;
+	    return ( intg / 9 ) * 4 + dig2bytes[intg % 9] + ( frac / 9 ) * 4 + dig2bytes[frac % 9];
+	case MYSQL_TYPE_VARCHAR:
+	case MYSQL_TYPE_VAR_STRING:
+	    *prefix = meta > 255 ? 2 : 1;
+	    break;
+	case MYSQL_TYPE_BLOB:
+	case MYSQL_TYPE_GEOMETRY:
+	case 242:
+	case 245:
+	    if ( meta < 1 || meta > 4 ) { return -1; }
+	    *prefix = meta;
+	    break;
+	case MYSQL_TYPE_STRING:
+	case MYSQL_TYPE_ENUM:
+	case MYSQL_TYPE_SET:
+	    // CHAR longer than 255 bytes borrows two bits of the type byte for its length.
+	    real_type = meta >> 8;
+	    length = meta & 0xff;
+	    if ( ( real_type & 0x30 ) != 0x30 )
+	    {
+		length |= ( ( real_type & 0x30 ) ^ 0x30 ) << 4;
+		real_type |= 0x30;
+	    }
+
+	    if ( real_type == MYSQL_TYPE_ENUM || real_type == MYSQL_TYPE_SET )
+	    {
+		return length;
+	    }
+
+	    *prefix = length > 255 ? 2 : 1;
+	    break;
+	default:
+	    return -1;
+    }
+
+    if ( end - p < *prefix )
+    {
+	return -1;
+    }
+
+    return *prefix + dfuse_binlog_uint( p, *prefix );
+}
+
+/*
+ * Steps *p over one row image (its columns-present bitmap is present), picking out the primary
+ * key's count columns (as k says where they are) as the text a SELECT would have given us, in
+ * buf if they need rendering.
+ *
+ * @returns 1 with the columns in values and lengths, 0 if the image doesn't include any of them
+ * (an UPDATE's after image under binlog_row_image=MINIMAL), or -1 if we can't make them out.
+ */
+static int dfuse_binlog_row_key( const struct dfuse_binlog_map *m, const struct dfuse_binlog_key *k, unsigned int count,
+    const unsigned char *present, const unsigned char **p, const unsigned char *end, char (*buf)[32], char **values,
+    unsigned long *lengths )
+{
+    const unsigned char *nulls;
+    unsigned long i, j, num_present = 0;
+    unsigned int prefix, c, found = 0;
+    unsigned long long value;
+    long long size;
+
+    for ( i = 0; i < m->num_columns; i++ )
+    {
+	num_present += ( present[i/8] >> ( i%8 ) ) & 1;
+    }
+
+    nulls = *p;
+    if ( end - *p < ( num_present + 7 ) / 8 )
+    {
+	return -1;
+    }
+    *p += ( num_present + 7 ) / 8;
+
+    for ( i = 0, j = 0; i < m->num_columns; i++ )
+    {
+	if ( !( ( present[i/8] >> ( i%8 ) ) & 1 ) )
+	{
+	    continue;
+	}
+
+	for ( c = 0; c < count && k->columns[c] != (int)i; c++ );
+
+	if ( ( nulls[j/8] >> ( j%8 ) ) & 1 )
+	{
+	    j++;
+	    if ( c < count )
+	    {
+		return -1;
+	    }
+	    continue;
+	}
+	j++;
+
+	if ( ( size = dfuse_binlog_value_size( m->types[i], m->meta[i], *p, end, &prefix ) ) < 0 || end - *p < size )
+	{
+	    return -1;
+	}
+
+	if ( c < count )
+	{
+	    switch ( m->types[i] )
+	    {
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_LONGLONG:
+		    value = dfuse_binlog_uint( *p, size );
+
+		    if ( k->is_unsigned[c] || value < 1ULL << ( 8*size - 1 ) )
+		    {
+			sprintf( buf[c], "%llu", value );
+		    }
+		    else
+		    {
+			// Negative: two's complement in size bytes.
+			sprintf( buf[c], "-%llu", ( ~value + 1 ) & ( ~0ULL >> ( 64 - 8*size ) ) );
+		    }
+
+		    values[c] = buf[c];
+		    lengths[c] = strlen( buf[c] );
+		    break;
+		case MYSQL_TYPE_VARCHAR:
+		case MYSQL_TYPE_VAR_STRING:
+		case MYSQL_TYPE_BLOB:
+		case MYSQL_TYPE_STRING:
+		    if ( !prefix )
+		    {
+			return -1;		// An ENUM or SET.
+		    }
+
+		    values[c] = (char *)*p + prefix;
+		    lengths[c] = size - prefix;
+		    break;
+		default:
+		    return -1;
+	    }
+
+	    found |= 1U << c;
+	}
+
+	*p += size;
+    }
+
+    // Some of a composite key but not all of it (MINIMAL, again) is a new key we can't name.
+    if ( !found )
+    {
+	return 0;
+    }
+
+    return found == ( 1U << count ) - 1 ? 1 : -1;
+}
+
+static void dfuse_binlog_rows( int type, const unsigned char *p, const unsigned char *end )
+{
+    struct dfuse_binlog_map *m;
+    const unsigned char *present[2];
+    unsigned long long table_id, num_columns;
+    unsigned long extra;
+    const struct dfuse_binlog_key *k;
+    char *values[DFUSE_MAX_KEY_COLUMNS], *joined;
+    unsigned long lengths[DFUSE_MAX_KEY_COLUMNS], key_length;
+    const char *key;
+    char buf[DFUSE_MAX_KEY_COLUMNS][32];
+    int images, i;
+
+    if ( end - p < 8 )
+    {
+	return;
+    }
+
+    table_id = dfuse_binlog_uint( p, 6 );
+    p += 8;
+
+    for ( m = binlog.maps; m && m->table_id != table_id; m = m->next );
+
+    if ( !m )
+    {
+	// We missed its TABLE_MAP, so it could be anybody's.
+	dfuse_binlog_invalidate( NULL, NULL, 0 );
+	return;
+    }
+
+    if ( !m->table )
+    {
+	return;
+    }
+
+    if ( type >= DFUSE_BINLOG_WRITE_ROWS )
+    {
+	extra = end - p >= 2 ? dfuse_binlog_uint( p, 2 ) : 0;
+	if ( extra < 2 || end - p < extra )
+	{
+	    dfuse_binlog_invalidate( m->table, NULL, 0 );
+	    return;
+	}
+	p += extra;
+    }
+
+    images = type == DFUSE_BINLOG_UPDATE_ROWS || type == DFUSE_BINLOG_UPDATE_ROWS_V1 ? 2 : 1;
+    k = &binlog.keys[m->table->index];
+
+    // A partial JSON update's after image isn't in the usual format, and we'd rather not guess.
+    if ( type == DFUSE_BINLOG_PARTIAL_UPDATE_ROWS || k->columns[0] < 0 || !m->num_columns
+      || dfuse_binlog_lenenc( &p, end, &num_columns ) || num_columns != m->num_columns
+      || end - p < images * ( ( num_columns + 7 ) / 8 ) )
+    {
+	dfuse_binlog_invalidate( m->table, NULL, 0 );
+	return;
+    }
+
+    for ( i = 0; i < images; i++ )
+    {
+	present[i] = p;
+	p += ( num_columns + 7 ) / 8;
+    }
+
+    while ( p < end )
+    {
+	binlog.rows++;
+
+	for ( i = 0; i < images; i++ )
+	{
+	    switch ( dfuse_binlog_row_key( m, k, m->table->key_columns, present[i], &p, end, buf, values, lengths ) )
+	    {
+		case 1:
+		    if ( !( key = dfuse_row_key_ref( m->table, values, lengths, &key_length, &joined ) ) )
+		    {
+			dfuse_binlog_invalidate( m->table, NULL, 0 );
+			return;
+		    }
+
+		    dfuse_binlog_invalidate( m->table, key, key_length );
+		    if ( joined ) { DFUSE_FREE( joined ); }
+		    break;
+		case 0:
+		    // An INSERT or DELETE always carries its key.
+		    if ( images == 2 )
+		    {
+			break;
+		    }
+		    // Fall through.
+		default:
+		    dfuse_binlog_invalidate( m->table, NULL, 0 );
+		    return;
+	    }
+	}
+    }
+}
+
+// A statement: BEGIN and COMMIT are harmless, and anything else could have changed anything.
+static void dfuse_binlog_query( const unsigned char *p, const unsigned char *end )
+{
+    unsigned long db_length, status_length, query_length;
+    unsigned int i;
+
+    if ( end - p < 13 )
+    {
+	return;
+    }
+
+    db_length = p[8];
+    status_length = dfuse_binlog_uint( p+11, 2 );
+    p += 13 + status_length + db_length + 1;
+
+    if ( p > end )
+    {
+	return;
+    }
+
+    query_length = end - p;
+
+    if ( ( query_length == 5 && !memcmp( p, "BEGIN", 5 ) ) || ( query_length == 6 && !memcmp( p, "COMMIT", 6 ) ) )
+    {
+	return;
+    }
+
+    D( "Binlog statement: '%.40s'.\n", p );
+
+    // DDL may have moved the primary key around, too.
+    for ( i = 0; i < num_tables; i++ )
+    {
+	binlog.keys[i].columns[0] = -1;
+    }
+
+    dfuse_binlog_invalidate( NULL, NULL, 0 );
+}
+
+/*
+ * One event, header and all (but no checksum).  Anything we don't know to be harmless (a
+ * compressed transaction, LOAD DATA, some event type newer than us) could have changed anything.
+ */
+static void dfuse_binlog_event( const unsigned char *event, unsigned long length )
+{
+    const unsigned char *end = event + length;
+
+    if ( length < DFUSE_BINLOG_HEADER )
+    {
+	return;
+    }
+
+    binlog.events++;
+
+    switch ( event[4] )
+    {
+	case DFUSE_BINLOG_QUERY:
+	    dfuse_binlog_query( event + DFUSE_BINLOG_HEADER, end );
+	    break;
+	case DFUSE_BINLOG_ROTATE:
+	    // A new file is as good a time as any to forget table ids nobody uses any more.
+	    dfuse_binlog_free_maps();
+	    break;
+	case DFUSE_BINLOG_TABLE_MAP:
+	    dfuse_binlog_table_map( event + DFUSE_BINLOG_HEADER, end );
+	    break;
+	case DFUSE_BINLOG_WRITE_ROWS_V1:
+	case DFUSE_BINLOG_UPDATE_ROWS_V1:
+	case DFUSE_BINLOG_DELETE_ROWS_V1:
+	case DFUSE_BINLOG_WRITE_ROWS:
+	case DFUSE_BINLOG_UPDATE_ROWS:
+	case DFUSE_BINLOG_DELETE_ROWS:
+	case DFUSE_BINLOG_PARTIAL_UPDATE_ROWS:
+	    dfuse_binlog_rows( event[4], event + DFUSE_BINLOG_HEADER, end );
+	    break;
+	// Bookkeeping, or context for a QUERY or rows event that follows (and speaks for itself).
+	case DFUSE_BINLOG_STOP:
+	case DFUSE_BINLOG_INTVAR:
+	case DFUSE_BINLOG_RAND:
+	case DFUSE_BINLOG_USER_VAR:
+	case DFUSE_BINLOG_FORMAT_DESCRIPTION:
+	case DFUSE_BINLOG_XID:
+	case DFUSE_BINLOG_HEARTBEAT:
+	case DFUSE_BINLOG_IGNORABLE:
+	case DFUSE_BINLOG_ROWS_QUERY:
+	case DFUSE_BINLOG_GTID:
+	case DFUSE_BINLOG_ANONYMOUS_GTID:
+	case DFUSE_BINLOG_PREVIOUS_GTIDS:
+	case DFUSE_BINLOG_TRANSACTION_CONTEXT:
+	case DFUSE_BINLOG_VIEW_CHANGE:
+	case DFUSE_BINLOG_XA_PREPARE:
+	case DFUSE_BINLOG_HEARTBEAT_V2:
+	case DFUSE_BINLOG_GTID_TAGGED:
+	case DFUSE_BINLOG_MARIADB_ANNOTATE_ROWS:
+	case DFUSE_BINLOG_MARIADB_CHECKPOINT:
+	case DFUSE_BINLOG_MARIADB_GTID:
+	case DFUSE_BINLOG_MARIADB_GTID_LIST:
+	case DFUSE_BINLOG_MARIADB_START_ENCRYPTION:
+	    break;
+	default:
+	    D( "Binlog: event type %u.\n", event[4] );
+	    dfuse_binlog_invalidate( NULL, NULL, 0 );
+	    break;
+    }
+}
+
+/*
+ * Connects, and asks to be sent everything logged from here on.
+ *
+ * @returns The connection, with the dump under way, or NULL (having logged why).
+ */
+static MYSQL *dfuse_binlog_connect( void )
+{
+    MYSQL *sql;
+    MYSQL_RES *sql_res;
+    MYSQL_ROW sql_row = NULL;
+    unsigned int timeout = 3 * DFUSE_BINLOG_HEARTBEAT_SECONDS;
+    unsigned long long position = 0;
+    unsigned char *packet;
+    unsigned long file_length = 0;
+    char query[128];
+    int rv;
+
+    if ( !( sql = mysql_init( NULL ) ) )
+    {
+	return NULL;
+    }
+
+    // Heartbeats (below) mean an idle server still talks to us; silence means it's gone.
+    mysql_options( sql, MYSQL_OPT_READ_TIMEOUT, &timeout );
+
+    if ( !mysql_real_connect( sql, MYSQLSERVER, MYSQLUSER, MYSQLPASS, MYSQLDB, 0, NULL, 0 ) )
+    {
+	syslog( LOG_WARNING, "dfuse binlog: couldn't connect: '%s'.", mysql_error( sql ) );
+	mysql_close( sql );
+	return NULL;
+    }
+
+    // A server that checksums its events won't send them to a client that doesn't say it copes.
+    // Servers too old to checksum don't know the variable; that's fine.
+    binlog.checksum = 0;
+
+    if ( !dfuse_query( sql, "SET @master_binlog_checksum = @@global.binlog_checksum, @source_binlog_checksum = @@global.binlog_checksum" )
+      && !dfuse_query( sql, "SELECT @@global.binlog_checksum" ) && ( sql_res = mysql_store_result( sql ) ) )
+    {
+	if ( ( sql_row = mysql_fetch_row( sql_res ) ) && sql_row[0] )
+	{
+	    binlog.checksum = !strcasecmp( sql_row[0], "CRC32" );
+	}
+
+	mysql_free_result( sql_res );
+    }
+
+    snprintf( query, sizeof( query ), "SET @master_heartbeat_period = %llu, @source_heartbeat_period = %llu",
+	DFUSE_BINLOG_HEARTBEAT_SECONDS * 1000000000ULL, DFUSE_BINLOG_HEARTBEAT_SECONDS * 1000000000ULL );
+    dfuse_query( sql, query );
+
+    // 8.4 renamed it.
+    if ( ( dfuse_query( sql, "SHOW MASTER STATUS" ) && dfuse_query( sql, "SHOW BINARY LOG STATUS" ) )
+      || !( sql_res = mysql_store_result( sql ) ) )
+    {
+	syslog( LOG_WARNING, "dfuse binlog: couldn't find the end of the binary log: '%s'.", mysql_error( sql ) );
+	mysql_close( sql );
+	return NULL;
+    }
+
+    if ( !( sql_row = mysql_fetch_row( sql_res ) ) || !sql_row[0] || !sql_row[1] )
+    {
+	syslog( LOG_WARNING, "dfuse binlog: the server isn't writing a binary log." );
+	mysql_free_result( sql_res );
+	mysql_close( sql );
+	return NULL;
+    }
+
+    file_length = strlen( sql_row[0] );
+    position = strtoull( sql_row[1], NULL, 10 );
+
+    // COM_BINLOG_DUMP: position (4), flags (2), our server id (4), file name.
+    if ( !( packet = DFUSE_MALLOC( 10 + file_length ) ) )
+    {
+	mysql_free_result( sql_res );
+	mysql_close( sql );
+	return NULL;
+    }
+
+    packet[0] = position; packet[1] = position >> 8; packet[2] = position >> 16; packet[3] = position >> 24;
+    packet[4] = packet[5] = 0;
+    packet[6] = options.binlog_server_id; packet[7] = options.binlog_server_id >> 8;
+    packet[8] = options.binlog_server_id >> 16; packet[9] = options.binlog_server_id >> 24;
+    memcpy( packet + 10, sql_row[0], file_length );
+
+    D( "Following the binlog from %s.\n", sql_row[0] );
+
+    mysql_free_result( sql_res );
+
+    rv = sql->methods->advanced_command( sql, COM_BINLOG_DUMP, NULL, 0, packet, 10 + file_length, 1, NULL );
+
+    DFUSE_FREE( packet );
+
+    if ( rv )
+    {
+	syslog( LOG_WARNING, "dfuse binlog: the server wouldn't send us its binary log: '%s'.", mysql_error( sql ) );
+	mysql_close( sql );
+	return NULL;
+    }
+
+    return sql;
+}
+
+static void *dfuse_binlog_run( void *unused )
+{
+    MYSQL *sql = NULL;
+    unsigned long length;
+    unsigned char *packet;
+    unsigned int waited;
+
+    dfuse_thread_init();
+
+    while ( !binlog.stopping )
+    {
+	if ( !sql )
+	{
+	    if ( !( sql = dfuse_binlog_connect() ) )
+	    {
+		// A second at a time, so unmounting doesn't have to wait it out.
+		for ( waited = 0; waited < DFUSE_BINLOG_RETRY_SECONDS && !binlog.stopping; waited++ )
+		{
+		    sleep( 1 );
+		}
+		continue;
+	    }
+
+	    // Whatever changed while we weren't listening, we'll never hear about.
+	    dfuse_binlog_invalidate( NULL, NULL, 0 );
+	    binlog.connects++;
+	    binlog_following = 1;
+	}
+
+	length = my_net_read( &sql->net );
+	packet = sql->net.read_pos;
+
+	// Every event comes behind an OK byte; anything else (an error, EOF, no server) ends it.
+	if ( length == packet_error || length < 1 || packet[0] != 0x00 )
+	{
+	    binlog_following = 0;
+
+	    if ( length != packet_error && length > 9 && packet[0] == 0xff )
+	    {
+		syslog( LOG_WARNING, "dfuse binlog: the server stopped sending: %llu '%.*s'.",
+		    dfuse_binlog_uint( packet+1, 2 ), (int)( length - 9 ), packet + 9 );
+	    }
+	    else if ( !binlog.stopping )
+	    {
+		syslog( LOG_WARNING, "dfuse binlog: lost the connection: '%s'.", mysql_error( sql ) );
+	    }
+
+	    mysql_close( sql );
+	    sql = NULL;
+	    continue;
+	}
+
+	dfuse_binlog_event( packet + 1, length - 1 - ( binlog.checksum && length > 5 ? 4 : 0 ) );
+    }
+
+    binlog_following = 0;
+
+    if ( sql )
+    {
+	mysql_close( sql );
+    }
+
+    dfuse_binlog_free_maps();
+
+    return NULL;
+}
+
+int dfuse_binlog_start( void )
+{
+    unsigned int i;
+
+    if ( !( binlog.keys = DFUSE_MALLOC( sizeof( struct dfuse_binlog_key ) * num_tables ) ) )
+    {
+	return -1;
+    }
+
+    memset( binlog.keys, 0, sizeof( struct dfuse_binlog_key ) * num_tables );
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	binlog.keys[i].columns[0] = -1;
+    }
+
+    if ( !multi_table && !dfuse_unquote_identifier( options.table, binlog.single ) )
+    {
+	syslog( LOG_WARNING, "dfuse binlog: -t '%s' isn't a table name, so any change to any table will flush its cache.", options.table );
+    }
+
+    if ( pthread_create( &binlog.thread, NULL, dfuse_binlog_run, NULL ) )
+    {
+	return -1;
+    }
+
+    binlog.running = 1;
+
+    return 0;
+}
+
+void dfuse_binlog_stop( void )
+{
+    if ( !binlog.running )
+    {
+	return;
+    }
+
+    // Waits at most a heartbeat for the thread to notice.
+    binlog.stopping = 1;
+    pthread_join( binlog.thread, NULL );
+
+    binlog.running = 0;
+}
+
+void dfuse_binlog_report( void )
+{
+    if ( !options.binlog )
+    {
+	return;
+    }
+
+    syslog( LOG_INFO, "dfuse binlog: %llu connects, %llu events, %llu rows, %llu keys and %llu tables invalidated",
+	binlog.connects, binlog.events, binlog.rows, binlog.keys_invalidated, binlog.tables_invalidated );
+}
+
+/*
+ * --poll=MS: for servers whose binlog we can't follow (not ROW format, or no replication grants),
+ * a thread that asks every MS ms which rows have changed since it last asked, and hands them to
+ * dfuse_invalidate.  With -T, that's the rows whose timestamp is no older than the server's clock
+ * at the previous tick: a scan, unless -T is an indexed column, and blind to deletes (which
+ * getattr still notices once --attr-ttl is up) and to rows committed by a transaction that
+ * started long before it.  Without -T, every tick has the server checksum every row, and compares
+ * with last time: it sees everything, but it's a full scan every tick, and costs us a few dozen
+ * bytes per row.  Fine for small tables; the rest are what -T and --binlog are for.
+ */
+struct dfuse_poll_sum {
+    char *key;
+    unsigned long key_length;
+    unsigned long long hash;
+    unsigned long long sum;	// 64 bits of the row's MD5, or ~0 if it had nothing to checksum.
+    unsigned long long tick;	// The last tick that saw the row.
+    struct dfuse_poll_sum *next;
+};
+
+// Checksum mode only: what the last tick saw of one table.
+struct dfuse_poll_table {
+    char *query;
+    struct dfuse_poll_sum **buckets;
+    unsigned long bucket_count;	// Always a power of two.
+    unsigned long count;
+};
+
+struct dfuse_poller {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;	// It's time to stop.
+    pthread_t thread;
+    int running;
+    int stopping;
+
+    // Only the poller thread touches the rest, until dfuse_poll_stop() has joined it.
+    long long since;		// -T mode: the server's clock at the last good tick, or -1.
+    unsigned long long tick;
+    struct dfuse_poll_table *tables;	// Checksum mode, per table.
+
+    unsigned long long ticks;
+    unsigned long long failures;
+    unsigned long long keys_invalidated;
+} poller = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void dfuse_poll_free_sum( struct dfuse_poll_sum *e )
+{
+    DFUSE_FREE( e->key );
+    DFUSE_FREE( e );
+}
+
+// Doubles pt's bucket array; failure to do so is harmless.
+static void dfuse_poll_grow( struct dfuse_poll_table *pt )
+{
+    struct dfuse_poll_sum **buckets, *e, *next;
+    unsigned long i, bucket_count;
+
+    bucket_count = pt->bucket_count ? pt->bucket_count * 2 : DFUSE_ATTR_CACHE_MIN_BUCKETS;
+
+    if ( !( buckets = calloc( bucket_count, sizeof( struct dfuse_poll_sum * ) ) ) )
+    {
+	return;
+    }
+
+    for ( i = 0; i < pt->bucket_count; i++ )
+    {
+	for ( e = pt->buckets[i]; e; e = next )
+	{
+	    next = e->next;
+	    e->next = buckets[e->hash & (bucket_count-1)];
+	    buckets[e->hash & (bucket_count-1)] = e;
+	}
+    }
+
+    free( pt->buckets );
+    pt->buckets = buckets;
+    pt->bucket_count = bucket_count;
+}
+
+/*
+ * Everything we serve from a row of table, as a list CONCAT_WS will take for checksumming it,
+ * each value QUOTE()d: CONCAT_WS skips NULLs, so otherwise (NULL,'x') and ('x',NULL) would sum
+ * the same, as would two values that differ only in where a separator falls.  That's -c in raw
+ * mode, the schema's columns in --json mode (NULL if one's an expression), and with
+ * --column-files, the columns we found (or, if the key's all there is, the key).
+ */
+char *dfuse_row_sum_columns( MYSQL *sql, struct dfuse_table *table )
+{
+    struct dfuse_schema *schema;
+    char *columns, *quoted, *joined;
+    unsigned int i;
+
+    if ( json )
+    {
+	if ( !( schema = dfuse_json_schema( sql, table ) ) || !schema->sum_sql )
+	{
+	    D( "Can't checksum '%s': some column is an expression.\n", table->name );
+	    return NULL;
+	}
+
+	return dfuse_asprintf( "%s", schema->sum_sql );
+    }
+
+    if ( !options.column_files )
+    {
+	return dfuse_asprintf( "QUOTE(%s)", options.columns );
+    }
+
+    if ( !table->num_columns )
+    {
+	return dfuse_asprintf( "%s", table->prikey );
+    }
+
+    for ( columns = NULL, i = 0; i < table->num_columns; i++ )
+    {
+	if ( !( quoted = dfuse_asprintf( "QUOTE(%s)", table->column_sql[i] ) ) )
+	{
+	    if ( columns ) { DFUSE_FREE( columns ); }
+	    return NULL;
+	}
+
+	joined = columns ? dfuse_asprintf( "%s,%s", columns, quoted ) : dfuse_asprintf( "%s", quoted );
+
+	DFUSE_FREE( quoted );
+	if ( columns ) { DFUSE_FREE( columns ); }
+
+	if ( !( columns = joined ) )
+	{
+	    return NULL;
+	}
+    }
+
+    return columns;
+}
+
+// The checksum query for table: every key, and 64 bits of an MD5 of all we serve from its row.
+static char *dfuse_poll_sums_sql( MYSQL *sql, struct dfuse_table *table )
+{
+    char *columns, *rv;
+
+    if ( !( columns = dfuse_row_sum_columns( sql, table ) ) )
+    {
+	return NULL;
+    }
+
+    rv = dfuse_asprintf( "SELECT %s,CONV(LEFT(MD5(CONCAT_WS(0x1f,%s)),16),16,10) FROM %s", table->prikey, columns,
+	table->sql_name );
+
+    DFUSE_FREE( columns );
+
+    return rv;
+}
+
+/*
+ * Checksum mode: reads every row of table, and invalidates the ones that are new, or whose
+ * checksum has changed, or that have gone.  The first tick only learns the checksums.
+ *
+ * @returns 0 on success, or -1 if the table couldn't be read, all of it.
+ */
+static int dfuse_poll_sums( MYSQL *sql, struct dfuse_table *table, int baseline )
+{
+    struct dfuse_poll_table *pt = &poller.tables[table->index];
+    struct dfuse_poll_sum **ep, *e;
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    unsigned long *lengths, i, key_length;
+    unsigned long long h, sum;
+    const char *key;
+    char *joined;
+    int rv = 0;
+
+    if ( !pt->query && !( pt->query = dfuse_poll_sums_sql( sql, table ) ) )
+    {
+	return -1;
+    }
+
+    if ( dfuse_query( sql, pt->query ) || !( res = mysql_use_result( sql ) ) )
+    {
+	D( "Poll failed: %s\n", mysql_error( sql ) );
+	return -1;
+    }
+
+    while ( ( row = mysql_fetch_row( res ) ) )
+    {
+	lengths = mysql_fetch_lengths( res );
+
+	if ( !( key = dfuse_row_key_ref( table, row, lengths, &key_length, &joined ) ) )
+	{
+	    continue;
+	}
+
+	sum = row[table->key_columns] ? strtoull( row[table->key_columns], NULL, 10 ) : ~0ULL;
+	h = dfuse_hash( key, key_length );
+
+	if ( pt->count >= pt->bucket_count )
+	{
+	    dfuse_poll_grow( pt );
+	}
+
+	if ( !pt->bucket_count )
+	{
+	    if ( joined ) { DFUSE_FREE( joined ); }
+	    rv = -1;
+	    break;
+	}
+
+	for ( e = pt->buckets[h & (pt->bucket_count-1)]; e; e = e->next )
+	{
+	    if ( e->hash == h && e->key_length == key_length && !memcmp( e->key, key, key_length ) )
+	    {
+		break;
+	    }
+	}
+
+	if ( !e )
+	{
+	    // A row we can't keep track of is a row we'd never see change.
+	    if ( !( e = DFUSE_MALLOC( sizeof( struct dfuse_poll_sum ) ) ) || !( e->key = DFUSE_MALLOC( key_length+1 ) ) )
+	    {
+		if ( e ) { DFUSE_FREE( e ); }
+		if ( joined ) { DFUSE_FREE( joined ); }
+		rv = -1;
+		break;
+	    }
+
+	    memcpy( e->key, key, key_length );
+	    e->key[key_length] = '\0';
+	    e->key_length = key_length;
+	    e->hash = h;
+	    e->sum = ~sum;
+	    e->next = pt->buckets[h & (pt->bucket_count-1)];
+	    pt->buckets[h & (pt->bucket_count-1)] = e;
+	    pt->count++;
+	}
+
+	if ( e->sum != sum && !baseline )
+	{
+	    dfuse_invalidate( table, e->key, e->key_length );
+	    poller.keys_invalidated++;
+	}
+
+	e->sum = sum;
+	e->tick = poller.tick;
+
+	if ( joined ) { DFUSE_FREE( joined ); }
+    }
+
+    // mysql_fetch_row() ends a result that broke off halfway just as it ends a whole one.
+    if ( !rv && mysql_errno( sql ) )
+    {
+	D( "Poll failed: %s\n", mysql_error( sql ) );
+	rv = -1;
+    }
+
+    mysql_free_result( res );
+
+    if ( rv )
+    {
+	return rv;
+    }
+
+    // Whatever this tick didn't see has been deleted.
+    for ( i = 0; i < pt->bucket_count; i++ )
+    {
+	for ( ep = &pt->buckets[i]; ( e = *ep ); )
+	{
+	    if ( e->tick != poller.tick )
+	    {
+		*ep = e->next;
+		dfuse_invalidate( table, e->key, e->key_length );
+		poller.keys_invalidated++;
+		dfuse_poll_free_sum( e );
+		pt->count--;
+		continue;
+	    }
+	    ep = &e->next;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * -T mode: invalidates every row of table whose timestamp says it changed since the last tick.
+ *
+ * @returns 0 on success, or -1 if the table couldn't be read, all of it.
+ */
+static int dfuse_poll_since( MYSQL *sql, struct dfuse_table *table )
+{
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    unsigned long *lengths, key_length;
+    const char *key;
+    char *query, *joined;
+    int rv = 0;
+
+    if ( !( query = dfuse_asprintf( "SELECT %s FROM %s WHERE (%s)>=%lld", table->prikey, table->sql_name,
+	options.timestamp, poller.since - DFUSE_POLL_OVERLAP_SECONDS ) ) )
+    {
+	return -1;
+    }
+
+    if ( dfuse_query( sql, query ) || !( res = mysql_use_result( sql ) ) )
+    {
+	D( "Poll failed: %s\n", mysql_error( sql ) );
+	DFUSE_FREE( query );
+	return -1;
+    }
+
+    DFUSE_FREE( query );
+
+    while ( ( row = mysql_fetch_row( res ) ) )
+    {
+	lengths = mysql_fetch_lengths( res );
+
+	if ( ( key = dfuse_row_key_ref( table, row, lengths, &key_length, &joined ) ) )
+	{
+	    dfuse_invalidate( table, key, key_length );
+	    poller.keys_invalidated++;
+	}
+
+	if ( joined ) { DFUSE_FREE( joined ); }
+    }
+
+    if ( mysql_errno( sql ) )
+    {
+	D( "Poll failed: %s\n", mysql_error( sql ) );
+	rv = -1;
+    }
+
+    mysql_free_result( res );
+
+    return rv;
+}
+
+/*
+ * One look at what's changed, in every table.  A tick that fails leaves the last good one as
+ * the starting point for the next, so nothing in between goes unseen.
+ *
+ * @returns 0 on success, or -1 if any table couldn't be read.
+ */
+static int dfuse_poll_tick( void )
+{
+    MYSQL *sql;
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    long long now = -1;
+    unsigned int i;
+    int rv = 0, baseline;
+
+    if ( !( sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	return -1;
+    }
+
+    // The server's clock, not ours: it's the one that wrote the timestamps.
+    if ( options.timestamp )
+    {
+	if ( dfuse_query( sql, "SELECT UNIX_TIMESTAMP()" ) || !( res = mysql_store_result( sql ) ) )
+	{
+	    D( "Poll failed: %s\n", mysql_error( sql ) );
+	    DFRV(-1);
+	}
+
+	if ( ( row = mysql_fetch_row( res ) ) && row[0] )
+	{
+	    now = strtoll( row[0], NULL, 10 );
+	}
+
+	mysql_free_result( res );
+
+	if ( now < 0 )
+	{
+	    DFRV(-1);
+	}
+    }
+
+    baseline = !poller.tick;
+    poller.tick++;
+
+    for ( i = 0; !rv && i < num_tables; i++ )
+    {
+	if ( options.timestamp )
+	{
+	    rv = baseline ? 0 : dfuse_poll_since( sql, &tables[i] );
+	}
+	else
+	{
+	    rv = dfuse_poll_sums( sql, &tables[i], baseline );
+	}
+    }
+
+    // Checksum mode has nothing to start over from until it's seen every table once.
+    if ( rv && baseline )
+    {
+	poller.tick = 0;
+    }
+
+    if ( !rv && options.timestamp )
+    {
+	poller.since = now;
+    }
+
+    DFRV(rv);
+}
+
+static void *dfuse_poll_run( void *unused )
+{
+    struct timeval now;
+    struct timespec deadline;
+
+    dfuse_thread_init();
+
+    pthread_mutex_lock( &poller.lock );
+
+    while ( !poller.stopping )
+    {
+	pthread_mutex_unlock( &poller.lock );
+
+	poller.ticks++;
+
+	if ( dfuse_poll_tick() )
+	{
+	    poller.failures++;
+
+	    if ( poll_following )
+	    {
+		syslog( LOG_WARNING, "dfuse poll: couldn't check for changes; caching is off until we can." );
+	    }
+
+	    poll_following = 0;
+	}
+	else if ( !poll_following )
+	{
+	    // Whatever got cached before we were looking, we can't vouch for.
+	    dfuse_invalidate( NULL, NULL, 0 );
+	    poll_following = 1;
+	}
+
+	gettimeofday( &now, NULL );
+	deadline.tv_sec = now.tv_sec + options.poll / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + ( options.poll % 1000 ) * 1000000;
+	if ( deadline.tv_nsec >= 1000000000 )
+	{
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock( &poller.lock );
+
+	while ( !poller.stopping )
+	{
+	    if ( pthread_cond_timedwait( &poller.wake, &poller.lock, &deadline ) == ETIMEDOUT )
+	    {
+		break;
+	    }
+	}
+    }
+
+    pthread_mutex_unlock( &poller.lock );
+
+    poll_following = 0;
+
+    return NULL;
+}
+
+int dfuse_poll_start( void )
+{
+    poller.since = -1;
+
+    if ( !options.timestamp && !( poller.tables = calloc( num_tables, sizeof( struct dfuse_poll_table ) ) ) )
+    {
+	return -1;
+    }
+
+    if ( pthread_create( &poller.thread, NULL, dfuse_poll_run, NULL ) )
+    {
+	return -1;
+    }
+
+    poller.running = 1;
+
+    return 0;
+}
+
+void dfuse_poll_stop( void )
+{
+    struct dfuse_poll_sum *e;
+    unsigned long i, j;
+
+    if ( poller.running )
+    {
+	pthread_mutex_lock( &poller.lock );
+	poller.stopping = 1;
+	pthread_cond_signal( &poller.wake );
+	pthread_mutex_unlock( &poller.lock );
+
+	pthread_join( poller.thread, NULL );
+
+	poller.running = 0;
+    }
+
+    if ( !poller.tables )
+    {
+	return;
+    }
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	for ( j = 0; j < poller.tables[i].bucket_count; j++ )
+	{
+	    while ( ( e = poller.tables[i].buckets[j] ) )
+	    {
+		poller.tables[i].buckets[j] = e->next;
+		dfuse_poll_free_sum( e );
+	    }
+	}
+
+	free( poller.tables[i].buckets );
+	if ( poller.tables[i].query ) { DFUSE_FREE( poller.tables[i].query ); }
+    }
+
+    free( poller.tables );
+    poller.tables = NULL;
+}
+
+void dfuse_poll_report( void )
+{
+    if ( !options.poll )
+    {
+	return;
+    }
+
+    syslog( LOG_INFO, "dfuse poll: %llu ticks, %llu failed, %llu keys invalidated",
+	poller.ticks, poller.failures, poller.keys_invalidated );
+}
+
+/*
+ * --mirror=DIR: for read-mostly tables, a local copy of each one, loaded in bulk into
+ * DIR/<table>.mirror and mmap()ed, so getattr, open and readdir are answered from the page cache
+ * without any SQL.  The file is the rows in the server's ORDER BY order (for readdir), followed by
+ * an index of them in memcmp() order of key (for lookups), each entry pointing at the key and at
+ * the value: the raw column, or under --json the rendered row.
+ *
+ * Every --mirror-refresh seconds a thread brings it up to date in a new file and swaps that in,
+ * fetching only the rows that changed (plus the list of keys, for inserts and deletes), and
+ * copying the rest over from the old file.  With a change feed (--binlog or --poll),
+ * dfuse_invalidate tells us which rows those are, and they're answered from SQL until the refresh.
+ * Without one, each row carries a validator, -T or else a hash of the row the server works out,
+ * and the refresh asks for every row's; a mirrored row can then be up to --mirror-refresh seconds
+ * stale, which is the point of a mirror.  A lookup goes by exact key, so under a case-insensitive
+ * collation, it only finds a row by the name it's listed under.
+ *
+ * The files outlive the mount.  The next one with the same options revalidates them the same way
+ * before trusting them, so a remount only fetches what changed while we were gone.
+ */
+#define DFUSE_MIRROR_MAGIC "DFUSEMR1"
+
+struct dfuse_mirror_header {
+    char magic[8];
+    uint64_t fingerprint;	// Of the options that decide what's in it; see dfuse_mirror_fingerprint.
+    uint64_t count;
+    uint64_t entries;		// Offset of count struct dfuse_mirror_entry, in listing order.
+    uint64_t index;		// Offset of count entry numbers, in memcmp() order of key.
+    int64_t newest;		// With -T, the biggest validator.
+};
+
+struct dfuse_mirror_entry {
+    uint64_t key;		// Offsets into the file.
+    uint64_t value;
+    uint64_t value_length;
+    uint64_t validator;		// -T (also the mtime, without --json), or the first 64 bits of an MD5 of the row.
+    uint32_t key_length;
+    uint32_t is_null;
+};
+
+struct dfuse_mirror_key {
+    char *key;
+    unsigned long key_length;
+    struct dfuse_mirror_key *next;
+};
+
+// Keys only SQL can answer for.  all means the whole table.
+struct dfuse_mirror_set {
+    struct dfuse_mirror_key *buckets[DFUSE_MIRROR_DIRTY_BUCKETS];
+    unsigned long count;
+    int all;
+};
+
+struct dfuse_mirror_table {
+    pthread_rwlock_t lock;	// Read-held to look anything up in map, write-held to swap it.
+    char *map;			// NULL until the first load.
+    size_t map_length;
+    char *path;
+    uint64_t fingerprint;
+
+    // Under mirror.lock: changed since the map's rows were read, and changed since the refresh
+    // that's running now started reading them.
+    struct dfuse_mirror_set dirty;
+    struct dfuse_mirror_set refreshing;
+};
+
+struct dfuse_mirror {
+    pthread_mutex_t lock;	// The dirty sets, and stopping.
+    pthread_cond_t wake;	// It's time to stop.
+    pthread_t thread;
+    int running;
+    int stopping;
+    struct dfuse_mirror_table *tables;	// One per tables[], once we've started.
+
+    unsigned long long loads;
+    unsigned long long refreshes;
+    unsigned long long revalidations;
+    unsigned long long reused;		// Files a previous mount left us.
+    unsigned long long failures;
+    unsigned long long rows_copied;
+    unsigned long long rows_fetched;
+    unsigned long long hits;
+    unsigned long long misses;
+} mirror = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct dfuse_mirror_key **dfuse_mirror_set_find( struct dfuse_mirror_set *set, const char *key, unsigned long key_length )
+{
+    struct dfuse_mirror_key **kp;
+
+    for ( kp = &set->buckets[dfuse_hash( key, key_length ) % DFUSE_MIRROR_DIRTY_BUCKETS]; *kp; kp = &(*kp)->next )
+    {
+	if ( (*kp)->key_length == key_length && !memcmp( (*kp)->key, key, key_length ) )
+	{
+	    break;
+	}
+    }
+
+    return kp;
+}
+
+static void dfuse_mirror_set_clear( struct dfuse_mirror_set *set )
+{
+    struct dfuse_mirror_key *k;
+    unsigned long i;
+
+    for ( i = 0; i < DFUSE_MIRROR_DIRTY_BUCKETS; i++ )
+    {
+	while ( ( k = set->buckets[i] ) )
+	{
+	    set->buckets[i] = k->next;
+	    DFUSE_FREE( k->key );
+	    DFUSE_FREE( k );
+	}
+    }
+
+    set->count = 0;
+    set->all = 0;
+}
+
+// Caller holds mirror.lock.  Past DFUSE_MIRROR_DIRTY_MAX keys, it's cheaper to reload the lot.
+static void dfuse_mirror_set_add( struct dfuse_mirror_set *set, const char *key, unsigned long key_length )
+{
+    struct dfuse_mirror_key **kp, *k;
+
+    if ( set->all )
+    {
+	return;
+    }
+
+    if ( !key || set->count >= DFUSE_MIRROR_DIRTY_MAX )
+    {
+	dfuse_mirror_set_clear( set );
+	set->all = 1;
+	return;
+    }
+
+    if ( *( kp = dfuse_mirror_set_find( set, key, key_length ) ) )
+    {
+	return;
+    }
+
+    if ( !( k = DFUSE_MALLOC( sizeof( struct dfuse_mirror_key ) ) ) || !( k->key = DFUSE_MALLOC( key_length ? key_length : 1 ) ) )
+    {
+	if ( k ) { DFUSE_FREE( k ); }
+	dfuse_mirror_set_clear( set );
+	set->all = 1;
+	return;
+    }
+
+    memcpy( k->key, key, key_length );
+    k->key_length = key_length;
+    k->next = NULL;
+    *kp = k;
+    set->count++;
+}
+
+// From dfuse_invalidate: a row (or a table, or with no table, everything) changed.
+void dfuse_mirror_mark( const struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    unsigned int i;
+
+    if ( !mirror.tables )
+    {
+	return;
+    }
+
+    pthread_mutex_lock( &mirror.lock );
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	if ( !table || table->index == i )
+	{
+	    dfuse_mirror_set_add( &mirror.tables[i].dirty, key, key_length );
+	}
+    }
+
+    pthread_mutex_unlock( &mirror.lock );
+}
+
+/*
+ * Whether the mirror can answer for key (or with no key, for the whole table, as readdir needs).
+ * Caller holds mt->lock for reading.
+ */
+static int dfuse_mirror_trusted( struct dfuse_mirror_table *mt, const char *key, unsigned long key_length )
+{
+    int rv;
+
+    // A change feed that's fallen behind can't tell us what's changed.
+    if ( !mt->map || ( ( options.binlog || options.poll ) && !dfuse_changes_following() ) )
+    {
+	return 0;
+    }
+
+    pthread_mutex_lock( &mirror.lock );
+
+    if ( key )
+    {
+	rv = !mt->dirty.all && !mt->refreshing.all && !*dfuse_mirror_set_find( &mt->dirty, key, key_length )
+	    && !*dfuse_mirror_set_find( &mt->refreshing, key, key_length );
+    }
+    else
+    {
+	rv = !mt->dirty.all && !mt->refreshing.all && !mt->dirty.count && !mt->refreshing.count;
+    }
+
+    pthread_mutex_unlock( &mirror.lock );
+
+    return rv;
+}
+
+static const struct dfuse_mirror_entry *dfuse_mirror_entry( const char *map, uint64_t n )
+{
+    const struct dfuse_mirror_header *h = (const struct dfuse_mirror_header *)map;
+
+    return (const struct dfuse_mirror_entry *)( map + h->entries ) + n;
+}
+
+static int dfuse_mirror_compare( const char *a, unsigned long a_length, const char *b, unsigned long b_length )
+{
+    int rv = memcmp( a, b, a_length < b_length ? a_length : b_length );
+
+    return rv ? rv : ( a_length > b_length ) - ( a_length < b_length );
+}
+
+// Binary search of map's index.  Returns key's entry number, or -1.
+static long long dfuse_mirror_find( const char *map, const char *key, unsigned long key_length )
+{
+    const struct dfuse_mirror_header *h = (const struct dfuse_mirror_header *)map;
+    const uint64_t *index = (const uint64_t *)( map + h->index );
+    const struct dfuse_mirror_entry *e;
+    uint64_t low = 0, high = h->count, middle;
+    int c;
+
+    while ( low < high )
+    {
+	middle = low + ( high - low ) / 2;
+	e = dfuse_mirror_entry( map, index[middle] );
+
+	if ( !( c = dfuse_mirror_compare( map + e->key, e->key_length, key, key_length ) ) )
+	{
+	    return index[middle];
+	}
+
+	if ( c < 0 )
+	{
+	    low = middle + 1;
+	}
+	else
+	{
+	    high = middle;
+	}
+    }
+
+    return -1;
+}
+
+static void dfuse_mirror_entry_stat( const struct dfuse_mirror_entry *e, struct stat *stbuf )
+{
+    dfuse_fill_stat( stbuf, e->is_null, e->value_length, NULL );
+
+    if ( !json && options.timestamp )
+    {
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = (int64_t)e->validator;
+    }
+}
+
+/*
+ * getattr from the mirror.
+ *
+ * @returns DFUSE_CACHE_HIT (*stbuf filled in), DFUSE_CACHE_NEGATIVE (no such row), or
+ * DFUSE_CACHE_MISS (ask the database).
+ */
+int dfuse_mirror_stat( struct dfuse_table *table, const char *key, unsigned long key_length, struct stat *stbuf )
+{
+    struct dfuse_mirror_table *mt;
+    long long n;
+    int rv = DFUSE_CACHE_MISS;
+
+    if ( !mirror.tables )
+    {
+	return DFUSE_CACHE_MISS;
+    }
+
+    mt = &mirror.tables[table->index];
+
+    pthread_rwlock_rdlock( &mt->lock );
+
+    if ( dfuse_mirror_trusted( mt, key, key_length ) )
+    {
+	if ( ( n = dfuse_mirror_find( mt->map, key, key_length ) ) < 0 )
+	{
+	    rv = DFUSE_CACHE_NEGATIVE;
+	}
+	else
+	{
+	    dfuse_mirror_entry_stat( dfuse_mirror_entry( mt->map, n ), stbuf );
+	    rv = DFUSE_CACHE_HIT;
+	}
+    }
+
+    pthread_rwlock_unlock( &mt->lock );
+
+    __sync_fetch_and_add( rv == DFUSE_CACHE_MISS ? &mirror.misses : &mirror.hits, 1 );
+
+    return rv;
+}
+
+// Whether open() can skip connecting: the mirror has key's row, or knows there isn't one.
+int dfuse_mirror_has( struct dfuse_table *table, const char *key, unsigned long key_length )
+{
+    struct dfuse_mirror_table *mt;
+    int rv;
+
+    if ( !mirror.tables )
+    {
+	return 0;
+    }
+
+    mt = &mirror.tables[table->index];
+
+    pthread_rwlock_rdlock( &mt->lock );
+    rv = dfuse_mirror_trusted( mt, key, key_length );
+    pthread_rwlock_unlock( &mt->lock );
+
+    return rv;
+}
+
+/*
+ * Copies fh's row out of the mirror into fh->data.
+ *
+ * @returns 0 on success, 1 if only the database can say, or a negative errno.
+ */
+int dfuse_mirror_fetch( struct dfuse_handle *fh )
+{
+    struct dfuse_mirror_table *mt;
+    const struct dfuse_mirror_entry *e;
+    long long n;
+    int rv = 1;
+
+    if ( !mirror.tables )
+    {
+	return 1;
+    }
+
+    mt = &mirror.tables[fh->table->index];
+
+    pthread_rwlock_rdlock( &mt->lock );
+
+    if ( dfuse_mirror_trusted( mt, fh->key, fh->key_length ) )
+    {
+	if ( ( n = dfuse_mirror_find( mt->map, fh->key, fh->key_length ) ) < 0 )
+	{
+	    rv = -ENOENT;
+	}
+	else if ( ( e = dfuse_mirror_entry( mt->map, n ) )->is_null )
+	{
+	    rv = -EINVAL;		// TAG: NULL_HANDLING
+	}
+	else if ( !( fh->data = DFUSE_MALLOC( e->value_length + 1 ) ) )
+	{
+	    rv = -ENOMEM;
+	}
+	else
+	{
+	    memcpy( fh->data, mt->map + e->value, e->value_length );
+	    fh->data[e->value_length] = '\0';
+	    fh->length = fh->capacity = e->value_length;
+	    rv = 0;
+	}
+    }
+
+    pthread_rwlock_unlock( &mt->lock );
+
+    __sync_fetch_and_add( rv > 0 ? &mirror.misses : &mirror.hits, 1 );
+
+    return rv;
+}
+
+/*
+ * dfuse_dir_fetch_batch, from the mirror: the same rows, in the same order, since the mirror
+ * was loaded ORDER BY the key too.
+ *
+ * @returns 0 on success, 1 if only the database can say, or a negative errno.
+ */
+int dfuse_mirror_list( struct dfuse_dir_handle *dh, const char *after_key, unsigned long after_key_length,
+    unsigned long long skip, off_t first_cookie )
+{
+    struct dfuse_mirror_table *mt;
+    const struct dfuse_mirror_header *h;
+    const struct dfuse_mirror_entry *e;
+    struct dfuse_dir_entry *de;
+    long long n = -1;
+    uint64_t first, i;
+    int rv = 0;
+
+    // A --shard directory only has some of the table's rows.
+    if ( !mirror.tables || !dh->table || dh->table->shard )
+    {
+	return 1;
+    }
+
+    mt = &mirror.tables[dh->table->index];
+
+    pthread_rwlock_rdlock( &mt->lock );
+
+    // Picking up after a key this mirror never had means the last batch came from somewhere else.
+    if ( !dfuse_mirror_trusted( mt, NULL, 0 ) || ( after_key && ( n = dfuse_mirror_find( mt->map, after_key, after_key_length ) ) < 0 ) )
+    {
+	pthread_rwlock_unlock( &mt->lock );
+	__sync_fetch_and_add( &mirror.misses, 1 );
+	return 1;
+    }
+
+    h = (const struct dfuse_mirror_header *)mt->map;
+    first = after_key ? (uint64_t)n + 1 : skip;
+
+    dfuse_dir_free_batch( dh );
+
+    dh->first_cookie = first_cookie;
+    dh->with_stat = 1;
+    dh->eof = first + options.readdir_batch >= h->count;
+
+    if ( !( dh->entries = DFUSE_MALLOC( sizeof( struct dfuse_dir_entry ) * ( options.readdir_batch + 1 ) ) ) )
+    {
+	pthread_rwlock_unlock( &mt->lock );
+	return -ENOMEM;
+    }
+
+    for ( i = first; i < h->count && dh->count < options.readdir_batch; i++ )
+    {
+	e = dfuse_mirror_entry( mt->map, i );
+	de = &dh->entries[dh->count];
+
+	if ( !( de->name = dfuse_key_name( dh->table, mt->map + e->key, e->key_length ) ) )
+	{
+	    if ( !( de->name = DFUSE_MALLOC( 1 ) ) )
+	    {
+		rv = -ENOMEM;
+		break;
+	    }
+	    de->name[0] = '\0';
+	}
+
+	if ( !( de->key = DFUSE_MALLOC( e->key_length + 1 ) ) )
+	{
+	    DFUSE_FREE( de->name );
+	    rv = -ENOMEM;
+	    break;
+	}
+
+	memcpy( de->key, mt->map + e->key, e->key_length );
+	de->key[e->key_length] = '\0';
+	de->key_length = e->key_length;
+	de->shard = 0;
+
+	dfuse_mirror_entry_stat( e, &de->st );
+
+	dh->count++;
+    }
+
+    pthread_rwlock_unlock( &mt->lock );
+
+    __sync_fetch_and_add( &mirror.hits, 1 );
+
+    return rv;
+}
+
+/*
+ * A new mirror file being written.  Keys and values go out as they arrive; the entries (whose
+ * values may arrive later, see dfuse_mirror_refresh_rows) and the index go at the end.
+ */
+struct dfuse_mirror_build {
+    FILE *file;
+    char *path;
+    uint64_t fingerprint;
+    uint64_t offset;
+    struct dfuse_mirror_entry *entries;
+    char **keys;		// Our copies, for sorting the index.
+    int *pending;		// Still waiting for its value; dropped at the end if it never gets one.
+    unsigned long count;
+    unsigned long capacity;
+};
+
+static int dfuse_mirror_write( struct dfuse_mirror_build *b, const void *data, unsigned long length, uint64_t *offset )
+{
+    if ( offset )
+    {
+	*offset = b->offset;
+    }
+
+    if ( length && fwrite( data, length, 1, b->file ) != 1 )
+    {
+	return -EIO;
+    }
+
+    b->offset += length;
+
+    return 0;
+}
+
+// Pads the file out to a multiple of 8, so what comes next can be read in place.
+static int dfuse_mirror_align( struct dfuse_mirror_build *b )
+{
+    static const char zeroes[8] = { 0 };
+
+    return dfuse_mirror_write( b, zeroes, ( 8 - b->offset % 8 ) % 8, NULL );
+}
+
+/*
+ * Adds an entry for key, whose value comes from dfuse_mirror_put_value.  A NULL key (which can't
+ * be a filename) goes in as an empty one, so it takes up a cookie, as in dfuse_dir_fetch_batch.
+ */
+static int dfuse_mirror_put_key( struct dfuse_mirror_build *b, const char *key, unsigned long key_length )
+{
+    struct dfuse_mirror_entry *entries;
+    char **keys;
+    int *pending;
+    unsigned long capacity;
+
+    if ( !key )
+    {
+	key = "";
+	key_length = 0;
+    }
+
+    if ( b->count == b->capacity )
+    {
+	capacity = b->capacity ? b->capacity * 2 : 1024;
+
+	if ( !( entries = realloc( b->entries, sizeof( struct dfuse_mirror_entry ) * capacity ) ) )
+	{
+	    return -ENOMEM;
+	}
+	b->entries = entries;
+
+	if ( !( keys = realloc( b->keys, sizeof( char * ) * capacity ) ) )
+	{
+	    return -ENOMEM;
+	}
+	b->keys = keys;
+
+	if ( !( pending = realloc( b->pending, sizeof( int ) * capacity ) ) )
+	{
+	    return -ENOMEM;
+	}
+	b->pending = pending;
+
+	b->capacity = capacity;
+    }
+
+    if ( !( b->keys[b->count] = DFUSE_MALLOC( key_length ? key_length : 1 ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    memcpy( b->keys[b->count], key, key_length );
+    memset( &b->entries[b->count], 0, sizeof( struct dfuse_mirror_entry ) );
+    b->entries[b->count].key_length = key_length;
+    b->pending[b->count] = 1;
+    b->count++;
+
+    return dfuse_mirror_write( b, key, key_length, &b->entries[b->count-1].key );
+}
+
+static int dfuse_mirror_put_value( struct dfuse_mirror_build *b, unsigned long n, const char *value,
+    unsigned long long length, int is_null, uint64_t validator )
+{
+    b->entries[n].value_length = length;
+    b->entries[n].is_null = is_null;
+    b->entries[n].validator = validator;
+    b->pending[n] = 0;
+
+    return dfuse_mirror_write( b, value, length, &b->entries[n].value );
+}
+
+// A validator, as the server sent it.
+static uint64_t dfuse_mirror_parse_validator( const char *value )
+{
+    if ( !value )
+    {
+	return 0;
+    }
+
+    return options.timestamp ? (uint64_t)strtoll( value, NULL, 10 ) : strtoull( value, NULL, 10 );
+}
+
+/*
+ * Entry n's value, from a row as DFUSE_STMT_MIRROR_ROW returns it: the -c column(s), then the
+ * validator.
+ */
+static int dfuse_mirror_put_row( struct dfuse_mirror_build *b, unsigned long n, struct dfuse_schema *schema,
+    char **values, unsigned long *lengths, unsigned int num_fields )
+{
+    char *rendered;
+    unsigned long length;
+    int rv;
+
+    if ( num_fields < 2 )
+    {
+	return -EIO;
+    }
+
+    if ( !json )
+    {
+	return dfuse_mirror_put_value( b, n, values[0] ? values[0] : "", values[0] ? lengths[0] : 0, !values[0],
+	    dfuse_mirror_parse_validator( values[1] ) );
+    }
+
+    if ( !schema || schema->num_fields != num_fields-1 )
+    {
+	return -EIO;
+    }
+
+    if ( !( rendered = dfuse_render_json( schema, values, lengths, b->keys[n], b->entries[n].key_length, &length ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    rv = dfuse_mirror_put_value( b, n, rendered, length, 0, dfuse_mirror_parse_validator( values[num_fields-1] ) );
+
+    DFUSE_FREE( rendered );
+
+    return rv;
+}
+
+static void dfuse_mirror_build_free( struct dfuse_mirror_build *b )
+{
+    unsigned long i;
+
+    if ( b->file )
+    {
+	fclose( b->file );
+	unlink( b->path );
+    }
+
+    for ( i = 0; i < b->count; i++ )
+    {
+	DFUSE_FREE( b->keys[i] );
+    }
+
+    if ( b->path ) { DFUSE_FREE( b->path ); }
+    free( b->entries );
+    free( b->keys );
+    free( b->pending );
+}
+
+static struct dfuse_mirror_build *mirror_sorting;
+
+static int dfuse_mirror_index_compare( const void *a, const void *b )
+{
+    const struct dfuse_mirror_build *sb = mirror_sorting;
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return dfuse_mirror_compare( sb->keys[x], sb->entries[x].key_length, sb->keys[y], sb->entries[y].key_length );
+}
+
+// Drops entries that never got a value, writes out the entries and the index, and then the header.
+static int dfuse_mirror_finish( struct dfuse_mirror_build *b )
+{
+    struct dfuse_mirror_header header;
+    uint64_t *index;
+    unsigned long i, kept;
+    int rv;
+
+    for ( i = kept = 0; i < b->count; i++ )
+    {
+	if ( b->pending[i] )
+	{
+	    DFUSE_FREE( b->keys[i] );
+	    continue;
+	}
+
+	b->entries[kept] = b->entries[i];
+	b->keys[kept] = b->keys[i];
+	b->pending[kept] = 0;
+	kept++;
+    }
+
+    b->count = kept;
+
+    if ( !( index = DFUSE_MALLOC( sizeof( uint64_t ) * ( b->count ? b->count : 1 ) ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    for ( i = 0; i < b->count; i++ )
+    {
+	index[i] = i;
+    }
+
+    // Only the mirror thread ever builds, so one static is enough to get b to the comparison.
+    mirror_sorting = b;
+    qsort( index, b->count, sizeof( uint64_t ), dfuse_mirror_index_compare );
+    mirror_sorting = NULL;
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, DFUSE_MIRROR_MAGIC, sizeof( header.magic ) );
+    header.fingerprint = b->fingerprint;
+    header.count = b->count;
+
+    for ( i = 0; i < b->count; i++ )
+    {
+	if ( !i || (int64_t)b->entries[i].validator > header.newest )
+	{
+	    header.newest = (int64_t)b->entries[i].validator;
+	}
+    }
+
+    if ( ( rv = dfuse_mirror_align( b ) )
+      || ( rv = dfuse_mirror_write( b, b->entries, sizeof( struct dfuse_mirror_entry ) * b->count, &header.entries ) )
+      || ( rv = dfuse_mirror_write( b, index, sizeof( uint64_t ) * b->count, &header.index ) ) )
+    {
+	DFUSE_FREE( index );
+	return rv;
+    }
+
+    DFUSE_FREE( index );
+
+    // On disk before it's renamed into place: the next mount may be after a reboot.
+    if ( fseek( b->file, 0, SEEK_SET ) || fwrite( &header, sizeof( header ), 1, b->file ) != 1 || fflush( b->file )
+      || fsync( fileno( b->file ) ) )
+    {
+	return -EIO;
+    }
+
+    return 0;
+}
+
+static int dfuse_mirror_build_start( struct dfuse_mirror_build *b, struct dfuse_mirror_table *mt )
+{
+    static const struct dfuse_mirror_header blank;
+
+    memset( b, 0, sizeof( struct dfuse_mirror_build ) );
+    b->fingerprint = mt->fingerprint;
+
+    if ( !( b->path = dfuse_asprintf( "%s.%ld", mt->path, (long)getpid() ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    if ( !( b->file = fopen( b->path, "w" ) ) )
+    {
+	syslog( LOG_ERR, "dfuse mirror: can't write %s: %s", b->path, strerror( errno ) );
+	return -EIO;
+    }
+
+    // The header's filled in once there's something for it to say.
+    return dfuse_mirror_write( b, &blank, sizeof( blank ), NULL );
+}
+
+/*
+ * Maps mt's file, if it's one of ours, for the same options, and all there.  (It may be a previous
+ * mount's, and that may not have finished writing it, or something else may have been at it
+ * since.)  Every offset in it is checked here, once, so that lookups can trust them.
+ *
+ * @returns 0 on success, or a negative errno.
+ */
+static int dfuse_mirror_map( struct dfuse_mirror_table *mt, char **map, size_t *length )
+{
+    const struct dfuse_mirror_header *h;
+    const struct dfuse_mirror_entry *entries, *e;
+    const uint64_t *index;
+    struct stat st;
+    uint64_t i;
+    int fd;
+
+    if ( ( fd = open( mt->path, O_RDONLY ) ) < 0 )
+    {
+	return -errno;
+    }
+
+    if ( fstat( fd, &st ) || st.st_size < (off_t)sizeof( struct dfuse_mirror_header ) )
+    {
+	close( fd );
+	return -EIO;
+    }
+
+    *length = st.st_size;
+    *map = mmap( NULL, *length, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+
+    if ( *map == MAP_FAILED )
+    {
+	return -EIO;
+    }
+
+    h = (const struct dfuse_mirror_header *)*map;
+
+    if ( memcmp( h->magic, DFUSE_MIRROR_MAGIC, sizeof( h->magic ) ) || h->fingerprint != mt->fingerprint
+      || h->count > *length / sizeof( struct dfuse_mirror_entry )
+      || h->entries % 8 || h->entries > *length - sizeof( struct dfuse_mirror_entry ) * h->count
+      || h->index % 8 || h->index > *length - sizeof( uint64_t ) * h->count )
+    {
+	munmap( *map, *length );
+	return -EIO;
+    }
+
+    entries = (const struct dfuse_mirror_entry *)( *map + h->entries );
+    index = (const uint64_t *)( *map + h->index );
+
+    for ( i = 0; i < h->count; i++ )
+    {
+	e = &entries[i];
+
+	if ( index[i] >= h->count || e->key > *length || e->key_length > *length - e->key
+	  || e->value > *length || e->value_length > *length - e->value )
+	{
+	    syslog( LOG_ERR, "dfuse mirror: %s is damaged.", mt->path );
+	    munmap( *map, *length );
+	    return -EIO;
+	}
+    }
+
+    return 0;
+}
+
+// Renames the finished file into place, maps it, and swaps it in for whatever mt had.
+static int dfuse_mirror_install( struct dfuse_mirror_build *b, struct dfuse_mirror_table *mt )
+{
+    char *map, *old_map;
+    size_t length, old_length;
+    int rv;
+
+    fclose( b->file );
+    b->file = NULL;
+
+    if ( rename( b->path, mt->path ) )
+    {
+	unlink( b->path );
+	return -EIO;
+    }
+
+    if ( ( rv = dfuse_mirror_map( mt, &map, &length ) ) )
+    {
+	return rv;
+    }
+
+    pthread_rwlock_wrlock( &mt->lock );
+    old_map = mt->map;
+    old_length = mt->map_length;
+    mt->map = map;
+    mt->map_length = length;
+    pthread_rwlock_unlock( &mt->lock );
+
+    if ( old_map )
+    {
+	munmap( old_map, old_length );
+    }
+
+    return 0;
+}
+
+/*
+ * What tells us a row's changed: -T if we have it, since then the server needn't read the rows,
+ * and otherwise an MD5 of everything we serve from the row, cut to 64 bits.
+ */
+char *dfuse_mirror_validator_sql( MYSQL *sql, struct dfuse_table *table )
+{
+    char *columns, *rv;
+
+    if ( options.timestamp )
+    {
+	return dfuse_asprintf( "(%s)", options.timestamp );
+    }
+
+    if ( !( columns = dfuse_row_sum_columns( sql, table ) ) )
+    {
+	return NULL;
+    }
+
+    rv = dfuse_asprintf( "CONV(LEFT(MD5(CONCAT_WS(0x1f,%s)),16),16,10)", columns );
+
+    DFUSE_FREE( columns );
+
+    return rv;
+}
+
+// Reads the whole table, in one streamed query.
+static int dfuse_mirror_load_rows( MYSQL *sql, struct dfuse_table *table, struct dfuse_schema *schema, struct dfuse_mirror_build *b )
+{
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    unsigned long *lengths, key_length;
+    unsigned int num_fields, k = table->key_columns;
+    const char *key;
+    char *columns, *validator, *query, *joined;
+    int rv = 0;
+
+    if ( !( validator = dfuse_mirror_validator_sql( sql, table ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    query = ( columns = dfuse_select_columns( table ) )
+	? dfuse_asprintf( "SELECT %s,%s,%s FROM %s ORDER BY %s", table->prikey, columns, validator, table->sql_name,
+	    table->prikey ) : NULL;
+    DFUSE_FREE( columns );
+    DFUSE_FREE( validator );
+
+    if ( !query )
+    {
+	return -ENOMEM;
+    }
+
+    if ( dfuse_query( sql, query ) || !( res = mysql_use_result( sql ) ) )
+    {
+	D( "Mirror load failed: '%s'.\n", mysql_error( sql ) );
+	DFUSE_FREE( query );
+	return -EIO;
+    }
+
+    DFUSE_FREE( query );
+
+    num_fields = mysql_num_fields( res );
+
+    while ( !rv && ( row = mysql_fetch_row( res ) ) )
+    {
+	lengths = mysql_fetch_lengths( res );
+
+	key = dfuse_row_key_ref( table, row, lengths, &key_length, &joined );
+
+	if ( !key && k > 1 )
+	{
+	    rv = -ENOMEM;
+	}
+	else if ( !( rv = dfuse_mirror_put_key( b, key, key_length ) ) )
+	{
+	    rv = dfuse_mirror_put_row( b, b->count-1, schema, row+k, lengths+k, num_fields-k );
+	}
+
+	if ( joined ) { DFUSE_FREE( joined ); }
+
+	__sync_fetch_and_add( &stats.rows_fetched, 1 );
+    }
+
+    if ( !rv && mysql_errno( sql ) )
+    {
+	rv = -EIO;
+    }
+
+    mysql_free_result( res );
+
+    return rv;
+}
+
+/*
+ * Incremental refresh: just the keys, from the server (so inserts and deletes show up, in order),
+ * with the values of the rows that haven't changed copied over from mt's file, and those that have
+ * fetched again one by one.  Which have changed, we know from mt->refreshing, and if validate is
+ * set, also from comparing every row's validator with what the file has.
+ */
+static int dfuse_mirror_refresh_rows( MYSQL *sql, struct dfuse_table *table, struct dfuse_schema *schema,
+    struct dfuse_mirror_table *mt, struct dfuse_mirror_build *b, int validate )
+{
+    const struct dfuse_mirror_header *h = (const struct dfuse_mirror_header *)mt->map;
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    MYSQL_STMT *stmt;
+    struct dfuse_stmt_row fetched;
+    const struct dfuse_mirror_entry *e;
+    unsigned long *lengths, i, key_length;
+    long long n;
+    const char *key;
+    char *validator = NULL, *query, *joined = NULL;
+    int rv = 0, changed;
+
+    if ( validate && !( validator = dfuse_mirror_validator_sql( sql, table ) ) )
+    {
+	return -ENOMEM;
+    }
+
+    query = dfuse_asprintf( "SELECT %s%s%s FROM %s ORDER BY %s", table->prikey, validator ? "," : "",
+	validator ? validator : "", table->sql_name, table->prikey );
+    if ( validator ) { DFUSE_FREE( validator ); }
+
+    if ( !query )
+    {
+	return -ENOMEM;
+    }
+
+    if ( dfuse_query( sql, query ) || !( res = mysql_use_result( sql ) ) )
+    {
+	D( "Mirror refresh failed: '%s'.\n", mysql_error( sql ) );
+	DFUSE_FREE( query );
+	return -EIO;
+    }
+
+    DFUSE_FREE( query );
+
+    // Only this thread ever swaps mt->map, so it needn't be locked to read it here.
+    while ( !rv && ( row = mysql_fetch_row( res ) ) )
+    {
+	lengths = mysql_fetch_lengths( res );
+
+	if ( joined )
+	{
+	    DFUSE_FREE( joined );
+	}
+
+	key = dfuse_row_key_ref( table, row, lengths, &key_length, &joined );
+
+	if ( !key && table->key_columns > 1 )
+	{
+	    rv = -ENOMEM;
+	    break;
+	}
+
+	if ( ( rv = dfuse_mirror_put_key( b, key, key_length ) ) )
+	{
+	    break;
+	}
+
+	if ( !key )
+	{
+	    rv = dfuse_mirror_put_value( b, b->count-1, "", 0, 1, 0 );
+	    continue;
+	}
+
+	pthread_mutex_lock( &mirror.lock );
+	changed = !!*dfuse_mirror_set_find( &mt->refreshing, key, key_length );
+	pthread_mutex_unlock( &mirror.lock );
+
+	if ( changed || ( n = dfuse_mirror_find( mt->map, key, key_length ) ) < 0 )
+	{
+	    continue;
+	}
+
+	e = dfuse_mirror_entry( mt->map, n );
+
+	/*
+	 * -T only has a resolution of a second, so a row written again in the second the file's
+	 * newest row was written in needn't look any different.  Anything older than that was
+	 * already old when we read it.
+	 */
+	if ( validate && ( e->validator != dfuse_mirror_parse_validator( row[table->key_columns] )
+	  || ( options.timestamp && (int64_t)e->validator >= h->newest - DFUSE_MIRROR_OVERLAP_SECONDS ) ) )
+	{
+	    continue;
+	}
+
+	rv = dfuse_mirror_put_value( b, b->count-1, mt->map + e->value, e->value_length, e->is_null, e->validator );
+	__sync_fetch_and_add( &mirror.rows_copied, 1 );
+    }
+
+    if ( joined ) { DFUSE_FREE( joined ); }
+
+    if ( !rv && mysql_errno( sql ) )
+    {
+	rv = -EIO;
+    }
+
+    mysql_free_result( res );
+
+    // Now that the connection's free for other statements: whatever's still pending.
+    memset( &fetched, 0, sizeof( fetched ) );
+
+    for ( i = 0; !rv && i < b->count; i++ )
+    {
+	if ( !b->pending[i] )
+	{
+	    continue;
+	}
+
+	if ( ( rv = dfuse_stmt_execute( table, DFUSE_STMT_MIRROR_ROW, b->keys[i], b->entries[i].key_length, NULL, 0, &stmt ) ) )
+	{
+	    break;
+	}
+
+	// Gone since we listed it: it stays pending, and dfuse_mirror_finish drops it.
+	if ( ( rv = dfuse_stmt_fetch_row( stmt, &fetched ) ) > 0 )
+	{
+	    rv = dfuse_mirror_put_row( b, i, schema, fetched.values, fetched.lengths, fetched.num_fields );
+	    __sync_fetch_and_add( &mirror.rows_fetched, 1 );
+	}
+
+	mysql_stmt_free_result( stmt );
+    }
+
+    dfuse_stmt_row_free( &fetched );
+
+    return rv;
+}
+
+/*
+ * Brings one table's mirror up to date: loads it if there's nothing to start from, revalidates it
+ * if there's no change feed to say what's changed (or it's lost track), and otherwise fetches
+ * whatever the feed said changed, if anything.
+ *
+ * @returns 0 on success, or a negative errno.
+ */
+static int dfuse_mirror_refresh( struct dfuse_table *table )
+{
+    struct dfuse_mirror_table *mt = &mirror.tables[table->index];
+    struct dfuse_mirror_build b;
+    struct dfuse_schema *schema = NULL;
+    MYSQL *sql;
+    int rv, full, validate;
+
+    pthread_mutex_lock( &mirror.lock );
+
+    full = !mt->map;
+    validate = mt->dirty.all || !( options.binlog || options.poll );
+
+    if ( !full && !validate && !mt->dirty.count )
+    {
+	pthread_mutex_unlock( &mirror.lock );
+	return 0;
+    }
+
+    // From here on, a change lands in dirty, and stays unanswerable until the refresh after this.
+    mt->refreshing = mt->dirty;
+    memset( &mt->dirty, 0, sizeof( mt->dirty ) );
+
+    pthread_mutex_unlock( &mirror.lock );
+
+    if ( !( sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	rv = -EIO;
+    }
+    else if ( json && !( schema = dfuse_json_schema( sql, table ) ) )
+    {
+	rv = -EIO;
+    }
+    else if ( !( rv = dfuse_mirror_build_start( &b, mt ) ) )
+    {
+	rv = full ? dfuse_mirror_load_rows( sql, table, schema, &b ) : dfuse_mirror_refresh_rows( sql, table, schema, mt, &b, validate );
+
+	if ( !rv && !( rv = dfuse_mirror_finish( &b ) ) )
+	{
+	    rv = dfuse_mirror_install( &b, mt );
+	}
+
+	dfuse_mirror_build_free( &b );
+    }
+
+    dfuse_checkin();
+
+    pthread_mutex_lock( &mirror.lock );
+
+    if ( rv )
+    {
+	// We can't say which of them made it; the next refresh will have to check them all.
+	dfuse_mirror_set_add( &mt->dirty, NULL, 0 );
+	mirror.failures++;
+    }
+    else if ( full )
+    {
+	mirror.loads++;
+    }
+    else if ( validate )
+    {
+	mirror.revalidations++;
+    }
+    else
+    {
+	mirror.refreshes++;
+    }
+
+    dfuse_mirror_set_clear( &mt->refreshing );
+
+    pthread_mutex_unlock( &mirror.lock );
+
+    return rv;
+}
+
+static void *dfuse_mirror_run( void *unused )
+{
+    struct timeval now;
+    struct timespec deadline;
+    unsigned int i;
+
+    dfuse_thread_init();
+
+    pthread_mutex_lock( &mirror.lock );
+
+    while ( !mirror.stopping )
+    {
+	pthread_mutex_unlock( &mirror.lock );
+
+	for ( i = 0; i < num_tables; i++ )
+	{
+	    if ( dfuse_mirror_refresh( &tables[i] ) )
+	    {
+		syslog( LOG_WARNING, "dfuse mirror: couldn't refresh %s; serving it from the database until we can.", tables[i].name );
+	    }
+	}
+
+	gettimeofday( &now, NULL );
+	deadline.tv_sec = now.tv_sec + options.mirror_refresh;
+	deadline.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock( &mirror.lock );
+
+	while ( !mirror.stopping )
+	{
+	    if ( pthread_cond_timedwait( &mirror.wake, &mirror.lock, &deadline ) == ETIMEDOUT )
+	    {
+		break;
+	    }
+	}
+    }
+
+    pthread_mutex_unlock( &mirror.lock );
+
+    return NULL;
+}
+
+/*
+ * Everything that decides what's in table's file, so a mount with different options (or another
+ * server's table of the same name) doesn't take a file that isn't its own for one that is.
+ */
+static uint64_t dfuse_mirror_fingerprint( struct dfuse_table *table )
+{
+    uint64_t rv;
+    char *s;
+
+    if ( !( s = dfuse_asprintf( "%s\x1f%s\x1f%s\x1f%s\x1f%s\x1f%s\x1f%d", MYSQLSERVER, MYSQLDB, table->sql_name,
+	table->prikey, options.columns, options.timestamp ? options.timestamp : "", json ) ) )
+    {
+	return 0;
+    }
+
+    rv = dfuse_hash( s, strlen( s ) );
+
+    DFUSE_FREE( s );
+
+    return rv;
+}
+
+int dfuse_mirror_start( void )
+{
+    struct dfuse_mirror_table *mts;
+    unsigned int i;
+    char *name;
+
+    if ( !( mts = calloc( num_tables, sizeof( struct dfuse_mirror_table ) ) ) )
+    {
+	return -1;
+    }
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	pthread_rwlock_init( &mts[i].lock, NULL );
+
+	// -t is verbatim SQL, so it may have slashes in it.
+	if ( !( name = urlencode( tables[i].name, strlen( tables[i].name ) ) ) )
+	{
+	    return -1;
+	}
+
+	mts[i].path = dfuse_asprintf( "%s/%s.mirror", options.mirror, name );
+	DFUSE_FREE( name );
+
+	if ( !mts[i].path )
+	{
+	    return -1;
+	}
+
+	mts[i].fingerprint = dfuse_mirror_fingerprint( &tables[i] );
+
+	// A previous mount's file: untrusted until the first refresh has checked every row of it.
+	if ( !dfuse_mirror_map( &mts[i], &mts[i].map, &mts[i].map_length ) )
+	{
+	    mts[i].dirty.all = 1;
+	    mirror.reused++;
+	}
+	else
+	{
+	    mts[i].map = NULL;
+	}
+    }
+
+    mirror.tables = mts;
+
+    if ( pthread_create( &mirror.thread, NULL, dfuse_mirror_run, NULL ) )
+    {
+	return -1;
+    }
+
+    mirror.running = 1;
+
+    return 0;
+}
+
+void dfuse_mirror_stop( void )
+{
+    struct dfuse_mirror_table *mts = mirror.tables;
+    unsigned int i;
+
+    if ( mirror.running )
+    {
+	pthread_mutex_lock( &mirror.lock );
+	mirror.stopping = 1;
+	pthread_cond_signal( &mirror.wake );
+	pthread_mutex_unlock( &mirror.lock );
+
+	pthread_join( mirror.thread, NULL );
+
+	mirror.running = 0;
+    }
+
+    if ( !mts )
+    {
+	return;
+    }
+
+    mirror.tables = NULL;
+
+    for ( i = 0; i < num_tables; i++ )
+    {
+	if ( mts[i].map )
+	{
+	    munmap( mts[i].map, mts[i].map_length );
+	}
+
+	// The file stays, for the next mount to revalidate.
+	if ( mts[i].path )
+	{
+	    DFUSE_FREE( mts[i].path );
+	}
+
+	dfuse_mirror_set_clear( &mts[i].dirty );
+	dfuse_mirror_set_clear( &mts[i].refreshing );
+	pthread_rwlock_destroy( &mts[i].lock );
+    }
+
+    free( mts );
+}
+
+void dfuse_mirror_report( void )
+{
+    if ( !options.mirror )
+    {
+	return;
+    }
+
+    syslog( LOG_INFO, "dfuse mirror: %llu files reused, %llu loads, %llu revalidations, %llu incremental refreshes "
+	"(%llu rows copied, %llu fetched), %llu failed; %llu lookups answered, %llu sent to the database",
+	mirror.reused, mirror.loads, mirror.revalidations, mirror.refreshes, mirror.rows_copied, mirror.rows_fetched,
+	mirror.failures, mirror.hits, mirror.misses );
+}
+
+/*
+ * Writes a dirty handle back to its row: right away, in a transaction of its own, or under
+ * --write-back by queueing it for the committer.  Caller holds fh->lock and has a connection
+ * checked out (which the queueing gives back).
+ *
+ * @returns 0 on success, or a negative errno suitable for handing to FUSE.
+ */
+static int dfuse_handle_writeback( MYSQL *sql, struct dfuse_handle *fh, struct dfuse_wb_waiter *waiter )
+{
+    struct dfuse_row_update u;
+    int rv;
+
+    if ( !fh->dirty )
+    {
+	return 0;
+    }
+
+    if ( write_back.running )
+    {
+	rv = dfuse_write_back_enqueue( sql, fh, waiter );
+    }
+    else
+    {
+	u.table = fh->table;
+	u.key = fh->key;
+	u.key_length = fh->key_length;
+	u.column = fh->column;
+	u.data = fh->data;
+	u.parser = fh->parser;
+	fh->parser = NULL;
+	u.length = fh->length;
+
+	if ( !( rv = dfuse_row_update_prepare( sql, &u ) ) )
+	{
+	    rv = dfuse_row_update_commit( sql, &u );
+	    dfuse_row_update_free( &u );
+	}
+
+	if ( waiter )
+	{
+	    waiter->rv = rv;
+	    waiter->done = 1;
+	}
+    }
+
+    if ( !rv )
+    {
+	fh->dirty = 0;
+    }
+
+    return rv;
+}
+
+static void dfuse_release( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    MYSQL *sql;
+    struct dfuse_handle *fh = (struct dfuse_handle *)(uintptr_t)fi->fh;
+
+    fi->fh = 0;
+
+    // Normally flush has already written it back; this catches whatever got written after that.
+    if ( fh && fh->dirty )
+    {
+	if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+	{
+	    D( "Lost writes to '%s': no connection.\n", fh->key );
+	}
+	else if ( dfuse_handle_writeback( sql, fh, NULL ) )
+	{
+	    D( "Lost writes to '%s': the UPDATE failed.\n", fh->key );
+	}
+    }
+
+    dfuse_free_handle( fh );
+
+    dfuse_checkin();
+    fuse_reply_err( req, 0 );
+}
+
+/*
+ * Called on every close() of the file, which is the last point at which an error can still
+ * reach the program that wrote it; so this is where writes go to the database, or under
+ * --write-back, to the committer's queue.
+ */
+static void dfuse_flush( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    MYSQL *sql;
+    struct dfuse_handle *fh = (struct dfuse_handle *)(uintptr_t)fi->fh;
+    int rv;
+
+    if ( !fh || !fh->dirty )
+    {
+	fuse_reply_err( req, 0 );
+	return;
+    }
+
+    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	rv = -EIO;
+    }
+    else
+    {
+	pthread_mutex_lock( &fh->lock );
+	rv = dfuse_handle_writeback( sql, fh, NULL );
+	pthread_mutex_unlock( &fh->lock );
+    }
+
+    dfuse_checkin();
+    fuse_reply_err( req, -rv );
+}
+
+/*
+ * Without --write-back, this is just flush.  With it, we queue whatever's still dirty and then
+ * wait for the committer to get it into the database.
+ */
+static int dfuse_fsync_fh( struct dfuse_handle *fh )
+{
+    MYSQL *sql;
+    struct dfuse_wb_waiter waiter = { 0, 0 };
+    int rv = 0, queued = 0;
+
+    if ( !fh )
+    {
+	return -EBADF;
+    }
+
+    pthread_mutex_lock( &fh->lock );
+
+    if ( fh->dirty )
+    {
+	if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+	{
+	    pthread_mutex_unlock( &fh->lock );
+	    DFRV(-EIO);
+	}
+
+	rv = dfuse_handle_writeback( sql, fh, &waiter );
+	queued = !rv;
+
+	// Give the connection back: the committer may need it.
+	dfuse_checkin();
+    }
+
+    pthread_mutex_unlock( &fh->lock );
+
+    if ( rv || !write_back.running )
+    {
+	return rv;
+    }
+
+    // Nothing of ours was dirty, but an earlier flush of this file may still be in the queue.
+    return dfuse_write_back_wait( queued ? &waiter : NULL );
+}
+
+static void dfuse_fsync( fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi )
+{
+    fuse_reply_err( req, -dfuse_fsync_fh( (struct dfuse_handle *)(uintptr_t)fi->fh ) );
+}
+
+/*
+ * We can't INSERT rows (yet), but O_CREAT on a row that's already there is just an open, and the
+ * kernel sends us here for one when it doesn't have the name cached.
+ */
+static void dfuse_create( fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi )
+{
+    struct fuse_entry_param e;
+    int rv;
+
+    if ( !( rv = dfuse_lookup_entry( parent, name, &e ) ) && !e.ino )
+    {
+	rv = -ENOENT;
+    }
+
+    if ( !rv && ( rv = dfuse_open_ino( e.ino, fi ) ) )
+    {
+	// The kernel never heard about the lookup, so it won't be forgetting it.
+	dfuse_inode_forget( e.ino, 1 );
+    }
+
+    if ( rv )
+    {
+	fuse_reply_err( req, rv == -ENOENT ? EPERM : -rv );
+	return;
+    }
+
+    fuse_reply_create( req, &e, fi );
+}
+
+/*
+ * truncate() by name, with no handle to truncate.  We check the row's there, then leave the new
+ * size for the open() that's coming (see dfuse_pending_truncate); that open writes it back.
+ */
+static int dfuse_truncate( struct dfuse_table *table, const char *key, unsigned long key_length, unsigned int column, off_t offset )
+{
+    MYSQL_STMT *stmt;
+    int rv;
+
+    if ( offset < 0 )
+    {
+	return -EINVAL;
+    }
+
+    if ( offset > MAX_STRING_LENGTH )
+    {
+	return -EFBIG;
+    }
+
+    if ( !dfuse_connect( NULL, NULL, NULL, NULL ) )
+    {
+	DFRV(-EIO);
+    }
+
+    if ( !( rv = dfuse_stmt_execute( table, DFUSE_STMT_EXISTS, key, key_length, NULL, 0, &stmt ) ) )
+    {
+	rv = mysql_stmt_num_rows( stmt ) ? 0 : -ENOENT;
+
+	mysql_stmt_free_result( stmt );
+    }
+
+    if ( !rv && !( rv = dfuse_pending_truncate_add( table, key, key_length, column, offset ) ) )
+    {
+	dfuse_invalidate( table, key, key_length );
+    }
+
+    DFRV(rv);
+}
+
+static int dfuse_ftruncate( struct dfuse_handle *fh, off_t offset )
+{
+    int rv;
+
+    if ( !fh || !fh->data )
+    {
+	return -EBADF;
+    }
+
+    if ( offset < 0 )
+    {
+	return -EINVAL;
+    }
+
+    pthread_mutex_lock( &fh->lock );
+
+    if ( !( rv = dfuse_handle_resize( fh, offset ) ) )
+    {
+	fh->dirty = 1;
+	dfuse_handle_parse( fh, offset, 0 );
+    }
+
+    pthread_mutex_unlock( &fh->lock );
+
+    return rv;
+}
+
+/*
+ * Of all the attributes, only the size can change (truncate, or ftruncate with a handle); the
+ * rest get ENOSYS, as they always have.  The kernel bundles a ctime update with every truncate,
+ * which we've nowhere to keep.
+ */
+static void dfuse_setattr( fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi )
+{
+    struct dfuse_handle *fh = fi ? (struct dfuse_handle *)(uintptr_t)fi->fh : NULL;
+    struct dfuse_table *table;
+    struct dfuse_inode *inode;
+    struct stat stbuf;
+    double ttl;
+    int rv;
+
+    if ( ( to_set & ~FUSE_SET_ATTR_CTIME ) != FUSE_SET_ATTR_SIZE )
+    {
+	fuse_reply_err( req, ENOSYS );
+	return;
+    }
+
+    if ( ( rv = dfuse_resolve_ino( ino, &table, &inode ) ) >= 0 && rv != ( options.column_files ? DFUSE_PATH_COLUMN : DFUSE_PATH_ROW ) )
+    {
+	rv = -EISDIR;
+    }
+
+    if ( rv >= 0 )
+    {
+	rv = fh ? dfuse_ftruncate( fh, attr->st_size )
+	    : dfuse_truncate( table, inode->key, inode->key_length, inode->column, attr->st_size );
+    }
+
+    if ( !rv )
+    {
+	rv = dfuse_getattr_ino( ino, &stbuf, fi, &ttl );
+    }
+
+    if ( rv )
     {
-	exit(-1);
+	fuse_reply_err( req, -rv );
+	return;
     }
 
-    return cached_debug_fd;
+    fuse_reply_attr( req, &stbuf, ttl );
 }
 
-static int dfuse_readlink(const char *path, char *linkbuf, size_t bufsize )
+/*
+ * Writes only ever touch the handle; dfuse_flush sends the result to the database, so a file
+ * written in a hundred chunks is still one UPDATE.
+ */
+static int dfuse_write_fh( struct dfuse_handle *fh, const char *buf, size_t size, off_t offset )
 {
-    //In the interest of saving ourselves a lot of time, if this is being called,
-    //it's a symlink, and if it is, it's always the same one.
+    int rv;
 
-    //TAG: NULL_HANDLING
+    if ( !fh || !fh->data )
+    {
+	return -EBADF;
+    }
 
-    if ( bufsize <= 0 )
+    if ( offset < 0 )
     {
-	DFRV(-EINVAL);
+	return -EINVAL;
     }
 
-    if ( bufsize < strlen("/dev/null") + 1 ) //libc function says strlen(/dev/null), but FUSE API docs say +1.
+    if ( size > MAX_STRING_LENGTH || (unsigned long long)offset > MAX_STRING_LENGTH - size )
     {
-	DFRV(-ENOMEM);
+	return -EFBIG;
     }
 
-    strncpy(linkbuf,"/dev/null",bufsize);
-    DFRV(0);
+    pthread_mutex_lock( &fh->lock );
+
+    if ( offset + size > fh->length && ( rv = dfuse_handle_resize( fh, offset + size ) ) )
+    {
+	pthread_mutex_unlock( &fh->lock );
+	return rv;
+    }
+
+    memcpy( fh->data + offset, buf, size );
+    fh->dirty = 1;
+    dfuse_handle_parse( fh, offset, size );
+
+    pthread_mutex_unlock( &fh->lock );
+
+    return size;
 }
 
-static int dfuse_getattr(const char *path, struct stat *stbuf)
+static void dfuse_write( fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi )
 {
-    MYSQL *sql;
-    MYSQL_RES *sql_res;
-    MYSQL_ROW sql_row;
-    int qr;
-    char sqlbuf[2000];
-    char *clean_path;
-    struct string_length *url_path_struct;
-    char *url_path;
+    int rv;
 
-    if( !path || path[0] == '\0' )
+    if ( ( rv = dfuse_write_fh( (struct dfuse_handle *)(uintptr_t)fi->fh, buf, size, offset ) ) < 0 )
     {
-	DFRV(-ENOENT);
+	fuse_reply_err( req, -rv );
+	return;
     }
 
-    memset(stbuf, 0, sizeof(struct stat));
-    if(strcmp(path, "/") == 0) {
-	stbuf->st_mode = S_IFDIR | 0755;
-	stbuf->st_nlink = 2;
+    fuse_reply_write( req, rv );
+}
+
+/*
+ * A read from a streamed handle: just the bytes asked for, straight into the reply, so a
+ * read costs O(size) memory however big the value is, and offsets past 4GB work.
+ */
+static int dfuse_read_range( struct dfuse_handle *fh, char *buf, size_t size, off_t offset )
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[2+DFUSE_MAX_KEY_COLUMNS], result;
+    struct dfuse_key_values kv;
+    unsigned long long ints[2];
+    unsigned long length = 0;
+    my_bool is_null = 0;
+    int rv;
+
+    if ( offset < 0 || (unsigned long long)offset >= fh->streamed_length )
+    {
+	return 0;
     }
-    else {
-	stbuf->st_mode = S_IFREG | 0644;
-	stbuf->st_nlink = 1;
 
-	if ( !(url_path_struct = urldecode(path+sizeof(char)) ) )
-	{
-	    DFRV(-ENOMEM); //Not necessarily ENOMEM, but something went wrong, anyway.
-	}
+    if ( (unsigned long long)offset + size > fh->streamed_length )
+    {
+	size = fh->streamed_length - offset;
+    }
 
-	url_path = url_path_struct->string;
+    if ( ( rv = dfuse_key_split( fh->table, fh->key, fh->key_length, &kv ) ) )
+    {
+	return rv;
+    }
 
-	if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFRV(-EIO);
-	}
+    if ( !dfuse_connect( NULL, NULL, NULL, NULL ) )
+    {
+	dfuse_key_values_free( &kv );
+	DFRV(-EIO);
+    }
 
-	if ( !( clean_path = DFUSE_MALLOC((url_path_struct->length)*2+1) ) )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFRV(-ENOMEM);
-	}
+    ints[0] = offset + 1;	// SUBSTRING counts from 1, and in bytes, since DFUSE_STMT_RANGE casts to BINARY.
+    ints[1] = size;
 
-	mysql_real_escape_string( sql, clean_path, url_path, url_path_struct->length );
+    memset( params, 0, sizeof( params ) );
+    params[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    params[0].buffer = &ints[0];
+    params[0].is_unsigned = 1;
+    params[1].buffer_type = MYSQL_TYPE_LONGLONG;
+    params[1].buffer = &ints[1];
+    params[1].is_unsigned = 1;
+    dfuse_key_bind( &kv, params+2 );
 
-	if ( strlen(clean_path) <= 0 )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFUSE_FREE(clean_path);
-	    DFRV(-ENOENT);
-	}
+    rv = dfuse_stmt_execute_binds( fh->table, DFUSE_STMT_COLUMN( fh->column, DFUSE_STMT_RANGE ), params, &stmt );
+    dfuse_key_values_free( &kv );
 
-	//DONE: mysql_real_escape_string, test for zero-length path
-	if ( json )
-	{
-	    if ( 0 > snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT %s FROM %s WHERE %s='%s'", options.columns, options.table, options.prikey, clean_path ) )
-	    {
-		DFUSE_FREE(url_path);
-		DFUSE_FREE(url_path_struct);
-		DFUSE_FREE(clean_path);
-		DFRV(-EIO);
-	    }
-	}
-	else if ( options.timestamp )
-	{
-	    if ( 0 > snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT OCTET_LENGTH(%s),%s FROM %s WHERE %s='%s'", options.columns, options.timestamp, options.table, options.prikey, clean_path ) )
-	    {
-		DFUSE_FREE(url_path);
-		DFUSE_FREE(url_path_struct);
-		DFUSE_FREE(clean_path);
-		DFRV(-EIO);
-	    }
-	}
-	else
-	{
-	    if ( 0 > snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT OCTET_LENGTH(%s) FROM %s WHERE %s='%s'", options.columns, options.table, options.prikey, clean_path) )
-	    {
-		DFUSE_FREE(url_path);
-		DFUSE_FREE(url_path_struct);
-		DFUSE_FREE(clean_path);
-		DFRV(-EIO);
-	    }
-	}
+    if ( rv )
+    {
+	DFRV(rv);
+    }
 
-	qr = mysql_query( sql, sqlbuf );
+    memset( &result, 0, sizeof( result ) );
+    result.buffer_type = MYSQL_TYPE_BLOB;
+    result.buffer = buf;
+    result.buffer_length = size;
+    result.length = &length;
+    result.is_null = &is_null;
 
-	switch( qr )
+    if ( mysql_stmt_bind_result( stmt, &result ) )
+    {
+	rv = -EIO;
+    }
+    else
+    {
+	switch ( mysql_stmt_fetch( stmt ) )
 	{
-	    case CR_COMMANDS_OUT_OF_SYNC:
-	    case CR_SERVER_GONE_ERROR:
-	    case CR_SERVER_LOST:
-	    case CR_UNKNOWN_ERROR:
-	    default:
-		DFUSE_FREE(url_path);
-		DFUSE_FREE(url_path_struct);
-		DFUSE_FREE(clean_path);
-
-		DFRV(-EIO);
 	    case 0:
+	    case MYSQL_DATA_TRUNCATED:
+		// The row may have shrunk since open(); that just makes this a short read.
+		rv = is_null ? 0 : ( length < size ? length : size );
+		__sync_fetch_and_add( &stats.bytes_fetched, rv );
+		break;
+	    default:
+		// Including MYSQL_NO_DATA: the row's gone out from under us.
+		rv = -EIO;
 		break;
 	}
+    }
 
-	if ( !( sql_res = mysql_store_result( sql ) ) )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFUSE_FREE(clean_path);
+    mysql_stmt_free_result( stmt );
 
-	    DFRV(-EIO);
-	}
+    DFRV(rv);
+}
 
-	if ( mysql_num_rows( sql_res ) == 0 )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFUSE_FREE(clean_path);
+/*
+ * Replies to a read of fh.  A snapshot goes to the kernel straight from the handle; a streamed
+ * range needs a buffer of its own to land in.
+ */
+static void dfuse_read( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    struct dfuse_handle *fh = (struct dfuse_handle *)(uintptr_t)fi->fh;
+    char *buf;
+    int rv;
 
-	    mysql_free_result( sql_res );
+    if ( !fh )
+    {
+	fuse_reply_err( req, EBADF );
+	return;
+    }
 
-	    DFRV(-ENOENT);
-	}
-	else if ( mysql_num_rows( sql_res ) != 1 )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFUSE_FREE(clean_path);
+    pthread_mutex_lock( &fh->lock );
 
-	    mysql_free_result( sql_res );
+    // An open that let the kernel keep its cache left the fetching to us.  If the row's gone
+    // since, that's the same as it vanishing in the middle of a streamed read.
+    if ( !fh->data && !fh->streamed_length )
+    {
+	dfuse_reader_begin();
+	rv = dfuse_handle_fetch( NULL, fh, 1 );
+	dfuse_reader_end();
 
-	    DFRV(-EIO);
+	if ( rv )
+	{
+	    pthread_mutex_unlock( &fh->lock );
+	    fuse_reply_err( req, rv == -ENOENT ? EIO : -rv );
+	    return;
 	}
+    }
 
-	sql_row = mysql_fetch_row( sql_res );	
-
-//	fprintf( debug_fd(), "st_size: %d\n", atoi(sql_row[0]) );
+    if ( !fh->data )
+    {
+	pthread_mutex_unlock( &fh->lock );
 
-	if ( json )
+	if ( !( buf = DFUSE_MALLOC( size ? size : 1 ) ) )
 	{
-	    char * jsonified = dfuse_jsonify_row( &sql_row, sql_res, url_path, url_path_struct->length);
-	    //Blatant opportunity for caching/optimization.
-
-	    if ( !jsonified )
-	    {
-		DFUSE_FREE(url_path);
-		DFUSE_FREE(url_path_struct);
-		DFUSE_FREE(clean_path);
-
-		DFRV(-ENOMEM); //Hard to know for sure, but a likely cause, at least.
-	    }
-
-	    D("Got a jsonified string: '%s'.\n", jsonified);
-
-	    D("Looks to be about %ld long.\n", strlen(jsonified));
-
-	    stbuf->st_size = strlen(jsonified);
+	    fuse_reply_err( req, ENOMEM );
+	    return;
+	}
 
-	    D("It's %ld long.\n", stbuf->st_size);
+	dfuse_reader_begin();
+	rv = dfuse_read_range( fh, buf, size, offset );
+	dfuse_reader_end();
 
-	    DFUSE_FREE( jsonified );
-	}
-	else if ( sql_row[0] == NULL ) //This will happen if table[prikey].column is NULL
+	if ( rv < 0 )
 	{
-	    // TAG: NULL_HANDLING
-	    stbuf->st_size = strlen("/dev/null")-1;
-	
-	    if ( stbuf->st_mode & S_IFREG )
-	    {
-		// I recognize that there are cheaper ways to do this, but I didn't want
-		// to have to have a 0xfffffffff or whatever, just in case someone has a
-		// freaky set of st_mode flags.
-		stbuf->st_mode -= S_IFREG;
-	    }
-	    stbuf->st_mode |= S_IFLNK;
-//	    DFRV(-ENOENT); //This creates an unambiguous representation of NULL (vs "")
-//	    stbuf->st_size = 0;
+	    fuse_reply_err( req, -rv );
 	}
 	else
 	{
-	    stbuf->st_size = atoi(sql_row[0]);
-	}
-
-	if ( !json && options.timestamp && sql_row[1])
-	{
-//	    fprintf( debug_fd(), "st_(x)time: %d\n", atoi(sql_row[1]) );
-	    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = atoi(sql_row[1]);
-	}
-
-	// TODO: properly support timestamp in json mode
-	if ( json && options.timestamp )
-	{
-	    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+	    fuse_reply_buf( req, buf, rv );
 	}
 
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-
-	mysql_free_result( sql_res );
-    }
-
-//    usleep( 10000 );
-
-    DFRV(0);
-}
-
-static int dfuse_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
-{
-    return dfuse_getattr(path,stbuf);
-}
-
-MYSQL *dfuse_connect( char *host, char *user, char *pass, char *defaultdb )
-{
-    int use_defaults = 0;
-    MYSQL *sql = NULL;
-
-    if ( !host || !user || !pass || !defaultdb )
-    {
-	use_defaults = 1;
-    }
-
-    if ( !use_defaults )
-    {
-	if ( !( sql = mysql_init( NULL ) ) )
-	{
-	    return NULL;
-	}
-	return mysql_real_connect( sql, host, user, pass, defaultdb, 0, NULL, 0 );
+	DFUSE_FREE( buf );
+	return;
     }
 
-    if ( cached_sql && !mysql_ping( cached_sql ) ) //0 = connection is up, so !ping is a good thing
-    {
-	return cached_sql;
-    }
+    // Everything else was fetched already; no SQL happens here.
 
-    if ( cached_sql != NULL ) //If we had an old one, kill it cleanly, just in case
+    if ( offset < 0 || (unsigned long)offset >= fh->length )
     {
-	mysql_close( cached_sql );
-	cached_sql = NULL;
+	pthread_mutex_unlock( &fh->lock );
+	fuse_reply_buf( req, NULL, 0 );
+	return;
     }
 
-    if ( !( cached_sql = mysql_init( NULL ) ) )
+    if ( offset + size > fh->length )
     {
-	return NULL;
+	size = fh->length - offset;
     }
 
-    cached_sql = mysql_real_connect( cached_sql, MYSQLSERVER, MYSQLUSER, MYSQLPASS, MYSQLDB, 0, NULL, 0 );
+    // Copied out by the time it returns, so the lock needn't outlive it.
+    fuse_reply_buf( req, fh->data + offset, size );
 
-    return cached_sql;
+    pthread_mutex_unlock( &fh->lock );
 }
 
-static int dfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-    MYSQL *sql;
-    MYSQL_RES *sql_res;
-    MYSQL_ROW sql_row;
-    int qr;
-    char sqlbuf[2000];
+/*
+ * /.dfuse/stats: everything the *_report() functions send to syslog at unmount, plus per-op
+ * latencies and SQL traffic (see struct dfuse_stats), as one JSON object, rendered afresh at each
+ * open.  /.dfuse never shows up in a listing, and in the root of a -t mount it hides a row
+ * keyed ".dfuse", if there is one.  Neither it nor the file can be changed.  With --snapshot,
+ * /.dfuse/snapshot sits next to it: always empty, and touching it (or writing to it) ends the
+ * current read view.
+ */
+#define DFUSE_STATS_DIR_NAME ".dfuse"
+#define DFUSE_STATS_NAME "stats"
+#define DFUSE_SNAPSHOT_NAME "snapshot"
 
-    // There's only one directory, and it's "/".
-    if(strcmp(path, "/") != 0)
-    {
-	DFRV(-ENOENT);
-    }
+struct dfuse_stats_buf {
+    char *data;
+    unsigned long length;
+    unsigned long capacity;
+    int failed;
+};
 
-    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
-    {
-	DFRV(-EIO);
-    }
+static void dfuse_stats_printf( struct dfuse_stats_buf *b, const char *fmt, ... )
+{
+    va_list ap;
+    int n;
+    char *data;
 
-    if ( 0 > ( snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT %s FROM %s", options.prikey, options.table ) ) )
+    if ( b->failed )
     {
-	DFRV(-EIO);
+	return;
     }
 
-    qr = mysql_query( sql, sqlbuf );
+    va_start( ap, fmt );
+    n = vsnprintf( b->data + b->length, b->capacity - b->length, fmt, ap );
+    va_end( ap );
 
-    switch( qr )
+    if ( n < 0 )
     {
-	case CR_COMMANDS_OUT_OF_SYNC:
-	case CR_SERVER_GONE_ERROR:
-	case CR_SERVER_LOST:
-	case CR_UNKNOWN_ERROR:
-	default:
-	    DFRV(-EIO);
-	case 0:
-	    break;
-    }
-
-    if ( !( sql_res = mysql_use_result( sql ) ) )
-    {
-	DFRV(-EIO);
+	b->failed = 1;
+	return;
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
-    while ( ( sql_row = mysql_fetch_row( sql_res ) ) )
+    if ( b->length + n >= b->capacity )
     {
-	char * ptr;
-	if ( (filler(buf, ptr = urlencode(sql_row[0], mysql_fetch_lengths( sql_res )[0]), NULL, 0) ) )
+	if ( !( data = realloc( b->data, ( b->length + n ) * 2 ) ) )
 	{
-	    //The "filler" func's buffer is full, but it's unclear what the right thing to do is here.
-	    //Opt to fail (very) noisily.
-	    raise(SIGSEGV);
+	    b->failed = 1;
+	    return;
 	}
-	DFUSE_FREE(ptr);
-    }
 
-    mysql_free_result( sql_res );
+	b->data = data;
+	b->capacity = ( b->length + n ) * 2;
 
-    DFRV(0);
+	va_start( ap, fmt );
+	vsnprintf( b->data + b->length, b->capacity - b->length, fmt, ap );
+	va_end( ap );
+    }
+
+    b->length += n;
 }
 
-static int dfuse_open(const char *path, struct fuse_file_info *fi)
+// How often the cheap answer did the job, out of every time it was asked.
+static double dfuse_stats_rate( unsigned long long hits, unsigned long long total )
 {
-    MYSQL *sql;
-    MYSQL_RES *sql_res;
-    int qr;
-    char sqlbuf[2000];
-    struct string_length *url_path_struct;
-    char *url_path, *clean_path;
-
-    D( "Asked to open '%s'.", path );
+    return total ? (double)hits / total : 0;
+}
 
-    // The O_ACCMODE dance is needed because O_RDONLY is 0x0.  @#&$*
-//    if((fi->flags & O_ACCMODE) != O_RDONLY)
+/*
+ * Renders the stats, as of now.
+ *
+ * @returns A NUL-terminated string (of *length bytes, not counting the NUL) for the caller to
+ * free, or NULL if we're out of memory.
+ */
+char *dfuse_stats_render( unsigned long *length )
+{
+    struct dfuse_stats_buf b = { NULL, 0, 0, 0 };
+    unsigned int op, i;
 
-    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    if ( !( b.data = DFUSE_MALLOC( 4096 ) ) )
     {
-	DFRV(-EIO);
+	return NULL;
     }
+    b.capacity = 4096;
 
-    if ( !path || path[0] == '\0' )
-    {
-	DFRV(-EIO);
-    }
+    dfuse_stats_printf( &b, "{\n  \"uptime\": %ld,\n  \"ops\": {", (long)( time( NULL ) - stats.started ) );
 
-    if ( !( url_path_struct = urldecode(path+sizeof(char)) ) )
+    for ( op = 0; op < DFUSE_OP_COUNT; op++ )
     {
-	DFRV(-ENOMEM);
-    }
+	dfuse_stats_printf( &b, "%s\n    \"%s\": { \"count\": %llu, \"usec\": %llu, \"histogram\": {", op ? "," : "",
+	    dfuse_op_names[op], stats.ops[op].count, stats.ops[op].usec );
 
-    url_path = url_path_struct->string;
+	for ( i = 0; i < DFUSE_STATS_BUCKETS - 1; i++ )
+	{
+	    dfuse_stats_printf( &b, " \"%llu\": %llu,", 1ULL << i, stats.ops[op].buckets[i] );
+	}
 
-    if ( !( clean_path = DFUSE_MALLOC((url_path_struct->length)*2+1) ) )
-    {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFRV(-ENOMEM);
+	dfuse_stats_printf( &b, " \"inf\": %llu } }", stats.ops[op].buckets[i] );
     }
 
-    mysql_real_escape_string( sql, clean_path, url_path, url_path_struct->length );
-
-    if ( strlen(clean_path) <= 0 )
+    dfuse_stats_printf( &b, "\n  },\n  \"sql\": { \"queries\": %llu, \"rows_fetched\": %llu, \"bytes_fetched\": %llu },\n",
+	stats.queries, stats.rows_fetched, stats.bytes_fetched );
+
+    pthread_mutex_lock( &pool.lock );
+    dfuse_stats_printf( &b, "  \"pool\": { \"open\": %u, \"idle\": %u, \"peak_open\": %u, \"checkouts\": %llu, "
+	"\"connects\": %llu, \"connect_failures\": %llu, \"pings\": %llu, \"waits\": %llu, \"wait_usec\": %llu, "
+	"\"peak_waiting\": %u, \"timeouts\": %llu },\n",
+	pool.open, pool.idle_count, pool.peak_open, pool.checkouts, pool.connects, pool.connect_failures,
+	pool.pings, pool.waits, pool.wait_usec, pool.peak_waiting, pool.timeouts );
+    pthread_mutex_unlock( &pool.lock );
+
+    pthread_mutex_lock( &attr_cache.lock );
+    dfuse_stats_printf( &b, "  \"attr_cache\": { \"entries\": %lu, \"hits\": %llu, \"negative_hits\": %llu, "
+	"\"misses\": %llu, \"evictions\": %llu, \"hit_rate\": %.4f },\n",
+	attr_cache.count, attr_cache.hits, attr_cache.negative_hits, attr_cache.misses, attr_cache.evictions,
+	dfuse_stats_rate( attr_cache.hits + attr_cache.negative_hits, attr_cache.hits + attr_cache.negative_hits + attr_cache.misses ) );
+    pthread_mutex_unlock( &attr_cache.lock );
+
+    pthread_mutex_lock( &generations.lock );
+    dfuse_stats_printf( &b, "  \"page_cache\": { \"kept\": %llu, \"dropped\": %llu, \"keep_rate\": %.4f, "
+	"\"tracked\": %lu, \"forgotten\": %llu },\n",
+	generations.kept, generations.dropped, dfuse_stats_rate( generations.kept, generations.kept + generations.dropped ),
+	generations.count, generations.forgotten );
+    pthread_mutex_unlock( &generations.lock );
+
+    pthread_mutex_lock( &inodes.lock );
+    dfuse_stats_printf( &b, "  \"inodes\": { \"known\": %lu, \"forgotten\": %llu },\n", inodes.count, inodes.forgotten );
+    pthread_mutex_unlock( &inodes.lock );
+
+    pthread_mutex_lock( &notifier.lock );
+    dfuse_stats_printf( &b, "  \"kernel_notices\": { \"entries\": %llu, \"inodes\": %llu, \"lost\": %llu }",
+	notifier.entries, notifier.inodes, notifier.lost );
+    pthread_mutex_unlock( &notifier.lock );
+
+    if ( options.write_back )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-	DFRV(-ENOENT);
+	pthread_mutex_lock( &write_back.lock );
+	dfuse_stats_printf( &b, ",\n  \"write_back\": { \"pending\": %u, \"batches\": %llu, \"batch_failures\": %llu, "
+	    "\"rows\": %llu, \"row_failures\": %llu, \"queue_waits\": %llu }",
+	    write_back.pending, write_back.batches, write_back.batch_failures, write_back.rows, write_back.row_failures,
+	    write_back.queue_waits );
+	pthread_mutex_unlock( &write_back.lock );
     }
 
-    //The "0 >" test means that the resultant string can be nonsense (cut off due to being
-    //longer than MAX_SQL_LENGTH), but that's okay; MySQL will yell at us for that here in
-    //a minute.
-    if ( 0 > snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT %s FROM %s WHERE %s='%s'", options.prikey, options.table, options.prikey, clean_path) )
+    if ( options.binlog )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-	DFRV(-EIO);
+	dfuse_stats_printf( &b, ",\n  \"binlog\": { \"following\": %s, \"connects\": %llu, \"events\": %llu, \"rows\": %llu, "
+	    "\"keys_invalidated\": %llu, \"tables_invalidated\": %llu }",
+	    binlog_following ? "true" : "false", binlog.connects, binlog.events, binlog.rows, binlog.keys_invalidated,
+	    binlog.tables_invalidated );
     }
 
-    DFUSE_FREE(url_path);
-    DFUSE_FREE(url_path_struct);
-    DFUSE_FREE(clean_path);
-
-    D( "Running SQL: '%s'.\n", sqlbuf );
-
-    qr = mysql_query( sql, sqlbuf );
-
-    switch( qr )
+    if ( options.poll )
     {
-	case CR_COMMANDS_OUT_OF_SYNC:
-	    DFRV(-EDEADLK);
-	case CR_SERVER_GONE_ERROR:
-	case CR_SERVER_LOST:
-	case CR_UNKNOWN_ERROR:
-	default:
-	    DFRV(-EIO);
-	case 0:
-	    break;
+	dfuse_stats_printf( &b, ",\n  \"poll\": { \"following\": %s, \"ticks\": %llu, \"failures\": %llu, \"keys_invalidated\": %llu }",
+	    poll_following ? "true" : "false", poller.ticks, poller.failures, poller.keys_invalidated );
     }
 
-    if ( !( sql_res = mysql_store_result( sql ) ) )
+    if ( options.snapshot )
     {
-	DFRV(-EIO);
+	dfuse_stats_printf( &b, ",\n  \"snapshot\": { \"views\": %llu, \"failures\": %llu, \"operations\": %llu, "
+	    "\"expired\": %llu, \"released\": %llu }",
+	    read_view.views, read_view.failures, read_view.operations, read_view.expired, read_view.released );
     }
 
-    if ( mysql_num_rows( sql_res ) == 0 )
+    if ( options.mirror )
     {
-	DFRV(-ENOENT);
+	dfuse_stats_printf( &b, ",\n  \"mirror\": { \"reused\": %llu, \"loads\": %llu, \"revalidations\": %llu, "
+	    "\"refreshes\": %llu, \"failures\": %llu, \"rows_copied\": %llu, \"rows_fetched\": %llu, \"hits\": %llu, "
+	    "\"misses\": %llu }",
+	    mirror.reused, mirror.loads, mirror.revalidations, mirror.refreshes, mirror.failures, mirror.rows_copied,
+	    mirror.rows_fetched, mirror.hits, mirror.misses );
     }
-    else if ( mysql_num_rows( sql_res ) != 1 )
+
+    dfuse_stats_printf( &b, "\n}\n" );
+
+    if ( b.failed )
     {
-	DFRV(-EIO);
+	DFUSE_FREE( b.data );
+	return NULL;
     }
 
-    mysql_free_result( sql_res );
+    *length = b.length;
 
-    DFRV(0);
+    return b.data;
 }
 
-char * forge_update( struct dfuse_nv_ll * rootnvll )
+static void dfuse_stats_stat( fuse_ino_t ino, struct stat *stbuf )
 {
-    struct dfuse_nv_ll * thisnvll;
-    char *rv, *rv_realloc, *rv_int, *clean_name, *clean_value;
-    unsigned long sizeofrv = 0;
-    const char update_intercolumn[] = ", ";
-    const char update_preset[] = "`";
-    const char update_midset[] = "`='";
-    const char update_postset[] = "'";
-    MYSQL *sql = NULL;
+    char *text;
+    unsigned long length = 0;
 
-    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    if ( ino == DFUSE_STATS_DIR_INO )
     {
-	D( "Failed to connect to database in forge_update at line %d.\n", __LINE__ );
-	DFRV(NULL);
+	dfuse_stat_dir( ino, stbuf );
+	return;
     }
 
-    sizeofrv = 1;
-    rv = malloc(sizeofrv);
-    (rv)[0] = '\0';
-
-    D( "Commencing forge run with rootnvll=%p.\n", rootnvll );
+    memset( stbuf, 0, sizeof( struct stat ) );
+    stbuf->st_ino = ino;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time( NULL );
 
-    for ( thisnvll = rootnvll; thisnvll; thisnvll = thisnvll->next )
+    if ( ino == DFUSE_SNAPSHOT_INO )
     {
-	D( "Forging loop with thisnvll=%p.\n", thisnvll );
-	// Does this nvll encode a deeper nesting?
-	if ( thisnvll->nvll_value )
-	{
-	    if ( (rv)[0] == '\0' )
-	    {
-		D( "[Empty rv] Forging a new one from %ld.\n", sizeofrv );
-		free(rv);
-		if ( !( rv = forge_update(thisnvll->nvll_value) ) )
-		{
-		    D( "Failed to forge_update with a blank rv at %d.", __LINE__ );
-		    DFRV(NULL);
-		}
-		sizeofrv += strlen(rv);
-		D( "[Empty rv] New sizeofrv is %ld.\n", sizeofrv );
-	    }
-	    else
-	    {
-		D( "This should never happen with DFuse-generated JSON: got deeply-nested JSON with rv so far='%s'.", rv );
-		rv_int = forge_update(thisnvll->nvll_value);
-		sizeofrv += strlen(update_intercolumn) + strlen(rv_int);
-		if ( !( rv_realloc = realloc( rv, sizeofrv ) ) )
-		{
-		    D( "Failed to realloc to %ld.", sizeofrv );
-		    DFUSE_FREE( rv );
-		    DFUSE_FREE( rv_int );
-		    DFRV(NULL);
-		}
-		rv = rv_realloc;
-		sprintf( rv, "%s%s%s", rv, update_intercolumn, rv_int );
-		DFUSE_FREE( rv_int );
-	    }
-	}
-	// Does this nvll encode a name-value pair?
-	// TODO: First blush suggests that thisnvll->value should likely not be here, since NULL is a valid answer.
-	//	 Then again, which is the correct semantics: negative value->length and NULL value->string, perhaps?
-	//	 Or is it better to set the whole value, itself, to NULL?
-	else if ( thisnvll->name && thisnvll->value )
-	{
-	    char * debug_string;
-
-	    D( "Found a \"real\" nvll with name='%s'.\n", thisnvll->name->string );
-	    // Do we already have an rv?  If not, create one from scratch.
-	    if ( rv[0] == '\0' )
-	    {
-		D( "[real empty rv] former sizeofrv=%ld.\n", sizeofrv );
-		// DFUSE_MALLOC doesn't support realloc() right now.  I could free() then malloc(), but meh.
-		sizeofrv += strlen(update_preset) + thisnvll->name->length + strlen(update_midset) + thisnvll->value->length + strlen(update_postset);
-		D( "[real empty rv] subsequent sizeofrv=%ld.\n", sizeofrv );
-		if ( !( rv_realloc = realloc( rv, sizeofrv ) ) )
-		{
-		    D( "Failed to realloc rv to='%ld'.", sizeofrv );
-		    DFUSE_FREE( rv );
-		    DFRV(NULL);
-		}
-		rv = rv_realloc;
-
-		if ( !( clean_name = DFUSE_MALLOC((thisnvll->name->length)*2+1) ) )
-		{
-		    D( "Failed to allocate for cleaned thisnvll->name with length=%ld.\n", thisnvll->name->length );
-		    DFUSE_FREE( rv );
-		    DFRV( NULL );
-		}
-
-		D( "Original nvll->name:  '%s'.\n", (debug_string = urlencode(thisnvll->name->string, thisnvll->name->length)) );
-		DFUSE_FREE( debug_string );
-		mysql_real_escape_string( sql, clean_name, thisnvll->name->string, thisnvll->name->length );
+	stbuf->st_mode = S_IFREG | 0644;
+	return;
+    }
 
-		if ( !clean_name || strlen(clean_name) <= 0 )
-		{
-		    D( "clean_name, with original length %ld, got mucked up somehow.\n", thisnvll->name->length );
-		    DFUSE_FREE(rv);
-		    if ( clean_name )
-		    {
-			DFUSE_FREE( clean_name );
-		    }
-		    DFRV(NULL);
-		}
-		D( "Cleaned nvll->name:   '%s'.\n", (debug_string = urlencode(clean_name,strlen(clean_name))) );
+    // Only a guide: opens read with direct_io, which goes by what read() returns instead.
+    if ( ( text = dfuse_stats_render( &length ) ) )
+    {
+	DFUSE_FREE( text );
+    }
 
-		if ( !( clean_value = DFUSE_MALLOC((thisnvll->value->length)*2+1) ) )
-		{
-		    D( "Failed to allocate for cleaned thisnvll->value with length=%ld.\n", thisnvll->value->length );
-		    DFUSE_FREE( rv );
-		    DFUSE_FREE( clean_name );
-		    DFRV( NULL );
-		}
+    stbuf->st_size = length;
+}
 
-		D( "Original nvll->value: '%s'.\n", (debug_string = urlencode(thisnvll->value->string, thisnvll->value->length)) );
-		DFUSE_FREE( debug_string );
-		mysql_real_escape_string( sql, clean_value, thisnvll->value->string, thisnvll->value->length );
+/*
+ * What dfuse_oper points at: /.dfuse is answered here, and everything else is timed on its way
+ * through to the handler proper.
+ */
+static void dfuse_stats_lookup( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+    unsigned long long started = dfuse_now_us();
+    struct fuse_entry_param e;
 
-		if ( !clean_value || strlen(clean_value) <= 0 )
-		{
-		    D( "clean_value, with original length %ld, got mucked up somehow.\n", thisnvll->value->length );
-		    DFUSE_FREE(rv);
-		    DFUSE_FREE(clean_name);
-		    if ( clean_value )
-		    {
-			DFUSE_FREE( clean_value );
-		    }
-		    DFRV(NULL);
-		}
+    if ( parent == DFUSE_STATS_DIR_INO || ( parent == FUSE_ROOT_ID && !strcmp( name, DFUSE_STATS_DIR_NAME ) ) )
+    {
+	memset( &e, 0, sizeof( e ) );
 
-		D( "Cleaned nvll->value:  '%s'.\n", (debug_string = urlencode(clean_value, strlen(clean_value))) );
-		DFUSE_FREE( debug_string );
+	if ( parent == FUSE_ROOT_ID )
+	{
+	    e.ino = DFUSE_STATS_DIR_INO;
+	}
+	else if ( !strcmp( name, DFUSE_STATS_NAME ) )
+	{
+	    e.ino = DFUSE_STATS_INO;
+	}
+	else if ( options.snapshot && !strcmp( name, DFUSE_SNAPSHOT_NAME ) )
+	{
+	    e.ino = DFUSE_SNAPSHOT_INO;
+	}
+	else
+	{
+	    fuse_reply_err( req, ENOENT );
+	    return;
+	}
 
-		sprintf( rv, "%s%s%s%s%s", update_preset, clean_name, update_midset, clean_value, update_postset );
+	e.entry_timeout = DFUSE_KERNEL_DIR_TTL;
+	e.attr_timeout = e.ino == DFUSE_STATS_DIR_INO ? DFUSE_KERNEL_DIR_TTL : 0;
+	dfuse_stats_stat( e.ino, &e.attr );
 
-		DFUSE_FREE(clean_name);
-		DFUSE_FREE(clean_value);
-	    }
-	    // We have an extant rv, so add to the end of it.
-	    else
-	    {
-		D( "[extant real rv] entering with rv='%s'.\n", rv );
-		D( "[extant real rv] former sizeofrv=%ld.\n", sizeofrv );
-		D( "[extant real rv] claimed name length=%ld\n", thisnvll->name->length );
-		D( "[extant real rv] measured name length=%ld\n", strlen(thisnvll->name->string) );
-		D( "[extant real rv] claimed value length=%ld\n", thisnvll->value->length );
-		D( "[extant real rv] measured value length=%ld\n", strlen(thisnvll->value->string) );
-		sizeofrv += strlen(update_intercolumn) + strlen(update_preset) + thisnvll->name->length + strlen(update_midset) + thisnvll->value->length + strlen(update_postset);
-		D( "[extant real rv] subsequent sizeofrv=%ld.\n", sizeofrv );
-		if ( !( rv = realloc( rv, sizeofrv ) ) )
-		{
-		    D( "Failed to realloc existing rv to '%ld'.\n", sizeofrv );
-		    free( rv );
-		    return NULL;
-		}
-		//TODO: blatantly not binary-safe.
-		sprintf( rv, "%s%s%s%s%s%s%s", rv, update_intercolumn, update_preset, thisnvll->name->string, update_midset, thisnvll->value->string, update_postset );
-	    }
-	}
+	fuse_reply_entry( req, &e );
+	return;
     }
 
-    return rv;
+    dfuse_lookup( req, parent, name );
+    dfuse_stats_op( DFUSE_OP_LOOKUP, started );
 }
 
-static int dfuse_flush(const char *path, struct fuse_file_info *fi)
+static void dfuse_stats_getattr( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
 {
-    return 0;
-}
+    unsigned long long started = dfuse_now_us();
+    struct stat stbuf;
 
-static int dfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
-{
-    return 0;
-}
+    if ( ino == DFUSE_STATS_DIR_INO || ino == DFUSE_STATS_INO || ino == DFUSE_SNAPSHOT_INO )
+    {
+	dfuse_stats_stat( ino, &stbuf );
+	fuse_reply_attr( req, &stbuf, ino == DFUSE_STATS_DIR_INO ? DFUSE_KERNEL_DIR_TTL : 0 );
+	return;
+    }
 
-static int dfuse_truncate(const char *path, off_t offset)
-{
-    return 0;
+    dfuse_getattr( req, ino, fi );
+    dfuse_stats_op( DFUSE_OP_GETATTR, started );
 }
 
-static int dfuse_write(const char *path, const char *buf, size_t size, off_t offset,
-			struct fuse_file_info *fi)
+static void dfuse_stats_open( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
 {
-    MYSQL *sql;
-    int qr;
-    char sqlbuf[2000];
-    struct string_length *url_path_struct;
-    char *url_path, *clean_path, *update_string;
-    struct dfuse_nv_ll *rootnvll = NULL;
+    unsigned long long started = dfuse_now_us();
+    struct dfuse_handle *fh;
 
-    //We don't do any buffering quite yet, so write it all at once or not at all.
-    if ( size <= 0 || offset != 0 )
+    if ( ino != DFUSE_STATS_INO && ino != DFUSE_SNAPSHOT_INO )
     {
-	DFRV(-EFAULT);
+	dfuse_open( req, ino, fi );
+	dfuse_stats_op( DFUSE_OP_OPEN, started );
+	return;
     }
 
-    //TODO: Refactor; this is literally a C&P from dfuse_read
-    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    if ( ino == DFUSE_STATS_INO && ( fi->flags & O_ACCMODE ) != O_RDONLY )
     {
-	DFRV(-EIO);
+	fuse_reply_err( req, EACCES );
+	return;
     }
 
-    if ( !path || path[0] == '\0' )
+    if ( ino == DFUSE_SNAPSHOT_INO && ( fi->flags & O_ACCMODE ) != O_RDONLY )
     {
-	DFRV(-ENOENT);
+	dfuse_read_view_release();
     }
 
-    if ( !(url_path_struct = urldecode(path+sizeof(char)) ) )
+    // A handle like any other, that just never came from a row, so dfuse_read and dfuse_release
+    // needn't know the difference.
+    if ( !( fh = DFUSE_MALLOC( sizeof( struct dfuse_handle ) ) ) )
     {
-	DFRV(-ENOMEM);
+	fuse_reply_err( req, ENOMEM );
+	return;
     }
 
-    url_path = url_path_struct->string;
+    memset( fh, 0, sizeof( struct dfuse_handle ) );
+    pthread_mutex_init( &fh->lock, NULL );
 
-    if ( !( clean_path = DFUSE_MALLOC((url_path_struct->length)*2+1) ) )
+    if ( ino == DFUSE_SNAPSHOT_INO )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFRV(-ENOMEM);
+	fh->data = DFUSE_MALLOC( 1 );
+	if ( fh->data ) { fh->data[0] = '\0'; }
     }
-
-    mysql_real_escape_string( sql, clean_path, url_path, url_path_struct->length );
-
-    if ( !clean_path || strlen(clean_path) <= 0 )
+    else
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-	DFRV(-ENOENT);
+	fh->data = dfuse_stats_render( &fh->length );
     }
 
-    if ( 0 > snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT %s FROM %s WHERE %s='%s'", options.columns, options.table, options.prikey, clean_path) )
+    if ( !fh->data )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-	DFRV(-EIO);
+	dfuse_free_handle( fh );
+	fuse_reply_err( req, ENOMEM );
+	return;
     }
 
-    D( "Querying: '%s'.\n", sqlbuf );
+    fh->capacity = fh->length;
 
-    qr = mysql_query( sql, sqlbuf );
+    fi->fh = (uint64_t)(uintptr_t)fh;
+    fi->direct_io = 1;
 
-    switch( qr )
-    {
-	case CR_COMMANDS_OUT_OF_SYNC:
-	case CR_SERVER_GONE_ERROR:
-	case CR_SERVER_LOST:
-	case CR_UNKNOWN_ERROR:
-	default:
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    DFUSE_FREE(clean_path);
+    fuse_reply_open( req, fi );
+}
 
-	    DFRV(-EIO);
-	case 0:
-	    break;
-    }
+static void dfuse_stats_read( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    unsigned long long started = dfuse_now_us();
 
-    if ( !( rootnvll = dfuse_parse_json( buf, size, NULL ) ) )
-    {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
+    dfuse_read( req, ino, size, offset, fi );
 
-	DFRV(-EIO);
+    // Scraping the stats shouldn't show up in them.
+    if ( ino != DFUSE_STATS_INO && ino != DFUSE_SNAPSHOT_INO )
+    {
+	dfuse_stats_op( DFUSE_OP_READ, started );
     }
+}
 
-    update_string = forge_update(rootnvll);
+static void dfuse_stats_write( fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    unsigned long long started = dfuse_now_us();
 
-    D("Got an UPDATE: UPDATE `%s`", options.table);
-    D(" SET %s", update_string);
-    D(" WHERE %s", options.prikey );
-    D("='%s'\n", clean_path );
+    // Opening it for writing was what counted; what's written goes nowhere.
+    if ( ino == DFUSE_SNAPSHOT_INO )
+    {
+	fuse_reply_write( req, size );
+	return;
+    }
 
-    return size;
+    dfuse_write( req, ino, buf, size, offset, fi );
+    dfuse_stats_op( DFUSE_OP_WRITE, started );
 }
 
-static int dfuse_read(const char *path, char *buf, size_t size, off_t offset,
-			struct fuse_file_info *fi)
+static void dfuse_stats_flush( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
 {
-    size_t len;
-//    (void) fi;
-    MYSQL *sql;
-    MYSQL_RES *sql_res;
-    MYSQL_ROW sql_row;
-    int qr;
-    char sqlbuf[2000];
-    struct string_length *url_path_struct;
-    char *url_path, *clean_path;
-    char *rv;
+    unsigned long long started = dfuse_now_us();
 
-    if ( !(sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
-    {
-	DFRV(-EIO);
-    }
+    dfuse_flush( req, ino, fi );
+    dfuse_stats_op( DFUSE_OP_FLUSH, started );
+}
 
-    if ( !path || path[0] == '\0' )
+static void dfuse_stats_opendir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+    // There's nothing in /.dfuse to page through, so it needs no dfuse_dir_handle.
+    if ( ino == DFUSE_STATS_DIR_INO )
     {
-	DFRV(-ENOENT);
+	fi->fh = 0;
+	fuse_reply_open( req, fi );
+	return;
     }
 
-    if ( !(url_path_struct = urldecode(path+sizeof(char)) ) )
+    dfuse_opendir( req, ino, fi );
+}
+
+// Lists /.dfuse: the stats, and with --snapshot, its control file.
+static void dfuse_stats_list( fuse_req_t req, size_t size, off_t offset, int plus )
+{
+    struct fuse_entry_param e;
+    char *buf;
+    size_t used = 0;
+
+    if ( !( buf = DFUSE_MALLOC( size ) ) )
     {
-	DFRV(-ENOMEM);
+	fuse_reply_err( req, ENOMEM );
+	return;
     }
 
-    url_path = url_path_struct->string;
+    memset( &e, 0, sizeof( e ) );
+    dfuse_stat_dir( DFUSE_STATS_DIR_INO, &e.attr );
 
-    if ( !( clean_path = DFUSE_MALLOC((url_path_struct->length)*2+1) ) )
+    if ( offset < 1 )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFRV(-ENOMEM);
+	dfuse_dir_add( req, buf, size, &used, plus, ".", &e, 1, NULL, NULL, 0, 0 );
     }
 
-    mysql_real_escape_string( sql, clean_path, url_path, url_path_struct->length );
+    e.attr.st_ino = FUSE_ROOT_ID;
 
-    if ( clean_path || strlen(clean_path) <= 0 )
+    if ( offset < 2 )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-	DFRV(-ENOENT);
+	dfuse_dir_add( req, buf, size, &used, plus, "..", &e, 2, NULL, NULL, 0, 0 );
     }
 
-    if ( 0 > snprintf( sqlbuf, MAX_SQL_LENGTH, "SELECT %s FROM %s WHERE %s='%s'", options.columns, options.table, options.prikey, clean_path) )
+    if ( offset < 3 )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-	DFUSE_FREE(clean_path);
-	DFRV(-EIO);
+	e.ino = DFUSE_STATS_INO;
+	e.entry_timeout = DFUSE_KERNEL_DIR_TTL;
+	dfuse_stats_stat( e.ino, &e.attr );
+	dfuse_dir_add( req, buf, size, &used, plus, DFUSE_STATS_NAME, &e, 3, NULL, NULL, 0, 0 );
     }
 
-    DFUSE_FREE(clean_path);
+    if ( offset < 4 && options.snapshot )
+    {
+	e.ino = DFUSE_SNAPSHOT_INO;
+	dfuse_stats_stat( e.ino, &e.attr );
+	dfuse_dir_add( req, buf, size, &used, plus, DFUSE_SNAPSHOT_NAME, &e, 4, NULL, NULL, 0, 0 );
+    }
 
-    qr = mysql_query( sql, sqlbuf );
+    fuse_reply_buf( req, buf, used );
 
-    switch( qr )
-    {
-	case CR_COMMANDS_OUT_OF_SYNC:
-	case CR_SERVER_GONE_ERROR:
-	case CR_SERVER_LOST:
-	case CR_UNKNOWN_ERROR:
-	default:
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
+    DFUSE_FREE( buf );
+}
 
-	    DFRV(-EIO);
-	case 0:
-	    break;
-    }
+static void dfuse_stats_readdir( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    unsigned long long started = dfuse_now_us();
 
-    if ( !( sql_res = mysql_store_result( sql ) ) )
+    if ( ino == DFUSE_STATS_DIR_INO )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-
-	DFRV(-EIO);
+	dfuse_stats_list( req, size, offset, 0 );
+	return;
     }
 
-    if ( mysql_num_rows( sql_res ) == 0 )
-    {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
+    dfuse_readdir( req, ino, size, offset, fi );
+    dfuse_stats_op( DFUSE_OP_READDIR, started );
+}
 
-	DFRV(-ENOENT);
-    }
+static void dfuse_stats_readdirplus( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi )
+{
+    unsigned long long started = dfuse_now_us();
 
-    if ( mysql_num_rows( sql_res ) != 1 )
+    if ( ino == DFUSE_STATS_DIR_INO )
     {
-	DFUSE_FREE(url_path);
-	DFUSE_FREE(url_path_struct);
-
-	DFRV(-EIO);
+	dfuse_stats_list( req, size, offset, 1 );
+	return;
     }
 
-    sql_row = mysql_fetch_row( sql_res );
+    dfuse_readdirplus( req, ino, size, offset, fi );
+    dfuse_stats_op( DFUSE_OP_READDIR, started );
+}
+
+// touch(1) on /.dfuse/snapshot, or the truncate of an "echo > /.dfuse/snapshot".
+static void dfuse_stats_setattr( fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi )
+{
+    struct stat stbuf;
 
-    if ( json )
+    if ( ino != DFUSE_SNAPSHOT_INO )
     {
-	D("url_path: '%s'\n",url_path);
-	rv = dfuse_jsonify_row( &sql_row, sql_res, url_path, url_path_struct->length );
+	dfuse_setattr( req, ino, attr, to_set, fi );
+	return;
     }
-    else
-    {
-	if ( sql_row[0] == NULL )
-	{
-	    DFUSE_FREE(url_path);
-	    DFUSE_FREE(url_path_struct);
-	    mysql_free_result( sql_res );
 
-	    DFRV(-EINVAL);		// TAG: NULL_HANDLING
-	}
+    dfuse_read_view_release();
 
-	rv = sql_row[0];
-    }
+    dfuse_stats_stat( ino, &stbuf );
+    fuse_reply_attr( req, &stbuf, 0 );
+}
 
-    DFUSE_FREE(url_path);
-    DFUSE_FREE(url_path_struct);
+/*
+ * Runs once FUSE has daemonized, so threads started here survive the fork.
+ */
+static void dfuse_init( void *userdata, struct fuse_conn_info *conn )
+{
+    stats.started = time( NULL );
 
-    if ( !rv || ( len = strlen(rv) ) < 0 )
+    // Before anything that might hear about a change.
+    if ( ( options.binlog || options.poll ) && dfuse_generations_init() )
     {
-	mysql_free_result( sql_res );
+	syslog( LOG_ERR, "dfuse: out of memory; the kernel won't get to keep its page cache." );
+    }
 
-	DFRV(-ENOENT);
+    if ( options.write_back && dfuse_write_back_start() )
+    {
+	syslog( LOG_ERR, "dfuse: couldn't start the write-back committer; writing through instead." );
     }
 
-    if (offset < len)
+    if ( options.binlog && dfuse_binlog_start() )
     {
-	if (offset + size > len)
-	{
-	    size = len - offset;
-	}
-	memcpy(buf, rv + offset, size);
+	syslog( LOG_ERR, "dfuse: couldn't start following the binlog; the attribute cache stays off." );
     }
-    else
+
+    if ( options.poll && dfuse_poll_start() )
     {
-	size = 0;
+	syslog( LOG_ERR, "dfuse: couldn't start polling for changes; the attribute cache stays off." );
     }
 
-    if ( json )
+    // Without it, a view nobody reads from again lasts until the next read.
+    if ( options.snapshot && dfuse_read_view_start() )
     {
-	DFUSE_FREE( rv );
+	syslog( LOG_ERR, "dfuse: couldn't start the snapshot reaper; read views only end when read from." );
     }
 
-    mysql_free_result( sql_res );
+    // After the change feeds, so the first load hears about everything that changes under it.
+    if ( options.mirror && dfuse_mirror_start() )
+    {
+	syslog( LOG_ERR, "dfuse: couldn't start the mirror; everything's served from the database." );
+    }
+
+    // Without it, the kernel just doesn't get to cache anything for long; see dfuse_kernel_ttl.
+    if ( ( options.binlog || options.poll ) && dfuse_notifier_start() )
+    {
+	syslog( LOG_ERR, "dfuse: couldn't start telling the kernel about changes; it won't cache them for long." );
+    }
+}
 
-    DFRV(size);
+static void dfuse_destroy( void *userdata )
+{
+    dfuse_binlog_stop();
+    dfuse_binlog_report();
+    dfuse_poll_stop();
+    dfuse_poll_report();
+    dfuse_read_view_stop();
+    dfuse_read_view_report();
+    dfuse_mirror_stop();
+    dfuse_mirror_report();
+    dfuse_notifier_stop();
+    dfuse_notifier_report();
+    dfuse_inodes_report();
+    dfuse_generations_report();
+    dfuse_write_back_stop();
+    dfuse_write_back_report();
+    dfuse_pool_report();
+    dfuse_attr_cache_report();
+    dfuse_pool_destroy();
 }
 
-static struct fuse_operations dfuse_oper = {
-    .getattr = dfuse_getattr,
-    .fgetattr = dfuse_fgetattr,
-    .readdir = dfuse_readdir,
-    .open = dfuse_open,
-    .read = dfuse_read,
-    .write = dfuse_write,
-    .flush = dfuse_flush,
+static struct fuse_lowlevel_ops dfuse_oper = {
+    .lookup = dfuse_stats_lookup,
+    .forget = dfuse_forget,
+    .forget_multi = dfuse_forget_multi,
+    .getattr = dfuse_stats_getattr,
+    .setattr = dfuse_stats_setattr,
+    .opendir = dfuse_stats_opendir,
+    .readdir = dfuse_stats_readdir,
+    .readdirplus = dfuse_stats_readdirplus,
+    .releasedir = dfuse_releasedir,
+    .open = dfuse_stats_open,
+    .read = dfuse_stats_read,
+    .release = dfuse_release,
+    .write = dfuse_stats_write,
+    .flush = dfuse_stats_flush,
     .create = dfuse_create,
-    .truncate = dfuse_truncate,
+    .fsync = dfuse_fsync,
     .readlink = dfuse_readlink,
+    .init = dfuse_init,
+    .destroy = dfuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
     int rv = -1;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts cmdline;
+    MYSQL *sql;
 #ifdef ESCAPE_ARGS
     char *clean_table, *clean_prikey, *clean_columns;
-    MYSQL *sql;
 #endif
 
 //    printf( "Starting...\n" );
 
+#ifdef BENCH_JSON
+    return dfuse_bench_json();
+#endif
+
     /* clear structure that holds our options */
     memset(&options, 0, sizeof(struct options));
+    options.pool_min = DFUSE_POOL_DEFAULT_MIN;
+    options.pool_max = DFUSE_POOL_DEFAULT_MAX;
+    options.attr_ttl = DFUSE_TTL_UNSET;
+    options.negative_ttl = DFUSE_TTL_UNSET;
+    options.attr_cache_max = DFUSE_ATTR_CACHE_MAX_DEFAULT;
+    options.readdir_batch = DFUSE_READDIR_BATCH_DEFAULT;
+    options.write_back_batch = DFUSE_WRITE_BACK_BATCH_DEFAULT;
+    options.write_back_delay = DFUSE_WRITE_BACK_DELAY_DEFAULT;
+    options.stream_threshold = DFUSE_STREAM_THRESHOLD_DEFAULT;
+    options.binlog = 0;
+    options.binlog_server_id = 0;
+    options.poll = 0;
+    options.snapshot = 0;
+    options.mirror = NULL;
+    options.mirror_refresh = DFUSE_MIRROR_REFRESH_DEFAULT;
+    options.shard = NULL;
+    options.shard_levels = DFUSE_SHARD_LEVELS_DEFAULT;
+    options.shard_width = DFUSE_SHARD_WIDTH_DEFAULT;
+
+    // Has to happen before there are any threads around to race it.
+    if ( mysql_library_init( 0, NULL, NULL ) )
+    {
+	printf( "Unable to initialize the MySQL client library.\n" );
+	return -1;
+    }
 
     if (fuse_opt_parse(&args, &options, dfuse_opts, dfuse_opt_proc))
     {
@@ -1880,8 +12657,47 @@ int main(int argc, char *argv[])
 	return -1;
     }
 
+    // What's left is FUSE's: the mountpoint, -f, -s, -o and the like.
+    if ( fuse_parse_cmdline( &args, &cmdline ) || !cmdline.mountpoint )
+    {
+	usage(argv);
+	fuse_opt_free_args(&args);
+	return -1;
+    }
+
+    // No -t means every table, each in a directory of its own, and each with its own primary key.
+    if ( !options.table && !options.prikey )
+    {
+	multi_table = 1;
+
+	if ( !options.columns )
+	{
+	    options.columns = "*";
+	    json = !options.column_files;
+	}
+    }
+
+    // Without a change feed, a cached stat() is wrong for as long as it's cached, and only the
+    // user can say how wrong is all right.
+    if ( options.attr_ttl == DFUSE_TTL_UNSET )
+    {
+	options.attr_ttl = options.binlog || options.poll ? DFUSE_ATTR_TTL_DEFAULT : 0;
+    }
+
+    if ( options.negative_ttl == DFUSE_TTL_UNSET )
+    {
+	options.negative_ttl = options.binlog || options.poll ? DFUSE_NEGATIVE_TTL_DEFAULT : 0;
+    }
+
+    if ( !multi_table && ( options.include || options.exclude ) )
+    {
+	printf( "--include and --exclude pick tables, so they can't be used with -t.\n" );
+	usage(argv);
+	return -1;
+    }
+
     if ( !options.username || !options.password || !options.hostname || !options.database
-	|| !options.table || !options.prikey || !options.columns )
+	|| ( !multi_table && ( !options.table || !options.prikey ) ) || !options.columns )
     {
 	printf( "Undefined critical variable.\n" );
 
@@ -1903,6 +12719,12 @@ int main(int argc, char *argv[])
     }
 
 #ifdef ESCAPE_ARGS
+    if ( multi_table )
+    {
+	printf( "This build escapes -t, -P and -c, and so requires all three.\n" );
+	return -1;
+    }
+
     if ( !( clean_table = DFUSE_MALLOC(strlen(options.table)*2+1) ) )
     {
 	printf( "Unable to allocate memory for clean_table.\n" );
@@ -1935,6 +12757,8 @@ int main(int argc, char *argv[])
     mysql_real_escape_string( sql, clean_prikey, options.prikey, strlen(options.prikey) );
     mysql_real_escape_string( sql, clean_columns, options.columns, strlen(options.columns) );
 
+    dfuse_checkin();
+
     DFUSE_FREE( options.table );
     DFUSE_FREE( options.prikey );
     DFUSE_FREE( options.columns );
@@ -1948,7 +12772,7 @@ int main(int argc, char *argv[])
 //    printf( "'%s': %d\n", options.prikey, strlen(options.prikey) );
 //    printf( "'%s': %d\n", options.columns, strlen(options.columns) );
 
-    if ( !strlen(options.table) || !strlen(options.prikey) || !strlen(options.columns) )
+    if ( ( !multi_table && ( !strlen(options.table) || !strlen(options.prikey) ) ) || !strlen(options.columns) )
     {
 	printf( "Invalid option set specified: you must declare a non-zero-length table, primary key(s), and column(s).\n" );
 	usage(argv);
@@ -1957,10 +12781,117 @@ int main(int argc, char *argv[])
 	return -1;
     }
 
+    if ( !options.readdir_batch )
+    {
+	printf( "Invalid --readdir-batch: we have to list at least one row at a time.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    if ( !options.write_back_batch )
+    {
+	printf( "Invalid --write-back-batch: a batch has to hold at least one row.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    if ( options.mirror && !options.mirror_refresh )
+    {
+	printf( "Invalid --mirror-refresh: the mirror has to be refreshed at least once a second.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    // A mirror is as of its last refresh, not as of the read view.
+    if ( options.mirror && options.snapshot )
+    {
+	printf( "--mirror and --snapshot can't be used together.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    // A row is either one file or a directory of them.
+    if ( options.column_files && json )
+    {
+	printf( "--column-files and --json can't be used together.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    // The mirror keeps whole rows, keyed by row, and so do its files.
+    if ( options.column_files && options.mirror )
+    {
+	printf( "--column-files and --mirror can't be used together.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    if ( options.shard && strcmp( options.shard, "prefix" ) && strcmp( options.shard, "hash" ) )
+    {
+	printf( "Invalid --shard: it's either 'prefix' or 'hash' (got '%s').\n", options.shard );
+	usage(argv);
+	return -1;
+    }
+
+    if ( options.shard && ( !options.shard_levels || !options.shard_width ) )
+    {
+	printf( "Invalid --shard-levels or --shard-width: both have to be at least 1.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    // Hash names are hex digits of a CRC32, and every directory above the rows lists all of them.
+    if ( options.shard && !strcmp( options.shard, "hash" )
+      && ( options.shard_width > 4 || options.shard_levels > 8 / options.shard_width ) )
+    {
+	printf( "Invalid --shard-width or --shard-levels: --shard=hash has 8 hex digits to go around, at most 4 a level.\n" );
+	usage(argv);
+	return -1;
+    }
+
+    // Replicas have to be told apart, and 0 would get us disconnected at the end of the log.
+    if ( options.binlog && !options.binlog_server_id )
+    {
+	options.binlog_server_id = 0x64660000 | ( getpid() & 0xffff );
+    }
+
+    if ( !options.pool_max || options.pool_min > options.pool_max )
+    {
+	printf( "Invalid pool size: --pool-max must be at least 1 and no smaller than --pool-min (got %u and %u).\n",
+	  options.pool_max, options.pool_min );
+	usage(argv);
+	return -1;
+    }
+
     //Arguably, we should try to connect to the DB here, just to ensure that we can do so before we daemonize ourselves away.
-    if ( !dfuse_connect( NULL, NULL, NULL, NULL ) )
+    if ( dfuse_pool_init() )
+    {
+	printf( "Failed to connect to MySQL server '%s' as '%s'.\n", options.hostname, options.username );
+	return -1;
+    }
+
+    if ( !( sql = dfuse_connect( NULL, NULL, NULL, NULL ) ) )
+    {
+	printf( "Failed to connect to MySQL server '%s' as '%s'.\n", options.hostname, options.username );
+	return -1;
+    }
+
+    rv = dfuse_load_tables( sql );
+
+    if ( !rv && options.shard )
+    {
+	rv = dfuse_shard_tables( sql );
+    }
+
+    if ( !rv && options.column_files )
+    {
+	rv = dfuse_column_tables( sql );
+    }
+
+    dfuse_checkin();
+
+    if ( rv )
     {
-	printf( "Failed to connect: MySQL server said, '%s'.\n", mysql_error( NULL ) );
 	return -1;
     }
 
@@ -1968,18 +12899,41 @@ int main(int argc, char *argv[])
 		/* { "foo": { "bar": "baz", "boo": "boz" } } */
     char * foo = "{ \"foo\": { \"bar&x36;\": \"&x00;&x01;&x02;&x03;&x04;&x05;&x06;&x07;&x08;&x09;&x0a;&x0b;&x0c;&x0d;&x0e;&x0f;&x10;&x11;&x12;&x13;&x14;&x15;&x16;&x17;&x18;&x19;&x1a;&x1b;&x1c;&x1d;&x1e;&x1f;&x20;&x21;&x22;&x23;&x24;&x25;&x26;&x27;&x28;&x29;&x2a;&x2b;&x2c;&x2d;&x2e;&x2f;&x30;&x31;&x32;&x33;&x34;&x35;&x36;&x37;&x38;&x39;&x3a;&x3b;&x3c;&x3d;&x3e;&x3f;&x40;&x41;&x42;&x43;&x44;&x45;&x46;&x47;&x48;&x49;&x4a;&x4b;&x4c;&x4d;&x4e;&x4f;&x50;&x51;&x52;&x53;&x54;&x55;&x56;&x57;&x58;&x59;&x5a;&x5b;&x5c;&x5d;&x5e;&x5f;&x60;&x61;&x62;&x63;&x64;&x65;&x66;&x67;&x68;&x69;&x6a;&x6b;&x6c;&x6d;&x6e;&x6f;&x70;&x71;&x72;&x73;&x74;&x75;&x76;&x77;&x78;&x79;&x7a;&x7b;&x7c;&x7d;&x7e;&x7f;&x80;&x81;&x82;&x83;&x84;&x85;&x86;&x87;&x88;&x89;&x8a;&x8b;&x8c;&x8d;&x8e;&x8f;&x90;&x91;&x92;&x93;&x94;&x95;&x96;&x97;&x98;&x99;&x9a;&x9b;&x9c;&x9d;&x9e;&x9f;&xa0;&xa1;&xa2;&xa3;&xa4;&xa5;&xa6;&xa7;&xa8;&xa9;&xaa;&xab;&xac;&xad;&xae;&xaf;&xb0;&xb1;&xb2;&xb3;&xb4;&xb5;&xb6;&xb7;&xb8;&xb9;&xba;&xbb;&xbc;&xbd;&xbe;&xbf;&xc0;&xc1;&xc2;&xc3;&xc4;&xc5;&xc6;&xc7;&xc8;&xc9;&xca;&xcb;&xcc;&xcd;&xce;&xcf;&xd0;&xd1;&xd2;&xd3;&xd4;&xd5;&xd6;&xd7;&xd8;&xd9;&xda;&xdb;&xdc;&xdd;&xde;&xdf;&xe0;&xe1;&xe2;&xe3;&xe4;&xe5;&xe6;&xe7;&xe8;&xe9;&xea;&xeb;&xec;&xed;&xee;&xef;&xf0;&xf1;&xf2;&xf3;&xf4;&xf5;&xf6;&xf7;&xf8;&xf9;&xfa;&xfb;&xfc;&xfd;&xfe;&xff; `az\", \"&x35;bo'o&x33;\": \"bo&x32;z\" } }";
 //    char * foo = "{\n     \"firstName\": \"John\",\n     \"lastName\": \"Smith\",\n     \"age\": \"&x32;5\",\n     \"address\":\n     {\n         \"streetAddress\": \"21 2nd Street\",\n         \"city\": \"New York\",\n         \"state\": \"NY\",\n         \"postalCode\": \"10021\"\n     },\n     \"phoneNumber\":\n     {\n         \"home\": {\n           \"type\": \"home\",\n           \"number\": \"212 555-1234\"\n         },\n         \"fax\": {\n           \"type\": \"fax\",\n           \"number\": \"646 555-4567\"\n         }\n     }\n }\n";
-    struct dfuse_nv_ll * somenvll;
+    struct dfuse_json_parser * someparser = dfuse_json_parser_new();
 
-    somenvll = dfuse_parse_json( foo, strlen(foo), NULL );
+    dfuse_json_feed( someparser, foo, strlen(foo) );
 
-    print_nvll( somenvll, 0 );
-
-    printf( "Forged update: '%s'.\n", forge_update( somenvll ) );
+    if ( !dfuse_json_finish( someparser ) )
+    {
+	print_json_tokens( someparser );
+    }
 
     exit( 0 );
 #endif
 
-    rv = fuse_main(args.argc, args.argv, &dfuse_oper);
+    if ( !( session = fuse_session_new( &args, &dfuse_oper, sizeof( dfuse_oper ), NULL ) ) )
+    {
+	printf( "Unable to start a FUSE session.\n" );
+	return -1;
+    }
+
+    rv = -1;
+
+    if ( !fuse_set_signal_handlers( session ) )
+    {
+	if ( !fuse_session_mount( session, cmdline.mountpoint ) )
+	{
+	    fuse_daemonize( cmdline.foreground );
+
+	    rv = cmdline.singlethread ? fuse_session_loop( session ) : fuse_session_loop_mt( session, cmdline.clone_fd );
+
+	    fuse_session_unmount( session );
+	}
+
+	fuse_remove_signal_handlers( session );
+    }
+
+    fuse_session_destroy( session );
 
     if (rv)
     {
@@ -1987,6 +12941,7 @@ int main(int argc, char *argv[])
     }
 
     /** free arguments */
+    free( cmdline.mountpoint );
     fuse_opt_free_args(&args);
 
     return rv;
@@ -1999,9 +12954,10 @@ void usage( char **argv )
 	"  -p: Password [MANDATORY]\n"
 	"  -H: Hostname [MANDATORY]\n"
 	"  -D: DB Name  [MANDATORY]\n"
-	"  -t: Table    [MANDATORY]\n"
-	"  -P: Prim. Key(s) [MANDATORY]\n"
-	"  -c: Column(s) [MANDATORY]\n"
+	"  -t: Table    (Omit, along with -P, to mount every table as /<table>/<key>.)\n"
+	"  -P: Prim. Key(s) [MANDATORY with -t]  A list of columns (-P a,b) is a composite\n"
+	"      key: each file is named for its columns' values, urlencoded, joined by commas.\n"
+	"  -c: Column(s) [MANDATORY with -t; otherwise defaults to '*' and implies --json]\n"
 	"  -T: Timestamp Column (Try 'UNIX_TIMESTAMP()' if your RCS is braindead.)\n"
 	"      At the moment, defaults to NOW() in --json mode when specified,\n"
 	"      regardless of what argument you pass to it.\n"
@@ -2010,9 +12966,83 @@ void usage( char **argv )
 	"                  as long as the server will let us.  In lazy mode, we\n"
 	"                  actively close our connection when we're done with it.\n"
 	"                  Bad for performance, great for max_connections.\n"
+	"  --pool-min=N: Connections to open at mount time and keep around (default %d).\n"
+	"  --pool-max=N: Most connections we'll ever hold at once (default %d).  This is\n"
+	"                also how many FUSE requests can hit the database in parallel;\n"
+	"                the rest wait their turn.  Pool stats go to syslog at unmount.\n"
+	"  --attr-ttl=S: Remember file attributes for S seconds (0 disables; the default,\n"
+	"                unless --binlog or --poll is following changes, when it's %d).\n"
+	"  --negative-ttl=S: Remember that a file doesn't exist for S seconds (likewise 0,\n"
+	"                    or %d with --binlog or --poll).\n"
+	"  --attr-cache-max=N: Remember at most N files' worth of the above (default %d).\n"
+	"  --readdir-batch=N: List directories N rows per query (default %d).\n"
 	"  --json: Output in JSON format (try combining with -c '*').\n"
+	"  --include=GLOB[,GLOB...]: Without -t, only mount tables matching one of these.\n"
+	"  --exclude=GLOB[,GLOB...]: Without -t, don't mount tables matching any of these.\n"
+	"                            Tables without a primary key aren't mounted.\n"
+	"  --write-back: Have close() queue its UPDATE rather than run it; a background\n"
+	"                thread commits the queue in batches, one transaction each.  A\n"
+	"                failed UPDATE only gets logged.  fsync(), and a stat() or open()\n"
+	"                of a file that's still queued, wait for it to be committed.\n"
+	"  --write-back-batch=N: Rows per write-back transaction (default %d).\n"
+	"  --write-back-delay=MS: Wait at most MS ms for a batch to fill (default %d).\n"
+	"  --stream-threshold=BYTES: Without --json, files opened read-only that are bigger\n"
+	"                            than this are read straight from the server a chunk\n"
+	"                            at a time, instead of all at once at open (default\n"
+	"                            %d, 0 disables).\n"
+	"  --binlog: Follow the server's binary log (binlog_format=ROW, and a user with\n"
+	"            REPLICATION SLAVE and REPLICATION CLIENT), evicting rows other writers\n"
+	"            change from the attribute cache as they change, so --attr-ttl can be\n"
+	"            long.  Until it's following, the cache is off.\n"
+	"  --binlog-server-id=N: Replica server id to follow it as; has to be unique among\n"
+	"                        the server's replicas (default: made up from our pid).\n"
+	"  --poll=MS: Every MS ms, ask the server which rows changed since last time, and\n"
+	"             evict them from the attribute cache, so --attr-ttl can be long.  With\n"
+	"             -T, that's rows whose -T is no older than the last ask (indexing -T\n"
+	"             helps; deletes go unseen until --attr-ttl is up); without, each ask\n"
+	"             checksums every row, which sees everything but reads the whole table.\n"
+	"             Until the first ask, the cache is off.  Off by default.\n"
+	"  With --binlog or --poll, files that haven't changed since they were last opened\n"
+	"  are read from the kernel's page cache, without asking us at all, and the kernel\n"
+	"  keeps names and attributes for --attr-ttl (--negative-ttl for missing files),\n"
+	"  being told as soon as they change.  Otherwise it keeps them for a second.\n"
+	"  --snapshot=S: Serve reads (lookups, stats, listings and read-only opens and\n"
+	"                reads) from one consistent snapshot of the database, on one\n"
+	"                connection, for S seconds from the first of them, or until\n"
+	"                <mountpoint>/.dfuse/snapshot is touched; then the next read takes\n"
+	"                a new one.  For point-in-time tars and git adds of a live\n"
+	"                database; reads take turns while it's on.  Off by default.\n"
+	"  --mirror=DIR: For read-mostly tables: keep a copy of each in a file in DIR, and\n"
+	"                answer stats, listings and opens from it without asking the\n"
+	"                server.  With --binlog or --poll, rows that change are asked\n"
+	"                about until the next refresh fetches them again; without,\n"
+	"                each refresh compares every row's -T (or a hash of the row) to\n"
+	"                the copy's, and reads can be that stale.  The files are kept\n"
+	"                when we unmount, and the next mount only fetches the rows that\n"
+	"                changed in between.  Off by default.\n"
+	"  --mirror-refresh=S: Bring the mirror up to date every S seconds (default %d).\n"
+	"  --shard=prefix|hash: For tables too big to list: put each row --shard-levels\n"
+	"                       directories deep, named for the start of its key (prefix:\n"
+	"                       /ab/abcdef, or /a/@/a for a key that runs out), or for the\n"
+	"                       hex digits of its key's CRC32 (hash: /3f/abcdef).  prefix\n"
+	"                       needs a key that sorts bytewise (a binary string or a _bin\n"
+	"                       collation), and lists with index range scans; a table\n"
+	"                       whose key doesn't can only use hash.  Off by default.\n"
+	"  --shard-levels=N: Levels of shard directories (default %d).\n"
+	"  --shard-width=N: Characters (prefix) or hex digits (hash) per level (default %d).\n"
+	"  --column-files: Make each row a directory with a file per column (of -c, which\n"
+	"                  can be '*'; key columns are left out), so reading or writing\n"
+	"                  one column only fetches or updates that one.  -c has to name\n"
+	"                  plain columns, not expressions.  Without -c, this replaces the\n"
+	"                  implied --json.  Not with --json or --mirror.\n"
+	"  Live counters (per-operation latency histograms, SQL round trips and bytes, the\n"
+	"  pool and the caches) are in <mountpoint>/.dfuse/stats, as JSON.  It isn't listed,\n"
+	"  and with -t it hides a row keyed \".dfuse\", if there is one.\n"
 //	Foreground doesn't seem to work properly at the moment; we'll leave it active,
 //	but undocumented, in case I'm just misunderstanding what it's doing.
 //	"  -f, --foreground: Don't daemonize (handy for debugging).\n"
-	, argv[0] );
+	, argv[0], DFUSE_POOL_DEFAULT_MIN, DFUSE_POOL_DEFAULT_MAX,
+	DFUSE_ATTR_TTL_DEFAULT, DFUSE_NEGATIVE_TTL_DEFAULT, DFUSE_ATTR_CACHE_MAX_DEFAULT, DFUSE_READDIR_BATCH_DEFAULT,
+	DFUSE_WRITE_BACK_BATCH_DEFAULT, DFUSE_WRITE_BACK_DELAY_DEFAULT, DFUSE_STREAM_THRESHOLD_DEFAULT,
+	DFUSE_MIRROR_REFRESH_DEFAULT, DFUSE_SHARD_LEVELS_DEFAULT, DFUSE_SHARD_WIDTH_DEFAULT );
 }